@@ -0,0 +1,124 @@
+// Throughput benchmark for the sharded Client.
+//
+// Usage: keyforge-bench [-n keys] [-b batch] [-v value_bytes] [-t threads] [-a token]
+//                       host:port [host:port ...]
+//
+// Batch mode (default): writes n keys with MPUT-style batches, then reads
+// them back with MGET-style batches, and prints ops/s for each phase. Run it
+// against 1, 2, 3... nodes to see aggregate throughput scale with node count.
+//
+// Latency mode (-t N): N client threads each issue single PUTs and wait for
+// the reply, so writes can only be grouped server side. Prints throughput
+// and p50/p99/max latency, e.g. for Raft commits with batching on and off,
+// or for the per-request overhead of keyforge-proxy (run it once against a
+// node and once against a proxy in front of it).
+
+#include "keyforge/Client.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace keyforge;
+
+int main(int argc, char** argv) {
+    size_t n = 100000;
+    size_t batch = 100;
+    size_t value_bytes = 32;
+    size_t threads = 0;
+    std::string token;
+    std::vector<Client::Node> nodes;
+
+    try {
+        for (int i = 1; i < argc; ++i) {
+            std::string arg = argv[i];
+            if (arg == "-n" && i + 1 < argc) n = std::stoul(argv[++i]);
+            else if (arg == "-b" && i + 1 < argc) batch = std::stoul(argv[++i]);
+            else if (arg == "-v" && i + 1 < argc) value_bytes = std::stoul(argv[++i]);
+            else if (arg == "-t" && i + 1 < argc) threads = std::stoul(argv[++i]);
+            else if (arg == "-a" && i + 1 < argc) token = argv[++i];
+            else {
+                auto colon = arg.rfind(':');
+                if (colon == std::string::npos) throw std::invalid_argument("bad node " + arg);
+                nodes.push_back({arg.substr(0, colon), std::stoi(arg.substr(colon + 1))});
+            }
+        }
+        if (nodes.empty()) nodes.push_back({"127.0.0.1", 4545});
+        if (batch == 0) batch = 1;
+
+        std::string value(value_bytes, 'x');
+
+        if (threads > 0) {
+            std::vector<std::vector<double>> latencies(threads);
+            std::vector<size_t> errors(threads, 0);
+            auto start = std::chrono::steady_clock::now();
+            std::vector<std::thread> workers;
+            for (size_t t = 0; t < threads; ++t) {
+                workers.emplace_back([&, t] {
+                    Client client(nodes);
+                    if (!token.empty()) client.auth(token);
+                    for (size_t i = t; i < n; i += threads) {
+                        auto op_start = std::chrono::steady_clock::now();
+                        bool ok = client.put("bench:" + std::to_string(i), value);
+                        latencies[t].push_back(std::chrono::duration<double, std::micro>(
+                            std::chrono::steady_clock::now() - op_start).count());
+                        if (!ok) errors[t]++;
+                    }
+                });
+            }
+            for (auto& w : workers) w.join();
+            double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+            std::vector<double> all;
+            size_t total_errors = 0;
+            for (size_t t = 0; t < threads; ++t) {
+                all.insert(all.end(), latencies[t].begin(), latencies[t].end());
+                total_errors += errors[t];
+            }
+            std::sort(all.begin(), all.end());
+            auto pct = [&](double p) { return all.empty() ? 0.0 : all[static_cast<size_t>(p * (all.size() - 1))]; };
+            std::cout << "PUT x" << threads << " threads: " << n << " ops in " << secs << " s ("
+                      << static_cast<size_t>(n / secs) << " ops/s, " << total_errors << " errors)\n";
+            std::cout << "Latency us: p50=" << pct(0.50) << " p99=" << pct(0.99)
+                      << " max=" << (all.empty() ? 0.0 : all.back()) << "\n";
+            return 0;
+        }
+
+        Client client(nodes);
+        if (!token.empty()) client.auth(token);
+
+        auto run_phase = [&](const char* name, bool write) {
+            auto start = std::chrono::steady_clock::now();
+            size_t errors = 0;
+            for (size_t base = 0; base < n; base += batch) {
+                size_t end = std::min(n, base + batch);
+                if (write) {
+                    std::vector<std::pair<std::string, std::string>> kvs;
+                    for (size_t i = base; i < end; ++i) kvs.emplace_back("bench:" + std::to_string(i), value);
+                    errors += kvs.size() - client.mput(kvs);
+                } else {
+                    std::vector<std::string> keys;
+                    for (size_t i = base; i < end; ++i) keys.push_back("bench:" + std::to_string(i));
+                    for (const auto& v : client.mget(keys)) {
+                        if (!v) errors++;
+                    }
+                }
+            }
+            double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            std::cout << name << ": " << n << " ops in " << secs << " s ("
+                      << static_cast<size_t>(n / secs) << " ops/s, " << errors << " errors)\n";
+        };
+
+        std::cout << "Nodes: " << nodes.size() << ", batch: " << batch << ", value: " << value_bytes << " bytes\n";
+        run_phase("MPUT", true);
+        run_phase("MGET", false);
+    }
+    catch (const std::exception& e) {
+        std::cerr << "[Bench] Error: " << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
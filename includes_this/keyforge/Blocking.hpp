@@ -0,0 +1,68 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+namespace keyforge {
+
+// Connections parked until a key changes (BLPOP, BRPOP, WAITKEY).
+//
+// A waiting connection registers its keys, then sleeps in poll() on an
+// eventfd (and on its socket, to notice a hang-up). The Store's write
+// observer calls touched() for every change, which only signals the
+// waiters of that key: nothing runs on a timer and an idle waiter costs
+// no CPU. A woken BLPOP re-checks its lists and goes back to sleep if
+// another client got there first.
+class Blocking {
+public:
+    struct Waiter {
+        Waiter(size_t db, std::vector<std::string> keys);
+        ~Waiter();
+        Waiter(const Waiter&) = delete;
+        Waiter& operator=(const Waiter&) = delete;
+
+        const size_t db;
+        const std::vector<std::string> keys;
+        int wake_fd;
+        std::atomic<const char*> event{nullptr};  // last change seen ("*" = whole database)
+    };
+
+    enum class Wake { Touched, Timeout, Hangup, Shutdown };
+
+    // Register before checking the keys, so a write in between still wakes it
+    std::shared_ptr<Waiter> watch(size_t db, std::vector<std::string> keys);
+    void cancel(const std::shared_ptr<Waiter>& waiter);
+
+    // Sleeps until one of the keys changes, the deadline passes (none:
+    // forever) or the client on client_fd hangs up
+    Wake block(Waiter& waiter, int client_fd, const std::chrono::steady_clock::time_point* deadline);
+
+    // Write observer hook (key "" = the whole database changed)
+    void touched(size_t db, const std::string& key, const char* event);
+
+    // Wakes everybody for good
+    void shutdown();
+
+    std::string info();
+
+private:
+    static std::string slot(size_t db, const std::string& key) { return std::to_string(db) + " " + key; }
+    static void wake(Waiter& waiter, const char* event);
+
+    std::mutex mtx_;
+    std::unordered_map<std::string, std::vector<std::shared_ptr<Waiter>>> table_;  // db + key -> waiters
+    std::unordered_set<std::shared_ptr<Waiter>> waiters_;
+    std::atomic<size_t> waiting_{0};  // lets writers skip the lock when nobody waits
+    std::atomic<bool> closed_{false};
+
+    std::atomic<uint64_t> wakeups_{0};
+    std::atomic<uint64_t> timeouts_{0};
+};
+
+} // namespace keyforge
@@ -0,0 +1,148 @@
+#pragma once
+#include "HashRing.hpp"
+#include "Net.hpp"
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <atomic>
+#include <future>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace keyforge {
+
+// Client library for one or more KeyForge servers.
+//
+// With several nodes, keys are sharded client-side on a consistent-hash
+// ring. Multi-key batches are split per node, each sub-batch is pipelined
+// over that node's connection, the nodes are driven in parallel, and the
+// replies are reassembled in the caller's order.
+//
+// Values are single words on the wire (the server splits on whitespace).
+//
+// Only commands with single-line replies (GET, PUT, UPDATE, DELETE, AUTH...)
+// are supported. I/O failures throw std::runtime_error.
+class Client {
+public:
+    struct Node {
+        std::string host;
+        int port;
+    };
+
+    explicit Client(const std::vector<Node>& nodes, size_t vnodes = 160);
+    Client(const std::string& host, int port);
+
+    // Ask a gossip-enabled node for the live members (GOSSIP MEMBERS), to
+    // build or refresh the node list. Throws std::runtime_error on failure.
+    static std::vector<Node> discover(const std::string& host, int port);
+    ~Client();
+
+    Client(const Client&) = delete;
+    Client& operator=(const Client&) = delete;
+
+    // Authenticate with every node (remembered for reconnects)
+    bool auth(const std::string& token);
+
+    // Single-key commands, routed to the owning node
+    bool put(const std::string& key, const std::string& value);
+    std::optional<std::string> get(const std::string& key);
+    // Read-your-writes against a replica: served once the node has applied
+    // the stream up to min_offset; throws if it stays behind (ERROR LAGGING).
+    std::optional<std::string> get(const std::string& key, uint64_t min_offset);
+    bool update(const std::string& key, const std::string& new_value);
+    bool remove(const std::string& key);
+
+    // Atomic counter (INCRBY): the new value, or nullopt if the key holds
+    // something that isn't an integer
+    std::optional<int64_t> incrBy(const std::string& key, int64_t delta = 1);
+
+    // Optimistic concurrency: read a value with its version (GETV), then
+    // write only if nobody changed it since (CAS). expected_version 0 means
+    // the key must not exist yet. On a conflict, *version is set to the
+    // current version (0 if the key is gone); on success to the new one.
+    std::optional<std::pair<std::string, uint64_t>> getVersioned(const std::string& key);
+    bool cas(const std::string& key, uint64_t expected_version, const std::string& value,
+             uint64_t* version = nullptr);
+
+    // Multi-key batches sent as one MGET / MSET line per chunk and node,
+    // results in input order
+    std::vector<std::optional<std::string>> mget(const std::vector<std::string>& keys);
+    size_t mput(const std::vector<std::pair<std::string, std::string>>& kvs);  // number stored
+
+    // Run commands[i] on the node owning keys[i]; returns one reply line each
+    std::vector<std::string> batch(const std::vector<std::string>& keys,
+                                   const std::vector<std::string>& commands);
+
+    // Pipeline per_node_cmds[i] to node i, all nodes in parallel; one reply
+    // line per command, grouped by node
+    std::vector<std::vector<std::string>> fanOut(const std::vector<std::vector<std::string>>& per_node_cmds);
+
+    size_t nodeCount() const { return conns_.size(); }
+    size_t nodeFor(const std::string& key) const { return ring_.nodeFor(key); }
+
+    // Replication offset token from the latest write acknowledged by the
+    // node owning key (0 if none yet)
+    uint64_t lastWriteOffset(const std::string& key);
+
+    // Client-side caching: get(key) results (misses included) are kept in a
+    // per-node LRU of up to max_cached entries, and the node pushes an
+    // invalidation when a cached key changes (CLIENT TRACKING ON). A lost
+    // connection empties that node's cache. Call before sharing the client.
+    void enableTracking(size_t max_cached = 10000);
+    uint64_t cacheHits() const { return cache_hits_.load(); }
+    uint64_t cacheMisses() const { return cache_misses_.load(); }
+
+private:
+    struct Connection {
+        Node node;
+        int fd = -1;
+        std::unique_ptr<net::LineReader> reader;
+        std::mutex mtx;
+        uint64_t last_offset = 0;  // newest write token seen (guarded by mtx)
+
+        // Tracking cache, most recently used first (guarded by mtx)
+        std::list<std::pair<std::string, std::optional<std::string>>> lru;
+        std::unordered_map<std::string, decltype(lru)::iterator> cached;
+        uint64_t invalidations = 0;  // bumped per push, so a GET can tell it raced one
+
+        // Per-node worker that runs sub-batches, so fan-out costs no thread spawn
+        std::thread worker;
+        std::mutex jobs_mtx;
+        std::condition_variable jobs_cv;
+        std::deque<std::packaged_task<std::vector<std::string>()>> jobs;
+        bool stop = false;
+    };
+
+    void workerLoop(Connection& conn);
+
+    // Send all commands in one write, then read one reply per command
+    std::vector<std::string> pipeline(Connection& conn, const std::vector<std::string>& cmds);
+    void ensureConnected(Connection& conn);
+    void disconnect(Connection& conn);
+    std::string call(const std::string& key, const std::string& command);
+    static void recordOffset(Connection& conn, const std::string& reply);  // conn.mtx held
+    static bool isReply(const std::string& reply, const std::string& word);
+
+    // Tracking pushes (conn.mtx held)
+    static bool isPush(const std::string& line);
+    static void applyPush(Connection& conn, const std::string& line);
+    void drainPushes(Connection& conn);
+
+    HashRing ring_;
+    std::vector<std::unique_ptr<Connection>> conns_;
+    std::string token_;
+    std::mutex token_mtx_;
+
+    size_t max_cached_ = 0;  // 0 = tracking off
+    std::atomic<uint64_t> cache_hits_{0};
+    std::atomic<uint64_t> cache_misses_{0};
+};
+
+} // namespace keyforge
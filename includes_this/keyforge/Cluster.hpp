@@ -0,0 +1,72 @@
+#pragma once
+#include "Store.hpp"
+#include "Replication.hpp"
+#include <cstdint>
+#include <shared_mutex>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+namespace keyforge {
+
+// Server-side cluster mode.
+//
+// The keyspace is split into kSlots hash slots (CRC16 of the key, or of the
+// part inside the first "{...}" so related keys can share a slot). Every
+// node keeps a map slot -> owner address. A command for a slot owned
+// elsewhere is answered with "MOVED <slot> <host:port>".
+//
+// Live migration of a slot range from A to B:
+//   on B:  CLUSTER SETSLOT first last IMPORTING A
+//   on A:  CLUSTER SETSLOT first last MIGRATING B
+//   on A:  MIGRATE B-host B-port first last [token]
+// While migrating, A serves keys it still has and answers "ASK <slot> B" for
+// the rest; B accepts those only right after the client sends ASKING.
+// MIGRATE moves keys in small batches, each read under the write lock and
+// sent with it released: a key written meanwhile is sent again (a DELETE if
+// it is gone), and A keeps serving a batch's keys until B has them. Then it
+// marks the range as owned by B on both nodes.
+class Cluster {
+public:
+    static constexpr uint16_t kSlots = 16384;
+
+    Cluster(Store& store, Replication& repl);
+
+    static uint16_t keySlot(const std::string& key);
+
+    // Turn cluster mode on, announcing ourselves as self ("host:port")
+    void enable(const std::string& self);
+    bool enabled() const;
+    std::string self() const;
+
+    // Routing decision for a key command. Empty = serve it here, otherwise
+    // the error reply to send (MOVED / ASK / CLUSTERDOWN).
+    std::string route(const std::string& key, bool asking);
+
+    // CLUSTER SETSLOT first last NODE|MIGRATING|IMPORTING|STABLE [addr]
+    bool setSlots(uint16_t first, uint16_t last, const std::string& state,
+                  const std::string& addr, std::string& err);
+
+    // Move every key in [first, last] to host:port. Returns keys moved, or
+    // -1 with err set.
+    long migrate(const std::string& host, int port, uint16_t first, uint16_t last,
+                 const std::string& token, size_t batch, std::string& err);
+
+    // CLUSTER SLOTS / CLUSTER INFO replies
+    std::string slotsReply();
+    std::string infoReply();
+
+private:
+    Store& store_;
+    Replication& repl_;
+
+    mutable std::shared_mutex mtx_;
+    bool enabled_ = false;
+    std::string self_;
+    std::vector<std::string> owner_;           // per slot, "" = unassigned
+    std::vector<std::string> migrating_to_;
+    std::vector<std::string> importing_from_;
+    std::unordered_set<std::string> in_flight_;  // sent by MIGRATE, still served here
+};
+
+} // namespace keyforge
@@ -0,0 +1,134 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace keyforge {
+
+// Value types beyond plain strings: lists, hashes and sorted sets. They are
+// changed in place by the Store, so a small change to a big value doesn't
+// rewrite (or resend) the whole thing. bytes() is an estimate of the heap
+// memory held, for the Store's memory accounting.
+
+// List as a deque of small arrays ("quicklist"): pushes and pops at either
+// end are O(1), and elements sit together instead of one heap node each.
+class QuickList {
+public:
+    static constexpr size_t kChunkSize = 128;
+
+    size_t size() const { return size_; }
+    size_t bytes() const { return bytes_; }
+
+    void pushFront(std::string value);
+    void pushBack(std::string value);
+    std::string popFront();  // the list must not be empty
+    std::string popBack();
+
+    // index < size()
+    const std::string& at(size_t index) const;
+    void set(size_t index, std::string value);
+
+    // Elements first..last (inclusive, last < size())
+    std::vector<std::string> range(size_t first, size_t last) const;
+
+private:
+    static size_t cost(const std::string& value) { return value.size() + sizeof(std::string); }
+    std::pair<size_t, size_t> locate(size_t index) const;  // chunk, offset within it
+
+    std::deque<std::vector<std::string>> chunks_;
+    size_t size_ = 0;
+    size_t bytes_ = 0;
+};
+
+// Field -> value map. Small hashes are a flat array searched linearly
+// (compact and cache friendly); past kMaxCompactFields fields, or a field or
+// value longer than kMaxCompactLength, it becomes a hash table for good.
+class HashValue {
+public:
+    static constexpr size_t kMaxCompactFields = 64;
+    static constexpr size_t kMaxCompactLength = 64;
+
+    size_t size() const { return table_ ? table_->size() : compact_.size(); }
+    size_t bytes() const { return bytes_; }
+    bool compact() const { return !table_; }
+
+    bool set(const std::string& field, std::string value);  // true if the field is new
+    const std::string* get(const std::string& field) const;
+    bool erase(const std::string& field);
+
+    std::vector<std::pair<std::string, std::string>> all() const;
+
+private:
+    static size_t cost(const std::string& field, const std::string& value) {
+        return field.size() + value.size() + 2 * sizeof(std::string);
+    }
+    void convert();  // compact array -> hash table
+
+    std::vector<std::pair<std::string, std::string>> compact_;
+    std::unique_ptr<std::unordered_map<std::string, std::string>> table_;
+    size_t bytes_ = 0;
+};
+
+// Members ordered by (score, member): a skiplist whose links record how many
+// elements they jump over, so rank lookups and rank ranges are O(log n),
+// plus a member -> score table for O(1) score lookups.
+class SortedSet {
+public:
+    SortedSet();
+    ~SortedSet();
+    SortedSet(const SortedSet&) = delete;
+    SortedSet& operator=(const SortedSet&) = delete;
+
+    size_t size() const { return scores_.size(); }
+    size_t bytes() const { return bytes_; }
+
+    // Scores as text: any finite double, written back with enough digits
+    // to round-trip exactly
+    static bool parseScore(const std::string& text, double& score);
+    static std::string formatScore(double score);
+
+    bool add(const std::string& member, double score);  // true if the member is new
+    bool erase(const std::string& member);
+    std::optional<double> score(const std::string& member) const;
+    std::optional<size_t> rank(const std::string& member) const;  // 0-based
+
+    // Members of rank first..last (inclusive, last < size()) with their scores
+    std::vector<std::pair<std::string, double>> range(size_t first, size_t last) const;
+
+private:
+    static constexpr int kMaxLevel = 32;
+
+    struct Node;
+    struct Link {
+        Node* next = nullptr;
+        size_t span = 0;  // elements skipped by following next
+    };
+    struct Node {
+        std::string member;
+        double score;
+        std::vector<Link> links;
+    };
+
+    // Member kept twice (node and score table) plus node and table overhead
+    static size_t cost(const std::string& member) { return 2 * member.size() + 128; }
+    static bool before(const Node* node, double score, const std::string& member) {
+        return node->score < score || (node->score == score && node->member < member);
+    }
+    int randomLevel();
+    void insert(const std::string& member, double score);
+    void unlink(const std::string& member, double score);
+
+    Node* head_;
+    int level_ = 1;
+    uint64_t rng_;
+    std::unordered_map<std::string, double> scores_;
+    size_t bytes_ = 0;
+};
+
+} // namespace keyforge
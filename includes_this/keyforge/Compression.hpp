@@ -0,0 +1,48 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace keyforge {
+namespace compression {
+
+// Value compression for the Store. Uses LZ4 when the build finds it and
+// otherwise a built-in LZ77 codec of the same family (greedy, 4-byte hash
+// matches, byte-aligned output): both favour speed over ratio. Compressed
+// data only lives in memory, so the two never have to read each other's.
+
+constexpr size_t kMaxDictionary = 16 * 1024;
+
+// "lz4" or "lz" (built in)
+const char* codecName();
+
+// Shared dictionary: bytes that every compressed value may refer back to,
+// which is what lets small values with common structure (JSON field names)
+// compress at all. Immutable once built.
+class Dictionary {
+public:
+    explicit Dictionary(std::string bytes);
+
+    const std::string& bytes() const { return bytes_; }
+
+    // Built-in codec: its match table primed with the dictionary
+    const std::vector<uint32_t>& table() const { return table_; }
+
+private:
+    std::string bytes_;
+    std::vector<uint32_t> table_;
+};
+
+// false when the result wouldn't be at least 1/8 smaller than src
+bool compress(const std::string& src, const Dictionary* dict, std::string& out);
+
+// raw_size is the original length; false on corrupt input
+bool decompress(const std::string& src, size_t raw_size, const Dictionary* dict, std::string& out);
+
+// A dictionary of up to max_bytes from sample values: the segments whose
+// 8-byte substrings recur in the most samples, most useful last
+std::string train(const std::vector<std::string>& samples, size_t max_bytes);
+
+} // namespace compression
+} // namespace keyforge
@@ -0,0 +1,80 @@
+#pragma once
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <streambuf>
+#include <string>
+
+namespace keyforge {
+
+// Sequential writer for persistence files (snapshots and their deltas),
+// used as the buffer of a std::ostream, that keeps a large write from
+// flooding the page cache:
+//
+//  - direct: the file is opened O_DIRECT and written from an aligned
+//    buffer in whole blocks, bypassing the page cache; the last partial
+//    block is padded and the file truncated back. Where the file system
+//    refuses O_DIRECT it falls back to buffered writes.
+//  - preallocate: fallocate() that many bytes up front (a size hint, say
+//    the previous file's) and twice as much again whenever the writes pass
+//    it, so the file gets few, large extents; close() gives back the rest.
+//  - sync_bytes: for buffered writes, start writeback of every sync_bytes
+//    written with sync_file_range(), wait for the range before it and
+//    drop that from the page cache, so no more than about twice that is
+//    ever dirty, instead of a writeback storm at the end.
+//  - max_bytes_per_sec: pace the writes to that rate (0: as fast as the
+//    disk goes). Only for writers that hold no lock.
+//
+// close() writes out the rest and fdatasync()s the file; a writer
+// destroyed without it just closes the file, for the caller to remove.
+class FileWriter : public std::streambuf {
+public:
+    struct Options {
+        bool direct = false;
+        size_t buffer_bytes = 1 << 20;  // rounded up to whole blocks
+        size_t preallocate = 0;
+        size_t sync_bytes = 8 << 20;    // 0: leave writeback to the kernel
+        size_t max_bytes_per_sec = 0;
+    };
+
+    static constexpr size_t kBlock = 4096;  // O_DIRECT alignment
+
+    explicit FileWriter(const std::string& path) : FileWriter(path, Options()) {}
+    FileWriter(const std::string& path, Options options);
+    ~FileWriter() override;
+    FileWriter(const FileWriter&) = delete;
+    FileWriter& operator=(const FileWriter&) = delete;
+
+    bool isOpen() const { return fd_ >= 0; }
+    bool close();
+
+    // Bytes written so far, buffered ones included
+    uint64_t written() const { return offset_ + static_cast<uint64_t>(pptr() - pbase()); }
+    // Still writing O_DIRECT (false if it wasn't asked for or fell back)
+    bool direct() const { return direct_; }
+
+protected:
+    int_type overflow(int_type ch) override;
+    std::streamsize xsputn(const char* s, std::streamsize n) override;
+
+private:
+    // Write out the buffer (all of it at close; otherwise whole blocks)
+    bool drain(bool all);
+    bool writeAt(const char* data, size_t size, uint64_t offset);
+    void preallocate(uint64_t upto);
+    void pace();
+
+    Options options_;
+    int fd_ = -1;
+    bool direct_ = false;
+    bool ok_ = true;
+    char* buffer_ = nullptr;
+    size_t capacity_ = 0;
+    uint64_t offset_ = 0;     // bytes already written to the file
+    uint64_t allocated_ = 0;  // bytes fallocate()d
+    uint64_t synced_ = 0;     // writeback started up to here
+    uint64_t waited_ = 0;     // and finished up to here
+    std::chrono::steady_clock::time_point start_;
+};
+
+} // namespace keyforge
@@ -0,0 +1,129 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <random>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace keyforge {
+
+// SWIM-style gossip membership and failure detection.
+//
+// Every node listens on UDP at its client port number. Once per protocol
+// period it pings one member (round robin over a shuffled list). Without an
+// ack it asks kIndirectProbes other members to ping the target for it
+// (PINGREQ); if that fails too the target becomes SUSPECT, and DEAD after
+// the suspicion timeout unless it refutes by gossiping ALIVE with a higher
+// incarnation.
+//
+// Membership changes are never broadcast: up to kMaxPiggyback pending
+// updates ride along on every PING/ACK, each one retransmitted about
+// 4*log10(n) times. A node therefore sends at most one probe (plus a few
+// indirect probes) per period, in datagrams bounded by kMaxDatagram.
+//
+//   PING <seq> <from>
+//   ACK <seq> <from>
+//   PINGREQ <seq> <from> <target>
+//
+// as the first line, followed by updates, one per line:
+// "<addr> ALIVE|SUSPECT|DEAD <incarnation>"
+//
+// Incarnations start at the wall-clock seconds of process start, so a
+// restarted node overrides the DEAD record of its previous life.
+class Gossip {
+public:
+    enum class State { ALIVE, SUSPECT, DEAD };
+
+    static constexpr std::chrono::milliseconds kProtocolPeriod{500};
+    static constexpr size_t kIndirectProbes = 3;
+    static constexpr size_t kMaxPiggyback = 8;
+    static constexpr size_t kMaxDatagram = 1400;
+
+    Gossip() = default;
+    ~Gossip();
+
+    // Join through seeds ("host:port", may include self). self is the
+    // address other members reach us at.
+    void start(const std::string& self, const std::vector<std::string>& seeds);
+    bool enabled() const { return enabled_.load(); }
+
+    // Addresses of members currently ALIVE or SUSPECT, self included
+    std::vector<std::string> liveMembers();
+
+    // GOSSIP INFO reply
+    std::string info();
+
+    void shutdown();
+
+private:
+    struct Member {
+        State state = State::ALIVE;
+        uint64_t incarnation = 0;
+        std::chrono::steady_clock::time_point changed;
+    };
+
+    struct Update {
+        State state;
+        uint64_t incarnation;
+        size_t transmits = 0;
+    };
+
+    struct Relay {  // PINGREQ we forward on behalf of another member
+        std::string requester;
+        uint64_t seq;
+        std::chrono::steady_clock::time_point expires;
+    };
+
+    void receiveLoop();
+    void probeLoop();
+    void probe(const std::string& target);
+
+    void handleMessage(const std::string& msg);
+    bool sendTo(const std::string& addr, const std::string& header, bool full_state = false);
+
+    // State changes (mtx_ held). Return true if the update was news.
+    bool applyUpdate(const std::string& addr, State state, uint64_t incarnation);
+    void enqueue(const std::string& addr, State state, uint64_t incarnation);
+    std::string piggyback(bool full_state);
+    size_t retransmitLimit() const;
+    std::chrono::milliseconds suspicionTimeout() const;
+
+    static const char* stateName(State s);
+
+    std::atomic<bool> enabled_{false};
+    std::atomic<bool> stopping_{false};
+    std::string self_;
+    int sock_ = -1;
+
+    std::mutex mtx_;
+    std::condition_variable ack_cv_;
+    uint64_t incarnation_ = 0;
+    uint64_t next_seq_ = 1;
+    std::map<std::string, Member> members_;   // excludes self
+    std::map<std::string, Update> updates_;   // pending dissemination
+    std::set<uint64_t> acked_;                // seqs of our probes that were acked
+    std::map<uint64_t, Relay> relays_;        // our seq -> PINGREQ origin
+    std::vector<std::string> seeds_;
+    std::vector<std::string> probe_order_;
+    size_t probe_pos_ = 0;
+    std::mt19937 rng_{std::random_device{}()};
+
+    std::thread receiver_;
+    std::thread prober_;
+
+    // Metrics
+    std::atomic<uint64_t> msgs_sent_{0};
+    std::atomic<uint64_t> msgs_received_{0};
+    std::atomic<uint64_t> bytes_sent_{0};
+    std::atomic<uint64_t> indirect_probes_{0};
+    std::atomic<uint64_t> suspicions_{0};
+    std::atomic<uint64_t> refutations_{0};
+};
+
+} // namespace keyforge
@@ -0,0 +1,37 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace keyforge {
+
+// Stable 64-bit hash (FNV-1a with a final avalanche step). Unlike std::hash
+// it gives the same answer in every process, so clients agree on placement.
+uint64_t hash64(const std::string& data);
+
+// Consistent-hash ring with virtual nodes. Each physical node is placed on
+// the ring `vnodes` times; a key belongs to the first point clockwise from
+// its hash. Adding or removing a node only moves ~1/N of the keys.
+class HashRing {
+public:
+    explicit HashRing(size_t vnodes = 160) : vnodes_(vnodes) {}
+
+    // Add a node identified by a stable name (e.g. "host:port").
+    // Returns its index, which is what nodeFor() reports.
+    size_t addNode(const std::string& name);
+
+    // Index of the node that owns key
+    size_t nodeFor(const std::string& key) const;
+
+    size_t nodeCount() const { return names_.size(); }
+    const std::string& nodeName(size_t idx) const { return names_[idx]; }
+
+private:
+    size_t vnodes_;
+    std::vector<std::string> names_;
+    std::vector<std::pair<uint64_t, size_t>> points_;  // sorted by hash
+};
+
+} // namespace keyforge
@@ -0,0 +1,46 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace keyforge {
+
+// Approximate read-frequency tracking for HOTKEYS.
+//
+// Every read bumps a count-min sketch (kDepth rows of kWidth atomic
+// counters; the estimate is the smallest of the key's counters, which can
+// only overestimate). A key is offered to the small top-K table only on
+// every kSampleEvery-th hit of its estimate, so a hot key doesn't take the
+// table lock on each read. All counts are halved every kDecayEvery reads,
+// so the list follows the recent workload rather than all-time totals.
+class HotKeys {
+public:
+    static constexpr size_t kDepth = 4;
+    static constexpr size_t kWidth = 4096;
+    static constexpr size_t kTopK = 64;
+    static constexpr uint32_t kSampleEvery = 8;
+    static constexpr uint64_t kDecayEvery = 1 << 20;
+
+    void record(const std::string& key);
+
+    // Up to n hottest keys with their estimated (decayed) read counts
+    std::vector<std::pair<std::string, uint32_t>> top(size_t n);
+
+    uint64_t recorded() const { return total_.load(std::memory_order_relaxed); }
+
+private:
+    void decay();
+
+    std::array<std::array<std::atomic<uint32_t>, kWidth>, kDepth> sketch_{};
+    std::atomic<uint64_t> total_{0};
+
+    std::mutex mtx_;
+    std::unordered_map<std::string, uint32_t> candidates_;  // key -> estimate
+};
+
+} // namespace keyforge
@@ -0,0 +1,50 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+namespace keyforge {
+
+// Counting Bloom filter over a Store's keys, so a lookup of a key that was
+// never written can be answered without taking the store lock.
+//
+// Blocked layout: a key's kProbes counters all sit in one 64-counter
+// (one cache line) block, so a check costs a single cache miss. Counters
+// are 8 bits and saturate (a saturated counter is never decremented), so
+// keys can be removed again. Writers must be serialized by the caller;
+// readers only load, so mayContain() is wait-free and needs no lock.
+// With kCountersPerKey counters per key at capacity, about 1% of misses
+// still get through (an unblocked filter would let 0.5% through, but
+// blocks fill unevenly).
+class KeyFilter {
+public:
+    static constexpr size_t kBlockSize = 64;
+    static constexpr int kProbes = 6;
+    static constexpr size_t kCountersPerKey = 12;
+
+    explicit KeyFilter(size_t capacity);  // keys it is sized for
+
+    static uint64_t hash(const std::string& key);
+
+    size_t capacity() const { return capacity_; }
+    size_t bytes() const { return blocks_ * kBlockSize; }
+
+    // false: the key is definitely absent
+    bool mayContain(uint64_t h) const;
+
+    void add(uint64_t h);
+    void remove(uint64_t h);
+    void clear();
+
+private:
+    template <typename F>
+    void probe(uint64_t h, F&& f) const;
+
+    size_t capacity_;
+    size_t blocks_;
+    std::unique_ptr<std::atomic<uint8_t>[]> counters_;
+};
+
+} // namespace keyforge
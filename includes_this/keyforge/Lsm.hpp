@@ -0,0 +1,167 @@
+#pragma once
+#include "StorageEngine.hpp"
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace keyforge {
+
+// LRU cache of SSTable blocks, by table number and offset
+class BlockCache {
+public:
+    explicit BlockCache(size_t capacity) : capacity_(capacity) {}
+
+    std::shared_ptr<const std::string> lookup(uint64_t table, uint64_t offset);
+    void insert(uint64_t table, uint64_t offset, std::shared_ptr<const std::string> block);
+
+    size_t bytes() const;
+    size_t capacity() const { return capacity_; }
+    size_t hits() const { return hits_.load(); }
+    size_t misses() const { return misses_.load(); }
+
+private:
+    struct Slot {
+        uint64_t table;
+        uint64_t offset;
+        std::shared_ptr<const std::string> block;
+    };
+    struct SlotKey {
+        uint64_t table;
+        uint64_t offset;
+        bool operator==(const SlotKey& o) const { return table == o.table && offset == o.offset; }
+    };
+    struct SlotHash {
+        size_t operator()(const SlotKey& k) const { return std::hash<uint64_t>{}(k.table * 0x9e3779b97f4a7c15ULL ^ k.offset); }
+    };
+
+    size_t capacity_;
+    size_t used_ = 0;
+    std::list<Slot> lru_;  // most recent first
+    std::unordered_map<SlotKey, std::list<Slot>::iterator, SlotHash> slots_;
+    std::atomic<size_t> hits_{0};
+    std::atomic<size_t> misses_{0};
+    mutable std::mutex mtx_;
+};
+
+// Log-structured merge tree in a directory of its own:
+//  - writes go to a sorted in-memory table (memtable); a full one is
+//    frozen and written out by a background thread as an SSTable in
+//    level 0, while a new one takes the writes. If that write fails (the
+//    disk is full) it is retried every second, and a put that finds the
+//    new memtable full meanwhile returns false.
+//  - an SSTable is immutable: sorted blocks of about block_bytes, an index
+//    with the last key of each block and a Bloom filter over its keys, so
+//    a lookup reads at most one block per table, and none from a table
+//    the filter rules out
+//  - leveled compaction: when level 0 has level0_tables tables they are
+//    merged into level 1, and when level n (n >= 1) outgrows
+//    level1_bytes * 10^(n-1) one of its tables is merged into level n+1.
+//    Tables within a level >= 1 never overlap, so a lookup checks one per
+//    level. Deletes are tombstones until they reach the last level.
+//  - blocks read by lookups stay in a BlockCache, so reads of a hot set
+//    that fits in it don't touch the disk
+//
+// The directory is scratch space, created empty and removed with the
+// engine: the Store saves its data through SAVE like any other.
+class LsmEngine : public StorageEngine {
+public:
+    struct Options {
+        size_t memtable_bytes = 4 << 20;
+        size_t block_bytes = 4096;
+        size_t table_bytes = 2 << 20;  // compaction output is cut at this size
+        size_t level0_tables = 4;
+        size_t level1_bytes = 10 << 20;
+        size_t block_cache_bytes = 64 << 20;
+        int bloom_bits_per_key = 10;
+    };
+
+    explicit LsmEngine(std::string dir) : LsmEngine(std::move(dir), Options()) {}
+    LsmEngine(std::string dir, Options options);
+    ~LsmEngine() override;
+    LsmEngine(const LsmEngine&) = delete;
+    LsmEngine& operator=(const LsmEngine&) = delete;
+
+    bool put(const std::string& key, const std::string& value) override;
+    void remove(const std::string& key) override;
+    std::optional<std::string> get(const std::string& key) override;
+    void forEach(const std::function<bool(const std::string&, const std::string&)>& fn) override;
+    std::vector<std::string> keysAfter(const std::optional<std::string>& after, size_t count) override;
+    // Pins the tables and copies the memtable (memtable_bytes at most)
+    std::unique_ptr<View> view() override;
+    void clear() override;
+    std::string info() const override;
+
+    static constexpr int kLevels = 7;
+
+    struct Table;
+    class Cursor;
+    // nullopt: a tombstone
+    using Memtable = std::map<std::string, std::optional<std::string>, std::less<>>;
+
+private:
+    // The tables in use; replaced, never changed, so a reader can keep
+    // using the one it took while compaction installs a new one
+    struct Version {
+        std::vector<std::shared_ptr<Table>> levels[kLevels];  // level 0 newest first, others by key
+    };
+    struct Pinned;
+
+    // false: a put that found the memtable full with the last one still
+    // not written out
+    bool write(const std::string& key, std::optional<std::string> value);
+    // Hand mem_ to the worker as imm_ (mtx_ held, imm_ empty)
+    void freeze();
+    // Every source from past `after` (nullopt: the start) on, newest
+    // first, for a merged read
+    std::vector<std::unique_ptr<Cursor>> cursors(const std::optional<std::string>& after);
+    static void tableCursors(const Version& version, const std::optional<std::string>& after,
+                             std::vector<std::unique_ptr<Cursor>>& out);
+    void backgroundLoop();
+    // Write imm_ out as a level 0 table
+    void flush(std::unique_lock<std::mutex>& lock);
+    // One compaction step if a level is over its limit; false if none was
+    bool compact(std::unique_lock<std::mutex>& lock);
+    // Merge sources (newest first) into tables cut at max_bytes; false
+    // (and no tables) if a source couldn't be read or a table written
+    bool writeTables(std::vector<std::unique_ptr<Cursor>> sources, bool drop_tombstones, size_t max_bytes,
+                     std::vector<std::shared_ptr<Table>>& out);
+    std::shared_ptr<Table> openTable(uint64_t number);
+    std::string tablePath(uint64_t number) const;
+    size_t levelLimit(int level) const;
+
+    std::string dir_;
+    Options options_;
+    BlockCache cache_;
+
+    std::shared_ptr<Memtable> mem_;
+    size_t mem_bytes_ = 0;
+    std::shared_ptr<const Memtable> imm_;  // being flushed
+    bool flush_failed_ = false;            // the last attempt at it did
+    std::shared_ptr<const Version> version_;
+    std::string compact_pointer_[kLevels];  // where the next compaction of each level starts
+    std::atomic<uint64_t> next_table_{1};  // file numbers, also the block cache key
+    uint64_t generation_ = 0;  // bumped by clear(), so a background job knows its output is stale
+
+    bool stop_ = false;
+    std::thread worker_;
+    std::condition_variable work_cv_;  // to the worker: something to flush or compact
+    std::condition_variable done_cv_;  // from it: imm_ was written out
+    mutable std::mutex mtx_;
+
+    std::atomic<size_t> flushes_{0};
+    std::atomic<size_t> compactions_{0};
+    std::atomic<size_t> bytes_written_{0};
+    std::atomic<size_t> bloom_skips_{0};
+    std::atomic<size_t> write_stalls_{0};
+};
+
+} // namespace keyforge
@@ -0,0 +1,84 @@
+#pragma once
+#include "StorageEngine.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+
+namespace keyforge {
+
+// Hash table kept in a memory-mapped file, so a restart maps it again
+// instead of reloading the data. The file is a header page, an
+// open-addressing table of slots (key hash, record offset) and an arena of
+// records (key length, value length, key, value) appended in turn. Every
+// reference is an offset from the start of the file, so the mapping may
+// land anywhere.
+//
+// Opening a file only checks its header: the format, the sizes and the
+// clean flag that persist() sets and the first change after it clears
+// again (synchronously), so a file left by a crash is never taken for a
+// complete one and is started over. A replaced or deleted record stays in
+// the arena as dead space until the table outgrows its slots or arena and
+// is rebuilt, live records only, into a new file renamed over the old.
+//
+// Instance 0 works in `home` itself and takes over a clean file found
+// there. Other instances (a Store's emptyLike() copies) start empty in
+// home.<instance>, and persist() renames theirs over home. A table that
+// was never persisted deletes its file with it.
+class MappedTable : public StorageEngine {
+public:
+    explicit MappedTable(std::string home, size_t instance = 0);
+    ~MappedTable() override;
+    MappedTable(const MappedTable&) = delete;
+    MappedTable& operator=(const MappedTable&) = delete;
+
+    bool put(const std::string& key, const std::string& value) override;
+    void remove(const std::string& key) override;
+    std::optional<std::string> get(const std::string& key) override;
+    void forEach(const std::function<bool(const std::string&, const std::string&)>& fn) override;
+    std::vector<std::string> keysAfter(const std::optional<std::string>& after, size_t count) override;
+    // A copy: a rebuild moves the records to another mapping
+    std::unique_ptr<View> view() override;
+    void clear() override;
+    std::string info() const override;
+
+    size_t restoredKeys() const override { return restored_; }
+    bool persistent() const override { return true; }
+    bool persist() override;
+
+    struct Header;
+    struct Slot {
+        uint64_t hash;
+        uint64_t offset;  // of the record; 0: empty, 1: deleted
+    };
+
+private:
+    // Map the file at path_ if it is a clean table; false otherwise
+    bool adopt();
+    // Write a table with room for `slots` slots and `arena` bytes of
+    // records, holding the live records of the current one if `copy`, and
+    // switch to it; false (and no change) if the disk has no room for it
+    bool rebuild(uint64_t slots, uint64_t arena, bool copy);
+    void unmap();
+    // The first change after persist() clears the clean flag, on disk
+    void dirty();
+
+    Header* header() const { return reinterpret_cast<Header*>(base_); }
+    Slot* slots() const;
+    // The slot holding key, or the free one it would go in (nullptr: none)
+    Slot* find(const std::string& key, uint64_t hash, bool& found) const;
+    bool record(uint64_t offset, const char*& key, uint32_t& key_len, const char*& value, uint32_t& value_len) const;
+
+    std::string home_;
+    std::string path_;
+    int fd_ = -1;
+    char* base_ = nullptr;
+    size_t mapped_ = 0;
+    size_t restored_ = 0;
+    double open_ms_ = 0;
+    bool persisted_ = false;
+    size_t rebuilds_ = 0;
+    mutable std::mutex mtx_;
+};
+
+} // namespace keyforge
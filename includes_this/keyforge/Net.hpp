@@ -0,0 +1,52 @@
+#pragma once
+#include <string>
+#include <cstddef>
+#include <vector>
+
+namespace keyforge {
+namespace net {
+
+// Longest command line a client may send; a connection with more pending
+// and no '\n' yet is closed rather than buffered without end
+constexpr size_t kMaxLineBytes = 64 << 20;
+
+// Open a blocking TCP connection to host:port. Returns -1 on failure.
+int connectTo(const std::string& host, int port);
+
+// Send the whole buffer, retrying on short writes. Returns false on error.
+bool sendAll(int fd, const char* data, size_t len);
+inline bool sendAll(int fd, const std::string& msg) {
+    return sendAll(fd, msg.data(), msg.size());
+}
+
+// Send several buffers back to back with one gathering write per batch of
+// up to IOV_MAX parts (used to send shared Pub/Sub messages without copying)
+bool sendAll(int fd, const std::vector<const std::string*>& parts);
+
+// Buffered reader for the line-oriented KeyForge protocol.
+// Lines are terminated by '\n'; a trailing '\r' is stripped.
+class LineReader {
+public:
+    explicit LineReader(int fd) : fd_(fd) {}
+
+    enum class Status { OK, TIMEOUT, CLOSED };
+
+    // Read one line, waiting at most timeout_ms (-1 = forever)
+    Status readLine(std::string& line, int timeout_ms = -1);
+
+    // Read exactly n raw bytes (used for bulk payloads such as snapshots)
+    Status readExact(size_t n, std::string& out, int timeout_ms = -1);
+
+    // Bytes already received but not yet consumed
+    size_t buffered() const { return buf_.size() - pos_; }
+
+private:
+    Status fill(int timeout_ms);
+
+    int fd_;
+    std::string buf_;
+    size_t pos_ = 0;
+};
+
+} // namespace net
+} // namespace keyforge
@@ -0,0 +1,87 @@
+#pragma once
+#include "Client.hpp"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace keyforge {
+
+// Scatter-gather proxy in front of several KeyForge nodes.
+//
+// App processes connect to the proxy instead of each holding the node list.
+// The proxy speaks the normal line protocol, shards keys on the same
+// consistent-hash ring as Client, and keeps a pool of Clients (one pooled
+// connection per node each) that a session borrows for each read.
+//
+// Single-key commands that arrive pipelined are forwarded as one batch.
+// MGET / MSET are split per node, SCAN and GET_KEY ask every node, all in
+// parallel, and the per-node replies are merged into one reply line.
+// A SCAN cursor is opaque: one per-node cursor each, joined with ','.
+// With watchMembership() the proxy follows the gossip view of the nodes.
+class Proxy {
+public:
+    Proxy(int port, const std::vector<Client::Node>& backends, size_t pool_size,
+          const std::string& token);
+    ~Proxy();
+
+    // Poll GOSSIP MEMBERS every interval and re-shard over the live nodes
+    // when membership changes (backends must run with --gossip)
+    void watchMembership(std::chrono::milliseconds interval);
+
+    void run();
+    void requestShutdown();
+
+private:
+    void handleClient(int client_fd);
+
+    // Execute the complete lines of one read, appending replies to out
+    void processLines(bool& authenticated, const std::vector<std::string>& lines, std::string& out);
+
+    // Run one command that is not part of a pipelined batch
+    std::string execute(Client& client, bool& authenticated, const std::string& line);
+
+    std::string mget(Client& client, std::istringstream& args);
+    std::string mset(Client& client, std::istringstream& args);
+    std::string scan(Client& client, std::istringstream& args);
+    std::string getKey(Client& client, const std::string& value);
+    std::string info();
+
+    // Replace the pool with Clients for a new backend list
+    void rebuildPool(const std::vector<Client::Node>& backends);
+    std::shared_ptr<Client> acquire();
+    void release(std::shared_ptr<Client> client);
+
+    int port_;
+    std::string token_;
+    size_t pool_size_;
+
+    std::vector<Client::Node> backends_;           // guarded by pool_mtx_
+    std::vector<std::shared_ptr<Client>> pool_;    // current generation
+    std::vector<std::shared_ptr<Client>> idle_;
+    std::mutex pool_mtx_;
+    std::condition_variable pool_cv_;
+    std::thread watcher_;
+
+    std::atomic<bool> shutdown_requested_{false};
+    int server_fd_{-1};
+    std::vector<std::thread> workers_;
+    std::mutex workers_mutex_;
+
+    // Metrics
+    std::atomic<size_t> connected_clients_{0};
+    std::atomic<uint64_t> requests_{0};
+    std::atomic<uint64_t> forwarded_batches_{0};
+    std::atomic<uint64_t> fanouts_{0};
+    std::atomic<uint64_t> backend_errors_{0};
+    std::atomic<uint64_t> busy_us_{0};  // time spent serving requests
+    std::atomic<uint64_t> pool_waits_{0};
+    std::atomic<uint64_t> topology_changes_{0};
+};
+
+} // namespace keyforge
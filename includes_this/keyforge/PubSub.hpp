@@ -0,0 +1,99 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+namespace keyforge {
+
+// Publish/subscribe channels (SUBSCRIBE, PSUBSCRIBE, PUBLISH).
+//
+// A published message is formatted once (">MESSAGE <channel> <payload>")
+// and the same immutable buffer is queued to every subscriber, so a
+// publish costs a pointer append per subscriber rather than a copy and a
+// send. Each subscriber's connection thread is woken through an eventfd
+// and writes its queue out itself; a publisher never waits for a socket.
+// A subscriber whose queue grows past kMaxPendingBytes is cut off (its
+// socket shut down, so its own thread stops waiting on it too).
+//
+// Keyspace notifications: every change to a key is published on
+// "__keyspace@<db>__:<key>" (message: the event, e.g. "set", "lpush") and
+// on "__keyevent@<db>__:<event>" (message: the key), only formatted when
+// someone could be listening.
+class PubSub {
+public:
+    static constexpr size_t kMaxPendingBytes = 8 * 1024 * 1024;
+
+    using Message = std::shared_ptr<const std::string>;
+
+    class Subscriber {
+    public:
+        explicit Subscriber(int fd);  // the connection's socket
+        ~Subscriber();
+        Subscriber(const Subscriber&) = delete;
+        Subscriber& operator=(const Subscriber&) = delete;
+
+        int wakeFd() const { return wake_fd_; }  // readable when messages are pending
+
+        // Everything queued so far; also resets the wake fd
+        std::vector<Message> take();
+
+        bool dropped() const { return dropped_.load(); }  // fell too far behind
+
+    private:
+        friend class PubSub;
+        bool deliver(const Message& msg, bool& dropped_now);  // false if not queued
+
+        int fd_;
+        int wake_fd_;
+        std::mutex mtx_;
+        std::deque<Message> pending_;
+        size_t pending_bytes_ = 0;
+        std::atomic<bool> dropped_{false};
+
+        // Guarded by PubSub::mtx_
+        std::unordered_set<std::string> channels_;
+        std::unordered_set<std::string> patterns_;
+    };
+
+    // Each returns the connection's number of subscriptions afterwards.
+    // An empty list unsubscribes from everything.
+    size_t subscribe(const std::shared_ptr<Subscriber>& sub, const std::vector<std::string>& channels);
+    size_t unsubscribe(const std::shared_ptr<Subscriber>& sub, const std::vector<std::string>& channels);
+    size_t psubscribe(const std::shared_ptr<Subscriber>& sub, const std::vector<std::string>& patterns);
+    size_t punsubscribe(const std::shared_ptr<Subscriber>& sub, const std::vector<std::string>& patterns);
+
+    // Number of subscribers that received it
+    size_t publish(const std::string& channel, const std::string& payload);
+
+    // Write observer hook (event is nullptr for bulk changes, not published)
+    void keyspaceEvent(size_t db, const std::string& key, const char* event);
+
+    std::string info();
+
+    // Glob match with * and ? (and \ to escape)
+    static bool matches(const char* pattern, const char* text);
+
+private:
+    size_t subscriptions(const Subscriber& sub) const { return sub.channels_.size() + sub.patterns_.size(); }
+    static bool keyspaceChannel(const std::string& channel) { return channel.rfind("__key", 0) == 0; }
+
+    mutable std::shared_mutex mtx_;  // publishers share it, (un)subscribing is exclusive
+    std::unordered_map<std::string, std::unordered_set<std::shared_ptr<Subscriber>>> channels_;
+    std::unordered_map<std::string, std::unordered_set<std::shared_ptr<Subscriber>>> patterns_;
+
+    // Keyspace channel subscriptions plus all patterns (any may match one)
+    std::atomic<size_t> keyspace_listeners_{0};
+
+    std::atomic<uint64_t> published_{0};
+    std::atomic<uint64_t> delivered_{0};
+    std::atomic<uint64_t> dropped_clients_{0};
+};
+
+} // namespace keyforge
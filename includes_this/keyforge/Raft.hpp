@@ -0,0 +1,179 @@
+#pragma once
+#include "Store.hpp"
+#include "Replication.hpp"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace keyforge {
+
+// Optional Raft consensus mode for a group of 3-5 nodes.
+//
+// Writes (PUT/UPDATE/DELETE) are appended to a replicated log on the leader
+// and only applied to the Store, and acknowledged, once a majority has the
+// entry on disk. Peers talk over the normal client port: an outgoing peer
+// connection sends RAFT_PEER and is then handed to servePeer().
+//
+//   RAFT_VOTE <term> <candidate> <lastIndex> <lastTerm>    -> VOTE <term> <granted>
+//   RAFT_APPEND <term> <leader> <prevIndex> <prevTerm> <commit> <n>
+//     followed by n lines "<term> <command>"               -> APPEND <term> <ok> <index>
+//   RAFT_SNAPSHOT <term> <leader> <lastIndex> <lastTerm> <bytes>
+//     followed by the snapshot payload                     -> SNAP <term> <lastIndex>
+//
+// With batching on, each AppendEntries carries up to kMaxBatch entries, up
+// to kPipelineDepth requests are in flight per follower, and concurrent
+// client writes share one fsync. With batching off every write is proposed,
+// synced and replicated on its own.
+//
+// The log is compacted into a Store snapshot every kSnapshotEvery entries;
+// followers that fall behind the snapshot receive it with RAFT_SNAPSHOT.
+// A snapshot file starts with the index and term it covers.
+// The leader serves reads locally while it holds a lease: a majority
+// acknowledged it within the minimum election timeout (minus a drift margin),
+// so no other leader can have been elected in the meantime.
+class Raft {
+public:
+    Raft(Store& store, Replication& repl);
+    ~Raft();
+
+    // Join the group `members` ("host:port", including self). State lives in
+    // files named <file_prefix>.log / .meta / .snap.
+    void start(const std::string& self, const std::vector<std::string>& members,
+               const std::string& file_prefix, const std::string& token);
+    bool enabled() const { return enabled_.load(); }
+
+    // Replicate one mutation and wait until it is applied. Returns the reply
+    // line for the client ("OK\n", "UPDATED\n", "ERROR NOTLEADER ...\n", ...).
+    std::string submit(const std::string& command);
+
+    // True if a linearizable read may be served locally; otherwise redirect
+    // holds the reply to send instead.
+    bool canServeRead(std::string& redirect);
+
+    // Take over an incoming peer connection (after RAFT_PEER)
+    void servePeer(int fd);
+
+    void setBatching(bool on);
+    std::string info();
+    void shutdown();
+
+private:
+    enum class Role { FOLLOWER, CANDIDATE, LEADER };
+
+    struct Entry {
+        uint64_t term;
+        std::string command;
+    };
+
+    struct Waiter {
+        uint64_t term;
+        std::promise<std::string> reply;
+    };
+
+    struct Peer {
+        std::string addr;
+        std::string host;
+        int port = 0;
+        int fd = -1;
+        uint64_t next_index = 1;   // next entry to send
+        uint64_t match_index = 0;  // highest entry known replicated
+        std::deque<std::pair<char, std::chrono::steady_clock::time_point>> inflight;
+        std::chrono::steady_clock::time_point last_ack_sent;  // send time of newest acked RPC
+        std::chrono::steady_clock::time_point last_send;
+        bool vote_requested = false;
+        std::thread sender;
+        std::thread reader;
+    };
+
+    // Log helpers (mtx_ held)
+    uint64_t lastIndex() const { return snap_index_ + log_.size(); }
+    uint64_t termAt(uint64_t index) const;
+    const Entry& entryAt(uint64_t index) const { return log_[index - snap_index_ - 1]; }
+    void appendLocal(const Entry& e);
+    void truncateFrom(uint64_t index);
+    void rewriteLogFile();
+    void persistMeta();
+    void becomeFollower(uint64_t term, const std::string& leader);
+    void becomeLeader();
+    void startElection();
+    void advanceCommit();
+    void resetElectionTimer();
+    bool leaseValid() const;
+
+    // Threads
+    void tickerLoop();
+    void applyLoop();
+    void flushLoop();
+    void senderLoop(Peer& peer);
+    void readerLoop(Peer& peer, int fd);
+    bool connectPeer(Peer& peer);
+
+    // Incoming RPCs (called from servePeer)
+    std::string handleVote(const std::string& line);
+    std::string handleAppend(const std::string& header, std::vector<Entry>& entries);
+    std::string handleSnapshot(const std::string& header, const std::string& payload);
+
+    void loadState();
+    void takeSnapshot();
+    std::string applyCommand(const std::string& command);
+
+    Store& store_;
+    Replication& repl_;
+
+    std::atomic<bool> enabled_{false};
+    std::atomic<bool> stopping_{false};
+    std::string self_;
+    std::string token_;
+    std::string prefix_;
+    size_t cluster_size_ = 1;
+
+    mutable std::mutex mtx_;
+    std::condition_variable cv_;           // log / role / commit changes
+    Role role_ = Role::FOLLOWER;
+    uint64_t current_term_ = 0;
+    std::string voted_for_;
+    std::string leader_;
+    size_t votes_ = 0;
+    std::vector<Entry> log_;               // entries after the snapshot
+    uint64_t snap_index_ = 0;              // last index covered by the snapshot
+    uint64_t snap_term_ = 0;
+    uint64_t commit_index_ = 0;
+    uint64_t last_applied_ = 0;
+    uint64_t persisted_index_ = 0;         // our own entries known to be on disk
+    uint64_t log_generation_ = 0;          // bumped whenever the file is rewritten
+    uint64_t noop_index_ = 0;              // first entry of the current leader term
+    std::chrono::steady_clock::time_point election_deadline_;
+    std::chrono::steady_clock::time_point last_leader_contact_;  // last AppendEntries / snapshot accepted
+    std::map<uint64_t, Waiter> waiters_;
+    std::vector<std::unique_ptr<Peer>> peers_;
+    FILE* log_file_ = nullptr;
+
+    std::atomic<bool> batching_{true};
+    std::mutex submit_mtx_;                // serializes writes when batching is off
+    std::mutex apply_mtx_;                 // apply batch vs. snapshot install
+
+    std::thread ticker_;
+    std::thread applier_;
+    std::thread flusher_;
+
+    // Metrics
+    std::atomic<uint64_t> committed_entries_{0};
+    std::atomic<uint64_t> append_rpcs_{0};
+    std::atomic<uint64_t> appended_entries_{0};
+    std::atomic<uint64_t> fsyncs_{0};
+    std::atomic<uint64_t> elections_{0};
+    std::atomic<uint64_t> snapshots_{0};
+    std::atomic<uint64_t> lease_reads_{0};
+};
+
+} // namespace keyforge
@@ -0,0 +1,242 @@
+#pragma once
+#include "Store.hpp"
+#include "Net.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace keyforge {
+
+// Leader-follower asynchronous replication.
+//
+// Every successful mutation on the leader is appended to a line-oriented
+// stream ("PUT k v", "UPDATE k v", "DELETE k", "INCRBY k n"); the writes of
+// a MULTI/EXEC transaction are framed by "MULTI" and "EXEC" lines, and a
+// follower applies (and re-propagates) the frame as a whole at its EXEC.
+// Commands for logical database n > 0 are prefixed "@n ", and a full
+// resync carries every database. The replication offset is the
+// number of stream bytes produced so far. A follower connects, issues SYNC,
+// receives a snapshot of the Store tagged with the offset it corresponds to
+// (streamed straight from memory, never through a file, and bulk loaded by
+// several threads on the follower), then tails the stream and periodically reports "REPLCONF ACK <offset>".
+// Followers re-propagate what they apply, so replicas can be chained.
+//
+// The leader also keeps the most recent stream bytes in a fixed-size
+// backlog ring. A reconnecting follower sends "PSYNC <replid> <offset>" and,
+// if that offset is still inside the backlog window, only the missed bytes
+// are resent ("CONTINUE"); otherwise it falls back to a full resync.
+class Replication {
+public:
+    explicit Replication(Store& store);
+    ~Replication();
+
+    // All logical databases, index 0 being the Store passed to the
+    // constructor. Call before any replication starts.
+    void setDatabases(std::vector<Store*> dbs);
+
+    // Writers hold their database's lock across the Store mutation and
+    // propagate(), so the stream order always matches the order mutations
+    // hit that Store. Databases have a lock each: a busy one doesn't hold
+    // up writers of the others.
+    std::unique_lock<std::mutex> lockWrites(size_t db) {
+        return std::unique_lock<std::mutex>(*write_mtxs_[db]);
+    }
+    // Several databases at once (EXEC with watched keys elsewhere, a full
+    // resync): always taken in ascending order
+    using WriteLocks = std::vector<std::unique_lock<std::mutex>>;
+    WriteLocks lockWrites(std::vector<size_t> dbs);
+    WriteLocks lockAllWrites();
+
+    // Keep the stream to this thread, for a MULTI/EXEC frame that must not
+    // interleave with another database's writes. Taken after the write
+    // locks, and again by propagate() on the same thread.
+    std::unique_lock<std::recursive_mutex> lockStream() {
+        return std::unique_lock<std::recursive_mutex>(stream_mtx_);
+    }
+
+    // Append one mutation to the stream (caller holds lockWrites(db) of
+    // the database it changed). Returns the replication offset after the
+    // command.
+    uint64_t propagate(const std::string& command);
+    uint64_t propagate(size_t db, const std::string& command) {
+        return propagate(db == 0 ? command : "@" + std::to_string(db) + " " + command);
+    }
+
+    // Run "INCRBY key delta" or "INCRBYFLOAT key delta" on the Store (or
+    // inside batch) and stream it (caller holds lockWrites(db)). Returns the
+    // reply line: the new value and the offset token, or an ERROR.
+    // INCRBYFLOAT is streamed as a PUT of its result, so replicas never redo
+    // the float arithmetic.
+    std::string applyCounter(const std::string& command, size_t db = 0, Store::Batch* batch = nullptr);
+
+    // Take over a client connection that issued SYNC (empty replid) or
+    // PSYNC replid offset. Blocks until the replica disconnects or the
+    // server shuts down.
+    void serveReplica(int fd, const std::string& peer,
+                      const std::string& psync_replid = "", uint64_t psync_offset = 0);
+
+    // Resize the backlog ring (drops its current contents)
+    void setBacklogSize(size_t bytes);
+
+    // Disconnect every replica (they reconnect with PSYNC)
+    void resetReplicas();
+
+    // The dataset was replaced wholesale (LOAD): start a new history so that
+    // replicas cannot partially resync against it. Caller holds the write
+    // lock of the database it replaced.
+    void newHistory();
+
+    // Follower side
+    void replicaOf(const std::string& host, int port, const std::string& token = "");
+    void promote();  // REPLICAOF NO ONE
+    bool isReplica() const { return is_replica_.load(); }
+
+    uint64_t offset() const { return repl_offset_.load(); }
+
+    // Block until the local offset reaches `offset` (a token from a write
+    // reply) or the timeout expires. True if caught up.
+    bool waitForOffset(uint64_t offset, std::chrono::milliseconds timeout);
+
+    // "host:port" of the leader we follow, empty when we are the leader
+    std::string leaderAddress();
+
+    // Human readable replication status for REPLINFO
+    std::string info();
+
+    // Stop follower and replica-feeder threads
+    void shutdown();
+
+private:
+    struct ReplicaLink {
+        int fd;
+        std::string peer;
+        std::string pending;          // stream bytes not yet sent
+        uint64_t ack_offset = 0;
+        uint64_t sent_bytes = 0;
+        double last_lag_ms = 0.0;
+        std::chrono::steady_clock::time_point last_ack;
+        bool drop = false;
+    };
+
+    // Fixed-size ring holding the most recent stream bytes
+    struct Backlog {
+        std::vector<char> buf_;
+        size_t head_ = 0;         // next write position
+        size_t histlen_ = 0;      // valid bytes in the ring
+        uint64_t end_offset_ = 0; // replication offset just past the newest byte
+
+        explicit Backlog(size_t capacity) : buf_(capacity) {}
+
+        uint64_t firstOffset() const { return end_offset_ - histlen_; }
+
+        void reset(uint64_t offset) {
+            head_ = 0;
+            histlen_ = 0;
+            end_offset_ = offset;
+        }
+
+        void append(const std::string& data) {
+            size_t cap = buf_.size();
+            const char* p = data.data();
+            size_t len = data.size();
+            end_offset_ += len;
+            if (len >= cap) {  // only the tail fits
+                p += len - cap;
+                len = cap;
+            }
+            size_t first = std::min(len, cap - head_);
+            std::memcpy(buf_.data() + head_, p, first);
+            std::memcpy(buf_.data(), p + first, len - first);
+            head_ = (head_ + len) % cap;
+            histlen_ = std::min(cap, histlen_ + len);
+        }
+
+        // Copy [from, end_offset_) into out; false if from left the window
+        bool copyFrom(uint64_t from, std::string& out) const {
+            if (from < firstOffset() || from > end_offset_) return false;
+            size_t len = static_cast<size_t>(end_offset_ - from);
+            size_t cap = buf_.size();
+            size_t start = (head_ + cap - len) % cap;
+            size_t first = std::min(len, cap - start);
+            out.assign(buf_.data() + start, first);
+            out.append(buf_.data(), len - first);
+            return true;
+        }
+    };
+
+    void followerLoop(std::string host, int port, std::string token);
+    void followerSession(int fd, const std::string& token);
+    bool applyCommand(const std::string& line);
+    void applyTransaction(const std::vector<std::string>& lines);  // "MULTI" ... "EXEC"
+    // The database a stream line is for ("@n " prefix, or 0)
+    static size_t streamDb(const std::string& line);
+    // Strip a "@n " database prefix from line; nullptr for an unknown database
+    Store* streamTarget(std::string& line);
+    // Receive snapshot frames into staging (one Store per database) using
+    // parallel loader threads
+    bool bulkLoad(net::LineReader& reader, std::vector<std::unique_ptr<Store>>& staging, size_t& bytes);
+    void recordAck(ReplicaLink& link, uint64_t ack);
+    void stopFollower();
+    void notifyOffsetWaiters();
+    static std::string newReplId();
+
+    Store& store_;
+    std::vector<Store*> dbs_{&store_};
+
+    std::vector<std::unique_ptr<std::mutex>> write_mtxs_;  // one per database
+    // The stream itself, shared by every database: taken inside propagate(),
+    // after the database's write lock
+    std::recursive_mutex stream_mtx_;
+    std::atomic<uint64_t> repl_offset_{0};
+    std::string replid_;              // guarded by stream_mtx_, like the three below
+    std::string replid2_;             // previous history we can still continue
+    uint64_t second_offset_ = 0;      // last offset valid for replid2_
+    Backlog backlog_{1024 * 1024};
+    std::atomic<uint64_t> full_syncs_{0};
+    std::atomic<uint64_t> snapshot_bytes_sent_{0};
+    std::atomic<uint64_t> partial_syncs_{0};
+    std::atomic<uint64_t> partial_sync_bytes_{0};
+
+    // Readers waiting in waitForOffset()
+    std::mutex offset_mtx_;
+    std::condition_variable offset_cv_;
+    std::atomic<int> offset_waiters_{0};
+    std::atomic<uint64_t> offset_waits_ok_{0};
+    std::atomic<uint64_t> offset_waits_timeout_{0};
+
+    // Leader state (guarded by links_mtx_)
+    std::mutex links_mtx_;
+    std::condition_variable links_cv_;
+    std::vector<std::shared_ptr<ReplicaLink>> links_;
+    std::deque<std::pair<uint64_t, std::chrono::steady_clock::time_point>> write_times_;
+    std::atomic<uint64_t> propagated_cmds_{0};
+
+    // Follower state
+    std::atomic<bool> is_replica_{false};
+    std::atomic<bool> follower_stop_{false};
+    std::atomic<bool> shutting_down_{false};
+    std::thread follower_thread_;
+    std::mutex control_mtx_;          // serializes replicaOf/promote/shutdown
+    std::mutex follower_mtx_;         // guards the fields below
+    std::string leader_host_;
+    int leader_port_ = 0;
+    bool link_up_ = false;
+    std::chrono::steady_clock::time_point last_io_;
+    size_t last_sync_keys_ = 0;
+    size_t last_sync_bytes_ = 0;
+    double last_sync_ms_ = 0.0;
+    bool last_sync_partial_ = false;
+    std::atomic<uint64_t> applied_cmds_{0};
+    double apply_rate_ = 0.0;         // commands per second over the last window
+};
+
+} // namespace keyforge
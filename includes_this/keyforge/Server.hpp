@@ -2,7 +2,17 @@
 #define KEYFORGE_SERVER_HPP
 
 #include "Store.hpp"
+#include "Replication.hpp"
+#include "Cluster.hpp"
+#include "Raft.hpp"
+#include "Gossip.hpp"
+#include "HotKeys.hpp"
+#include "Tracking.hpp"
+#include "PubSub.hpp"
+#include "Blocking.hpp"
 #include <atomic>
+#include <chrono>
+#include <memory>
 #include <thread>
 #include <vector>
 #include <mutex>
@@ -17,23 +27,135 @@ public:
     // Main entry point
     void run();
 
-    // Externally trigger shutdown (e.g., from signal handler)
+    // Externally trigger shutdown (e.g., from signal handler: it only sets
+    // a flag and wakes up run(), which stops everything else)
     void requestShutdown();
 
+    // Start as a follower of host:port (same as the REPLICAOF command)
+    void replicaOf(const std::string& host, int port, const std::string& token = "");
+
+    // Size of the replication backlog used for partial resync
+    void setReplBacklogSize(size_t bytes);
+
+    // How long a WAIT_OFFSET read waits for this replica to catch up
+    void setReadWait(std::chrono::milliseconds timeout);
+
+    // Turn on cluster mode; other nodes reach us at announce_host:port
+    void enableCluster(const std::string& announce_host);
+
+    // Join a Raft group; members are "host:port" and include this server
+    void enableRaft(const std::vector<std::string>& members, const std::string& token);
+
+    // Join the gossip membership through seeds ("host:port", may include this server)
+    void enableGossip(const std::vector<std::string>& seeds);
+
+    // Number of logical databases (SELECT 0..count-1). Call before run().
+    static constexpr size_t kDefaultDatabases = 16;
+    void setDatabases(size_t count);
+
+    // Per-database memory limit; 0 means unlimited
+    void setDbMaxMemory(size_t bytes);
+
+    // Put a key filter in front of every database (see KeyFilter.hpp)
+    void enableKeyFilter();
+
+    // Keep string values of at least threshold bytes compressed (0: off)
+    void setCompression(size_t threshold);
+
+    // Spill what doesn't fit in the per-database memory limit to an LSM
+    // tree under dir (see Lsm.hpp), one subdirectory per database
+    void setStorageDir(const std::string& dir, size_t block_cache_bytes);
+
+    // Keep each database's spilled entries in a memory-mapped table under
+    // dir (see MappedTable.hpp), which takes the whole dataset at shutdown
+    // and is mapped again, not reloaded, at the next start
+    void setMappedDir(const std::string& dir);
+
+    // Move string values untouched for cold_after to value logs under dir
+    // (see ValueLog.hpp), one subdirectory per database
+    void setValueLogDir(const std::string& dir, std::chrono::seconds cold_after);
+
+    // How every database writes its snapshot files (see FileWriter.hpp)
+    void setWriteOptions(const FileWriter::Options& options);
+
 private:
     int port_;
+    Tracking tracking_;  // before store_: the store's write observer points here
+    PubSub pubsub_;      // same
+    Blocking blocking_;  // same
+    HotKeys hotkeys_;
     Store store_;
+    Replication repl_{store_};
+    Cluster cluster_{store_, repl_};
+    Raft raft_{store_, repl_};
+    Gossip gossip_;
+
+    // Logical databases; database 0 is store_, the only one cluster
+    // mode and Raft know about
+    std::vector<Store*> dbs_;
+    std::vector<std::unique_ptr<Store>> extra_dbs_;
+
+    std::chrono::milliseconds read_wait_{100};
 
     std::atomic<bool> shutdown_requested_{false};
-    int server_fd_{-1};
+    std::atomic<int> server_fd_{-1};
 
     std::vector<std::thread> workers_;
     std::mutex workers_mutex_;
 
+    // Per-connection state
+    struct Session {
+        bool asking = false;  // next command may touch an IMPORTING slot
+        size_t db = 0;        // SELECTed database
+        std::shared_ptr<Tracking::Subscriber> tracking;  // set by CLIENT TRACKING ON
+        std::shared_ptr<PubSub::Subscriber> pubsub;      // set by the first (P)SUBSCRIBE
+
+        // MULTI ... EXEC
+        bool in_multi = false;
+        bool multi_failed = false;  // a command was refused while queueing
+        std::vector<std::string> queued;
+        struct Watch {
+            size_t db;  // SELECT may change before EXEC
+            std::string key;
+            uint64_t version;  // at WATCH
+        };
+        std::vector<Watch> watched;
+
+        void resetMulti() {
+            in_multi = multi_failed = false;
+            queued.clear();
+            watched.clear();
+        }
+    };
+
     void handleClient(int client_fd);
 
+    // The entry of members that names this server (matched by port)
+    std::string selfAddress(const std::vector<std::string>& members) const;
+
+    // Execute one command line, appending the reply to out.
+    // Returns false when the connection should be closed.
+    bool processCommand(int client_fd, Session& session, const std::string& line, std::string& out);
+
+    // EXEC: run the queued commands under one store lock, framed as a
+    // transaction in the replication stream
+    std::string execTransaction(Session& session);
+    std::string runQueued(Session& session, Store::Batch& batch, const std::string& line);
+
+    // List, hash and sorted-set commands (see Collections.hpp); writes are
+    // streamed as they are, so the caller holds lockWrites(db) for them
+    std::string runCollection(Session& session, Store::Batch& batch, const std::string& line);
+
+    // BLPOP / BRPOP / WAITKEY: parks the connection until a key changes.
+    // Returns false when the client hung up while waiting.
+    bool runBlocking(int client_fd, Session& session, const std::string& line, std::string& out);
+
+    // A reply, sent under the tracking lock when pushes share the socket
+    void reply(int client_fd, Session& session, const std::string& msg);
+
     // Utility
     static void send_all(int fd, const std::string& msg);
+    static std::string defaultFile(size_t db);  // SAVE/LOAD without a filename
 
     // Number of Connected clients counter
     std::atomic<size_t> connected_clients_{0};
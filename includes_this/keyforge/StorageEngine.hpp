@@ -0,0 +1,63 @@
+#pragma once
+#include <functional>
+#include <memory>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace keyforge {
+
+// Where a Store keeps the entries it has no room for in memory (see
+// Store::setStorageEngine). Values are opaque bytes; an implementation
+// must be safe to call from several threads.
+//
+// get() and forEach() throw StorageError when the data can't be read back:
+// that is an error for the command, never a missing key.
+struct StorageError : std::runtime_error {
+    explicit StorageError(const std::string& what) : std::runtime_error("IOERR " + what) {}
+};
+
+class StorageEngine {
+public:
+    virtual ~StorageEngine() = default;
+
+    // false if there is no room for it (out of disk space): the caller
+    // keeps the value
+    virtual bool put(const std::string& key, const std::string& value) = 0;
+    virtual void remove(const std::string& key) = 0;
+    virtual std::optional<std::string> get(const std::string& key) = 0;
+
+    // Every pair, in an order that only changes with the contents (key
+    // order for the LSM tree); stops when fn returns false
+    virtual void forEach(const std::function<bool(const std::string&, const std::string&)>& fn) = 0;
+
+    // Up to count keys greater than after (nullopt: from the smallest), in
+    // key order: a page of an incremental scan that keeps no state between
+    // calls. Throws StorageError like forEach.
+    virtual std::vector<std::string> keysAfter(const std::optional<std::string>& after, size_t count) = 0;
+
+    // What the engine holds at the time of view(), to read while writes go
+    // on, without the caller's lock (a full resync streams it to a replica)
+    class View {
+    public:
+        virtual ~View() = default;
+        // Like StorageEngine::forEach
+        virtual void forEach(const std::function<bool(const std::string&, const std::string&)>& fn) = 0;
+    };
+    virtual std::unique_ptr<View> view() = 0;
+
+    // Drop everything
+    virtual void clear() = 0;
+
+    // For STATS, one or more lines
+    virtual std::string info() const = 0;
+
+    // An engine that outlives the process (see MappedTable.hpp) may open
+    // with entries already in it; persist() makes what it holds durable
+    virtual size_t restoredKeys() const { return 0; }
+    virtual bool persistent() const { return false; }
+    virtual bool persist() { return false; }
+};
+
+} // namespace keyforge
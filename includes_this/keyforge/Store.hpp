@@ -1,16 +1,44 @@
 #pragma once
+#include "Collections.hpp"
+#include "ValuePool.hpp"
+#include "KeyFilter.hpp"
+#include "StorageEngine.hpp"
+#include "ValueLog.hpp"
+#include "FileWriter.hpp"
 #include <string>
 #include <unordered_map>
 #include <unordered_set>
 #include <mutex>
 #include <optional>
+#include <utility>
+#include <variant>
+#include <vector>
+#include <cstdint>
 #include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <thread>
+#include <iosfwd>
+#include <functional>
+#include <memory>
+#include <stdexcept>
 
 namespace keyforge {
 
 class Store {
 public:
-    Store() = default;
+    Store();
+    ~Store();
+
+    // A key holds one type of value: a string (or counter), a list, a hash or
+    // a sorted set. Using it as another type throws WrongType, and nothing
+    // is changed.
+    struct WrongType : std::runtime_error {
+        WrongType() : std::runtime_error("WRONGTYPE Operation against a key holding the wrong kind of value") {}
+    };
+
+    // "none", "string", "list", "hash" or "zset"
+    std::string type(const std::string& key) const;
 
     // Add a key-value pair
     void put(const std::string& key, const std::string& value);
@@ -24,31 +52,393 @@ public:
     // Remove key
     bool remove(const std::string& key);
 
+    // Every write stamps the key with a new version from a per-store clock
+    // that starts at the wall-clock time in microseconds, so versions are
+    // never reused, not even across restarts or a deleted and recreated key
+    std::optional<std::pair<std::string, uint64_t>> getVersioned(const std::string& key);
+    uint64_t version(const std::string& key) const;  // 0 if missing
+
+    // Store new_value only if key is still at version `expected` (0: key must
+    // not exist). On success version is the new version; on a conflict it is
+    // the current one (0 if the key is missing).
+    bool compareAndSwap(const std::string& key, uint64_t expected,
+                        const std::string& new_value, uint64_t& version);
+
+    // Counters: add delta to an integer value (a missing key counts as 0)
+    // and return the result; nullopt if the value isn't an integer or the
+    // result would overflow. Counters are stored as native integers, so an
+    // increment is done in place without allocating.
+    std::optional<int64_t> incrBy(const std::string& key, int64_t delta);
+
+    // Same for a decimal value; the result is stored as a string
+    std::optional<std::string> incrByFloat(const std::string& key, long double delta);
+
+    // Several operations under a single acquisition of the store lock, so
+    // no other reader or writer sees a state in between (MULTI/EXEC).
+    // Change notifications go out when the batch is destroyed. Don't call
+    // the Store's own methods while a Batch is alive.
+    class Batch {
+    public:
+        explicit Batch(Store& store);
+        ~Batch();
+        Batch(const Batch&) = delete;
+        Batch& operator=(const Batch&) = delete;
+
+        std::optional<std::string> get(const std::string& key);
+        std::optional<std::pair<std::string, uint64_t>> getVersioned(const std::string& key);
+        uint64_t version(const std::string& key) const;  // 0 if missing
+        void put(const std::string& key, const std::string& value);
+        bool update(const std::string& key, const std::string& new_value);
+        bool remove(const std::string& key);
+        std::optional<int64_t> incrBy(const std::string& key, int64_t delta);
+        std::optional<std::string> incrByFloat(const std::string& key, long double delta);
+
+        // Lists, hashes and sorted sets are only reached through a Batch (a
+        // single command is a one-operation batch). They are changed in
+        // place; a collection left empty is deleted. Negative list and rank
+        // indexes count from the end, ranges are inclusive and clamped.
+        size_t listPush(const std::string& key, std::vector<std::string> values, bool front);  // new length
+        std::optional<std::string> listPop(const std::string& key, bool front);
+        bool listSet(const std::string& key, long index, std::string value);  // false: no such element
+        std::optional<std::string> listIndex(const std::string& key, long index);
+        std::vector<std::string> listRange(const std::string& key, long start, long stop);
+        size_t listLength(const std::string& key);
+
+        size_t hashSet(const std::string& key, std::vector<std::pair<std::string, std::string>> fields);  // new fields
+        std::optional<std::string> hashGet(const std::string& key, const std::string& field);
+        size_t hashDelete(const std::string& key, const std::vector<std::string>& fields);
+        std::vector<std::pair<std::string, std::string>> hashGetAll(const std::string& key);
+        size_t hashLength(const std::string& key);
+
+        size_t zsetAdd(const std::string& key, const std::vector<std::pair<double, std::string>>& members);  // new members
+        size_t zsetRemove(const std::string& key, const std::vector<std::string>& members);
+        std::optional<double> zsetScore(const std::string& key, const std::string& member);
+        std::optional<size_t> zsetRank(const std::string& key, const std::string& member);
+        std::vector<std::pair<std::string, double>> zsetRange(const std::string& key, long start, long stop);
+        size_t zsetLength(const std::string& key);
+
+        // Replace key with a value in dump form (see kDumpMark)
+        bool restore(const std::string& key, const std::string& dump);
+
+    private:
+        // The key's collection of type T: nullptr if the key is missing
+        // (and !create), WrongType if it holds something else
+        template <typename T>
+        T* collection(const std::string& key, bool create);
+        // After changing key's collection in place: memory accounting, new
+        // version, or deletion if it is now empty (size 0)
+        void changed(const std::string& key, const char* event, size_t bytes_before, size_t size);
+
+        Store& store_;
+        std::unique_lock<std::mutex> lock_;
+        std::vector<std::pair<std::string, const char*>> changed_;  // key, event
+    };
+
     // Optional: get a key by value (reverse lookup)
     std::optional<std::string> getKeyByValue(const std::string& value);
 
-    // Methods for persistence
+    // Key presence check / read that don't touch the GET statistics
+    bool contains(const std::string& key) const;
+    std::optional<std::string> peek(const std::string& key) const;
+
+    // Incremental key iteration: appends roughly `count` keys and returns the
+    // cursor to continue from ("0" to start, and once the whole table has
+    // been visited). The in-memory keys come first, a bucket index as the
+    // cursor; then the spilled ones in key order, the cursor naming the last
+    // one returned, so each page seeks straight to the next. The lock is
+    // only held per call. Keys added or a rehash during the iteration may
+    // cause keys to be missed or repeated.
+    std::string scan(const std::string& cursor, size_t count, std::vector<std::string>& keys) const;
+
+    // Methods for persistence. The first save to a file writes the whole
+    // dataset (a base); later saves to the same file write only the keys
+    // changed or deleted since the previous one, as a delta
+    // (filename.delta.<n>). Once there are kMergeDeltas deltas, or they
+    // outweigh the base, a background thread merges them into a new base,
+    // streaming the old one. loadFromFile() applies a base's deltas in
+    // order; a file without a base header loads as a plain dump.
+    static constexpr uint64_t kMergeDeltas = 8;
     bool saveToFile(const std::string& filename);
     bool loadFromFile(const std::string& filename);
+    std::string snapshotInfo() const;
+    // How snapshot files are written (see FileWriter.hpp). The rate limit
+    // only applies to merges: a SAVE holds the lock while it writes.
+    void setWriteOptions(FileWriter::Options options);
+
+    // Same format as the file persistence, over any stream (used by replication)
+    bool saveToStream(std::ostream& os);
+    bool loadFromStream(std::istream& is);
+
+    // One record of that format: "key=value\n" with '\n' and '=' escaped.
+    // A list, hash or sorted set is written in dump form: kDumpMark, a type
+    // letter and its elements separated by spaces ("\tL a b", "\tH f v",
+    // "\tZ 1.5 m"). Protocol tokens never contain whitespace, so no string
+    // value looks like that. snapshot() and peek() use the same form.
+    static constexpr char kDumpMark = '\t';
+    static void encodeRecord(std::string& out, const std::string& key, const std::string& value);
+    static bool decodeRecord(const std::string& line, std::string& key, std::string& value);
 
+    // Every pair as of the call, taken without copying anything: the pairs
+    // in memory are walked a few hash buckets at a time by consume(), and a
+    // writer changing a key the walk hasn't reached yet first keeps what it
+    // was; the spilled ones are a view (see StorageEngine::view). So a
+    // snapshot can be written out without holding the lock, or twice the
+    // memory, for the length of the I/O.
+    struct Capture;
+    struct Snapshot {
+        std::shared_ptr<Capture> memory;               // nullptr: none
+        size_t memory_keys = 0;
+        std::unique_ptr<StorageEngine::View> spilled;  // nullptr: none
+        size_t spilled_keys = 0;
+
+        size_t keys() const { return memory_keys + spilled_keys; }
+        // Every pair to fn, taking the lock for each few buckets of the
+        // walk; stops when fn returns false. Throws StorageError if the
+        // spilled ones can't be read, or if the contents were replaced
+        // (LOAD, a resync) before the walk was done.
+        void consume(const std::function<bool(const std::string&, const std::string&)>& fn);
+    };
+    Snapshot snapshot();
+
+    // Bulk loading: insert many pairs under one lock acquisition (no
+    // statistics), and exchange the whole contents with another Store
+    void reserve(size_t n);
+    void putMany(std::vector<std::pair<std::string, std::string>>& kvs);  // moves out of kvs
+    void swapContents(Store& other);
+
+    // Called after every change, outside the lock, with the key that changed
+    // and what happened to it ("set", "del", "incrby", "lpush", ...), or ""
+    // and nullptr when many or all keys did. Set once, before the Store is
+    // shared.
+    void setWriteObserver(std::function<void(const std::string&, const char*)> observer) {
+        write_observer_ = std::move(observer);
+    }
 
     // Size of Store :
     size_t size() const {
         std::lock_guard<std::mutex> lock(mtx_);
-        return kv_store_.size();
+        return kv_store_.size() + spilled_;
+    }
+
+    // Approximate memory held by the entries (keys, values and a fixed
+    // per-entry overhead), and an optional cap that writers check before
+    // adding data (0 = unlimited)
+    size_t usedMemory() const { return used_bytes_.load(std::memory_order_relaxed); }
+    void setMaxMemory(size_t bytes) { max_memory_ = bytes; }
+    size_t maxMemory() const { return max_memory_; }
+    bool overMemoryLimit() const {
+        return max_memory_ > 0 && (!engine_ || spill_full_.load(std::memory_order_relaxed)) &&
+               usedMemory() >= max_memory_;
     }
 
+    // Optional second tier (see StorageEngine.hpp). With one, the memory
+    // limit no longer refuses writes: the least recently used entries past
+    // it are moved to the engine, keeping their version, and read back
+    // into memory by the first command that uses them. Everything else
+    // (SCAN, SAVE, GET_KEY, the key filter) sees both tiers. A command that
+    // can't read a spilled entry back throws StorageError, before changing
+    // anything. The factory also gives emptyLike() copies an engine of
+    // their own.
+    void setStorageEngine(std::function<std::unique_ptr<StorageEngine>()> factory);
+    std::string storageInfo() const;
+
+    // A persistent engine (see MappedTable.hpp) set while the Store is
+    // still empty brings back the entries it opened with, as spilled ones.
+    // persistStorage() moves every in-memory entry to it and makes it
+    // durable, for the next start to map (at shutdown: memory is left
+    // empty). true if there is no such engine.
+    bool persistStorage();
+
+    // Value tiering (see ValueLog.hpp): a background thread moves string
+    // values nobody has used for cold_after to a log from the factory,
+    // leaving the keys, their metadata and the values' Blobs in memory,
+    // and collects log segments that are mostly dead. The first command
+    // that uses a cold value reads it back; SAVE, snapshots, peek() and
+    // GET_KEY read it in place.
+    void setValueLog(std::function<std::unique_ptr<ValueLog>()> factory, std::chrono::seconds cold_after);
+    std::string valueLogInfo() const;
+
+    // A new, empty Store with this one's settings (memory limit, storage
+    // engine, value log, compression), to load a dataset into before swapContents()
+    std::unique_ptr<Store> emptyLike() const;
+
+    // Optional filter over the keys (see KeyFilter.hpp): GET, GETV and
+    // contains() of a key that was never written return without taking the
+    // lock. Once on, it stays on.
+    void enableKeyFilter();
+    std::string keyFilterInfo() const;
+
+    // String values of at least `threshold` bytes are kept compressed (see
+    // Compression.hpp) when that saves an eighth or more; 0 turns it off.
+    // They are decompressed on read, outside the lock. trainCompression()
+    // builds a shared dictionary from a sample of the current values for
+    // the values written after it, and returns its size.
+    void setCompression(size_t threshold);
+    size_t trainCompression(size_t max_bytes);
+    std::string compressionInfo() const;
+
+    // Identical string values are stored once (see ValuePool.hpp)
+    std::string dedupInfo() const;
+
     // Statistics & metrics variables :
     std::atomic<size_t> get_count{0};
     std::atomic<size_t> put_count{0};
     std::atomic<size_t> update_count{0};
     std::atomic<size_t> delete_count{0};
+    std::atomic<size_t> incr_count{0};
+    std::atomic<size_t> cas_count{0};
+    std::atomic<size_t> cas_conflict_count{0};
     std::atomic<size_t> get_miss_count{0};
 
 
 private:
-    std::unordered_map<std::string, std::string> kv_store_;
-    std::unordered_map<std::string, std::unordered_set<std::string>> value_to_keys_;
+    // Counters hold an integer, other scalars a value shared through pool_.
+    // A plain string only appears on the way in: setValue() interns it.
+    using Blob = ValuePool::Blob;
+    using Value = std::variant<std::string, int64_t, std::unique_ptr<QuickList>,
+                               std::unique_ptr<HashValue>, std::unique_ptr<SortedSet>, Blob*>;
+    static std::string render(const Value& v);  // dump form for collections
+    static Value parseValue(std::string text);  // inverse of render
+    static size_t valueBytes(const Value& v);   // not counting a shared Blob
+    static bool scalar(const Value& v) { return v.index() < 2 || v.index() == 5; }
+
+    struct Entry {
+        Value value;
+        uint64_t version = 0;
+        uint32_t touched = 0;  // access_clock_ when last used, for spilling
+    };
+
+    // Write v under key, keeping the reverse index in step and stamping a
+    // new version (mtx_ held)
+    Entry& setValue(const std::string& key, Value v);
+
+    // Shared by the single-command methods and Batch (mtx_ held, no notification)
+    std::optional<std::string> getLocked(const std::string& key);
+    std::optional<std::pair<std::string, uint64_t>> getVersionedLocked(const std::string& key);
+    void putLocked(const std::string& key, const std::string& value);
+    bool updateLocked(const std::string& key, const std::string& new_value);
+    bool removeLocked(const std::string& key);
+    std::optional<int64_t> incrByLocked(const std::string& key, int64_t delta);
+    std::optional<std::string> incrByFloatLocked(const std::string& key, long double delta);
+
+    // Before key is changed or removed in any way (mtx_ held): for every
+    // snapshot still walking towards key's bucket, keep the value it had
+    // when the snapshot was taken (nothing if it wasn't in memory)
+    void preserve(const std::string& key);
+    // The pairs in the capture's next few buckets, under the lock; false
+    // once it has walked them all, which ends it
+    bool captureNext(Capture& capture, std::vector<std::pair<std::string, std::string>>& out);
+    void endCapture(Capture* capture);  // mtx_ held
+    void breakCaptures();               // the contents are replaced (mtx_ held)
+
+    // Keep pool_ / int_values_ in step with kv_store_ (mtx_ held)
+    void indexValue(const std::string& key, const Value& v);
+    void unindexValue(const std::string& key, const Value& v);
+
+    void notifyWrite(const std::string& key, const char* event);
+
+    // The entry for key, read back from the storage engine if it was
+    // spilled there (mtx_ held). Commands use this rather than kv_store_.
+    Entry* findLocked(const std::string& key);
+    // A spilled entry's record, left where it is (mtx_ held)
+    std::optional<std::string> spilledRecord(const std::string& key) const;
+    // Take key out of the engine, if it's there: it's being rewritten (mtx_ held)
+    bool dropSpilled(const std::string& key);
+    // Move the least recently used entries out until used memory is back
+    // under the limit (mtx_ held), at the end of every write
+    void spillLocked();
+
+    // Cool values and collect the value log every few seconds
+    void tieringLoop();
+
+    // Record a change to key for the next delta (mtx_ held)
+    void markDirty(const std::string& key);
+    // Bodies of saveToStream / loadFromStream (mtx_ held, no notification)
+    bool saveLocked(std::ostream& os);
+    void loadLocked(std::istream& is);
+    // Apply one delta (mtx_ held); false if it is not the next one of chain
+    bool applyDelta(std::istream& is, uint64_t chain, uint64_t seq);
+    bool saveBase(const std::string& filename);
+    bool saveDelta(const std::string& filename);
+    // Fold deltas up to `upto` into filename's base (merge thread; files only)
+    void mergeDeltas(std::string filename, uint64_t chain, uint64_t upto, FileWriter::Options options);
+    void joinMerge();
+
+    // false: key is definitely absent (checked without the lock)
+    bool mayContain(const std::string& key) const;
+    // Keep the filter in step with kv_store_ (mtx_ held)
+    void filterAdd(const std::string& key);
+    void filterRemove(const std::string& key);
+    // Refill it from kv_store_, growing it if needed (mtx_ held). Readers
+    // that overlap a rebuild see key_filter_seq_ change and take the lock.
+    void rebuildKeyFilter();
+
+    std::function<void(const std::string&, const char*)> write_observer_;
+    std::unordered_map<std::string, Entry> kv_store_;
+    // Snapshots still walking kv_store_. They need its buckets to stay put,
+    // so while there are any its max load factor is raised from load_factor_.
+    std::vector<Capture*> captures_;
+    float load_factor_ = 1.0f;
+    // String values, stored once however many keys hold them; also the
+    // reverse index. Counters change too often to share or index.
+    ValuePool pool_;
+    size_t int_values_ = 0;  // counters, searched by getKeyByValue when there are any
+    uint64_t clock_;         // last version handed out
+    std::atomic<size_t> used_bytes_{0};  // changed under mtx_, read without it
+    size_t max_memory_ = 0;
+
+    std::atomic<KeyFilter*> key_filter_{nullptr};
+    // The current filter is the last one; the older, smaller ones stay
+    // allocated because a lock-free reader may still be looking at them
+    std::vector<std::unique_ptr<KeyFilter>> key_filters_;
+    std::atomic<uint64_t> key_filter_seq_{0};  // odd while the filter is rebuilt
+    mutable std::atomic<size_t> filter_skips_{0};            // misses answered by the filter
+    mutable std::atomic<size_t> filter_false_positives_{0};  // misses it let through
+
+    size_t compress_threshold_ = 0;
+    // Values keep pointing at the dictionary they were compressed with, so
+    // none is ever dropped; the last one is used for new values. Shared
+    // because swapContents() moves values between stores.
+    std::vector<std::shared_ptr<const compression::Dictionary>> dictionaries_;
+
+    std::function<std::unique_ptr<StorageEngine>()> engine_factory_;
+    std::unique_ptr<StorageEngine> engine_;
+    size_t spilled_ = 0;  // keys in engine_ (each is in exactly one tier)
+    uint32_t access_clock_ = 0;
+    uint64_t spill_seed_ = 0x9e3779b97f4a7c15ULL;  // picks where spilling samples
+    std::atomic<size_t> spills_{0};
+    std::atomic<size_t> faults_{0};
+    std::atomic<bool> spill_full_{false};  // the engine refused the last spill
+    std::chrono::steady_clock::time_point spill_retry_;
+
+    std::function<std::unique_ptr<ValueLog>()> value_log_factory_;
+    std::unique_ptr<ValueLog> value_log_;  // cold Blobs in pool_ point into it
+    std::chrono::seconds cold_after_{0};
+    uint32_t tier_now_ = 0;  // seconds since tiering started, for Blob::used
+    bool tier_stop_ = false;
+    std::condition_variable tier_cv_;
+    std::thread tier_thread_;
+
+    // Delta snapshots: the keys changed since the last save to
+    // snapshot_file_, unless there is no base yet or too many changed
+    // (all_dirty_: the next save writes a base)
+    std::unordered_set<std::string> dirty_keys_;
+    bool all_dirty_ = true;
+    mutable std::mutex snapshot_mtx_;  // SAVE / LOAD file work, taken before mtx_
+    std::string snapshot_file_;
+    FileWriter::Options write_options_;
+    std::atomic<bool> wrote_direct_{false};  // the last snapshot file did
+    uint64_t chain_id_ = 0;    // in the base and each of its deltas
+    uint64_t delta_seq_ = 0;   // last delta written
+    std::atomic<uint64_t> merged_upto_{0};  // deltas folded into the base
+    std::atomic<size_t> base_bytes_{0};
+    std::atomic<size_t> delta_bytes_{0};    // deltas not merged yet
+    std::thread merge_thread_;
+    std::atomic<bool> merging_{false};
+    std::atomic<size_t> base_saves_{0};
+    std::atomic<size_t> delta_saves_{0};
+    std::atomic<size_t> merges_{0};
+    std::atomic<size_t> last_save_bytes_{0};
     mutable std::mutex mtx_;
 };
 
@@ -0,0 +1,63 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+namespace keyforge {
+
+// Server-assisted client-side caching (CLIENT TRACKING ON).
+//
+// When a tracking connection reads a key, the key is remembered for that
+// connection. The next change to the key pushes ">INVALIDATE <key>" to it
+// and forgets the entry (one notification per read, like Redis' default
+// tracking mode). A dataset replaced wholesale pushes ">INVALIDATE *".
+//
+// Pushes are written from the writer's thread, so a subscriber's replies
+// and pushes share send_mtx. A client that stops reading can't stall
+// writers: a push that would block (or waits more than kPushWait for the
+// connection's own reply to go out) disconnects it instead, which makes it
+// drop its cache and reconnect.
+class Tracking {
+public:
+    static constexpr size_t kMaxTrackedKeys = 1000000;
+    static constexpr std::chrono::milliseconds kPushWait{50};
+
+    struct Subscriber {
+        explicit Subscriber(int fd) : fd(fd) {}
+        std::timed_mutex send_mtx;             // replies and pushes must not interleave
+        int fd;                                // guarded by send_mtx, -1 once closed
+        std::atomic<bool> dropped{false};      // missed a push: the connection must close
+        std::unordered_set<std::string> keys;  // guarded by Tracking::mtx_
+    };
+
+    std::shared_ptr<Subscriber> subscribe(int fd);
+    void unsubscribe(const std::shared_ptr<Subscriber>& sub);
+
+    // Call before reading key for sub, so a racing write still notifies it
+    void remember(const std::string& key, const std::shared_ptr<Subscriber>& sub);
+
+    // key changed ("" = the whole dataset)
+    void invalidate(const std::string& key);
+
+    std::string info();
+
+private:
+    void push(Subscriber& sub, const std::string& msg);
+
+    std::mutex mtx_;
+    std::unordered_map<std::string, std::vector<std::shared_ptr<Subscriber>>> table_;
+    std::unordered_set<std::shared_ptr<Subscriber>> subscribers_;
+    std::atomic<size_t> tracked_keys_{0};  // lets writers skip the lock when nobody tracks
+
+    std::atomic<uint64_t> invalidations_{0};
+    std::atomic<uint64_t> evictions_{0};
+    std::atomic<uint64_t> dropped_clients_{0};
+};
+
+} // namespace keyforge
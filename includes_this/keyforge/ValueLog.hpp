@@ -0,0 +1,81 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <string>
+
+namespace keyforge {
+
+// Append-only log of cold values, in segment files of about segment_bytes
+// in a directory of its own. A record is just the value's bytes: where it
+// is (a Ref) lives in memory with the value (see ValuePool::Blob), so the
+// log needs no index of its own.
+//
+// A released record only counts as dead space. A segment is deleted once
+// all of it is dead, and gcVictim() offers the sealed segment that is the
+// most dead (at least gc_dead_ratio) for its owner to copy the live
+// records out of and drop.
+//
+// A new segment is fallocate()d whole, and writeback of every sync_bytes
+// appended is started right away (sync_file_range, without waiting), so
+// the log never builds up much dirty data for the kernel to flush at once.
+//
+// Like the directory of an LsmEngine it is scratch space, created empty
+// and removed with the log. Not thread-safe: the Store calls it with its
+// lock held.
+class ValueLog {
+public:
+    struct Options {
+        size_t segment_bytes = 16 << 20;
+        double gc_dead_ratio = 0.5;
+        size_t sync_bytes = 4 << 20;  // 0: leave writeback to the kernel
+    };
+
+    struct Ref {
+        uint32_t segment = 0;
+        uint32_t size = 0;
+        uint64_t offset = 0;
+    };
+
+    explicit ValueLog(std::string dir) : ValueLog(std::move(dir), Options()) {}
+    ValueLog(std::string dir, Options options);
+    ~ValueLog();
+    ValueLog(const ValueLog&) = delete;
+    ValueLog& operator=(const ValueLog&) = delete;
+
+    // false if it couldn't be written (the value stays where it was)
+    bool append(const std::string& bytes, Ref& ref);
+    bool read(const Ref& ref, std::string& out) const;
+    void release(const Ref& ref);
+
+    // Segment to collect next, 0 if none is worth it
+    uint32_t gcVictim() const;
+
+    // Drop everything
+    void clear();
+
+    // Statistics
+    size_t segments() const { return segments_.size(); }
+    size_t diskBytes() const { return disk_bytes_; }
+    size_t deadBytes() const { return dead_bytes_; }
+
+private:
+    struct Segment {
+        int fd = -1;
+        uint64_t size = 0;
+        uint64_t dead = 0;
+        uint64_t synced = 0;  // writeback started up to here
+    };
+
+    std::string segmentPath(uint32_t number) const;
+    void drop(std::map<uint32_t, Segment>::iterator it);
+
+    std::string dir_;
+    Options options_;
+    std::map<uint32_t, Segment> segments_;
+    uint32_t head_ = 0;  // the one being appended to; 0 before the first append
+    size_t disk_bytes_ = 0;
+    size_t dead_bytes_ = 0;
+};
+
+} // namespace keyforge
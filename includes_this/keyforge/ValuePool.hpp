@@ -0,0 +1,107 @@
+#pragma once
+#include "Compression.hpp"
+#include "ValueLog.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+
+namespace keyforge {
+
+// Content-addressed string values for a Store: a value held by several
+// keys is stored once, looked up by the hash of its content. Each stored
+// value lists the keys holding it, which is both its reference count and
+// the reverse index behind GET_KEY. A value may be kept compressed (see
+// Compression.hpp); lookups still compare the uncompressed content.
+// A value nobody has used for a while may be moved to a ValueLog (cold):
+// its bytes leave memory, the rest of the Blob stays.
+//
+// Not thread-safe: the Store calls it with its lock held.
+class ValuePool {
+public:
+    struct Blob {
+        std::string data;  // the value, or its compressed form
+        uint32_t size = 0;  // uncompressed length
+        size_t hash = 0;
+        const compression::Dictionary* dict = nullptr;  // the one it was compressed with
+        bool packed = false;
+        uint32_t used = 0;         // when it was last used, in the Store's tiering clock
+        ValueLog* log = nullptr;   // cold: data is empty and the bytes are at ref
+        ValueLog::Ref ref;
+        std::unordered_set<std::string> keys;  // holding it
+    };
+
+    // Memory held by a stored value, apart from the keys
+    static size_t cost(const Blob& blob) { return blob.data.size() + sizeof(Blob) + 64; }
+
+    // The uncompressed value (read from the log if it is cold); nullopt if
+    // that read fails
+    static std::optional<std::string> read(const Blob& blob);
+
+    // Record that key now holds value: the stored copy if there is one,
+    // otherwise a new one, compressed when it is at least compress_from
+    // bytes long (0: never) and shrinks by an eighth
+    Blob* acquire(const std::string& key, std::string value, size_t compress_from,
+                  const compression::Dictionary* dict);
+
+    // key no longer holds blob; the last key frees it
+    void release(const std::string& key, Blob* blob);
+
+    const Blob* find(const std::string& value) const;
+
+    // Tiering. cool() looks at up to `budget` values from cursor on (back
+    // to 0 once all were seen) and moves those of at least min_bytes that
+    // weren't used since `before` to log. warm() reads a cold value back.
+    // collect() copies the live values out of the segment gcVictim()
+    // names, which frees it. Each returns the bytes of memory it freed
+    // (cool) or took (warm); collect() false if there was nothing to do.
+    size_t cool(ValueLog& log, uint32_t before, size_t min_bytes, size_t& cursor, size_t budget);
+    size_t warm(Blob* blob);
+    bool collect(ValueLog& log);
+
+    void clear();
+    void swap(ValuePool& other);
+
+    // Statistics
+    size_t values() const { return blobs_.size(); }   // distinct values
+    size_t references() const { return references_; }  // keys holding one
+    size_t storedBytes() const { return stored_bytes_; }
+    size_t sharedBytes() const { return shared_bytes_; }  // not stored again thanks to sharing
+    size_t packedValues() const { return packed_values_; }
+    size_t packedRawBytes() const { return packed_raw_bytes_; }
+    size_t packedBytes() const { return packed_bytes_; }
+    size_t coldValues() const { return cold_values_; }
+    size_t coldBytes() const { return cold_bytes_; }
+    size_t cooled() const { return cooled_; }
+    size_t warmed() const { return warmed_; }
+    size_t collected() const { return collected_; }  // segments
+    size_t rewrittenBytes() const { return rewritten_bytes_; }
+
+private:
+    Blob* lookup(size_t hash, const std::string& value) const;
+    // Its size as stored, in memory or in the log
+    static size_t stored(const Blob& blob) { return blob.log ? blob.ref.size : blob.data.size(); }
+    // Release a cold value's record (it is being freed or read back)
+    void forgetCold(Blob* blob);
+
+    std::unordered_multimap<size_t, std::unique_ptr<Blob>> blobs_;  // content hash -> value
+    size_t references_ = 0;
+    size_t stored_bytes_ = 0;
+    size_t shared_bytes_ = 0;
+    size_t packed_values_ = 0;
+    size_t packed_raw_bytes_ = 0;
+    size_t packed_bytes_ = 0;
+
+    std::unordered_map<uint32_t, std::unordered_set<Blob*>> cold_;  // log segment -> values in it
+    size_t cold_values_ = 0;
+    size_t cold_bytes_ = 0;
+    size_t cooled_ = 0;
+    size_t warmed_ = 0;
+    size_t collected_ = 0;
+    size_t rewritten_bytes_ = 0;
+};
+
+} // namespace keyforge
@@ -0,0 +1,102 @@
+#include "keyforge/Blocking.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+namespace keyforge {
+
+Blocking::Waiter::Waiter(size_t db, std::vector<std::string> keys)
+    : db(db), keys(std::move(keys)), wake_fd(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) {}
+
+Blocking::Waiter::~Waiter() {
+    if (wake_fd >= 0) close(wake_fd);
+}
+
+std::shared_ptr<Blocking::Waiter> Blocking::watch(size_t db, std::vector<std::string> keys) {
+    auto waiter = std::make_shared<Waiter>(db, std::move(keys));
+    std::lock_guard<std::mutex> lock(mtx_);
+    for (const auto& key : waiter->keys) table_[slot(db, key)].push_back(waiter);
+    waiters_.insert(waiter);
+    waiting_++;
+    if (closed_) wake(*waiter, "*");
+    return waiter;
+}
+
+void Blocking::cancel(const std::shared_ptr<Waiter>& waiter) {
+    std::lock_guard<std::mutex> lock(mtx_);
+    if (waiters_.erase(waiter) == 0) return;
+    for (const auto& key : waiter->keys) {
+        auto it = table_.find(slot(waiter->db, key));
+        if (it == table_.end()) continue;
+        auto& list = it->second;
+        list.erase(std::remove(list.begin(), list.end(), waiter), list.end());
+        if (list.empty()) table_.erase(it);
+    }
+    waiting_--;
+}
+
+Blocking::Wake Blocking::block(Waiter& waiter, int client_fd, const std::chrono::steady_clock::time_point* deadline) {
+    // POLLRDHUP: a client that closed its end while we wait
+    pollfd pfds[2] = {{waiter.wake_fd, POLLIN, 0}, {client_fd, POLLRDHUP, 0}};
+    for (;;) {
+        int timeout_ms = -1;
+        if (deadline) {
+            auto left = std::chrono::ceil<std::chrono::milliseconds>(*deadline - std::chrono::steady_clock::now());
+            if (left.count() <= 0) {
+                timeouts_++;
+                return Wake::Timeout;
+            }
+            timeout_ms = static_cast<int>(std::min<long long>(left.count(), 1 << 30));
+        }
+
+        int ready = poll(pfds, 2, timeout_ms);
+        if (ready < 0 && errno != EINTR) return Wake::Hangup;
+        if (ready <= 0) continue;  // interrupted, or the deadline (checked above)
+
+        if (pfds[0].revents & POLLIN) {
+            uint64_t count = 0;
+            ssize_t n = read(waiter.wake_fd, &count, sizeof(count));
+            (void)n;
+            return closed_ ? Wake::Shutdown : Wake::Touched;
+        }
+        if (pfds[1].revents & (POLLRDHUP | POLLHUP | POLLERR)) return Wake::Hangup;
+    }
+}
+
+void Blocking::touched(size_t db, const std::string& key, const char* event) {
+    if (waiting_.load(std::memory_order_relaxed) == 0) return;
+    std::lock_guard<std::mutex> lock(mtx_);
+    if (key.empty()) {
+        for (const auto& waiter : waiters_) {
+            if (waiter->db == db) wake(*waiter, "*");
+        }
+        return;
+    }
+    auto it = table_.find(slot(db, key));
+    if (it == table_.end()) return;
+    for (const auto& waiter : it->second) wake(*waiter, event ? event : "*");
+    wakeups_ += it->second.size();
+}
+
+void Blocking::shutdown() {
+    closed_ = true;
+    std::lock_guard<std::mutex> lock(mtx_);
+    for (const auto& waiter : waiters_) wake(*waiter, "*");
+}
+
+std::string Blocking::info() {
+    return "Blocked clients: " + std::to_string(waiting_.load()) + ", wakeups: " + std::to_string(wakeups_.load()) +
+           ", timeouts: " + std::to_string(timeouts_.load()) + "\n";
+}
+
+void Blocking::wake(Waiter& waiter, const char* event) {
+    waiter.event = event;
+    uint64_t one = 1;
+    ssize_t n = write(waiter.wake_fd, &one, sizeof(one));
+    (void)n;
+}
+
+} // namespace keyforge
@@ -0,0 +1,479 @@
+#include "keyforge/Client.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <exception>
+#include <future>
+#include <sstream>
+#include <stdexcept>
+#include <unistd.h>
+
+namespace keyforge {
+
+namespace {
+constexpr size_t kPipelineWindow = 256;
+constexpr size_t kMultiKeyChunk = 128;  // keys per MGET / MSET line
+} // namespace
+
+Client::Client(const std::vector<Node>& nodes, size_t vnodes) : ring_(vnodes) {
+    if (nodes.empty()) throw std::invalid_argument("Client needs at least one node");
+    for (const auto& n : nodes) {
+        ring_.addNode(n.host + ":" + std::to_string(n.port));
+        auto conn = std::make_unique<Connection>();
+        conn->node = n;
+        conns_.push_back(std::move(conn));
+    }
+    // A single node never fans out, so it needs no worker
+    if (conns_.size() > 1) {
+        for (auto& c : conns_) c->worker = std::thread(&Client::workerLoop, this, std::ref(*c));
+    }
+}
+
+Client::Client(const std::string& host, int port) : Client(std::vector<Node>{{host, port}}) {}
+
+std::vector<Client::Node> Client::discover(const std::string& host, int port) {
+    std::string where = host + ":" + std::to_string(port);
+    int fd = net::connectTo(host, port);
+    if (fd < 0) throw std::runtime_error("KeyForge node " + where + " unreachable");
+
+    net::LineReader reader(fd);
+    std::string reply;
+    bool ok = net::sendAll(fd, "GOSSIP MEMBERS\n") &&
+              reader.readLine(reply, 1000) == net::LineReader::Status::OK;
+    close(fd);
+    if (!ok) throw std::runtime_error("KeyForge node " + where + " did not answer GOSSIP MEMBERS");
+    if (reply.rfind("ERROR", 0) == 0) throw std::runtime_error("KeyForge node " + where + ": " + reply);
+
+    std::vector<Node> nodes;
+    std::istringstream members(reply);
+    std::string addr;
+    while (members >> addr) {
+        auto colon = addr.rfind(':');
+        if (colon == std::string::npos) continue;
+        nodes.push_back({addr.substr(0, colon), std::stoi(addr.substr(colon + 1))});
+    }
+    return nodes;
+}
+
+Client::~Client() {
+    for (auto& c : conns_) {
+        {
+            std::lock_guard<std::mutex> lock(c->jobs_mtx);
+            c->stop = true;
+        }
+        c->jobs_cv.notify_one();
+        if (c->worker.joinable()) c->worker.join();
+        disconnect(*c);
+    }
+}
+
+void Client::workerLoop(Connection& conn) {
+    while (true) {
+        std::packaged_task<std::vector<std::string>()> job;
+        {
+            std::unique_lock<std::mutex> lock(conn.jobs_mtx);
+            conn.jobs_cv.wait(lock, [&] { return conn.stop || !conn.jobs.empty(); });
+            if (conn.jobs.empty()) return;
+            job = std::move(conn.jobs.front());
+            conn.jobs.pop_front();
+        }
+        job();
+    }
+}
+
+void Client::disconnect(Connection& conn) {
+    if (conn.fd >= 0) close(conn.fd);
+    conn.fd = -1;
+    conn.reader.reset();
+    // Invalidations sent while disconnected are lost
+    conn.lru.clear();
+    conn.cached.clear();
+    conn.invalidations++;
+}
+
+void Client::ensureConnected(Connection& conn) {
+    if (conn.fd >= 0) return;
+
+    std::string where = conn.node.host + ":" + std::to_string(conn.node.port);
+    conn.fd = net::connectTo(conn.node.host, conn.node.port);
+    if (conn.fd < 0) throw std::runtime_error("KeyForge node " + where + " unreachable");
+    conn.reader = std::make_unique<net::LineReader>(conn.fd);
+
+    std::string token;
+    {
+        std::lock_guard<std::mutex> lock(token_mtx_);
+        token = token_;
+    }
+    if (!token.empty()) {
+        std::string reply;
+        if (!net::sendAll(conn.fd, "AUTH " + token + "\n") ||
+            conn.reader->readLine(reply) != net::LineReader::Status::OK) {
+            disconnect(conn);
+            throw std::runtime_error("KeyForge node " + where + " closed during AUTH");
+        }
+    }
+    if (max_cached_ > 0) {
+        std::string reply;
+        if (!net::sendAll(conn.fd, "CLIENT TRACKING ON\n") ||
+            conn.reader->readLine(reply) != net::LineReader::Status::OK || reply != "OK") {
+            disconnect(conn);
+            throw std::runtime_error("KeyForge node " + where + " refused CLIENT TRACKING");
+        }
+    }
+}
+
+std::vector<std::string> Client::pipeline(Connection& conn, const std::vector<std::string>& cmds) {
+    ensureConnected(conn);
+
+    std::vector<std::string> replies;
+    replies.reserve(cmds.size());
+
+    // Bounded windows: neither side can fill the other's socket buffer
+    // while nobody is reading.
+    bool ok = true;
+    std::string wire;
+    std::string line;
+    for (size_t base = 0; ok && base < cmds.size(); base += kPipelineWindow) {
+        size_t end = std::min(cmds.size(), base + kPipelineWindow);
+        wire.clear();
+        for (size_t i = base; i < end; ++i) {
+            wire += cmds[i];
+            wire += '\n';
+        }
+        ok = net::sendAll(conn.fd, wire);
+        while (ok && replies.size() < end) {
+            ok = conn.reader->readLine(line) == net::LineReader::Status::OK;
+            if (ok && isPush(line)) {
+                applyPush(conn, line);
+            } else if (ok) {
+                recordOffset(conn, line);
+                replies.push_back(line);
+            }
+        }
+    }
+    if (!ok) {
+        disconnect(conn);
+        throw std::runtime_error("KeyForge node " + conn.node.host + ":" +
+                                 std::to_string(conn.node.port) + " connection lost");
+    }
+    return replies;
+}
+
+void Client::recordOffset(Connection& conn, const std::string& reply) {
+    size_t space = reply.find(' ');
+    if (space == std::string::npos || !std::isdigit(static_cast<unsigned char>(reply[space + 1]))) return;
+    if (!isReply(reply, "OK") && !isReply(reply, "UPDATED") && !isReply(reply, "DELETED")) return;
+    conn.last_offset = std::max<uint64_t>(conn.last_offset, std::stoull(reply.substr(space + 1)));
+}
+
+bool Client::isReply(const std::string& reply, const std::string& word) {
+    return reply.compare(0, word.size(), word) == 0 &&
+           (reply.size() == word.size() || reply[word.size()] == ' ');
+}
+
+bool Client::isPush(const std::string& line) {
+    // Values are single words, so no reply can start like this
+    return line.rfind(">INVALIDATE ", 0) == 0;
+}
+
+void Client::applyPush(Connection& conn, const std::string& line) {
+    std::string key = line.substr(12);
+    conn.invalidations++;
+    if (key == "*") {
+        conn.lru.clear();
+        conn.cached.clear();
+        return;
+    }
+    auto it = conn.cached.find(key);
+    if (it == conn.cached.end()) return;
+    conn.lru.erase(it->second);
+    conn.cached.erase(it);
+}
+
+void Client::drainPushes(Connection& conn) {
+    if (conn.fd < 0) return;
+    std::string line;
+    while (true) {
+        auto st = conn.reader->readLine(line, 0);
+        if (st == net::LineReader::Status::TIMEOUT) return;
+        if (st == net::LineReader::Status::CLOSED) {
+            disconnect(conn);
+            return;
+        }
+        if (isPush(line)) applyPush(conn, line);
+    }
+}
+
+void Client::enableTracking(size_t max_cached) {
+    max_cached_ = max_cached;
+    for (auto& c : conns_) {
+        std::lock_guard<std::mutex> lock(c->mtx);
+        // Reconnect so the handshake turns tracking on
+        disconnect(*c);
+    }
+}
+
+std::string Client::call(const std::string& key, const std::string& command) {
+    Connection& conn = *conns_[ring_.nodeFor(key)];
+    std::lock_guard<std::mutex> lock(conn.mtx);
+    return pipeline(conn, {command}).front();
+}
+
+bool Client::auth(const std::string& token) {
+    {
+        std::lock_guard<std::mutex> lock(token_mtx_);
+        token_ = token;
+    }
+    bool all_ok = true;
+    for (auto& c : conns_) {
+        std::lock_guard<std::mutex> lock(c->mtx);
+        if (c->fd >= 0) {
+            auto reply = pipeline(*c, {"AUTH " + token}).front();
+            all_ok = all_ok && reply.rfind("OK", 0) == 0;
+        } else {
+            // Connecting authenticates with the stored token
+            ensureConnected(*c);
+        }
+    }
+    return all_ok;
+}
+
+bool Client::put(const std::string& key, const std::string& value) {
+    return isReply(call(key, "PUT " + key + " " + value), "OK");
+}
+
+std::optional<std::string> Client::get(const std::string& key) {
+    if (max_cached_ == 0) {
+        std::string reply = call(key, "GET " + key);
+        if (reply == "NOT_FOUND") return std::nullopt;
+        return reply;
+    }
+
+    Connection& conn = *conns_[ring_.nodeFor(key)];
+    std::lock_guard<std::mutex> lock(conn.mtx);
+    // Apply invalidations that already arrived before trusting the cache
+    drainPushes(conn);
+    auto hit = conn.cached.find(key);
+    if (hit != conn.cached.end()) {
+        cache_hits_++;
+        conn.lru.splice(conn.lru.begin(), conn.lru, hit->second);
+        return hit->second->second;
+    }
+    cache_misses_++;
+
+    uint64_t before = conn.invalidations;
+    std::string reply = pipeline(conn, {"GET " + key}).front();
+    std::optional<std::string> value;
+    if (reply != "NOT_FOUND") value = reply;
+
+    // Skip caching errors and redirects (never one word), and any result
+    // that raced an invalidation
+    if (reply.find(' ') == std::string::npos && conn.invalidations == before) {
+        conn.lru.emplace_front(key, value);
+        conn.cached[key] = conn.lru.begin();
+        if (conn.lru.size() > max_cached_) {
+            conn.cached.erase(conn.lru.back().first);
+            conn.lru.pop_back();
+        }
+    }
+    return value;
+}
+
+std::optional<std::string> Client::get(const std::string& key, uint64_t min_offset) {
+    std::string reply = call(key, "WAIT_OFFSET " + std::to_string(min_offset) + " GET " + key);
+    if (reply.rfind("ERROR LAGGING", 0) == 0) throw std::runtime_error("KeyForge " + reply);
+    if (reply == "NOT_FOUND") return std::nullopt;
+    return reply;
+}
+
+uint64_t Client::lastWriteOffset(const std::string& key) {
+    Connection& conn = *conns_[ring_.nodeFor(key)];
+    std::lock_guard<std::mutex> lock(conn.mtx);
+    return conn.last_offset;
+}
+
+bool Client::update(const std::string& key, const std::string& new_value) {
+    return isReply(call(key, "UPDATE " + key + " " + new_value), "UPDATED");
+}
+
+bool Client::remove(const std::string& key) {
+    return isReply(call(key, "DELETE " + key), "DELETED");
+}
+
+std::optional<int64_t> Client::incrBy(const std::string& key, int64_t delta) {
+    Connection& conn = *conns_[ring_.nodeFor(key)];
+    std::lock_guard<std::mutex> lock(conn.mtx);
+    std::string reply = pipeline(conn, {"INCRBY " + key + " " + std::to_string(delta)}).front();
+
+    // "<value> <offset token>"
+    std::istringstream iss(reply);
+    int64_t value = 0;
+    uint64_t offset = 0;
+    if (!(iss >> value >> offset)) return std::nullopt;
+    conn.last_offset = std::max(conn.last_offset, offset);
+    return value;
+}
+
+std::optional<std::pair<std::string, uint64_t>> Client::getVersioned(const std::string& key) {
+    std::string reply = call(key, "GETV " + key);
+    std::istringstream iss(reply);
+    std::string value;
+    uint64_t version = 0;
+    if (reply == "NOT_FOUND" || !(iss >> value >> version)) return std::nullopt;
+    return std::make_pair(value, version);
+}
+
+bool Client::cas(const std::string& key, uint64_t expected_version, const std::string& value,
+                 uint64_t* version) {
+    // "OK <offset> <version>" (recorded as a write token) or "CONFLICT <version>"
+    std::string reply = call(key, "CAS " + key + " " + std::to_string(expected_version) + " " + value);
+    std::istringstream iss(reply);
+    std::string word;
+    uint64_t n = 0, v = 0;
+    iss >> word;
+    bool ok = word == "OK";
+    if (ok ? !(iss >> n >> v) : !(word == "CONFLICT" && iss >> v)) {
+        throw std::runtime_error("KeyForge CAS failed: " + reply);
+    }
+    if (version) *version = v;
+    return ok;
+}
+
+std::vector<std::vector<std::string>> Client::fanOut(const std::vector<std::vector<std::string>>& per_node_cmds) {
+    if (per_node_cmds.size() != conns_.size()) {
+        throw std::invalid_argument("fanOut: expected one command list per node");
+    }
+
+    auto run = [&](size_t node) {
+        Connection& conn = *conns_[node];
+        std::lock_guard<std::mutex> lock(conn.mtx);
+        return pipeline(conn, per_node_cmds[node]);
+    };
+
+    // Drive all involved nodes at once; the first one runs on this thread,
+    // the rest on their node workers
+    std::vector<std::pair<size_t, std::future<std::vector<std::string>>>> pending;
+    size_t inline_node = conns_.size();
+    for (size_t node = 0; node < conns_.size(); ++node) {
+        if (per_node_cmds[node].empty()) continue;
+        if (inline_node == conns_.size()) {
+            inline_node = node;
+        } else {
+            std::packaged_task<std::vector<std::string>()> job([&run, node] { return run(node); });
+            pending.emplace_back(node, job.get_future());
+            Connection& conn = *conns_[node];
+            {
+                std::lock_guard<std::mutex> lock(conn.jobs_mtx);
+                conn.jobs.push_back(std::move(job));
+            }
+            conn.jobs_cv.notify_one();
+        }
+    }
+
+    std::vector<std::vector<std::string>> replies(conns_.size());
+    std::exception_ptr error;
+    try {
+        if (inline_node != conns_.size()) replies[inline_node] = run(inline_node);
+    } catch (...) {
+        error = std::current_exception();
+    }
+    // Workers reference this frame: wait for all of them before unwinding
+    for (auto& entry : pending) entry.second.wait();
+    if (error) std::rethrow_exception(error);
+    for (auto& [node, fut] : pending) replies[node] = fut.get();
+    return replies;
+}
+
+std::vector<std::string> Client::batch(const std::vector<std::string>& keys,
+                                       const std::vector<std::string>& commands) {
+    if (keys.size() != commands.size()) {
+        throw std::invalid_argument("batch: keys and commands differ in length");
+    }
+
+    // Split per node, remembering where each reply goes
+    std::vector<std::vector<std::string>> per_node_cmds(conns_.size());
+    std::vector<std::vector<size_t>> per_node_pos(conns_.size());
+    for (size_t i = 0; i < keys.size(); ++i) {
+        size_t node = ring_.nodeFor(keys[i]);
+        per_node_cmds[node].push_back(commands[i]);
+        per_node_pos[node].push_back(i);
+    }
+
+    std::vector<std::string> replies(keys.size());
+    auto node_replies = fanOut(per_node_cmds);
+    for (size_t node = 0; node < conns_.size(); ++node) {
+        for (size_t j = 0; j < node_replies[node].size(); ++j) {
+            replies[per_node_pos[node][j]] = std::move(node_replies[node][j]);
+        }
+    }
+    return replies;
+}
+
+std::vector<std::optional<std::string>> Client::mget(const std::vector<std::string>& keys) {
+    // One MGET line per chunk of keys owned by the same node
+    std::vector<std::vector<size_t>> per_node_pos(conns_.size());
+    for (size_t i = 0; i < keys.size(); ++i) per_node_pos[ring_.nodeFor(keys[i])].push_back(i);
+
+    std::vector<std::vector<std::string>> per_node_cmds(conns_.size());
+    for (size_t node = 0; node < conns_.size(); ++node) {
+        const auto& pos = per_node_pos[node];
+        for (size_t base = 0; base < pos.size(); base += kMultiKeyChunk) {
+            std::string cmd = "MGET";
+            for (size_t j = base; j < std::min(pos.size(), base + kMultiKeyChunk); ++j) {
+                cmd += ' ';
+                cmd += keys[pos[j]];
+            }
+            per_node_cmds[node].push_back(std::move(cmd));
+        }
+    }
+
+    std::vector<std::optional<std::string>> out(keys.size());
+    auto node_replies = fanOut(per_node_cmds);
+    for (size_t node = 0; node < conns_.size(); ++node) {
+        size_t j = 0;
+        for (const auto& line : node_replies[node]) {
+            size_t chunk = std::min(kMultiKeyChunk, per_node_pos[node].size() - j);
+            std::istringstream values(line);
+            std::string v;
+            size_t got = 0;
+            while (got < chunk && values >> v) {
+                if (v != "NOT_FOUND") out[per_node_pos[node][j + got]] = v;
+                got++;
+            }
+            if (got != chunk) throw std::runtime_error("KeyForge MGET failed: " + line);
+            j += chunk;
+        }
+    }
+    return out;
+}
+
+size_t Client::mput(const std::vector<std::pair<std::string, std::string>>& kvs) {
+    std::vector<std::vector<size_t>> per_node_pos(conns_.size());
+    for (size_t i = 0; i < kvs.size(); ++i) per_node_pos[ring_.nodeFor(kvs[i].first)].push_back(i);
+
+    std::vector<std::vector<std::string>> per_node_cmds(conns_.size());
+    std::vector<std::vector<size_t>> chunk_sizes(conns_.size());
+    for (size_t node = 0; node < conns_.size(); ++node) {
+        const auto& pos = per_node_pos[node];
+        for (size_t base = 0; base < pos.size(); base += kMultiKeyChunk) {
+            size_t end = std::min(pos.size(), base + kMultiKeyChunk);
+            std::string cmd = "MSET";
+            for (size_t j = base; j < end; ++j) {
+                cmd += ' ' + kvs[pos[j]].first + ' ' + kvs[pos[j]].second;
+            }
+            per_node_cmds[node].push_back(std::move(cmd));
+            chunk_sizes[node].push_back(end - base);
+        }
+    }
+
+    size_t stored = 0;
+    auto node_replies = fanOut(per_node_cmds);
+    for (size_t node = 0; node < conns_.size(); ++node) {
+        for (size_t j = 0; j < node_replies[node].size(); ++j) {
+            if (isReply(node_replies[node][j], "OK")) stored += chunk_sizes[node][j];
+        }
+    }
+    return stored;
+}
+
+} // namespace keyforge
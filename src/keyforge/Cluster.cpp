@@ -0,0 +1,287 @@
+#include "keyforge/Cluster.hpp"
+#include "keyforge/Logger.hpp"
+#include "keyforge/Net.hpp"
+
+#include <mutex>
+#include <sstream>
+#include <unistd.h>
+
+namespace keyforge {
+
+namespace {
+// CRC16-CCITT (XMODEM), the same slot function Redis Cluster uses
+uint16_t crc16(const char* buf, size_t len) {
+    uint16_t crc = 0;
+    for (size_t i = 0; i < len; ++i) {
+        crc ^= static_cast<uint16_t>(static_cast<unsigned char>(buf[i])) << 8;
+        for (int b = 0; b < 8; ++b) {
+            crc = (crc & 0x8000) ? static_cast<uint16_t>((crc << 1) ^ 0x1021)
+                                 : static_cast<uint16_t>(crc << 1);
+        }
+    }
+    return crc;
+}
+
+constexpr size_t kScanChunk = 512;
+} // namespace
+
+Cluster::Cluster(Store& store, Replication& repl)
+    : store_(store), repl_(repl),
+      owner_(kSlots), migrating_to_(kSlots), importing_from_(kSlots) {}
+
+uint16_t Cluster::keySlot(const std::string& key) {
+    // Hash tags: only "{...}" is hashed when present and non-empty
+    size_t open = key.find('{');
+    if (open != std::string::npos) {
+        size_t close = key.find('}', open + 1);
+        if (close != std::string::npos && close > open + 1) {
+            return crc16(key.data() + open + 1, close - open - 1) % kSlots;
+        }
+    }
+    return crc16(key.data(), key.size()) % kSlots;
+}
+
+void Cluster::enable(const std::string& self) {
+    std::unique_lock<std::shared_mutex> lock(mtx_);
+    enabled_ = true;
+    self_ = self;
+}
+
+bool Cluster::enabled() const {
+    std::shared_lock<std::shared_mutex> lock(mtx_);
+    return enabled_;
+}
+
+std::string Cluster::self() const {
+    std::shared_lock<std::shared_mutex> lock(mtx_);
+    return self_;
+}
+
+std::string Cluster::route(const std::string& key, bool asking) {
+    uint16_t slot = keySlot(key);
+    std::shared_lock<std::shared_mutex> lock(mtx_);
+    if (!enabled_) return "";
+
+    const std::string& owner = owner_[slot];
+    if (owner == self_) {
+        // Keys already moved out of a migrating slot live on the target now
+        if (!migrating_to_[slot].empty() && !store_.contains(key) && !in_flight_.count(key)) {
+            return "ASK " + std::to_string(slot) + " " + migrating_to_[slot] + "\n";
+        }
+        return "";
+    }
+    if (asking && !importing_from_[slot].empty()) return "";
+    if (owner.empty()) {
+        return "CLUSTERDOWN Hash slot " + std::to_string(slot) + " not served\n";
+    }
+    return "MOVED " + std::to_string(slot) + " " + owner + "\n";
+}
+
+bool Cluster::setSlots(uint16_t first, uint16_t last, const std::string& state,
+                       const std::string& addr, std::string& err) {
+    if (first > last || last >= kSlots) {
+        err = "ERROR Invalid slot range\n";
+        return false;
+    }
+    if (state != "STABLE" && addr.empty()) {
+        err = "ERROR Missing node address\n";
+        return false;
+    }
+
+    std::unique_lock<std::shared_mutex> lock(mtx_);
+    for (uint32_t slot = first; slot <= last; ++slot) {
+        if (state == "NODE") {
+            owner_[slot] = addr;
+            migrating_to_[slot].clear();
+            importing_from_[slot].clear();
+        } else if (state == "MIGRATING") {
+            if (owner_[slot] != self_) {
+                err = "ERROR Slot " + std::to_string(slot) + " is not owned by this node\n";
+                return false;
+            }
+            migrating_to_[slot] = addr;
+        } else if (state == "IMPORTING") {
+            importing_from_[slot] = addr;
+        } else if (state == "STABLE") {
+            migrating_to_[slot].clear();
+            importing_from_[slot].clear();
+        } else {
+            err = "ERROR Unknown slot state " + state + "\n";
+            return false;
+        }
+    }
+    return true;
+}
+
+long Cluster::migrate(const std::string& host, int port, uint16_t first, uint16_t last,
+                      const std::string& token, size_t batch, std::string& err) {
+    auto& log = Logger::instance();
+    if (first > last || last >= kSlots) {
+        err = "ERROR Invalid slot range\n";
+        return -1;
+    }
+    if (batch == 0) batch = 100;
+
+    std::string target = host + ":" + std::to_string(port);
+    int fd = net::connectTo(host, port);
+    if (fd < 0) {
+        err = "ERROR Cannot connect to " + target + "\n";
+        return -1;
+    }
+    net::LineReader reader(fd);
+
+    // Send a pipelined request and require every reply line to be OK...
+    auto request = [&](const std::string& wire, size_t replies) {
+        if (!net::sendAll(fd, wire)) return false;
+        std::string line;
+        for (size_t i = 0; i < replies; ++i) {
+            if (reader.readLine(line, 5000) != net::LineReader::Status::OK) return false;
+            // A key deleted while it was in flight is deleted there too
+            if (line.rfind("OK", 0) != 0 && line.rfind("DELETED", 0) != 0 && line != "NOT_FOUND") {
+                log.error("MIGRATE: target replied: " + line);
+                return false;
+            }
+        }
+        return true;
+    };
+    auto fail = [&](const std::string& why) {
+        close(fd);
+        // Whatever was in flight stays here, served as before
+        {
+            std::unique_lock<std::shared_mutex> lock(mtx_);
+            for (auto it = in_flight_.begin(); it != in_flight_.end();) {
+                uint16_t slot = keySlot(*it);
+                if (slot >= first && slot <= last) it = in_flight_.erase(it);
+                else ++it;
+            }
+        }
+        err = "ERROR " + why + "\n";
+        return -1L;
+    };
+
+    if (!token.empty() && !request("AUTH " + token + "\n", 1)) return fail("Target rejected AUTH");
+
+    long moved = 0;
+    bool moved_in_pass = true;
+    // A rehash during a pass can hide keys from scan(), so repeat until a
+    // full pass finds nothing left in the range.
+    try {
+        while (moved_in_pass) {
+            moved_in_pass = false;
+            std::string cursor = "0";
+            do {
+                std::vector<std::string> keys;
+                cursor = store_.scan(cursor, kScanChunk, keys);
+
+                std::vector<std::string> in_range;
+                for (auto& k : keys) {
+                    uint16_t slot = keySlot(k);
+                    if (slot >= first && slot <= last) in_range.push_back(std::move(k));
+                }
+
+                for (size_t base = 0; base < in_range.size(); base += batch) {
+                    std::vector<std::string> pending(in_range.begin() + static_cast<long>(base),
+                                                     in_range.begin() + static_cast<long>(std::min(in_range.size(), base + batch)));
+                    while (!pending.empty()) {
+                        // Writers wait while the batch is read, not while it
+                        // travels: the versions tell what changed meanwhile
+                        std::string wire;
+                        std::vector<std::pair<std::string, uint64_t>> sent;  // key, version read (0: gone)
+                        {
+                            auto wlock = repl_.lockWrites(0);
+                            std::unique_lock<std::shared_mutex> lock(mtx_);
+                            for (auto& k : pending) {
+                                uint64_t version = store_.version(k);
+                                auto value = store_.peek(k);
+                                if (!value) {
+                                    if (!in_flight_.count(k)) continue;
+                                    wire += "ASKING\nDELETE " + k + "\n";
+                                    sent.emplace_back(std::move(k), 0);
+                                    continue;
+                                }
+                                // Lists, hashes and sorted sets travel in dump form
+                                if (!value->empty() && (*value)[0] == Store::kDumpMark) {
+                                    wire += "ASKING\nRESTORE " + k + " " + value->substr(1) + "\n";
+                                } else {
+                                    wire += "ASKING\nPUT " + k + " " + *value + "\n";
+                                }
+                                in_flight_.insert(k);
+                                sent.emplace_back(std::move(k), version);
+                            }
+                        }
+                        pending.clear();
+                        if (sent.empty()) break;
+                        if (!request(wire, sent.size() * 2)) return fail("Migration to " + target + " failed");
+
+                        auto wlock = repl_.lockWrites(0);
+                        std::unique_lock<std::shared_mutex> lock(mtx_);
+                        for (auto& [k, version] : sent) {
+                            if (store_.version(k) != version) {
+                                pending.push_back(std::move(k));  // written since: send it again
+                                continue;
+                            }
+                            if (version != 0) {
+                                store_.remove(k);
+                                repl_.propagate("DELETE " + k);
+                                moved++;
+                                moved_in_pass = true;
+                            }
+                            in_flight_.erase(k);
+                        }
+                    }
+                }
+            } while (cursor != "0");
+        }
+    } catch (const StorageError& e) {
+        return fail(std::string("Migration to ") + target + " stopped: " + e.what());
+    }
+
+    // Hand the range over: target first, so nobody is left without an owner
+    std::string range = std::to_string(first) + " " + std::to_string(last);
+    if (!request("CLUSTER SETSLOT " + range + " NODE " + target + "\n", 1)) {
+        return fail("Target refused slot ownership");
+    }
+    setSlots(first, last, "NODE", target, err);
+    close(fd);
+
+    log.info("MIGRATE: moved " + std::to_string(moved) + " keys in slots " + range + " to " + target);
+    return moved;
+}
+
+std::string Cluster::slotsReply() {
+    std::shared_lock<std::shared_mutex> lock(mtx_);
+    std::ostringstream out;
+    uint32_t start = 0;
+    // One line per run of consecutive slots with the same owner
+    for (uint32_t slot = 1; slot <= kSlots; ++slot) {
+        if (slot == kSlots || owner_[slot] != owner_[start]) {
+            if (!owner_[start].empty()) {
+                out << start << " " << slot - 1 << " " << owner_[start] << "\n";
+            }
+            start = slot;
+        }
+    }
+    out << "END\n";
+    return out.str();
+}
+
+std::string Cluster::infoReply() {
+    std::shared_lock<std::shared_mutex> lock(mtx_);
+    size_t assigned = 0, mine = 0, migrating = 0, importing = 0;
+    for (uint32_t slot = 0; slot < kSlots; ++slot) {
+        if (!owner_[slot].empty()) assigned++;
+        if (!owner_[slot].empty() && owner_[slot] == self_) mine++;
+        if (!migrating_to_[slot].empty()) migrating++;
+        if (!importing_from_[slot].empty()) importing++;
+    }
+    std::ostringstream out;
+    out << "Cluster enabled: " << (enabled_ ? "yes" : "no") << "\n";
+    out << "Self: " << self_ << "\n";
+    out << "Slots assigned: " << assigned << "/" << kSlots << "\n";
+    out << "Slots owned here: " << mine << "\n";
+    out << "Slots migrating: " << migrating << "\n";
+    out << "Slots importing: " << importing << "\n";
+    return out.str();
+}
+
+} // namespace keyforge
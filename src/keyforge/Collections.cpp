@@ -0,0 +1,330 @@
+#include "keyforge/Collections.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+
+namespace keyforge {
+
+// QuickList
+
+void QuickList::pushFront(std::string value) {
+    if (chunks_.empty() || chunks_.front().size() >= kChunkSize) {
+        chunks_.emplace_front();
+        chunks_.front().reserve(kChunkSize);
+    }
+    bytes_ += cost(value);
+    auto& chunk = chunks_.front();
+    chunk.insert(chunk.begin(), std::move(value));
+    size_++;
+}
+
+void QuickList::pushBack(std::string value) {
+    if (chunks_.empty() || chunks_.back().size() >= kChunkSize) {
+        chunks_.emplace_back();
+        chunks_.back().reserve(kChunkSize);
+    }
+    bytes_ += cost(value);
+    chunks_.back().push_back(std::move(value));
+    size_++;
+}
+
+std::string QuickList::popFront() {
+    auto& chunk = chunks_.front();
+    std::string value = std::move(chunk.front());
+    chunk.erase(chunk.begin());
+    if (chunk.empty()) chunks_.pop_front();
+    bytes_ -= cost(value);
+    size_--;
+    return value;
+}
+
+std::string QuickList::popBack() {
+    auto& chunk = chunks_.back();
+    std::string value = std::move(chunk.back());
+    chunk.pop_back();
+    if (chunk.empty()) chunks_.pop_back();
+    bytes_ -= cost(value);
+    size_--;
+    return value;
+}
+
+std::pair<size_t, size_t> QuickList::locate(size_t index) const {
+    // Walk whole chunks from the nearer end
+    if (index < size_ / 2) {
+        for (size_t c = 0;; ++c) {
+            if (index < chunks_[c].size()) return {c, index};
+            index -= chunks_[c].size();
+        }
+    }
+    size_t from_back = size_ - 1 - index;
+    for (size_t c = chunks_.size() - 1;; --c) {
+        if (from_back < chunks_[c].size()) return {c, chunks_[c].size() - 1 - from_back};
+        from_back -= chunks_[c].size();
+    }
+}
+
+const std::string& QuickList::at(size_t index) const {
+    auto [chunk, offset] = locate(index);
+    return chunks_[chunk][offset];
+}
+
+void QuickList::set(size_t index, std::string value) {
+    auto [chunk, offset] = locate(index);
+    std::string& slot = chunks_[chunk][offset];
+    bytes_ += cost(value);
+    bytes_ -= cost(slot);
+    slot = std::move(value);
+}
+
+std::vector<std::string> QuickList::range(size_t first, size_t last) const {
+    std::vector<std::string> out;
+    out.reserve(last - first + 1);
+    size_t pos = 0;
+    for (const auto& chunk : chunks_) {
+        if (pos > last) break;
+        if (pos + chunk.size() > first) {
+            size_t from = first > pos ? first - pos : 0;
+            size_t to = std::min(chunk.size(), last - pos + 1);
+            out.insert(out.end(), chunk.begin() + from, chunk.begin() + to);
+        }
+        pos += chunk.size();
+    }
+    return out;
+}
+
+// HashValue
+
+bool HashValue::set(const std::string& field, std::string value) {
+    if (table_) {
+        auto [it, inserted] = table_->try_emplace(field);
+        if (!inserted) bytes_ -= cost(field, it->second);
+        bytes_ += cost(field, value);
+        it->second = std::move(value);
+        return inserted;
+    }
+
+    for (auto& [f, v] : compact_) {
+        if (f != field) continue;
+        bytes_ += cost(field, value) - cost(field, v);
+        v = std::move(value);
+        if (v.size() > kMaxCompactLength) convert();
+        return false;
+    }
+    bytes_ += cost(field, value);
+    compact_.emplace_back(field, std::move(value));
+    if (compact_.size() > kMaxCompactFields || field.size() > kMaxCompactLength ||
+        compact_.back().second.size() > kMaxCompactLength) {
+        convert();
+    }
+    return true;
+}
+
+const std::string* HashValue::get(const std::string& field) const {
+    if (table_) {
+        auto it = table_->find(field);
+        return it == table_->end() ? nullptr : &it->second;
+    }
+    for (const auto& [f, v] : compact_) {
+        if (f == field) return &v;
+    }
+    return nullptr;
+}
+
+bool HashValue::erase(const std::string& field) {
+    if (table_) {
+        auto it = table_->find(field);
+        if (it == table_->end()) return false;
+        bytes_ -= cost(field, it->second);
+        table_->erase(it);
+        return true;
+    }
+    for (auto it = compact_.begin(); it != compact_.end(); ++it) {
+        if (it->first != field) continue;
+        bytes_ -= cost(field, it->second);
+        compact_.erase(it);
+        return true;
+    }
+    return false;
+}
+
+std::vector<std::pair<std::string, std::string>> HashValue::all() const {
+    if (!table_) return compact_;
+    return {table_->begin(), table_->end()};
+}
+
+void HashValue::convert() {
+    table_ = std::make_unique<std::unordered_map<std::string, std::string>>();
+    table_->reserve(compact_.size());
+    for (auto& [f, v] : compact_) table_->emplace(std::move(f), std::move(v));
+    std::vector<std::pair<std::string, std::string>>().swap(compact_);
+}
+
+// SortedSet
+
+SortedSet::SortedSet()
+    : head_(new Node{"", 0, std::vector<Link>(kMaxLevel)}),
+      rng_(static_cast<uint64_t>(std::chrono::steady_clock::now().time_since_epoch().count()) | 1) {}
+
+SortedSet::~SortedSet() {
+    Node* node = head_;
+    while (node) {
+        Node* next = node->links[0].next;
+        delete node;
+        node = next;
+    }
+}
+
+int SortedSet::randomLevel() {
+    // Each level with probability 1/4 (xorshift64)
+    int level = 1;
+    for (;;) {
+        rng_ ^= rng_ << 13;
+        rng_ ^= rng_ >> 7;
+        rng_ ^= rng_ << 17;
+        if ((rng_ & 3) != 0 || level == kMaxLevel) return level;
+        level++;
+    }
+}
+
+void SortedSet::insert(const std::string& member, double score) {
+    Node* update[kMaxLevel];
+    size_t rank[kMaxLevel];
+    Node* node = head_;
+    for (int i = level_ - 1; i >= 0; --i) {
+        rank[i] = i == level_ - 1 ? 0 : rank[i + 1];
+        while (node->links[i].next && before(node->links[i].next, score, member)) {
+            rank[i] += node->links[i].span;
+            node = node->links[i].next;
+        }
+        update[i] = node;
+    }
+
+    int level = randomLevel();
+    if (level > level_) {
+        for (int i = level_; i < level; ++i) {
+            rank[i] = 0;
+            update[i] = head_;
+            head_->links[i].span = scores_.size();
+        }
+        level_ = level;
+    }
+
+    node = new Node{member, score, std::vector<Link>(level)};
+    for (int i = 0; i < level; ++i) {
+        node->links[i].next = update[i]->links[i].next;
+        update[i]->links[i].next = node;
+        node->links[i].span = update[i]->links[i].span - (rank[0] - rank[i]);
+        update[i]->links[i].span = rank[0] - rank[i] + 1;
+    }
+    for (int i = level; i < level_; ++i) update[i]->links[i].span++;
+}
+
+void SortedSet::unlink(const std::string& member, double score) {
+    Node* update[kMaxLevel];
+    Node* node = head_;
+    for (int i = level_ - 1; i >= 0; --i) {
+        while (node->links[i].next && before(node->links[i].next, score, member)) {
+            node = node->links[i].next;
+        }
+        update[i] = node;
+    }
+    node = node->links[0].next;  // the member's node
+
+    for (int i = 0; i < level_; ++i) {
+        if (update[i]->links[i].next == node) {
+            update[i]->links[i].span += node->links[i].span - 1;
+            update[i]->links[i].next = node->links[i].next;
+        } else {
+            update[i]->links[i].span--;
+        }
+    }
+    while (level_ > 1 && !head_->links[level_ - 1].next) level_--;
+    delete node;
+}
+
+bool SortedSet::parseScore(const std::string& text, double& score) {
+    char* end = nullptr;
+    score = std::strtod(text.c_str(), &end);
+    return !text.empty() && *end == '\0' && std::isfinite(score);
+}
+
+std::string SortedSet::formatScore(double score) {
+    // Shortest of 15 or 17 digits that reads back as the same double
+    char buf[32];
+    std::snprintf(buf, sizeof(buf), "%.15g", score);
+    if (std::strtod(buf, nullptr) != score) std::snprintf(buf, sizeof(buf), "%.17g", score);
+    return buf;
+}
+
+bool SortedSet::add(const std::string& member, double score) {
+    auto it = scores_.find(member);
+    if (it != scores_.end()) {
+        if (it->second != score) {
+            unlink(member, it->second);
+            scores_.erase(it);  // insert() counts the members before this one
+            insert(member, score);
+            scores_.emplace(member, score);
+        }
+        return false;
+    }
+    insert(member, score);
+    scores_.emplace(member, score);
+    bytes_ += cost(member);
+    return true;
+}
+
+bool SortedSet::erase(const std::string& member) {
+    auto it = scores_.find(member);
+    if (it == scores_.end()) return false;
+    unlink(member, it->second);
+    scores_.erase(it);
+    bytes_ -= cost(member);
+    return true;
+}
+
+std::optional<double> SortedSet::score(const std::string& member) const {
+    auto it = scores_.find(member);
+    if (it == scores_.end()) return std::nullopt;
+    return it->second;
+}
+
+std::optional<size_t> SortedSet::rank(const std::string& member) const {
+    auto it = scores_.find(member);
+    if (it == scores_.end()) return std::nullopt;
+
+    // Count the elements up to and including the member
+    size_t traversed = 0;
+    const Node* node = head_;
+    for (int i = level_ - 1; i >= 0; --i) {
+        while (node->links[i].next && (before(node->links[i].next, it->second, member) ||
+                                       node->links[i].next->member == member)) {
+            traversed += node->links[i].span;
+            node = node->links[i].next;
+        }
+    }
+    return traversed - 1;
+}
+
+std::vector<std::pair<std::string, double>> SortedSet::range(size_t first, size_t last) const {
+    // Descend to the element of rank `first` following the spans
+    size_t traversed = 0;
+    const Node* node = head_;
+    for (int i = level_ - 1; i >= 0; --i) {
+        while (node->links[i].next && traversed + node->links[i].span <= first + 1) {
+            traversed += node->links[i].span;
+            node = node->links[i].next;
+        }
+    }
+
+    std::vector<std::pair<std::string, double>> out;
+    out.reserve(last - first + 1);
+    for (size_t r = first; r <= last && node; ++r, node = node->links[0].next) {
+        out.emplace_back(node->member, node->score);
+    }
+    return out;
+}
+
+} // namespace keyforge
@@ -0,0 +1,234 @@
+#include "keyforge/Compression.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <queue>
+#include <tuple>
+#include <unordered_map>
+
+#ifdef KEYFORGE_HAVE_LZ4
+#include <lz4.h>
+#endif
+
+namespace keyforge {
+namespace compression {
+
+namespace {
+
+constexpr int kHashBits = 12;
+constexpr size_t kMinMatch = 4;
+
+uint32_t hashAt(const char* p) {
+    uint32_t v;
+    std::memcpy(&v, p, sizeof(v));
+    return (v * 2654435761u) >> (32 - kHashBits);
+}
+
+void putVarint(std::string& out, size_t v) {
+    while (v >= 0x80) {
+        out += static_cast<char>((v & 0x7f) | 0x80);
+        v >>= 7;
+    }
+    out += static_cast<char>(v);
+}
+
+bool getVarint(const std::string& in, size_t& pos, size_t& v) {
+    v = 0;
+    for (int shift = 0; pos < in.size() && shift < 64; shift += 7) {
+        auto byte = static_cast<unsigned char>(in[pos++]);
+        v |= static_cast<size_t>(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) return true;
+    }
+    return false;
+}
+
+// Built-in codec. A value is a series of (literal length, literals,
+// match length - 4, offset) with the last one cut after its literals.
+// Offsets count back through the output and then the dictionary in front.
+
+bool lzCompress(const std::string& src, const Dictionary* dict, std::string& out) {
+    size_t dict_size = dict ? dict->bytes().size() : 0;
+    std::string buf = dict ? dict->bytes() + src : src;
+    std::vector<uint32_t> table = dict ? dict->table() : std::vector<uint32_t>(1 << kHashBits, 0);
+    size_t budget = src.size() - src.size() / 8;
+
+    out.clear();
+    size_t i = dict_size, anchor = dict_size, end = buf.size();
+    while (i + kMinMatch <= end) {
+        uint32_t h = hashAt(buf.data() + i);
+        size_t candidate = table[h];  // position + 1, 0: none
+        table[h] = static_cast<uint32_t>(i + 1);
+        if (candidate == 0 || std::memcmp(buf.data() + candidate - 1, buf.data() + i, kMinMatch) != 0) {
+            i++;
+            continue;
+        }
+        size_t from = candidate - 1;
+        size_t len = kMinMatch;
+        while (i + len < end && buf[from + len] == buf[i + len]) len++;
+
+        putVarint(out, i - anchor);
+        out.append(buf, anchor, i - anchor);
+        putVarint(out, len - kMinMatch);
+        putVarint(out, i - from);
+        if (out.size() > budget) return false;
+        i += len;
+        anchor = i;
+    }
+    putVarint(out, end - anchor);
+    out.append(buf, anchor, end - anchor);
+    return out.size() <= budget;
+}
+
+bool lzDecompress(const std::string& src, size_t raw_size, const Dictionary* dict, std::string& out) {
+    const char* history = dict ? dict->bytes().data() : nullptr;
+    size_t dict_size = dict ? dict->bytes().size() : 0;
+    out.resize(raw_size);
+    char* dst = &out[0];
+    size_t pos = 0, o = 0, literals = 0, len = 0, offset = 0;
+    for (;;) {
+        if (!getVarint(src, pos, literals) || literals > src.size() - pos || literals > raw_size - o) return false;
+        std::memcpy(dst + o, src.data() + pos, literals);
+        pos += literals;
+        o += literals;
+        if (o == raw_size) return pos == src.size();
+
+        if (!getVarint(src, pos, len) || !getVarint(src, pos, offset)) return false;
+        len += kMinMatch;
+        if (offset == 0 || offset > dict_size + o || len > raw_size - o) return false;
+        // Byte by byte: a match may overlap the bytes it produces
+        size_t from = dict_size + o - offset;
+        for (size_t k = 0; k < len; ++k, ++from) {
+            dst[o++] = from < dict_size ? history[from] : dst[from - dict_size];
+        }
+    }
+}
+
+} // namespace
+
+const char* codecName() {
+#ifdef KEYFORGE_HAVE_LZ4
+    return "lz4";
+#else
+    return "lz";
+#endif
+}
+
+Dictionary::Dictionary(std::string bytes) : bytes_(std::move(bytes)), table_(1 << kHashBits, 0) {
+    if (bytes_.size() > kMaxDictionary) bytes_.erase(0, bytes_.size() - kMaxDictionary);
+    for (size_t i = 0; i + kMinMatch <= bytes_.size(); ++i) {
+        table_[hashAt(bytes_.data() + i)] = static_cast<uint32_t>(i + 1);
+    }
+}
+
+bool compress(const std::string& src, const Dictionary* dict, std::string& out) {
+#ifdef KEYFORGE_HAVE_LZ4
+    int bound = LZ4_compressBound(static_cast<int>(src.size()));
+    out.resize(static_cast<size_t>(bound));
+    int written = 0;
+    if (dict && !dict->bytes().empty()) {
+        LZ4_stream_t* stream = LZ4_createStream();
+        LZ4_loadDict(stream, dict->bytes().data(), static_cast<int>(dict->bytes().size()));
+        written = LZ4_compress_fast_continue(stream, src.data(), &out[0], static_cast<int>(src.size()), bound, 1);
+        LZ4_freeStream(stream);
+    } else {
+        written = LZ4_compress_default(src.data(), &out[0], static_cast<int>(src.size()), bound);
+    }
+    if (written <= 0) return false;
+    out.resize(static_cast<size_t>(written));
+    return out.size() <= src.size() - src.size() / 8;
+#else
+    return lzCompress(src, dict, out);
+#endif
+}
+
+bool decompress(const std::string& src, size_t raw_size, const Dictionary* dict, std::string& out) {
+#ifdef KEYFORGE_HAVE_LZ4
+    out.resize(raw_size);
+    int size = static_cast<int>(raw_size);
+    int read = dict ? LZ4_decompress_safe_usingDict(src.data(), &out[0], static_cast<int>(src.size()), size,
+                                                    dict->bytes().data(), static_cast<int>(dict->bytes().size()))
+                    : LZ4_decompress_safe(src.data(), &out[0], static_cast<int>(src.size()), size);
+    return read == size;
+#else
+    return lzDecompress(src, raw_size, dict, out);
+#endif
+}
+
+std::string train(const std::vector<std::string>& samples, size_t max_bytes) {
+    constexpr size_t kShingle = 8;
+    constexpr size_t kSegment = 64;
+    constexpr size_t kStep = 16;
+    max_bytes = std::min(max_bytes, kMaxDictionary);
+
+    auto shingleAt = [](const std::string& s, size_t i) {
+        uint64_t v;
+        std::memcpy(&v, s.data() + i, sizeof(v));
+        return v;
+    };
+
+    // In how many samples each 8-byte substring appears
+    struct Seen {
+        uint32_t samples = 0;
+        uint32_t last = UINT32_MAX;
+    };
+    std::unordered_map<uint64_t, Seen> freq;
+    for (uint32_t n = 0; n < samples.size(); ++n) {
+        const auto& s = samples[n];
+        for (size_t i = 0; i + kShingle <= s.size(); ++i) {
+            Seen& seen = freq[shingleAt(s, i)];
+            if (seen.last != n) {
+                seen.last = n;
+                seen.samples++;
+            }
+        }
+    }
+
+    // Score of a segment: how often its substrings recur elsewhere, minus
+    // the ones already in the dictionary
+    auto score = [&](const std::string& s, size_t start, size_t len) {
+        uint64_t total = 0;
+        for (size_t i = start; i + kShingle <= start + len; ++i) {
+            uint32_t count = freq[shingleAt(s, i)].samples;
+            if (count > 1) total += count;
+        }
+        return total;
+    };
+
+    using Candidate = std::tuple<uint64_t, uint32_t, size_t>;  // score, sample, start
+    std::priority_queue<Candidate> queue;
+    for (uint32_t n = 0; n < samples.size(); ++n) {
+        const auto& s = samples[n];
+        for (size_t start = 0; start + kShingle <= s.size(); start += kStep) {
+            uint64_t sc = score(s, start, std::min(kSegment, s.size() - start));
+            if (sc > 0) queue.emplace(sc, n, start);
+        }
+    }
+
+    // Lazy greedy: a candidate is only taken if it is still the best after
+    // rescoring against what was chosen before it
+    std::vector<std::string> chosen;
+    size_t bytes = 0;
+    while (!queue.empty() && bytes < max_bytes) {
+        auto [old_score, n, start] = queue.top();
+        queue.pop();
+        const auto& s = samples[n];
+        size_t len = std::min({kSegment, s.size() - start, max_bytes - bytes});
+        uint64_t sc = score(s, start, len);
+        if (sc == 0) continue;
+        if (!queue.empty() && sc < std::get<0>(queue.top())) {
+            queue.emplace(sc, n, start);
+            continue;
+        }
+        for (size_t i = start; i + kShingle <= start + len; ++i) freq[shingleAt(s, i)].samples = 0;
+        chosen.push_back(s.substr(start, len));
+        bytes += len;
+    }
+
+    // Best segments last: they end up closest to the data (shortest offsets)
+    std::string dict;
+    for (auto it = chosen.rbegin(); it != chosen.rend(); ++it) dict += *it;
+    return dict;
+}
+
+} // namespace compression
+} // namespace keyforge
@@ -0,0 +1,144 @@
+#include "keyforge/FileWriter.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace keyforge {
+
+FileWriter::FileWriter(const std::string& path, Options options) : options_(options) {
+    capacity_ = std::max<size_t>((options_.buffer_bytes + kBlock - 1) / kBlock * kBlock, kBlock);
+    int flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+    if (options_.direct) {
+        fd_ = ::open(path.c_str(), flags | O_DIRECT, 0644);
+        direct_ = fd_ >= 0;
+    }
+    if (fd_ < 0) fd_ = ::open(path.c_str(), flags, 0644);
+    if (fd_ < 0) return;
+    buffer_ = static_cast<char*>(std::aligned_alloc(kBlock, capacity_));
+    if (!buffer_) {
+        ::close(fd_);
+        fd_ = -1;
+        return;
+    }
+    setp(buffer_, buffer_ + capacity_);
+    preallocate(options_.preallocate);
+    start_ = std::chrono::steady_clock::now();
+}
+
+FileWriter::~FileWriter() {
+    if (fd_ >= 0) ::close(fd_);
+    std::free(buffer_);
+}
+
+FileWriter::int_type FileWriter::overflow(int_type ch) {
+    if (!drain(false)) return traits_type::eof();
+    if (!traits_type::eq_int_type(ch, traits_type::eof())) {
+        *pptr() = traits_type::to_char_type(ch);
+        pbump(1);
+    }
+    return traits_type::not_eof(ch);
+}
+
+std::streamsize FileWriter::xsputn(const char* s, std::streamsize n) {
+    std::streamsize done = 0;
+    while (done < n) {
+        if (pptr() == epptr() && !drain(false)) break;
+        size_t room = static_cast<size_t>(epptr() - pptr());
+        size_t chunk = std::min(room, static_cast<size_t>(n - done));
+        std::memcpy(pptr(), s + done, chunk);
+        pbump(static_cast<int>(chunk));
+        done += static_cast<std::streamsize>(chunk);
+    }
+    return done;
+}
+
+bool FileWriter::drain(bool all) {
+    if (fd_ < 0 || !ok_) return false;
+    size_t size = static_cast<size_t>(pptr() - pbase());
+    size_t out = all ? size : size / kBlock * kBlock;
+    if (out == 0) return true;
+    size_t len = out;
+    if (direct_ && out % kBlock != 0) {
+        // Only the last block is partial: pad it, close() truncates
+        len = (out + kBlock - 1) / kBlock * kBlock;
+        std::memset(buffer_ + out, 0, len - out);
+    }
+    preallocate(offset_ + len);
+    ok_ = writeAt(buffer_, len, offset_);
+    if (!ok_) return false;
+    offset_ += out;
+    std::memmove(buffer_, buffer_ + out, size - out);
+    setp(buffer_, buffer_ + capacity_);
+    pbump(static_cast<int>(size - out));
+    pace();
+    return true;
+}
+
+bool FileWriter::writeAt(const char* data, size_t size, uint64_t offset) {
+    size_t done = 0;
+    while (done < size) {
+        ssize_t n = ::pwrite(fd_, data + done, size - done, static_cast<off_t>(offset + done));
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && errno == EINVAL && direct_) {
+            // The file system takes the open but not the write: go buffered
+            int flags = ::fcntl(fd_, F_GETFL);
+            if (flags < 0 || ::fcntl(fd_, F_SETFL, flags & ~O_DIRECT) != 0) return false;
+            direct_ = false;
+            continue;
+        }
+        if (n <= 0) return false;
+        done += static_cast<size_t>(n);
+    }
+    return true;
+}
+
+void FileWriter::preallocate(uint64_t upto) {
+    if (options_.preallocate == 0 || upto <= allocated_) return;
+    uint64_t want = std::max<uint64_t>(upto, allocated_ > 0 ? allocated_ * 2 : options_.preallocate);
+    if (::fallocate(fd_, 0, static_cast<off_t>(allocated_), static_cast<off_t>(want - allocated_)) != 0) {
+        options_.preallocate = 0;  // not supported here: don't ask again
+        return;
+    }
+    allocated_ = want;
+}
+
+void FileWriter::pace() {
+    if (!direct_ && options_.sync_bytes > 0 && offset_ - synced_ >= options_.sync_bytes) {
+        // Finish the range started last time and drop it from the cache,
+        // then start on this one
+        if (synced_ > waited_) {
+            off_t from = static_cast<off_t>(waited_), len = static_cast<off_t>(synced_ - waited_);
+            ::sync_file_range(fd_, from, len,
+                              SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+            ::posix_fadvise(fd_, from, len, POSIX_FADV_DONTNEED);
+            waited_ = synced_;
+        }
+        ::sync_file_range(fd_, static_cast<off_t>(synced_), static_cast<off_t>(offset_ - synced_),
+                          SYNC_FILE_RANGE_WRITE);
+        synced_ = offset_;
+    }
+    if (options_.max_bytes_per_sec > 0) {
+        std::chrono::duration<double> due(static_cast<double>(offset_) / static_cast<double>(options_.max_bytes_per_sec));
+        std::this_thread::sleep_until(start_ + std::chrono::duration_cast<std::chrono::steady_clock::duration>(due));
+    }
+}
+
+bool FileWriter::close() {
+    if (fd_ < 0) return false;
+    bool ok = drain(true);
+    // Drops the padding and whatever was preallocated past the end
+    ok = ok && ::ftruncate(fd_, static_cast<off_t>(offset_)) == 0;
+    ok = ok && ::fdatasync(fd_) == 0;
+    if (ok && !direct_ && options_.sync_bytes > 0) ::posix_fadvise(fd_, static_cast<off_t>(waited_), 0, POSIX_FADV_DONTNEED);
+    ok = ::close(fd_) == 0 && ok;
+    fd_ = -1;
+    return ok;
+}
+
+} // namespace keyforge
@@ -0,0 +1,424 @@
+#include "keyforge/Gossip.hpp"
+#include "keyforge/Logger.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <sstream>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace keyforge {
+
+namespace {
+constexpr auto kAckTimeout = std::chrono::milliseconds(200);
+constexpr auto kDeadRetention = std::chrono::seconds(30);
+
+bool resolve(const std::string& addr, sockaddr_in& out) {
+    auto colon = addr.rfind(':');
+    if (colon == std::string::npos) return false;
+    std::string host = addr.substr(0, colon);
+    int port = std::atoi(addr.c_str() + colon + 1);
+    if (port <= 0) return false;
+
+    std::memset(&out, 0, sizeof(out));
+    out.sin_family = AF_INET;
+    out.sin_port = htons(static_cast<uint16_t>(port));
+    if (inet_pton(AF_INET, host.c_str(), &out.sin_addr) == 1) return true;
+
+    addrinfo hints{};
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_DGRAM;
+    addrinfo* res = nullptr;
+    if (getaddrinfo(host.c_str(), nullptr, &hints, &res) != 0 || !res) return false;
+    out.sin_addr = reinterpret_cast<sockaddr_in*>(res->ai_addr)->sin_addr;
+    freeaddrinfo(res);
+    return true;
+}
+
+double msSince(std::chrono::steady_clock::time_point t) {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t).count();
+}
+} // namespace
+
+Gossip::~Gossip() {
+    shutdown();
+}
+
+const char* Gossip::stateName(State s) {
+    switch (s) {
+        case State::ALIVE: return "ALIVE";
+        case State::SUSPECT: return "SUSPECT";
+        case State::DEAD: return "DEAD";
+    }
+    return "?";
+}
+
+void Gossip::start(const std::string& self, const std::vector<std::string>& seeds) {
+    auto colon = self.rfind(':');
+    int port = colon == std::string::npos ? 0 : std::atoi(self.c_str() + colon + 1);
+
+    sock_ = socket(AF_INET, SOCK_DGRAM, 0);
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = INADDR_ANY;
+    addr.sin_port = htons(static_cast<uint16_t>(port));
+    if (sock_ < 0 || bind(sock_, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        Logger::instance().error("Gossip: cannot bind UDP port " + std::to_string(port));
+        if (sock_ >= 0) close(sock_);
+        sock_ = -1;
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        self_ = self;
+        incarnation_ = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::seconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count());
+        for (const auto& s : seeds) {
+            if (s != self_) seeds_.push_back(s);
+        }
+        enqueue(self_, State::ALIVE, incarnation_);
+    }
+
+    enabled_.store(true);
+    receiver_ = std::thread(&Gossip::receiveLoop, this);
+    prober_ = std::thread(&Gossip::probeLoop, this);
+    Logger::instance().info("Gossip: " + self + " started with " + std::to_string(seeds_.size()) + " seeds");
+}
+
+void Gossip::shutdown() {
+    if (stopping_.exchange(true)) return;
+    ack_cv_.notify_all();
+    if (receiver_.joinable()) receiver_.join();
+    if (prober_.joinable()) prober_.join();
+    if (sock_ >= 0) close(sock_);
+    sock_ = -1;
+}
+
+size_t Gossip::retransmitLimit() const {
+    double n = static_cast<double>(members_.size() + 1);
+    return 4 * static_cast<size_t>(std::ceil(std::log10(n + 1)));
+}
+
+std::chrono::milliseconds Gossip::suspicionTimeout() const {
+    double n = static_cast<double>(members_.size() + 1);
+    double scale = std::max(1.0, std::log10(n));
+    return std::chrono::milliseconds(static_cast<long>(4 * scale * kProtocolPeriod.count()));
+}
+
+void Gossip::enqueue(const std::string& addr, State state, uint64_t incarnation) {
+    updates_[addr] = Update{state, incarnation, 0};
+}
+
+bool Gossip::applyUpdate(const std::string& addr, State state, uint64_t incarnation) {
+    auto& log = Logger::instance();
+
+    if (addr == self_) {
+        // Someone suspects us: refute with a newer incarnation
+        if (state != State::ALIVE && incarnation >= incarnation_) {
+            incarnation_ = incarnation + 1;
+            enqueue(self_, State::ALIVE, incarnation_);
+            refutations_++;
+            log.warn("Gossip: refuting " + std::string(stateName(state)) + " about us, incarnation " +
+                     std::to_string(incarnation_));
+        }
+        return false;
+    }
+
+    auto it = members_.find(addr);
+    if (it == members_.end()) {
+        if (state == State::DEAD) return false;  // nothing to forget
+        members_[addr] = Member{state, incarnation, std::chrono::steady_clock::now()};
+        enqueue(addr, state, incarnation);
+        log.info("Gossip: member " + addr + " joined (" + stateName(state) + ")");
+        return true;
+    }
+
+    Member& m = it->second;
+    bool news = false;
+    switch (state) {
+        case State::ALIVE:
+            news = incarnation > m.incarnation;
+            break;
+        case State::SUSPECT:
+            news = (m.state == State::ALIVE && incarnation >= m.incarnation) || incarnation > m.incarnation;
+            break;
+        case State::DEAD:
+            news = (m.state != State::DEAD && incarnation >= m.incarnation) || incarnation > m.incarnation;
+            break;
+    }
+    if (!news) return false;
+
+    if (m.state != state) {
+        log.info("Gossip: member " + addr + " " + stateName(m.state) + " -> " + stateName(state));
+    }
+    m.state = state;
+    m.incarnation = incarnation;
+    m.changed = std::chrono::steady_clock::now();
+    enqueue(addr, state, incarnation);
+    return true;
+}
+
+std::string Gossip::piggyback(bool full_state) {
+    std::string out;
+    auto line = [](const std::string& addr, State state, uint64_t inc) {
+        return addr + " " + stateName(state) + " " + std::to_string(inc) + "\n";
+    };
+
+    if (full_state) {
+        // A new member gets our whole view at once (as much as fits)
+        out += line(self_, State::ALIVE, incarnation_);
+        for (const auto& [addr, m] : members_) {
+            std::string l = line(addr, m.state, m.incarnation);
+            if (out.size() + l.size() > kMaxDatagram - 64) break;
+            out += l;
+        }
+        return out;
+    }
+
+    // Least transmitted updates first
+    std::vector<std::map<std::string, Update>::iterator> order;
+    for (auto it = updates_.begin(); it != updates_.end(); ++it) order.push_back(it);
+    std::sort(order.begin(), order.end(), [](const auto& a, const auto& b) {
+        return a->second.transmits < b->second.transmits;
+    });
+
+    size_t limit = retransmitLimit();
+    size_t added = 0;
+    for (auto it : order) {
+        if (added == kMaxPiggyback) break;
+        std::string l = line(it->first, it->second.state, it->second.incarnation);
+        if (out.size() + l.size() > kMaxDatagram - 64) break;
+        out += l;
+        added++;
+        if (++it->second.transmits >= limit) updates_.erase(it);
+    }
+    return out;
+}
+
+bool Gossip::sendTo(const std::string& addr, const std::string& header, bool full_state) {
+    sockaddr_in dest{};
+    if (!resolve(addr, dest)) return false;
+
+    std::string msg = header + "\n";
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        msg += piggyback(full_state);
+    }
+    ssize_t n = sendto(sock_, msg.data(), msg.size(), 0, (struct sockaddr*)&dest, sizeof(dest));
+    if (n < 0) return false;
+    msgs_sent_++;
+    bytes_sent_ += static_cast<uint64_t>(n);
+    return true;
+}
+
+void Gossip::handleMessage(const std::string& msg) {
+    std::istringstream in(msg);
+    std::string header;
+    std::getline(in, header);
+
+    std::istringstream h(header);
+    std::string type, from, target;
+    uint64_t seq = 0;
+    h >> type >> seq >> from >> target;
+    if (from.empty() || from == self_) return;
+    msgs_received_++;
+
+    bool new_sender = false;
+    std::string relay_to;
+    uint64_t relay_seq = 0;
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        std::string line;
+        while (std::getline(in, line)) {
+            std::istringstream u(line);
+            std::string addr, state;
+            uint64_t inc = 0;
+            if (!(u >> addr >> state >> inc)) continue;
+            State s = state == "ALIVE" ? State::ALIVE : state == "SUSPECT" ? State::SUSPECT : State::DEAD;
+            applyUpdate(addr, s, inc);
+        }
+        // Heard from someone we didn't know about: they're evidently alive
+        if (members_.find(from) == members_.end()) {
+            new_sender = true;
+            applyUpdate(from, State::ALIVE, 0);
+        }
+
+        if (type == "ACK") {
+            auto it = relays_.find(seq);
+            if (it != relays_.end()) {
+                relay_to = it->second.requester;
+                relay_seq = it->second.seq;
+                relays_.erase(it);
+            } else {
+                acked_.insert(seq);
+            }
+        } else if (type == "PINGREQ") {
+            relay_seq = next_seq_++;
+            relays_[relay_seq] = Relay{from, seq, std::chrono::steady_clock::now() + kProtocolPeriod};
+        }
+    }
+
+    if (type == "PING") {
+        sendTo(from, "ACK " + std::to_string(seq) + " " + self_, new_sender);
+    } else if (type == "ACK") {
+        if (!relay_to.empty()) {
+            // Indirect probe answered: report it to the member that asked
+            sendTo(relay_to, "ACK " + std::to_string(relay_seq) + " " + from);
+        } else {
+            ack_cv_.notify_all();
+        }
+    } else if (type == "PINGREQ" && !target.empty()) {
+        sendTo(target, "PING " + std::to_string(relay_seq) + " " + self_);
+    }
+}
+
+void Gossip::receiveLoop() {
+    std::vector<char> buf(65536);
+    while (!stopping_.load()) {
+        pollfd pfd{sock_, POLLIN, 0};
+        if (poll(&pfd, 1, 100) <= 0) continue;
+        ssize_t n = recv(sock_, buf.data(), buf.size(), 0);
+        if (n <= 0) continue;
+        handleMessage(std::string(buf.data(), static_cast<size_t>(n)));
+    }
+}
+
+void Gossip::probe(const std::string& target) {
+    uint64_t seq;
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        seq = next_seq_++;
+    }
+    auto deadline = std::chrono::steady_clock::now() + kProtocolPeriod;
+    sendTo(target, "PING " + std::to_string(seq) + " " + self_);
+
+    std::vector<std::string> helpers;
+    {
+        std::unique_lock<std::mutex> lock(mtx_);
+        if (ack_cv_.wait_for(lock, kAckTimeout, [&] { return acked_.count(seq) || stopping_.load(); })) {
+            acked_.erase(seq);
+            return;
+        }
+        // No direct ack: ask a few random members to probe it for us
+        for (const auto& [addr, m] : members_) {
+            if (addr != target && m.state == State::ALIVE) helpers.push_back(addr);
+        }
+        std::shuffle(helpers.begin(), helpers.end(), rng_);
+        if (helpers.size() > kIndirectProbes) helpers.resize(kIndirectProbes);
+    }
+
+    for (const auto& helper : helpers) {
+        indirect_probes_++;
+        sendTo(helper, "PINGREQ " + std::to_string(seq) + " " + self_ + " " + target);
+    }
+
+    std::unique_lock<std::mutex> lock(mtx_);
+    bool acked = ack_cv_.wait_until(lock, deadline, [&] { return acked_.count(seq) || stopping_.load(); });
+    acked_.erase(seq);
+    if (acked || stopping_.load()) return;
+
+    auto it = members_.find(target);
+    if (it != members_.end() && it->second.state == State::ALIVE) {
+        suspicions_++;
+        applyUpdate(target, State::SUSPECT, it->second.incarnation);
+    }
+}
+
+void Gossip::probeLoop() {
+    while (!stopping_.load()) {
+        auto period_start = std::chrono::steady_clock::now();
+
+        std::string target;
+        std::vector<std::string> join;
+        {
+            std::lock_guard<std::mutex> lock(mtx_);
+            bool alone = std::none_of(members_.begin(), members_.end(), [](const auto& m) {
+                return m.second.state != State::DEAD;
+            });
+            if (alone) {
+                join = seeds_;
+            } else {
+                // Round robin over a shuffled member list, reshuffled each pass
+                while (target.empty()) {
+                    if (probe_pos_ >= probe_order_.size()) {
+                        probe_order_.clear();
+                        for (const auto& [addr, m] : members_) {
+                            if (m.state != State::DEAD) probe_order_.push_back(addr);
+                        }
+                        std::shuffle(probe_order_.begin(), probe_order_.end(), rng_);
+                        probe_pos_ = 0;
+                    }
+                    const std::string& cand = probe_order_[probe_pos_++];
+                    auto it = members_.find(cand);
+                    if (it != members_.end() && it->second.state != State::DEAD) target = cand;
+                }
+            }
+        }
+
+        if (!join.empty()) {
+            for (const auto& seed : join) sendTo(seed, "PING 0 " + self_, true);
+        } else if (!target.empty()) {
+            probe(target);
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mtx_);
+            auto now = std::chrono::steady_clock::now();
+            auto suspicion = suspicionTimeout();
+            for (auto it = members_.begin(); it != members_.end();) {
+                Member& m = it->second;
+                if (m.state == State::SUSPECT && now - m.changed > suspicion) {
+                    applyUpdate(it->first, State::DEAD, m.incarnation);
+                } else if (m.state == State::DEAD && now - m.changed > kDeadRetention) {
+                    it = members_.erase(it);
+                    continue;
+                }
+                ++it;
+            }
+            for (auto it = relays_.begin(); it != relays_.end();) {
+                it = it->second.expires < now ? relays_.erase(it) : std::next(it);
+            }
+            acked_.clear();  // late acks for probes that already gave up
+        }
+
+        while (!stopping_.load() && std::chrono::steady_clock::now() - period_start < kProtocolPeriod) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        }
+    }
+}
+
+std::vector<std::string> Gossip::liveMembers() {
+    std::lock_guard<std::mutex> lock(mtx_);
+    std::vector<std::string> out{self_};
+    for (const auto& [addr, m] : members_) {
+        if (m.state != State::DEAD) out.push_back(addr);
+    }
+    std::sort(out.begin(), out.end());
+    return out;
+}
+
+std::string Gossip::info() {
+    std::ostringstream out;
+    std::lock_guard<std::mutex> lock(mtx_);
+    out << "Self: " << self_ << " (incarnation " << incarnation_ << ")\n";
+    out << "Members: " << members_.size() + 1 << "\n";
+    for (const auto& [addr, m] : members_) {
+        out << "  " << addr << " " << stateName(m.state) << " incarnation=" << m.incarnation
+            << " since=" << static_cast<long>(msSince(m.changed)) << "ms\n";
+    }
+    out << "Pending updates: " << updates_.size() << " (retransmit limit " << retransmitLimit() << ")\n";
+    out << "Suspicion timeout: " << suspicionTimeout().count() << " ms\n";
+    out << "Messages: sent=" << msgs_sent_.load() << " received=" << msgs_received_.load()
+        << " bytes_sent=" << bytes_sent_.load() << "\n";
+    out << "Indirect probes: " << indirect_probes_.load() << ", suspicions: " << suspicions_.load()
+        << ", refutations: " << refutations_.load() << "\n";
+    return out.str();
+}
+
+} // namespace keyforge
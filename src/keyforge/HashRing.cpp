@@ -0,0 +1,41 @@
+#include "keyforge/HashRing.hpp"
+
+#include <algorithm>
+#include <stdexcept>
+
+namespace keyforge {
+
+uint64_t hash64(const std::string& data) {
+    uint64_t h = 1469598103934665603ULL;
+    for (unsigned char c : data) {
+        h ^= c;
+        h *= 1099511628211ULL;
+    }
+    // splitmix64 finalizer: FNV alone clusters badly for short similar keys
+    h ^= h >> 30;
+    h *= 0xbf58476d1ce4e5b9ULL;
+    h ^= h >> 27;
+    h *= 0x94d049bb133111ebULL;
+    h ^= h >> 31;
+    return h;
+}
+
+size_t HashRing::addNode(const std::string& name) {
+    size_t idx = names_.size();
+    names_.push_back(name);
+    for (size_t v = 0; v < vnodes_; ++v) {
+        points_.emplace_back(hash64(name + "#" + std::to_string(v)), idx);
+    }
+    std::sort(points_.begin(), points_.end());
+    return idx;
+}
+
+size_t HashRing::nodeFor(const std::string& key) const {
+    if (points_.empty()) throw std::runtime_error("HashRing has no nodes");
+    uint64_t h = hash64(key);
+    auto it = std::lower_bound(points_.begin(), points_.end(), std::make_pair(h, size_t{0}));
+    if (it == points_.end()) it = points_.begin();  // wrap around
+    return it->second;
+}
+
+} // namespace keyforge
@@ -0,0 +1,62 @@
+#include "keyforge/HotKeys.hpp"
+#include "keyforge/HashRing.hpp"
+
+#include <algorithm>
+
+namespace keyforge {
+
+void HotKeys::record(const std::string& key) {
+    // Double hashing: row i uses h1 + i * h2
+    uint64_t h = hash64(key);
+    uint32_t h1 = static_cast<uint32_t>(h);
+    uint32_t h2 = static_cast<uint32_t>(h >> 32) | 1;
+
+    uint32_t estimate = UINT32_MAX;
+    for (size_t row = 0; row < kDepth; ++row) {
+        size_t col = (h1 + row * h2) % kWidth;
+        uint32_t v = sketch_[row][col].fetch_add(1, std::memory_order_relaxed) + 1;
+        estimate = std::min(estimate, v);
+    }
+
+    if (total_.fetch_add(1, std::memory_order_relaxed) % kDecayEvery == kDecayEvery - 1) decay();
+    if (estimate % kSampleEvery != 0) return;
+
+    std::lock_guard<std::mutex> lock(mtx_);
+    auto it = candidates_.find(key);
+    if (it != candidates_.end()) {
+        it->second = estimate;
+        return;
+    }
+    if (candidates_.size() < kTopK) {
+        candidates_.emplace(key, estimate);
+        return;
+    }
+    // Replace the coldest candidate if this key is hotter
+    auto coldest = std::min_element(candidates_.begin(), candidates_.end(),
+        [](const auto& a, const auto& b) { return a.second < b.second; });
+    if (coldest->second < estimate) {
+        candidates_.erase(coldest);
+        candidates_.emplace(key, estimate);
+    }
+}
+
+void HotKeys::decay() {
+    for (auto& row : sketch_) {
+        for (auto& c : row) c.store(c.load(std::memory_order_relaxed) / 2, std::memory_order_relaxed);
+    }
+    std::lock_guard<std::mutex> lock(mtx_);
+    for (auto& [key, count] : candidates_) count /= 2;
+}
+
+std::vector<std::pair<std::string, uint32_t>> HotKeys::top(size_t n) {
+    std::vector<std::pair<std::string, uint32_t>> out;
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        out.assign(candidates_.begin(), candidates_.end());
+    }
+    std::sort(out.begin(), out.end(), [](const auto& a, const auto& b) { return a.second > b.second; });
+    if (out.size() > n) out.resize(n);
+    return out;
+}
+
+} // namespace keyforge
@@ -0,0 +1,60 @@
+#include "keyforge/KeyFilter.hpp"
+#include "keyforge/HashRing.hpp"
+
+#include <algorithm>
+
+namespace keyforge {
+
+KeyFilter::KeyFilter(size_t capacity)
+    : capacity_(std::max<size_t>(capacity, 1)),
+      blocks_((capacity_ * kCountersPerKey + kBlockSize - 1) / kBlockSize),
+      counters_(new std::atomic<uint8_t>[blocks_ * kBlockSize]) {
+    clear();
+}
+
+uint64_t KeyFilter::hash(const std::string& key) {
+    return hash64(key);
+}
+
+template <typename F>
+void KeyFilter::probe(uint64_t h, F&& f) const {
+    // High bits pick the block, a remix of the hash gives 6 bits per probe
+    size_t block = static_cast<size_t>((static_cast<unsigned __int128>(h) * blocks_) >> 64);
+    std::atomic<uint8_t>* base = &counters_[block * kBlockSize];
+    uint64_t bits = h * 0x9e3779b97f4a7c15ULL;
+    for (int i = 0; i < kProbes; ++i) {
+        if (!f(base[(bits >> (6 * i)) & (kBlockSize - 1)])) return;
+    }
+}
+
+bool KeyFilter::mayContain(uint64_t h) const {
+    bool found = true;
+    probe(h, [&](std::atomic<uint8_t>& c) {
+        found = c.load(std::memory_order_acquire) != 0;
+        return found;
+    });
+    return found;
+}
+
+// Writers are serialized, so a plain load and store is enough
+void KeyFilter::add(uint64_t h) {
+    probe(h, [](std::atomic<uint8_t>& c) {
+        uint8_t v = c.load(std::memory_order_relaxed);
+        if (v != UINT8_MAX) c.store(v + 1, std::memory_order_release);
+        return true;
+    });
+}
+
+void KeyFilter::remove(uint64_t h) {
+    probe(h, [](std::atomic<uint8_t>& c) {
+        uint8_t v = c.load(std::memory_order_relaxed);
+        if (v != 0 && v != UINT8_MAX) c.store(v - 1, std::memory_order_release);
+        return true;
+    });
+}
+
+void KeyFilter::clear() {
+    for (size_t i = 0; i < blocks_ * kBlockSize; ++i) counters_[i].store(0, std::memory_order_relaxed);
+}
+
+} // namespace keyforge
@@ -0,0 +1,919 @@
+#include "keyforge/Lsm.hpp"
+#include "keyforge/HashRing.hpp"
+#include "keyforge/Logger.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <stdexcept>
+#include <string_view>
+#include <system_error>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace keyforge {
+
+namespace {
+
+// SSTable layout: data blocks, then the index (per block: last key,
+// offset, size), the Bloom filter, and a fixed footer pointing at both.
+// A block entry is varint key length, key, varint value length + 1 (0 for
+// a tombstone), value.
+constexpr uint64_t kTableMagic = 0x4b46535354424c31ULL;  // "KFSSTBL1"
+constexpr size_t kFooterSize = 6 * 8;
+constexpr size_t kWriteBuffer = 1 << 20;
+
+void putVarint(std::string& out, uint64_t v) {
+    while (v >= 0x80) {
+        out += static_cast<char>((v & 0x7f) | 0x80);
+        v >>= 7;
+    }
+    out += static_cast<char>(v);
+}
+
+bool getVarint(const char*& p, const char* end, uint64_t& v) {
+    v = 0;
+    for (int shift = 0; p < end && shift < 64; shift += 7) {
+        auto byte = static_cast<unsigned char>(*p++);
+        v |= static_cast<uint64_t>(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) return true;
+    }
+    return false;
+}
+
+void putFixed64(std::string& out, uint64_t v) {
+    for (int i = 0; i < 8; ++i) out += static_cast<char>(v >> (8 * i));
+}
+
+uint64_t getFixed64(const char* p) {
+    uint64_t v = 0;
+    for (int i = 0; i < 8; ++i) v |= static_cast<uint64_t>(static_cast<unsigned char>(p[i])) << (8 * i);
+    return v;
+}
+
+// One block entry; false at the end of the block or on a corrupt one
+bool nextEntry(const char*& p, const char* end, std::string_view& key, std::optional<std::string_view>& value) {
+    uint64_t klen = 0, vlen = 0;
+    if (!getVarint(p, end, klen) || klen > static_cast<uint64_t>(end - p)) return false;
+    key = std::string_view(p, klen);
+    p += klen;
+    if (!getVarint(p, end, vlen)) return false;
+    if (vlen == 0) {
+        value.reset();
+        return true;
+    }
+    if (vlen - 1 > static_cast<uint64_t>(end - p)) return false;
+    value = std::string_view(p, vlen - 1);
+    p += vlen - 1;
+    return true;
+}
+
+bool readAt(int fd, uint64_t offset, size_t size, std::string& out) {
+    out.resize(size);
+    size_t done = 0;
+    while (done < size) {
+        ssize_t n = ::pread(fd, &out[done], size - done, static_cast<off_t>(offset + done));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        done += static_cast<size_t>(n);
+    }
+    return true;
+}
+
+bool writeAll(int fd, const std::string& data) {
+    size_t done = 0;
+    while (done < data.size()) {
+        ssize_t n = ::write(fd, data.data() + done, data.size() - done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        done += static_cast<size_t>(n);
+    }
+    return true;
+}
+
+// Bloom probes by double hashing; bits_per_key * ln 2 of them is optimal
+int bloomProbes(int bits_per_key) {
+    return std::clamp(bits_per_key * 69 / 100, 1, 30);
+}
+
+template <typename F>
+void bloomProbe(uint64_t h, size_t bits, int probes, F&& f) {
+    uint64_t delta = (h >> 33) | (h << 31);
+    for (int i = 0; i < probes; ++i) {
+        f(h % bits);
+        h += delta;
+    }
+}
+
+} // namespace
+
+// Tables
+
+struct LsmEngine::Table {
+    struct Block {
+        std::string last_key;
+        uint64_t offset;
+        uint64_t size;
+    };
+
+    uint64_t number = 0;
+    std::string path;
+    int fd = -1;
+    uint64_t file_size = 0;
+    std::string smallest, largest;
+    std::vector<Block> index;
+    std::string bloom;
+    int probes = 1;
+    std::atomic<bool> obsolete{false};  // compacted away: the file goes with the last reader
+
+    ~Table() {
+        if (fd >= 0) ::close(fd);
+        if (obsolete) ::unlink(path.c_str());
+    }
+
+    bool mayContain(uint64_t h) const {
+        if (bloom.empty()) return true;
+        bool maybe = true;
+        bloomProbe(h, bloom.size() * 8, probes, [&](uint64_t bit) {
+            if (!(static_cast<unsigned char>(bloom[bit / 8]) & (1u << (bit % 8)))) maybe = false;
+        });
+        return maybe;
+    }
+
+    // 0: not here, 1: value, 2: tombstone, -1: the block can't be read
+    int get(const std::string& key, BlockCache& cache, std::string& value) const {
+        auto it = std::lower_bound(index.begin(), index.end(), key,
+                                   [](const Block& b, const std::string& k) { return b.last_key < k; });
+        if (it == index.end()) return 0;
+        auto block = cache.lookup(number, it->offset);
+        if (!block) {
+            std::string data;
+            if (!readAt(fd, it->offset, it->size, data)) return -1;
+            block = std::make_shared<const std::string>(std::move(data));
+            cache.insert(number, it->offset, block);
+        }
+        const char* p = block->data();
+        const char* end = p + block->size();
+        std::string_view k;
+        std::optional<std::string_view> v;
+        while (p < end) {
+            if (!nextEntry(p, end, k, v)) return -1;
+            if (k < key) continue;
+            if (k != key) return 0;
+            if (!v) return 2;
+            value.assign(v->data(), v->size());
+            return 1;
+        }
+        return 0;
+    }
+};
+
+namespace {
+
+class TableBuilder {
+public:
+    TableBuilder(const std::string& path, const LsmEngine::Options& options)
+        : options_(options), fd_(::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) {}
+    ~TableBuilder() {
+        if (fd_ >= 0) ::close(fd_);
+    }
+
+    void add(const std::string& key, const std::optional<std::string>& value) {
+        putVarint(block_, key.size());
+        block_ += key;
+        putVarint(block_, value ? value->size() + 1 : 0);
+        if (value) block_ += *value;
+        last_key_ = key;
+        hashes_.push_back(hash64(key));
+        if (block_.size() >= options_.block_bytes) endBlock();
+    }
+
+    uint64_t size() const { return offset_ + block_.size(); }
+
+    bool finish() {
+        endBlock();
+        uint64_t index_offset = offset_;
+        std::string index;
+        for (const auto& [key, offset, size] : blocks_) {
+            putVarint(index, key.size());
+            index += key;
+            putFixed64(index, offset);
+            putFixed64(index, size);
+        }
+        out_ += index;
+
+        size_t bits = std::max<size_t>(hashes_.size() * options_.bloom_bits_per_key, 64);
+        std::string bloom((bits + 7) / 8, '\0');
+        int probes = bloomProbes(options_.bloom_bits_per_key);
+        for (uint64_t h : hashes_) {
+            bloomProbe(h, bloom.size() * 8, probes, [&](uint64_t bit) { bloom[bit / 8] |= static_cast<char>(1u << (bit % 8)); });
+        }
+        out_ += bloom;
+
+        putFixed64(out_, index_offset);
+        putFixed64(out_, index.size());
+        putFixed64(out_, index_offset + index.size());
+        putFixed64(out_, bloom.size());
+        putFixed64(out_, static_cast<uint64_t>(probes));
+        putFixed64(out_, kTableMagic);
+        offset_ += index.size() + bloom.size() + kFooterSize;
+        return drain(true) && ok_;
+    }
+
+private:
+    void endBlock() {
+        if (block_.empty()) return;
+        blocks_.push_back({last_key_, offset_, block_.size()});
+        offset_ += block_.size();
+        out_ += block_;
+        block_.clear();
+        drain(false);
+    }
+
+    bool drain(bool all) {
+        if (fd_ < 0) ok_ = false;
+        if (!ok_ || (!all && out_.size() < kWriteBuffer)) return ok_;
+        ok_ = writeAll(fd_, out_);
+        out_.clear();
+        return ok_;
+    }
+
+    const LsmEngine::Options& options_;
+    int fd_;
+    bool ok_ = true;
+    std::string block_;
+    std::string out_;
+    std::string last_key_;
+    uint64_t offset_ = 0;
+    std::vector<LsmEngine::Table::Block> blocks_;
+    std::vector<uint64_t> hashes_;
+};
+
+} // namespace
+
+std::shared_ptr<LsmEngine::Table> LsmEngine::openTable(uint64_t number) {
+    auto table = std::make_shared<Table>();
+    table->number = number;
+    table->path = tablePath(number);
+    table->fd = ::open(table->path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (table->fd < 0) return nullptr;
+    off_t size = ::lseek(table->fd, 0, SEEK_END);
+    std::string footer;
+    if (size < static_cast<off_t>(kFooterSize) || !readAt(table->fd, size - kFooterSize, kFooterSize, footer) ||
+        getFixed64(footer.data() + 40) != kTableMagic) {
+        return nullptr;
+    }
+    table->file_size = static_cast<uint64_t>(size);
+    uint64_t index_offset = getFixed64(footer.data()), index_size = getFixed64(footer.data() + 8);
+    uint64_t bloom_offset = getFixed64(footer.data() + 16), bloom_size = getFixed64(footer.data() + 24);
+    table->probes = static_cast<int>(getFixed64(footer.data() + 32));
+
+    std::string index;
+    if (!readAt(table->fd, index_offset, index_size, index) ||
+        !readAt(table->fd, bloom_offset, bloom_size, table->bloom)) {
+        return nullptr;
+    }
+    const char* p = index.data();
+    const char* end = p + index.size();
+    while (p < end) {
+        uint64_t klen = 0;
+        if (!getVarint(p, end, klen) || klen + 16 > static_cast<uint64_t>(end - p)) return nullptr;
+        Table::Block block{std::string(p, klen), getFixed64(p + klen), getFixed64(p + klen + 8)};
+        table->index.push_back(std::move(block));
+        p += klen + 16;
+    }
+    if (table->index.empty()) return nullptr;
+    table->largest = table->index.back().last_key;
+
+    std::string first;
+    if (!readAt(table->fd, table->index[0].offset, table->index[0].size, first)) return nullptr;
+    const char* q = first.data();
+    std::string_view key;
+    std::optional<std::string_view> value;
+    if (!nextEntry(q, q + first.size(), key, value)) return nullptr;
+    table->smallest = std::string(key);
+    return table;
+}
+
+// Cursors: the sources of a merge, each in key order. One that can't read
+// its data ends there with failed() set, so what it would have hidden
+// isn't taken for the latest.
+
+class LsmEngine::Cursor {
+public:
+    virtual ~Cursor() = default;
+    virtual bool valid() const = 0;
+    virtual bool failed() const { return false; }
+    virtual const std::string& key() const = 0;
+    virtual const std::optional<std::string>& value() const = 0;
+    virtual void next() = 0;
+};
+
+namespace {
+
+// A frozen memtable
+class MemCursor : public LsmEngine::Cursor {
+public:
+    MemCursor(std::shared_ptr<const LsmEngine::Memtable> mem, const std::optional<std::string>& after = std::nullopt)
+        : mem_(std::move(mem)), it_(after ? mem_->upper_bound(*after) : mem_->begin()) {}
+    bool valid() const override { return it_ != mem_->end(); }
+    const std::string& key() const override { return it_->first; }
+    const std::optional<std::string>& value() const override { return it_->second; }
+    void next() override { ++it_; }
+
+private:
+    std::shared_ptr<const LsmEngine::Memtable> mem_;
+    LsmEngine::Memtable::const_iterator it_;
+};
+
+// The memtable taking writes: copied a slice at a time under the engine
+// lock, instead of whole for every read
+class LiveMemCursor : public LsmEngine::Cursor {
+public:
+    LiveMemCursor(std::shared_ptr<const LsmEngine::Memtable> mem, std::mutex& mtx, std::optional<std::string> after)
+        : mem_(std::move(mem)), mtx_(mtx), after_(std::move(after)) {
+        fill();
+    }
+    bool valid() const override { return pos_ < slice_.size(); }
+    const std::string& key() const override { return slice_[pos_].first; }
+    const std::optional<std::string>& value() const override { return slice_[pos_].second; }
+    void next() override {
+        if (++pos_ < slice_.size() || slice_.size() < kSlice) return;
+        after_ = slice_.back().first;
+        fill();
+    }
+
+private:
+    static constexpr size_t kSlice = 256;
+
+    void fill() {
+        slice_.clear();
+        pos_ = 0;
+        std::lock_guard<std::mutex> lock(mtx_);
+        for (auto it = after_ ? mem_->upper_bound(*after_) : mem_->begin(); it != mem_->end() && slice_.size() < kSlice;
+             ++it) {
+            slice_.emplace_back(it->first, it->second);
+        }
+    }
+
+    std::shared_ptr<const LsmEngine::Memtable> mem_;
+    std::mutex& mtx_;
+    std::optional<std::string> after_;
+    std::vector<std::pair<std::string, std::optional<std::string>>> slice_;
+    size_t pos_ = 0;
+};
+
+// Tables read one after the other: a level 0 table alone, or a whole
+// level >= 1. Blocks are read straight from the file, so a scan or a
+// compaction doesn't push the hot blocks out of the cache.
+class TablesCursor : public LsmEngine::Cursor {
+public:
+    explicit TablesCursor(std::vector<std::shared_ptr<LsmEngine::Table>> tables,
+                          const std::optional<std::string>& after = std::nullopt)
+        : tables_(std::move(tables)) {
+        if (after) {
+            // Straight to the block that may hold the next key
+            while (table_ < tables_.size() && tables_[table_]->largest <= *after) table_++;
+            if (table_ < tables_.size()) {
+                const auto& index = tables_[table_]->index;
+                block_ = std::upper_bound(index.begin(), index.end(), *after,
+                                          [](const std::string& k, const LsmEngine::Table::Block& b) {
+                                              return k < b.last_key;
+                                          }) -
+                         index.begin();
+            }
+        }
+        advance();
+        while (after && valid_ && key_ <= *after) advance();
+    }
+    bool valid() const override { return valid_; }
+    bool failed() const override { return failed_; }
+    const std::string& key() const override { return key_; }
+    const std::optional<std::string>& value() const override { return value_; }
+    void next() override { advance(); }
+
+private:
+    void advance() {
+        for (;;) {
+            std::string_view k;
+            std::optional<std::string_view> v;
+            if (p_ < end_) {
+                if (!nextEntry(p_, end_, k, v)) return fail();
+                key_.assign(k.data(), k.size());
+                if (v) value_.emplace(v->data(), v->size());
+                else value_.reset();
+                valid_ = true;
+                return;
+            }
+            if (table_ >= tables_.size()) {
+                valid_ = false;
+                return;
+            }
+            const auto& table = *tables_[table_];
+            if (block_ >= table.index.size()) {
+                table_++;
+                block_ = 0;
+                continue;
+            }
+            const auto& entry = table.index[block_++];
+            if (!readAt(table.fd, entry.offset, entry.size, data_)) return fail();
+            p_ = data_.data();
+            end_ = p_ + data_.size();
+        }
+    }
+
+    void fail() {
+        Logger::instance().error("Storage engine: cannot read " + tables_[table_]->path);
+        valid_ = false;
+        failed_ = true;
+    }
+
+    std::vector<std::shared_ptr<LsmEngine::Table>> tables_;
+    size_t table_ = 0, block_ = 0;
+    std::string data_;
+    const char* p_ = nullptr;
+    const char* end_ = nullptr;
+    std::string key_;
+    std::optional<std::string> value_;
+    bool valid_ = false;
+    bool failed_ = false;
+};
+
+// Sources newest first: of equal keys the newest wins, the others are skipped
+class MergingCursor : public LsmEngine::Cursor {
+public:
+    explicit MergingCursor(std::vector<std::unique_ptr<LsmEngine::Cursor>> sources) : sources_(std::move(sources)) {
+        pick();
+    }
+    bool valid() const override { return current_ < sources_.size(); }
+    bool failed() const override { return failed_; }
+    const std::string& key() const override { return sources_[current_]->key(); }
+    const std::optional<std::string>& value() const override { return sources_[current_]->value(); }
+    void next() override {
+        std::string key = sources_[current_]->key();
+        for (auto& source : sources_) {
+            if (source->valid() && source->key() == key) source->next();
+        }
+        pick();
+    }
+
+private:
+    void pick() {
+        current_ = sources_.size();
+        for (const auto& source : sources_) failed_ = failed_ || source->failed();
+        if (failed_) return;
+        for (size_t i = 0; i < sources_.size(); ++i) {
+            if (!sources_[i]->valid()) continue;
+            if (current_ == sources_.size() || sources_[i]->key() < sources_[current_]->key()) current_ = i;
+        }
+    }
+
+    std::vector<std::unique_ptr<LsmEngine::Cursor>> sources_;
+    size_t current_ = 0;
+    bool failed_ = false;
+};
+
+} // namespace
+
+// Block cache
+
+std::shared_ptr<const std::string> BlockCache::lookup(uint64_t table, uint64_t offset) {
+    std::lock_guard<std::mutex> lock(mtx_);
+    auto it = slots_.find(SlotKey{table, offset});
+    if (it == slots_.end()) {
+        misses_++;
+        return nullptr;
+    }
+    hits_++;
+    lru_.splice(lru_.begin(), lru_, it->second);
+    return it->second->block;
+}
+
+void BlockCache::insert(uint64_t table, uint64_t offset, std::shared_ptr<const std::string> block) {
+    std::lock_guard<std::mutex> lock(mtx_);
+    if (capacity_ == 0 || slots_.count(SlotKey{table, offset})) return;
+    used_ += block->size();
+    lru_.push_front(Slot{table, offset, std::move(block)});
+    slots_[SlotKey{table, offset}] = lru_.begin();
+    while (used_ > capacity_ && !lru_.empty()) {
+        const Slot& victim = lru_.back();
+        used_ -= victim.block->size();
+        slots_.erase(SlotKey{victim.table, victim.offset});
+        lru_.pop_back();
+    }
+}
+
+size_t BlockCache::bytes() const {
+    std::lock_guard<std::mutex> lock(mtx_);
+    return used_;
+}
+
+// Engine
+
+LsmEngine::LsmEngine(std::string dir, Options options)
+    : dir_(std::move(dir)), options_(options), cache_(options.block_cache_bytes),
+      mem_(std::make_shared<Memtable>()), version_(std::make_shared<Version>()) {
+    std::error_code ec;
+    std::filesystem::remove_all(dir_, ec);
+    std::filesystem::create_directories(dir_, ec);
+    if (ec) throw std::runtime_error("Storage directory " + dir_ + ": " + ec.message());
+    worker_ = std::thread([this] { backgroundLoop(); });
+}
+
+LsmEngine::~LsmEngine() {
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        stop_ = true;
+    }
+    work_cv_.notify_all();
+    done_cv_.notify_all();
+    worker_.join();
+    version_.reset();  // closes the tables
+    std::error_code ec;
+    std::filesystem::remove_all(dir_, ec);
+}
+
+std::string LsmEngine::tablePath(uint64_t number) const {
+    char name[32];
+    std::snprintf(name, sizeof(name), "/%06llu.sst", static_cast<unsigned long long>(number));
+    return dir_ + name;
+}
+
+size_t LsmEngine::levelLimit(int level) const {
+    size_t limit = options_.level1_bytes;
+    for (int i = 1; i < level; ++i) limit *= 10;
+    return limit;
+}
+
+bool LsmEngine::put(const std::string& key, const std::string& value) {
+    return write(key, value);
+}
+
+void LsmEngine::remove(const std::string& key) {
+    write(key, std::nullopt);
+}
+
+bool LsmEngine::write(const std::string& key, std::optional<std::string> value) {
+    std::unique_lock<std::mutex> lock(mtx_);
+    if (mem_bytes_ >= options_.memtable_bytes) {
+        // Still full: the worker was writing out the last one when it
+        // filled. Wait for it, unless that keeps failing (the disk is
+        // full): then refuse a put, while a delete goes in over the limit
+        // rather than leave the key behind.
+        if (imm_ && !flush_failed_) {
+            write_stalls_++;
+            done_cv_.wait(lock, [&] { return !imm_ || stop_ || flush_failed_; });
+        }
+        if (imm_ && value) return false;
+        if (!imm_) freeze();
+    }
+    size_t bytes = value ? value->size() : 0;
+    auto [it, inserted] = mem_->try_emplace(key);
+    if (inserted) mem_bytes_ += key.size() + 48;  // map node, roughly
+    else if (it->second) mem_bytes_ -= it->second->size();
+    it->second = std::move(value);
+    mem_bytes_ += bytes;
+    if (mem_bytes_ >= options_.memtable_bytes && !imm_) freeze();
+    return true;
+}
+
+void LsmEngine::freeze() {
+    imm_ = std::move(mem_);
+    mem_ = std::make_shared<Memtable>();
+    mem_bytes_ = 0;
+    work_cv_.notify_one();
+}
+
+std::optional<std::string> LsmEngine::get(const std::string& key) {
+    std::shared_ptr<const Memtable> imm;
+    std::shared_ptr<const Version> version;
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        auto it = mem_->find(key);
+        if (it != mem_->end()) return it->second;
+        imm = imm_;
+        version = version_;
+    }
+    if (imm) {
+        auto it = imm->find(key);
+        if (it != imm->end()) return it->second;
+    }
+
+    uint64_t h = hash64(key);
+    std::string value;
+    auto probe = [&](const Table& table) {
+        if (!table.mayContain(h)) {
+            bloom_skips_++;
+            return 0;
+        }
+        return table.get(key, cache_, value);
+    };
+    auto result = [&](const Table& table, int found) -> std::optional<std::string> {
+        if (found < 0) {
+            Logger::instance().error("Storage engine: cannot read " + table.path);
+            throw StorageError("storage engine read failed");
+        }
+        return found == 1 ? std::optional<std::string>(std::move(value)) : std::nullopt;
+    };
+    for (const auto& table : version->levels[0]) {
+        int found = probe(*table);
+        if (found) return result(*table, found);
+    }
+    for (int level = 1; level < kLevels; ++level) {
+        const auto& tables = version->levels[level];
+        auto it = std::lower_bound(tables.begin(), tables.end(), key,
+                                   [](const std::shared_ptr<Table>& t, const std::string& k) { return t->largest < k; });
+        if (it == tables.end() || key < (*it)->smallest) continue;
+        int found = probe(**it);
+        if (found) return result(**it, found);
+    }
+    return std::nullopt;
+}
+
+std::vector<std::unique_ptr<LsmEngine::Cursor>> LsmEngine::cursors(const std::optional<std::string>& after) {
+    std::shared_ptr<const Memtable> mem, imm;
+    std::shared_ptr<const Version> version;
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        mem = mem_;
+        imm = imm_;
+        version = version_;
+    }
+    // Opening a table cursor reads its first block: not under the lock
+    std::vector<std::unique_ptr<Cursor>> sources;
+    sources.push_back(std::make_unique<LiveMemCursor>(mem, mtx_, after));
+    if (imm) sources.push_back(std::make_unique<MemCursor>(imm, after));
+    tableCursors(*version, after, sources);
+    return sources;
+}
+
+void LsmEngine::tableCursors(const Version& version, const std::optional<std::string>& after,
+                             std::vector<std::unique_ptr<Cursor>>& out) {
+    for (const auto& table : version.levels[0]) {
+        out.push_back(std::make_unique<TablesCursor>(std::vector<std::shared_ptr<Table>>{table}, after));
+    }
+    for (int level = 1; level < kLevels; ++level) {
+        if (!version.levels[level].empty()) out.push_back(std::make_unique<TablesCursor>(version.levels[level], after));
+    }
+}
+
+// The tables stay open while a view holds them, even once compacted away
+// or cleared
+struct LsmEngine::Pinned : StorageEngine::View {
+    std::shared_ptr<const Memtable> mem, imm;
+    std::shared_ptr<const Version> version;
+
+    void forEach(const std::function<bool(const std::string&, const std::string&)>& fn) override {
+        std::vector<std::unique_ptr<Cursor>> sources;
+        sources.push_back(std::make_unique<MemCursor>(mem));
+        if (imm) sources.push_back(std::make_unique<MemCursor>(imm));
+        tableCursors(*version, std::nullopt, sources);
+        MergingCursor merged(std::move(sources));
+        for (; merged.valid(); merged.next()) {
+            if (merged.value() && !fn(merged.key(), *merged.value())) return;
+        }
+        if (merged.failed()) throw StorageError("storage engine read failed");
+    }
+};
+
+std::unique_ptr<StorageEngine::View> LsmEngine::view() {
+    auto pinned = std::make_unique<Pinned>();
+    std::lock_guard<std::mutex> lock(mtx_);
+    pinned->mem = std::make_shared<const Memtable>(*mem_);
+    pinned->imm = imm_;
+    pinned->version = version_;
+    return pinned;
+}
+
+void LsmEngine::forEach(const std::function<bool(const std::string&, const std::string&)>& fn) {
+    MergingCursor merged(cursors(std::nullopt));
+    for (; merged.valid(); merged.next()) {
+        if (merged.value() && !fn(merged.key(), *merged.value())) return;
+    }
+    if (merged.failed()) throw StorageError("storage engine read failed");
+}
+
+std::vector<std::string> LsmEngine::keysAfter(const std::optional<std::string>& after, size_t count) {
+    std::vector<std::string> keys;
+    MergingCursor merged(cursors(after));
+    for (; merged.valid() && keys.size() < count; merged.next()) {
+        if (merged.value()) keys.push_back(merged.key());
+    }
+    if (merged.failed()) throw StorageError("storage engine read failed");
+    return keys;
+}
+
+void LsmEngine::clear() {
+    std::lock_guard<std::mutex> lock(mtx_);
+    generation_++;
+    for (const auto& level : version_->levels) {
+        for (const auto& table : level) table->obsolete = true;
+    }
+    version_ = std::make_shared<Version>();
+    mem_ = std::make_shared<Memtable>();
+    mem_bytes_ = 0;
+    imm_.reset();
+    flush_failed_ = false;
+    for (auto& pointer : compact_pointer_) pointer.clear();
+    done_cv_.notify_all();
+}
+
+// Background work
+
+void LsmEngine::backgroundLoop() {
+    std::unique_lock<std::mutex> lock(mtx_);
+    while (!stop_) {
+        if (imm_) {
+            flush(lock);
+            continue;
+        }
+        if (compact(lock)) continue;
+        // A memtable may have been frozen while compaction ran
+        work_cv_.wait(lock, [&] { return stop_ || imm_; });
+    }
+}
+
+bool LsmEngine::writeTables(std::vector<std::unique_ptr<Cursor>> sources, bool drop_tombstones, size_t max_bytes,
+                            std::vector<std::shared_ptr<Table>>& out) {
+    std::unique_ptr<TableBuilder> builder;
+    uint64_t number = 0;
+    bool ok = true;
+    auto finish = [&] {
+        if (!builder) return;
+        ok = builder->finish() && ok;
+        bytes_written_ += builder->size();
+        builder.reset();
+        auto table = ok ? openTable(number) : nullptr;
+        if (table) {
+            out.push_back(std::move(table));
+        } else {
+            ::unlink(tablePath(number).c_str());
+            ok = false;
+        }
+    };
+    MergingCursor merged(std::move(sources));
+    for (; ok && merged.valid(); merged.next()) {
+        if (drop_tombstones && !merged.value()) continue;
+        if (!builder) {
+            number = next_table_++;
+            builder = std::make_unique<TableBuilder>(tablePath(number), options_);
+        }
+        builder->add(merged.key(), merged.value());
+        if (builder->size() >= max_bytes) finish();
+    }
+    // An input that can't be read leaves the merge short: none of it counts
+    ok = ok && !merged.failed();
+    finish();
+    if (!ok) {
+        for (auto& table : out) table->obsolete = true;
+        out.clear();
+    }
+    return ok;
+}
+
+void LsmEngine::flush(std::unique_lock<std::mutex>& lock) {
+    auto imm = imm_;
+    uint64_t generation = generation_;
+    lock.unlock();
+    std::vector<std::unique_ptr<Cursor>> sources;
+    sources.push_back(std::make_unique<MemCursor>(imm));
+    std::vector<std::shared_ptr<Table>> tables;
+    bool ok = writeTables(std::move(sources), false, SIZE_MAX, tables);
+    lock.lock();
+
+    if (generation != generation_) {
+        for (auto& table : tables) table->obsolete = true;
+        return;
+    }
+    if (!ok) {
+        // Keep it in memory and try again in a while; puts that find the
+        // memtable full meanwhile are refused
+        Logger::instance().error("Storage engine: cannot write a table in " + dir_);
+        flush_failed_ = true;
+        done_cv_.notify_all();
+        work_cv_.wait_for(lock, std::chrono::seconds(1), [&] { return stop_; });
+        return;
+    }
+    auto next = std::make_shared<Version>(*version_);
+    next->levels[0].insert(next->levels[0].begin(), tables.begin(), tables.end());
+    version_ = std::move(next);
+    imm_.reset();
+    flush_failed_ = false;
+    flushes_++;
+    done_cv_.notify_all();
+}
+
+bool LsmEngine::compact(std::unique_lock<std::mutex>& lock) {
+    auto levelBytes = [](const std::vector<std::shared_ptr<Table>>& tables) {
+        size_t bytes = 0;
+        for (const auto& table : tables) bytes += table->file_size;
+        return bytes;
+    };
+
+    const Version& version = *version_;
+    int level = -1;
+    if (version.levels[0].size() >= options_.level0_tables) {
+        level = 0;
+    } else {
+        for (int l = 1; l < kLevels - 1 && level < 0; ++l) {
+            if (levelBytes(version.levels[l]) > levelLimit(l)) level = l;
+        }
+    }
+    if (level < 0) return false;
+
+    // Inputs: all of level 0, or the next table of level n round robin;
+    // plus whatever they overlap in the level below
+    std::vector<std::shared_ptr<Table>> inputs, overlap;
+    if (level == 0) {
+        inputs = version.levels[0];
+    } else {
+        const auto& tables = version.levels[level];
+        auto it = std::find_if(tables.begin(), tables.end(),
+                               [&](const std::shared_ptr<Table>& t) { return t->smallest > compact_pointer_[level]; });
+        if (it == tables.end()) it = tables.begin();
+        inputs.push_back(*it);
+        compact_pointer_[level] = (*it)->largest;
+    }
+    std::string lo = inputs[0]->smallest, hi = inputs[0]->largest;
+    for (const auto& table : inputs) {
+        lo = std::min(lo, table->smallest);
+        hi = std::max(hi, table->largest);
+    }
+    for (const auto& table : version.levels[level + 1]) {
+        if (!(table->largest < lo || table->smallest > hi)) overlap.push_back(table);
+    }
+    // Tombstones have nothing left to hide once nothing lies below
+    bool bottom = true;
+    for (int l = level + 2; l < kLevels; ++l) bottom = bottom && version.levels[l].empty();
+    uint64_t generation = generation_;
+    lock.unlock();
+
+    std::vector<std::unique_ptr<Cursor>> sources;
+    if (level == 0) {
+        for (const auto& table : inputs) {
+            sources.push_back(std::make_unique<TablesCursor>(std::vector<std::shared_ptr<Table>>{table}));
+        }
+    } else {
+        sources.push_back(std::make_unique<TablesCursor>(inputs));
+    }
+    sources.push_back(std::make_unique<TablesCursor>(overlap));
+    std::vector<std::shared_ptr<Table>> outputs;
+    bool ok = writeTables(std::move(sources), bottom, options_.table_bytes, outputs);
+    lock.lock();
+
+    if (generation != generation_) {
+        for (auto& table : outputs) table->obsolete = true;
+        return true;
+    }
+    if (!ok) {
+        Logger::instance().error("Storage engine: compaction failed in " + dir_ + ", keeping its inputs");
+        work_cv_.wait_for(lock, std::chrono::seconds(1), [&] { return stop_; });
+        return false;
+    }
+
+    // Only this thread removes tables, so the inputs are all still there
+    // (new level 0 tables may have arrived in front of them)
+    auto next = std::make_shared<Version>(*version_);
+    auto drop = [](std::vector<std::shared_ptr<Table>>& from, const std::vector<std::shared_ptr<Table>>& gone) {
+        from.erase(std::remove_if(from.begin(), from.end(),
+                                  [&](const std::shared_ptr<Table>& t) {
+                                      return std::find(gone.begin(), gone.end(), t) != gone.end();
+                                  }),
+                   from.end());
+        for (const auto& table : gone) table->obsolete = true;
+    };
+    drop(next->levels[level], inputs);
+    drop(next->levels[level + 1], overlap);
+    auto& below = next->levels[level + 1];
+    below.insert(below.end(), outputs.begin(), outputs.end());
+    std::sort(below.begin(), below.end(),
+              [](const std::shared_ptr<Table>& a, const std::shared_ptr<Table>& b) { return a->smallest < b->smallest; });
+    version_ = std::move(next);
+    compactions_++;
+    return true;
+}
+
+std::string LsmEngine::info() const {
+    std::lock_guard<std::mutex> lock(mtx_);
+    std::string out = "Storage engine: lsm, memtable " + std::to_string(mem_bytes_) + " bytes";
+    for (int level = 0; level < kLevels; ++level) {
+        const auto& tables = version_->levels[level];
+        if (tables.empty()) continue;
+        size_t bytes = 0;
+        for (const auto& table : tables) bytes += table->file_size;
+        out += ", L" + std::to_string(level) + " " + std::to_string(tables.size()) + " tables " +
+               std::to_string(bytes) + " bytes";
+    }
+    out += "\nBlock cache: " + std::to_string(cache_.bytes()) + "/" + std::to_string(cache_.capacity()) +
+           " bytes, hits: " + std::to_string(cache_.hits()) + ", misses: " + std::to_string(cache_.misses()) +
+           ", bloom skips: " + std::to_string(bloom_skips_.load()) + "\n";
+    out += "Compaction: flushes: " + std::to_string(flushes_.load()) + ", compactions: " +
+           std::to_string(compactions_.load()) + ", bytes written: " + std::to_string(bytes_written_.load()) +
+           ", write stalls: " + std::to_string(write_stalls_.load()) + "\n";
+    return out;
+}
+
+} // namespace keyforge
@@ -0,0 +1,385 @@
+#include "keyforge/MappedTable.hpp"
+#include "keyforge/HashRing.hpp"
+#include "keyforge/Logger.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <iterator>
+#include <set>
+#include <string_view>
+#include <stdexcept>
+#include <system_error>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace keyforge {
+
+namespace {
+
+constexpr uint64_t kMagic = 0x4b464d4150544231ULL;  // "KFMAPTB1"
+constexpr uint32_t kFormat = 1;
+constexpr uint64_t kHeaderBytes = 4096;
+constexpr uint64_t kMinSlots = 1 << 14;
+constexpr uint64_t kMinArena = 16 << 20;
+constexpr uint64_t kEmpty = 0;
+constexpr uint64_t kDeleted = 1;
+constexpr uint64_t kRecordHeader = 8;  // key length, value length
+
+// Out of slots or arena space with no way to get more: the table stays as
+// it was, and the caller keeps what it wanted to put there
+bool fail(const std::string& path, const char* what) {
+    Logger::instance().error("Mapped table " + path + ": " + what + ": " + std::strerror(errno));
+    return false;
+}
+
+} // namespace
+
+struct MappedTable::Header {
+    uint64_t magic;
+    uint32_t format;
+    uint32_t clean;        // set by persist(), cleared by the next change
+    uint64_t file_size;
+    uint64_t slot_count;   // a power of two
+    uint64_t arena_offset;  // right after the slots
+    uint64_t arena_bytes;
+    uint64_t arena_used;
+    uint64_t dead_bytes;   // in replaced or deleted records
+    uint64_t live;         // keys
+    uint64_t deleted;      // slots marked kDeleted
+};
+static_assert(sizeof(MappedTable::Header) <= kHeaderBytes, "header must fit its page");
+
+MappedTable::MappedTable(std::string home, size_t instance)
+    : home_(std::move(home)), path_(instance == 0 ? home_ : home_ + "." + std::to_string(instance)) {
+    std::error_code ec;
+    auto dir = std::filesystem::path(home_).parent_path();
+    if (!dir.empty()) std::filesystem::create_directories(dir, ec);
+
+    auto start = std::chrono::steady_clock::now();
+    if (instance == 0 && adopt()) {
+        restored_ = header()->live;
+        open_ms_ = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        Logger::instance().info("Mapped table: " + path_ + ": " + std::to_string(restored_) + " keys mapped in " +
+                                std::to_string(static_cast<long>(open_ms_)) + " ms");
+        return;
+    }
+    if (instance == 0 && std::filesystem::exists(path_, ec)) {
+        Logger::instance().warn("Mapped table: " + path_ + " was not closed cleanly, starting empty");
+    }
+    if (!rebuild(kMinSlots, kMinArena, false)) throw std::runtime_error("Mapped table " + path_ + ": cannot create it");
+}
+
+MappedTable::~MappedTable() {
+    unmap();
+    if (!persisted_) ::unlink(path_.c_str());
+}
+
+bool MappedTable::adopt() {
+    int fd = ::open(path_.c_str(), O_RDWR | O_CLOEXEC);
+    if (fd < 0) return false;
+    struct stat st {};
+    if (::fstat(fd, &st) != 0 || static_cast<uint64_t>(st.st_size) < kHeaderBytes) {
+        ::close(fd);
+        return false;
+    }
+    size_t size = static_cast<size_t>(st.st_size);
+    void* base = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED) {
+        ::close(fd);
+        return false;
+    }
+
+    const auto* h = static_cast<const Header*>(base);
+    bool valid = h->magic == kMagic && h->format == kFormat && h->clean == 1 && h->file_size == size &&
+                 h->slot_count > 0 && (h->slot_count & (h->slot_count - 1)) == 0 &&
+                 h->slot_count <= (size - kHeaderBytes) / sizeof(Slot) &&
+                 h->arena_offset == kHeaderBytes + h->slot_count * sizeof(Slot) &&
+                 h->arena_offset + h->arena_bytes == size && h->arena_used <= h->arena_bytes &&
+                 h->dead_bytes <= h->arena_used && h->live + h->deleted < h->slot_count;
+    if (!valid) {
+        ::munmap(base, size);
+        ::close(fd);
+        return false;
+    }
+    fd_ = fd;
+    base_ = static_cast<char*>(base);
+    mapped_ = size;
+    persisted_ = true;  // until the next change
+    dirty();            // a crash from here on must not look clean
+    return true;
+}
+
+bool MappedTable::rebuild(uint64_t slot_count, uint64_t arena, bool copy) {
+    std::string next = path_ + ".rebuild";
+    int fd = ::open(next.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) return fail(next, "open");
+    uint64_t arena_offset = kHeaderBytes + slot_count * sizeof(Slot);
+    size_t size = static_cast<size_t>(arena_offset + arena);
+    // Allocated up front: a page of a sparse file with no disk space left
+    // for it would fail when first written to, as a SIGBUS
+    if (int err = ::posix_fallocate(fd, 0, static_cast<off_t>(size)); err != 0) {
+        ::close(fd);
+        ::unlink(next.c_str());
+        errno = err;
+        return fail(next, "posix_fallocate");
+    }
+    void* mapped = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (mapped == MAP_FAILED) {
+        ::close(fd);
+        ::unlink(next.c_str());
+        return fail(next, "mmap");
+    }
+
+    char* base = static_cast<char*>(mapped);
+    auto* h = reinterpret_cast<Header*>(base);
+    *h = Header{kMagic, kFormat, 0, size, slot_count, arena_offset, arena, 0, 0, 0, 0};
+    auto* table = reinterpret_cast<Slot*>(base + kHeaderBytes);
+    if (copy && base_) {
+        // Live records only, packed at the start of the new arena
+        const Slot* old = slots();
+        for (uint64_t i = 0; i < header()->slot_count; ++i) {
+            const char *key = nullptr, *value = nullptr;
+            uint32_t key_len = 0, value_len = 0;
+            if (old[i].offset <= kDeleted || !record(old[i].offset, key, key_len, value, value_len)) continue;
+            uint64_t bytes = kRecordHeader + key_len + value_len;
+            uint64_t offset = arena_offset + h->arena_used;
+            std::memcpy(base + offset, key - kRecordHeader, bytes);
+            h->arena_used += bytes;
+            uint64_t j = old[i].hash & (slot_count - 1);
+            while (table[j].offset != kEmpty) j = (j + 1) & (slot_count - 1);
+            table[j] = Slot{old[i].hash, offset};
+            h->live++;
+        }
+        rebuilds_++;
+    }
+    if (::rename(next.c_str(), path_.c_str()) != 0) {
+        ::munmap(mapped, size);
+        ::close(fd);
+        ::unlink(next.c_str());
+        return fail(path_, "rename");
+    }
+    unmap();
+    fd_ = fd;
+    base_ = base;
+    mapped_ = size;
+    persisted_ = false;
+    return true;
+}
+
+void MappedTable::unmap() {
+    if (base_) ::munmap(base_, mapped_);
+    if (fd_ >= 0) ::close(fd_);
+    base_ = nullptr;
+    fd_ = -1;
+    mapped_ = 0;
+}
+
+void MappedTable::dirty() {
+    if (!header()->clean) return;
+    header()->clean = 0;
+    ::msync(base_, kHeaderBytes, MS_SYNC);
+    persisted_ = false;
+}
+
+MappedTable::Slot* MappedTable::slots() const {
+    return reinterpret_cast<Slot*>(base_ + kHeaderBytes);
+}
+
+bool MappedTable::record(uint64_t offset, const char*& key, uint32_t& key_len, const char*& value,
+                         uint32_t& value_len) const {
+    const Header* h = header();
+    uint64_t end = h->arena_offset + h->arena_used;
+    if (offset < h->arena_offset || offset + kRecordHeader > end) return false;
+    std::memcpy(&key_len, base_ + offset, 4);
+    std::memcpy(&value_len, base_ + offset + 4, 4);
+    if (offset + kRecordHeader + key_len + value_len > end) return false;
+    key = base_ + offset + kRecordHeader;
+    value = key + key_len;
+    return true;
+}
+
+MappedTable::Slot* MappedTable::find(const std::string& key, uint64_t hash, bool& found) const {
+    uint64_t mask = header()->slot_count - 1;
+    Slot* table = slots();
+    Slot* free = nullptr;
+    found = false;
+    for (uint64_t i = hash & mask, n = 0; n <= mask; i = (i + 1) & mask, ++n) {
+        Slot& slot = table[i];
+        if (slot.offset == kEmpty) return free ? free : &slot;
+        if (slot.offset == kDeleted) {
+            if (!free) free = &slot;
+            continue;
+        }
+        const char *k = nullptr, *v = nullptr;
+        uint32_t key_len = 0, value_len = 0;
+        if (slot.hash == hash && record(slot.offset, k, key_len, v, value_len) && key_len == key.size() &&
+            std::memcmp(k, key.data(), key_len) == 0) {
+            found = true;
+            return &slot;
+        }
+    }
+    return free;
+}
+
+bool MappedTable::put(const std::string& key, const std::string& value) {
+    std::lock_guard<std::mutex> lock(mtx_);
+    if (key.size() > UINT32_MAX || value.size() > UINT32_MAX) return false;
+    dirty();
+    uint64_t bytes = kRecordHeader + key.size() + value.size();
+    Header* h = header();
+    // Slots at most 70% used (deleted ones included), and room in the arena
+    if (h->arena_used + bytes > h->arena_bytes || (h->live + h->deleted + 1) * 10 > h->slot_count * 7) {
+        uint64_t live_bytes = h->arena_used - h->dead_bytes + bytes;
+        uint64_t slot_count = kMinSlots;
+        while ((h->live + 1) * 10 > slot_count * 7 / 2) slot_count *= 2;  // half full after the rebuild
+        if (!rebuild(slot_count, std::max(kMinArena, live_bytes * 2), true)) return false;
+        h = header();
+    }
+
+    uint64_t hash = hash64(key);
+    bool found = false;
+    Slot* slot = find(key, hash, found);
+    uint64_t offset = h->arena_offset + h->arena_used;
+    uint32_t key_len = static_cast<uint32_t>(key.size()), value_len = static_cast<uint32_t>(value.size());
+    std::memcpy(base_ + offset, &key_len, 4);
+    std::memcpy(base_ + offset + 4, &value_len, 4);
+    std::memcpy(base_ + offset + kRecordHeader, key.data(), key.size());
+    std::memcpy(base_ + offset + kRecordHeader + key.size(), value.data(), value.size());
+    h->arena_used += bytes;
+
+    if (found) {
+        const char *k = nullptr, *v = nullptr;
+        uint32_t old_key = 0, old_value = 0;
+        if (record(slot->offset, k, old_key, v, old_value)) h->dead_bytes += kRecordHeader + old_key + old_value;
+    } else {
+        if (slot->offset == kDeleted) h->deleted--;
+        h->live++;
+        slot->hash = hash;
+    }
+    slot->offset = offset;
+    return true;
+}
+
+void MappedTable::remove(const std::string& key) {
+    std::lock_guard<std::mutex> lock(mtx_);
+    bool found = false;
+    Slot* slot = find(key, hash64(key), found);
+    if (!found) return;
+    dirty();
+    Header* h = header();
+    const char *k = nullptr, *v = nullptr;
+    uint32_t key_len = 0, value_len = 0;
+    if (record(slot->offset, k, key_len, v, value_len)) h->dead_bytes += kRecordHeader + key_len + value_len;
+    slot->offset = kDeleted;
+    h->live--;
+    h->deleted++;
+}
+
+std::optional<std::string> MappedTable::get(const std::string& key) {
+    std::lock_guard<std::mutex> lock(mtx_);
+    bool found = false;
+    Slot* slot = find(key, hash64(key), found);
+    const char *k = nullptr, *v = nullptr;
+    uint32_t key_len = 0, value_len = 0;
+    if (!found || !record(slot->offset, k, key_len, v, value_len)) return std::nullopt;
+    return std::string(v, value_len);
+}
+
+void MappedTable::forEach(const std::function<bool(const std::string&, const std::string&)>& fn) {
+    std::lock_guard<std::mutex> lock(mtx_);
+    const Slot* table = slots();
+    std::string key, value;
+    for (uint64_t i = 0; i < header()->slot_count; ++i) {
+        const char *k = nullptr, *v = nullptr;
+        uint32_t key_len = 0, value_len = 0;
+        if (table[i].offset <= kDeleted || !record(table[i].offset, k, key_len, v, value_len)) continue;
+        key.assign(k, key_len);
+        value.assign(v, value_len);
+        if (!fn(key, value)) return;
+    }
+}
+
+std::vector<std::string> MappedTable::keysAfter(const std::optional<std::string>& after, size_t count) {
+    // Slots are in hash order: every key is looked at, the smallest kept
+    std::lock_guard<std::mutex> lock(mtx_);
+    const Slot* table = slots();
+    std::set<std::string> keys;
+    for (uint64_t i = 0; i < header()->slot_count && count > 0; ++i) {
+        const char *k = nullptr, *v = nullptr;
+        uint32_t key_len = 0, value_len = 0;
+        if (table[i].offset <= kDeleted || !record(table[i].offset, k, key_len, v, value_len)) continue;
+        std::string_view key(k, key_len);
+        if (after && key <= *after) continue;
+        if (keys.size() == count && key >= *keys.rbegin()) continue;
+        keys.emplace(key);
+        if (keys.size() > count) keys.erase(std::prev(keys.end()));
+    }
+    return {keys.begin(), keys.end()};
+}
+
+namespace {
+
+struct CopiedView : StorageEngine::View {
+    std::vector<std::pair<std::string, std::string>> pairs;
+
+    void forEach(const std::function<bool(const std::string&, const std::string&)>& fn) override {
+        for (const auto& [key, value] : pairs) {
+            if (!fn(key, value)) return;
+        }
+    }
+};
+
+} // namespace
+
+std::unique_ptr<StorageEngine::View> MappedTable::view() {
+    auto copy = std::make_unique<CopiedView>();
+    forEach([&](const std::string& key, const std::string& value) {
+        copy->pairs.emplace_back(key, value);
+        return true;
+    });
+    return copy;
+}
+
+void MappedTable::clear() {
+    std::lock_guard<std::mutex> lock(mtx_);
+    if (rebuild(kMinSlots, kMinArena, false)) return;
+    // No room for a new file: empty this one where it is
+    dirty();
+    Header* h = header();
+    std::memset(slots(), 0, h->slot_count * sizeof(Slot));
+    h->arena_used = h->dead_bytes = h->live = h->deleted = 0;
+}
+
+bool MappedTable::persist() {
+    std::lock_guard<std::mutex> lock(mtx_);
+    if (::msync(base_, mapped_, MS_SYNC) != 0) return false;
+    header()->clean = 1;
+    if (::msync(base_, kHeaderBytes, MS_SYNC) != 0) return false;
+    if (path_ != home_) {
+        if (::rename(path_.c_str(), home_.c_str()) != 0) return false;
+        path_ = home_;
+    }
+    persisted_ = true;
+    return true;
+}
+
+std::string MappedTable::info() const {
+    std::lock_guard<std::mutex> lock(mtx_);
+    const Header* h = header();
+    char ms[32];
+    std::snprintf(ms, sizeof(ms), "%.1f", open_ms_);
+    return "Storage engine: mmap " + path_ + ", " + std::to_string(h->live) + " keys, " +
+           std::to_string(h->slot_count) + " slots, arena " + std::to_string(h->arena_used) + "/" +
+           std::to_string(h->arena_bytes) + " bytes (" + std::to_string(h->dead_bytes) + " dead), rebuilds: " +
+           std::to_string(rebuilds_) + "\n" + "Restart: " + std::to_string(restored_) + " keys mapped in " + ms +
+           " ms\n";
+}
+
+} // namespace keyforge
@@ -0,0 +1,132 @@
+#include "keyforge/Net.hpp"
+
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+namespace keyforge {
+namespace net {
+
+int connectTo(const std::string& host, int port) {
+    addrinfo hints{};
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+
+    addrinfo* res = nullptr;
+    std::string port_str = std::to_string(port);
+    if (getaddrinfo(host.c_str(), port_str.c_str(), &hints, &res) != 0) return -1;
+
+    int fd = -1;
+    for (addrinfo* ai = res; ai != nullptr; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd < 0) continue;
+        if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) break;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+
+    if (fd >= 0) {
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    return fd;
+}
+
+bool sendAll(int fd, const char* data, size_t len) {
+    size_t total_sent = 0;
+    while (total_sent < len) {
+        ssize_t sent = send(fd, data + total_sent, len - total_sent, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR) continue;
+        if (sent <= 0) return false;
+        total_sent += sent;
+    }
+    return true;
+}
+
+bool sendAll(int fd, const std::vector<const std::string*>& parts) {
+    std::vector<iovec> iov;
+    size_t next = 0;  // first part not yet in iov
+    size_t offset = 0;  // bytes of iov[0] already sent
+    while (next < parts.size() || !iov.empty()) {
+        while (next < parts.size() && iov.size() < IOV_MAX) {
+            iov.push_back({const_cast<char*>(parts[next]->data()), parts[next]->size()});
+            next++;
+        }
+        iov[0].iov_base = static_cast<char*>(iov[0].iov_base) + offset;
+        iov[0].iov_len -= offset;
+
+        msghdr msg{};
+        msg.msg_iov = iov.data();
+        msg.msg_iovlen = iov.size();
+        ssize_t sent = sendmsg(fd, &msg, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR) {
+            offset = 0;
+            continue;
+        }
+        if (sent <= 0) return false;
+
+        // Drop the buffers that went out completely
+        size_t done = 0;
+        size_t left = static_cast<size_t>(sent);
+        while (done < iov.size() && left >= iov[done].iov_len) left -= iov[done++].iov_len;
+        iov.erase(iov.begin(), iov.begin() + done);
+        offset = left;
+    }
+    return true;
+}
+
+LineReader::Status LineReader::fill(int timeout_ms) {
+    pollfd pfd{fd_, POLLIN, 0};
+    int rc = poll(&pfd, 1, timeout_ms);
+    if (rc == 0) return Status::TIMEOUT;
+    if (rc < 0) return errno == EINTR ? Status::TIMEOUT : Status::CLOSED;
+
+    // Compact consumed prefix before growing the buffer
+    if (pos_ > 0) {
+        buf_.erase(0, pos_);
+        pos_ = 0;
+    }
+
+    char chunk[16384];
+    ssize_t n = recv(fd_, chunk, sizeof(chunk), 0);
+    if (n < 0 && (errno == EINTR || errno == EAGAIN)) return Status::TIMEOUT;
+    if (n <= 0) return Status::CLOSED;
+    buf_.append(chunk, static_cast<size_t>(n));
+    return Status::OK;
+}
+
+LineReader::Status LineReader::readLine(std::string& line, int timeout_ms) {
+    while (true) {
+        size_t nl = buf_.find('\n', pos_);
+        if (nl != std::string::npos) {
+            size_t end = nl;
+            if (end > pos_ && buf_[end - 1] == '\r') end--;
+            line.assign(buf_, pos_, end - pos_);
+            pos_ = nl + 1;
+            return Status::OK;
+        }
+        Status st = fill(timeout_ms);
+        if (st != Status::OK) return st;
+    }
+}
+
+LineReader::Status LineReader::readExact(size_t n, std::string& out, int timeout_ms) {
+    while (buffered() < n) {
+        Status st = fill(timeout_ms);
+        if (st != Status::OK) return st;
+    }
+    out.assign(buf_, pos_, n);
+    pos_ += n;
+    return Status::OK;
+}
+
+} // namespace net
+} // namespace keyforge
@@ -0,0 +1,449 @@
+#include "keyforge/Proxy.hpp"
+#include "keyforge/Logger.hpp"
+#include "keyforge/Net.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <iostream>
+#include <unistd.h>
+#include <poll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+namespace keyforge {
+
+namespace {
+void sendAllFd(int fd, const std::string& msg) {
+    size_t total_sent = 0;
+    while (total_sent < msg.size()) {
+        ssize_t sent = send(fd, msg.data() + total_sent, msg.size() - total_sent, MSG_NOSIGNAL);
+        if (sent <= 0) break;
+        total_sent += sent;
+    }
+}
+
+const char* kUnknownCommand =
+    "ERROR: Unknown command\nValid Commands : [GET, PUT, UPDATE, DELETE, INCR, DECR, INCRBY, INCRBYFLOAT, GETV, CAS, "
+    "MGET, MSET, SCAN, GET_KEY, LPUSH, RPUSH, LPOP, RPOP, LSET, LINDEX, LRANGE, LLEN, HSET, HGET, HDEL, "
+    "HGETALL, HLEN, ZADD, ZREM, ZSCORE, ZRANK, ZRANGE, ZCARD, TYPE, AUTH, PROXYINFO]\n";
+
+// Forwarded unchanged to the node owning their first argument
+bool isSingleKey(const std::string& cmd) {
+    return cmd == "GET" || cmd == "PUT" || cmd == "UPDATE" || cmd == "DELETE" ||
+           cmd == "INCR" || cmd == "DECR" || cmd == "INCRBY" || cmd == "INCRBYFLOAT" ||
+           cmd == "GETV" || cmd == "CAS" || cmd == "TYPE" ||
+           cmd == "LPUSH" || cmd == "RPUSH" || cmd == "LPOP" || cmd == "RPOP" || cmd == "LSET" ||
+           cmd == "LINDEX" || cmd == "LRANGE" || cmd == "LLEN" ||
+           cmd == "HSET" || cmd == "HGET" || cmd == "HDEL" || cmd == "HGETALL" || cmd == "HLEN" ||
+           cmd == "ZADD" || cmd == "ZREM" || cmd == "ZSCORE" || cmd == "ZRANK" || cmd == "ZRANGE" || cmd == "ZCARD";
+}
+} // namespace
+
+Proxy::Proxy(int port, const std::vector<Client::Node>& backends, size_t pool_size,
+             const std::string& token)
+    : port_(port), token_(token), pool_size_(pool_size == 0 ? 1 : pool_size) {
+    rebuildPool(backends);
+}
+
+void Proxy::rebuildPool(const std::vector<Client::Node>& backends) {
+    std::vector<std::shared_ptr<Client>> fresh;
+    for (size_t i = 0; i < pool_size_; ++i) {
+        auto client = std::make_shared<Client>(backends);
+        if (!token_.empty()) {
+            // The token is kept for reconnects even if a node is down right now
+            try {
+                client->auth(token_);
+            } catch (const std::exception& e) {
+                Logger::instance().warn(std::string("Proxy: ") + e.what());
+            }
+        }
+        fresh.push_back(std::move(client));
+    }
+
+    // Clients of the old pool that are in use are dropped once released
+    {
+        std::lock_guard<std::mutex> lock(pool_mtx_);
+        backends_ = backends;
+        pool_ = fresh;
+        idle_ = std::move(fresh);
+    }
+    pool_cv_.notify_all();
+}
+
+void Proxy::watchMembership(std::chrono::milliseconds interval) {
+    watcher_ = std::thread([this, interval] {
+        auto name = [](const std::vector<Client::Node>& nodes) {
+            std::vector<std::string> names;
+            for (const auto& n : nodes) names.push_back(n.host + ":" + std::to_string(n.port));
+            std::sort(names.begin(), names.end());
+            return names;
+        };
+
+        while (!shutdown_requested_.load()) {
+            std::vector<Client::Node> current;
+            {
+                std::lock_guard<std::mutex> lock(pool_mtx_);
+                current = backends_;
+            }
+            // Any member that answers has the gossip view
+            for (const auto& node : current) {
+                std::vector<Client::Node> live;
+                try {
+                    live = Client::discover(node.host, node.port);
+                } catch (const std::exception&) {
+                    continue;
+                }
+                if (!live.empty() && name(live) != name(current)) {
+                    Logger::instance().info("Proxy: membership changed, now " + std::to_string(live.size()) + " nodes");
+                    rebuildPool(live);
+                    topology_changes_++;
+                }
+                break;
+            }
+
+            auto until = std::chrono::steady_clock::now() + interval;
+            while (!shutdown_requested_.load() && std::chrono::steady_clock::now() < until) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(50));
+            }
+        }
+    });
+}
+
+Proxy::~Proxy() {
+    if (server_fd_ != -1) close(server_fd_);
+    shutdown_requested_.store(true);
+    if (watcher_.joinable()) watcher_.join();
+    std::lock_guard<std::mutex> lock(workers_mutex_);
+    for (auto& w : workers_) {
+        if (w.joinable()) w.join();
+    }
+}
+
+void Proxy::requestShutdown() {
+    shutdown_requested_.store(true);
+    if (server_fd_ != -1) {
+        shutdown(server_fd_, SHUT_RDWR);
+        close(server_fd_);
+        server_fd_ = -1;
+    }
+}
+
+std::shared_ptr<Client> Proxy::acquire() {
+    std::unique_lock<std::mutex> lock(pool_mtx_);
+    if (idle_.empty()) pool_waits_++;
+    pool_cv_.wait(lock, [&] { return !idle_.empty(); });
+    auto client = std::move(idle_.back());
+    idle_.pop_back();
+    return client;
+}
+
+void Proxy::release(std::shared_ptr<Client> client) {
+    {
+        std::lock_guard<std::mutex> lock(pool_mtx_);
+        if (std::find(pool_.begin(), pool_.end(), client) == pool_.end()) return;  // replaced meanwhile
+        idle_.push_back(std::move(client));
+    }
+    pool_cv_.notify_one();
+}
+
+std::string Proxy::mget(Client& client, std::istringstream& args) {
+    std::vector<std::string> keys;
+    std::string key;
+    while (args >> key) keys.push_back(key);
+    if (keys.empty()) return "ERROR Usage: MGET key [key ...]\n";
+
+    fanouts_++;
+    std::string reply;
+    auto values = client.mget(keys);
+    for (size_t i = 0; i < values.size(); ++i) {
+        if (i > 0) reply += ' ';
+        reply += values[i] ? *values[i] : "NOT_FOUND";
+    }
+    return reply + "\n";
+}
+
+std::string Proxy::mset(Client& client, std::istringstream& args) {
+    std::vector<std::pair<std::string, std::string>> kvs;
+    std::string key, value;
+    while (args >> key >> value) kvs.emplace_back(key, value);
+    if (kvs.empty()) return "ERROR Usage: MSET key value [key value ...]\n";
+
+    fanouts_++;
+    size_t stored = client.mput(kvs);
+    if (stored == kvs.size()) return "OK\n";
+    return "ERROR MSET stored " + std::to_string(stored) + " of " + std::to_string(kvs.size()) + " keys\n";
+}
+
+std::string Proxy::scan(Client& client, std::istringstream& args) {
+    std::string cursor, opt;
+    size_t count = 10;
+    args >> cursor >> opt;
+    if (opt == "COUNT") args >> count;
+    if (count == 0) count = 1;
+
+    // "0" starts every node; otherwise one cursor per node, "-" = finished
+    size_t nodes = client.nodeCount();
+    std::vector<std::string> node_cursor(nodes, "0");
+    if (!cursor.empty() && cursor != "0") {
+        std::istringstream parts(cursor);
+        std::string part;
+        size_t i = 0;
+        while (std::getline(parts, part, ',')) {
+            if (i < node_cursor.size()) node_cursor[i] = part;
+            i++;
+        }
+        if (i != node_cursor.size()) return "ERROR Invalid SCAN cursor\n";
+    }
+
+    size_t active = 0;
+    for (const auto& c : node_cursor) active += (c != "-");
+    if (active == 0) return "0\n";
+    size_t per_node = std::max<size_t>(1, count / active);
+
+    std::vector<std::vector<std::string>> cmds(nodes);
+    for (size_t i = 0; i < nodes; ++i) {
+        if (node_cursor[i] != "-") {
+            cmds[i].push_back("SCAN " + node_cursor[i] + " COUNT " + std::to_string(per_node));
+        }
+    }
+
+    fanouts_++;
+    std::string keys;
+    auto replies = client.fanOut(cmds);
+    for (size_t i = 0; i < nodes; ++i) {
+        if (replies[i].empty()) continue;
+        std::istringstream line(replies[i].front());
+        std::string next, key;
+        line >> next;
+        if (next.empty() || !std::isdigit(static_cast<unsigned char>(next[0]))) {
+            return "ERROR backend SCAN failed: " + replies[i].front() + "\n";
+        }
+        node_cursor[i] = next == "0" ? "-" : next;
+        while (line >> key) keys += " " + key;
+    }
+    bool done = true;
+    for (const auto& c : node_cursor) done = done && c == "-";
+
+    std::string next_cursor = "0";
+    if (!done) {
+        next_cursor.clear();
+        for (size_t i = 0; i < nodes; ++i) {
+            if (i > 0) next_cursor += ',';
+            next_cursor += node_cursor[i];
+        }
+    }
+    return next_cursor + keys + "\n";
+}
+
+std::string Proxy::getKey(Client& client, const std::string& value) {
+    // Any node may hold the value: ask all of them
+    std::vector<std::vector<std::string>> cmds(client.nodeCount(), {"GET_KEY " + value});
+    fanouts_++;
+    for (const auto& node_replies : client.fanOut(cmds)) {
+        if (node_replies.front() != "NOT_FOUND") return node_replies.front() + "\n";
+    }
+    return "NOT_FOUND\n";
+}
+
+std::string Proxy::info() {
+    uint64_t requests = requests_.load();
+    std::string out;
+    {
+        std::lock_guard<std::mutex> lock(pool_mtx_);
+        out = "Backends: " + std::to_string(backends_.size()) + "\n";
+    }
+    out += "Topology changes: " + std::to_string(topology_changes_.load()) + "\n";
+    out += "Pool size: " + std::to_string(pool_size_) + " (waits " + std::to_string(pool_waits_.load()) + ")\n";
+    out += "Connected clients: " + std::to_string(connected_clients_.load()) + "\n";
+    out += "Requests: " + std::to_string(requests) + "\n";
+    out += "Forwarded batches: " + std::to_string(forwarded_batches_.load()) + "\n";
+    out += "Fan-out requests: " + std::to_string(fanouts_.load()) + "\n";
+    out += "Backend errors: " + std::to_string(backend_errors_.load()) + "\n";
+    out += "Avg time per request: " + std::to_string(requests ? busy_us_.load() / requests : 0) + " us\n";
+    return out;
+}
+
+std::string Proxy::execute(Client& client, bool& authenticated, const std::string& line) {
+    std::istringstream iss(line);
+    std::string cmd, key;
+    iss >> cmd;
+
+    if (isSingleKey(cmd)) {
+        iss >> key;
+        if ((cmd == "UPDATE" || cmd == "DELETE") && !authenticated) {
+            return "ERROR Unauthorized. Please AUTH first.\n";
+        }
+        if (key.empty()) return "ERROR Usage: " + cmd + " key\n";
+        return client.batch({key}, {line}).front() + "\n";
+    }
+    if (cmd == "MGET") return mget(client, iss);
+    if (cmd == "MSET") return mset(client, iss);
+    if (cmd == "SCAN") return scan(client, iss);
+    if (cmd == "GET_KEY") {
+        std::string value;
+        iss >> value;
+        return getKey(client, value);
+    }
+    if (cmd == "AUTH") {
+        std::string token;
+        iss >> token;
+        authenticated = !token_.empty() && token == token_;
+        return authenticated ? "OK Authenticated\n" : "ERROR Invalid token\n";
+    }
+    if (cmd == "PROXYINFO") return info();
+    return kUnknownCommand;
+}
+
+void Proxy::processLines(bool& authenticated, const std::vector<std::string>& lines, std::string& out) {
+    auto start = std::chrono::steady_clock::now();
+    auto lease = acquire();
+    Client& client = *lease;
+
+    // Consecutive single-key commands go out as one pipelined batch. A failed
+    // batch gets one error line per command, so replies stay aligned.
+    std::vector<std::string> batch_keys, batch_cmds;
+    auto flush = [&] {
+        if (batch_cmds.empty()) return;
+        forwarded_batches_++;
+        try {
+            for (const auto& reply : client.batch(batch_keys, batch_cmds)) out += reply + "\n";
+        } catch (const std::exception& e) {
+            backend_errors_++;
+            for (size_t i = 0; i < batch_cmds.size(); ++i) out += std::string("ERROR backend: ") + e.what() + "\n";
+        }
+        batch_keys.clear();
+        batch_cmds.clear();
+    };
+
+    for (const auto& line : lines) {
+        requests_++;
+        std::istringstream iss(line);
+        std::string cmd, key;
+        iss >> cmd >> key;
+        bool batchable = !key.empty() &&
+                         isSingleKey(cmd) && ((cmd != "UPDATE" && cmd != "DELETE") || authenticated);
+        if (batchable) {
+            batch_keys.push_back(key);
+            batch_cmds.push_back(line);
+            continue;
+        }
+
+        flush();
+        try {
+            out += execute(client, authenticated, line);
+        } catch (const std::exception& e) {
+            backend_errors_++;
+            out += std::string("ERROR backend: ") + e.what() + "\n";
+        }
+    }
+    flush();
+
+    release(std::move(lease));
+    busy_us_ += static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - start).count());
+}
+
+void Proxy::handleClient(int client_fd) {
+    connected_clients_++;
+
+    char buffer[4096];
+    std::string inbuf;
+    bool authenticated = false;
+    std::vector<std::string> lines;
+
+    while (!shutdown_requested_.load()) {
+        pollfd pfd{client_fd, POLLIN, 0};
+        if (poll(&pfd, 1, 100) <= 0) continue;
+
+        ssize_t n = recv(client_fd, buffer, sizeof(buffer), MSG_DONTWAIT);
+        if (n < 0) continue;
+        if (n == 0) break;  // client disconnected
+
+        inbuf.append(buffer, static_cast<size_t>(n));
+
+        lines.clear();
+        size_t start = 0;
+        size_t nl;
+        while ((nl = inbuf.find('\n', start)) != std::string::npos) {
+            std::string line = inbuf.substr(start, nl - start);
+            start = nl + 1;
+            if (!line.empty() && line.back() == '\r') line.pop_back();
+            lines.push_back(std::move(line));
+        }
+        inbuf.erase(0, start);
+
+        std::string out;
+        if (!lines.empty()) processLines(authenticated, lines, out);
+        if (inbuf.size() > net::kMaxLineBytes) {
+            sendAllFd(client_fd, out + "ERROR Line too long\n");
+            break;
+        }
+        if (!out.empty()) sendAllFd(client_fd, out);
+    }
+
+    connected_clients_--;
+    close(client_fd);
+}
+
+void Proxy::run() {
+    server_fd_ = socket(AF_INET, SOCK_STREAM, 0);
+    if (server_fd_ < 0) {
+        perror("socket");
+        return;
+    }
+
+    int opt = 1;
+    if (setsockopt(server_fd_, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
+        perror("setsockopt");
+        return;
+    }
+
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = INADDR_ANY;
+    addr.sin_port = htons(port_);
+
+    if (bind(server_fd_, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        perror("bind");
+        return;
+    }
+
+    if (listen(server_fd_, 128) < 0) {
+        perror("listen");
+        return;
+    }
+
+    std::cout << "KeyForge proxy listening on port " << port_ << "...\n";
+
+    while (!shutdown_requested_.load()) {
+        sockaddr_in client_addr{};
+        socklen_t len = sizeof(client_addr);
+        int client_fd = accept(server_fd_, (struct sockaddr*)&client_addr, &len);
+
+        if (client_fd < 0) {
+            if (shutdown_requested_.load()) break;
+            perror("accept");
+            continue;
+        }
+
+        int nodelay = 1;
+        setsockopt(client_fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+        std::lock_guard<std::mutex> lock(workers_mutex_);
+        workers_.emplace_back(&Proxy::handleClient, this, client_fd);
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(workers_mutex_);
+        for (auto& w : workers_) {
+            if (w.joinable()) w.join();
+        }
+        workers_.clear();
+    }
+
+    std::cout << "Proxy stopped.\n";
+}
+
+} // namespace keyforge
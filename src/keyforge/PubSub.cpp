@@ -0,0 +1,182 @@
+#include "keyforge/PubSub.hpp"
+#include "keyforge/Logger.hpp"
+
+#include <cstdint>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace keyforge {
+
+// Subscriber
+
+PubSub::Subscriber::Subscriber(int fd) : fd_(fd), wake_fd_(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) {}
+
+PubSub::Subscriber::~Subscriber() {
+    if (wake_fd_ >= 0) close(wake_fd_);
+}
+
+bool PubSub::Subscriber::deliver(const Message& msg, bool& dropped_now) {
+    std::lock_guard<std::mutex> lock(mtx_);
+    if (dropped_) return false;
+    if (pending_bytes_ + msg->size() > kMaxPendingBytes) {
+        // Not reading fast enough: the connection closes instead of
+        // holding on to more and more messages. Unsubscribing happens
+        // before the socket is closed, so fd_ is still this connection's.
+        dropped_ = dropped_now = true;
+        pending_.clear();
+        pending_bytes_ = 0;
+        shutdown(fd_, SHUT_RDWR);
+    } else {
+        pending_.push_back(msg);
+        pending_bytes_ += msg->size();
+        if (pending_.size() > 1) return true;  // already woken
+    }
+    uint64_t one = 1;
+    ssize_t n = write(wake_fd_, &one, sizeof(one));
+    (void)n;
+    return !dropped_now;
+}
+
+std::vector<PubSub::Message> PubSub::Subscriber::take() {
+    uint64_t count = 0;
+    ssize_t n = read(wake_fd_, &count, sizeof(count));
+    (void)n;
+    std::lock_guard<std::mutex> lock(mtx_);
+    std::vector<Message> out(std::make_move_iterator(pending_.begin()), std::make_move_iterator(pending_.end()));
+    pending_.clear();
+    pending_bytes_ = 0;
+    return out;
+}
+
+// Registry
+
+size_t PubSub::subscribe(const std::shared_ptr<Subscriber>& sub, const std::vector<std::string>& channels) {
+    std::unique_lock<std::shared_mutex> lock(mtx_);
+    for (const auto& channel : channels) {
+        if (!sub->channels_.insert(channel).second) continue;
+        channels_[channel].insert(sub);
+        if (keyspaceChannel(channel)) keyspace_listeners_++;
+    }
+    return subscriptions(*sub);
+}
+
+size_t PubSub::unsubscribe(const std::shared_ptr<Subscriber>& sub, const std::vector<std::string>& channels) {
+    std::unique_lock<std::shared_mutex> lock(mtx_);
+    std::vector<std::string> all;
+    const auto& names = channels.empty() ? (all = {sub->channels_.begin(), sub->channels_.end()}) : channels;
+    for (const auto& channel : names) {
+        if (sub->channels_.erase(channel) == 0) continue;
+        auto it = channels_.find(channel);
+        it->second.erase(sub);
+        if (it->second.empty()) channels_.erase(it);
+        if (keyspaceChannel(channel)) keyspace_listeners_--;
+    }
+    return subscriptions(*sub);
+}
+
+size_t PubSub::psubscribe(const std::shared_ptr<Subscriber>& sub, const std::vector<std::string>& patterns) {
+    std::unique_lock<std::shared_mutex> lock(mtx_);
+    for (const auto& pattern : patterns) {
+        if (!sub->patterns_.insert(pattern).second) continue;
+        patterns_[pattern].insert(sub);
+        keyspace_listeners_++;
+    }
+    return subscriptions(*sub);
+}
+
+size_t PubSub::punsubscribe(const std::shared_ptr<Subscriber>& sub, const std::vector<std::string>& patterns) {
+    std::unique_lock<std::shared_mutex> lock(mtx_);
+    std::vector<std::string> all;
+    const auto& names = patterns.empty() ? (all = {sub->patterns_.begin(), sub->patterns_.end()}) : patterns;
+    for (const auto& pattern : names) {
+        if (sub->patterns_.erase(pattern) == 0) continue;
+        auto it = patterns_.find(pattern);
+        it->second.erase(sub);
+        if (it->second.empty()) patterns_.erase(it);
+        keyspace_listeners_--;
+    }
+    return subscriptions(*sub);
+}
+
+size_t PubSub::publish(const std::string& channel, const std::string& payload) {
+    published_++;
+    size_t receivers = 0;
+    bool dropped_now = false;
+    size_t dropped = 0;
+    std::shared_lock<std::shared_mutex> lock(mtx_);
+
+    auto it = channels_.find(channel);
+    if (it != channels_.end()) {
+        auto msg = std::make_shared<const std::string>(">MESSAGE " + channel + " " + payload + "\n");
+        for (const auto& sub : it->second) {
+            if (sub->deliver(msg, dropped_now)) receivers++;
+            if (dropped_now) dropped++;
+            dropped_now = false;
+        }
+    }
+    for (const auto& [pattern, subs] : patterns_) {
+        if (!matches(pattern.c_str(), channel.c_str())) continue;
+        auto msg = std::make_shared<const std::string>(">PMESSAGE " + pattern + " " + channel + " " + payload + "\n");
+        for (const auto& sub : subs) {
+            if (sub->deliver(msg, dropped_now)) receivers++;
+            if (dropped_now) dropped++;
+            dropped_now = false;
+        }
+    }
+
+    delivered_ += receivers;
+    if (dropped > 0) {
+        dropped_clients_ += dropped;
+        Logger::instance().warn("PubSub: dropping " + std::to_string(dropped) + " subscriber(s) that fell behind");
+    }
+    return receivers;
+}
+
+void PubSub::keyspaceEvent(size_t db, const std::string& key, const char* event) {
+    if (!event || keyspace_listeners_.load(std::memory_order_relaxed) == 0) return;
+    std::string space = "@" + std::to_string(db) + "__:";
+    publish("__keyspace" + space + key, event);
+    publish("__keyevent" + space + event, key);
+}
+
+std::string PubSub::info() {
+    size_t channels = 0, patterns = 0;
+    {
+        std::shared_lock<std::shared_mutex> lock(mtx_);
+        channels = channels_.size();
+        patterns = patterns_.size();
+    }
+    std::string out = "Pub/Sub channels: " + std::to_string(channels) + ", patterns: " + std::to_string(patterns) + "\n";
+    out += "Messages published: " + std::to_string(published_.load()) + ", delivered: " +
+           std::to_string(delivered_.load()) + "\n";
+    out += "Dropped slow subscribers: " + std::to_string(dropped_clients_.load()) + "\n";
+    return out;
+}
+
+bool PubSub::matches(const char* pattern, const char* text) {
+    // Iterative glob: on a mismatch, let the last * swallow one more character
+    const char* star = nullptr;
+    const char* resume = nullptr;
+    while (*text) {
+        if (*pattern == '*') {
+            star = pattern++;
+            resume = text;
+            continue;
+        }
+        const char* literal = *pattern == '\\' && pattern[1] ? pattern + 1 : pattern;
+        if (*pattern && (*pattern == '?' || *literal == *text)) {
+            pattern = literal + 1;
+            text++;
+        } else if (star) {
+            pattern = star + 1;
+            text = ++resume;
+        } else {
+            return false;
+        }
+    }
+    while (*pattern == '*') pattern++;
+    return *pattern == '\0';
+}
+
+} // namespace keyforge
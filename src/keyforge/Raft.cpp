@@ -0,0 +1,972 @@
+#include "keyforge/Raft.hpp"
+#include "keyforge/Logger.hpp"
+#include "keyforge/Net.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <random>
+#include <sstream>
+#include <vector>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace keyforge {
+
+namespace {
+constexpr int kHeartbeatMs = 50;
+constexpr int kElectionMinMs = 300;
+constexpr int kElectionMaxMs = 600;
+constexpr int kLeaseMarginMs = 60;       // allowance for clock drift between nodes
+constexpr size_t kMaxBatch = 512;        // entries per AppendEntries
+constexpr size_t kPipelineDepth = 8;     // AppendEntries in flight per follower
+constexpr uint64_t kSnapshotEvery = 10000;
+constexpr size_t kSnapshotChunk = 256 * 1024;  // read from the file per send
+constexpr int kSubmitTimeoutMs = 5000;
+
+using Clock = std::chrono::steady_clock;
+
+// fsync a stdio stream that was already flushed, without holding the
+// stream itself (the descriptor may be replaced meanwhile)
+int dupForSync(FILE* f) {
+    return f ? dup(fileno(f)) : -1;
+}
+
+bool writeFileDurably(const std::string& path, const std::string& data) {
+    std::string tmp = path + ".tmp";
+    FILE* f = std::fopen(tmp.c_str(), "wb");
+    if (!f) return false;
+    bool ok = std::fwrite(data.data(), 1, data.size(), f) == data.size();
+    ok = std::fflush(f) == 0 && ok;
+    ok = fsync(fileno(f)) == 0 && ok;
+    std::fclose(f);
+    return ok && std::rename(tmp.c_str(), path.c_str()) == 0;
+}
+
+// The RAFT_SNAPSHOT header, completed with the size of the snapshot file
+// open as `file`, then the file itself a chunk at a time. A read that comes
+// up short can't be papered over: false drops the connection.
+bool sendSnapshotFile(int sock, const std::string& header, int file) {
+    struct stat st {};
+    size_t size = file >= 0 && ::fstat(file, &st) == 0 ? static_cast<size_t>(st.st_size) : 0;
+    if (!net::sendAll(sock, header + std::to_string(size) + "\n")) return false;
+    std::vector<char> buf(std::min(size, kSnapshotChunk));
+    for (size_t sent = 0; sent < size;) {
+        ssize_t n = ::pread(file, buf.data(), std::min(buf.size(), size - sent), static_cast<off_t>(sent));
+        if (n <= 0 || !net::sendAll(sock, buf.data(), static_cast<size_t>(n))) return false;
+        sent += static_cast<size_t>(n);
+    }
+    return true;
+}
+
+// A snapshot file starts with "#RAFTSNAP <index> <term>": what it covers is
+// renamed into place with the data, so the two can never disagree. The
+// Store's loader skips the line (it has no '=').
+constexpr const char* kSnapTag = "#RAFTSNAP";
+
+std::string snapHeader(uint64_t index, uint64_t term) {
+    return std::string(kSnapTag) + " " + std::to_string(index) + " " + std::to_string(term) + "\n";
+}
+
+bool readSnapHeader(const std::string& path, uint64_t& index, uint64_t& term) {
+    std::ifstream in(path);
+    std::string tag;
+    uint64_t i = 0, t = 0;
+    if (!(in >> tag >> i >> t) || tag != kSnapTag) return false;
+    index = i;
+    term = t;
+    return true;
+}
+
+// The Store data of a snapshot payload, without its header
+std::string snapBody(const std::string& payload) {
+    if (payload.compare(0, std::strlen(kSnapTag), kSnapTag) != 0) return payload;
+    size_t nl = payload.find('\n');
+    return nl == std::string::npos ? std::string() : payload.substr(nl + 1);
+}
+} // namespace
+
+Raft::Raft(Store& store, Replication& repl) : store_(store), repl_(repl) {}
+
+Raft::~Raft() {
+    shutdown();
+}
+
+// ---------------------------------------------------------------------------
+// Startup / persistence
+// ---------------------------------------------------------------------------
+
+void Raft::start(const std::string& self, const std::vector<std::string>& members,
+                 const std::string& file_prefix, const std::string& token) {
+    self_ = self;
+    token_ = token;
+    prefix_ = file_prefix;
+    cluster_size_ = members.size();
+
+    for (const auto& m : members) {
+        if (m == self) continue;
+        auto peer = std::make_unique<Peer>();
+        peer->addr = m;
+        auto colon = m.rfind(':');
+        peer->host = m.substr(0, colon);
+        peer->port = std::stoi(m.substr(colon + 1));
+        peers_.push_back(std::move(peer));
+    }
+    if (peers_.size() + 1 != cluster_size_) {
+        throw std::invalid_argument("Raft member list must contain this node (" + self + ")");
+    }
+
+    loadState();
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        resetElectionTimer();
+    }
+    enabled_.store(true);
+
+    ticker_ = std::thread(&Raft::tickerLoop, this);
+    applier_ = std::thread(&Raft::applyLoop, this);
+    flusher_ = std::thread(&Raft::flushLoop, this);
+    for (auto& p : peers_) p->sender = std::thread(&Raft::senderLoop, this, std::ref(*p));
+
+    Logger::instance().info("Raft: " + self_ + " started with " + std::to_string(cluster_size_) +
+                            " members, term " + std::to_string(current_term_) +
+                            ", last index " + std::to_string(lastIndex()));
+}
+
+void Raft::loadState() {
+    std::lock_guard<std::mutex> lock(mtx_);
+
+    std::ifstream meta(prefix_ + ".meta");
+    if (meta) {
+        meta >> current_term_ >> voted_for_;
+        if (voted_for_ == "-") voted_for_.clear();
+    }
+
+    // Files from before the header kept index and term in .snapmeta
+    bool have_snapshot = readSnapHeader(prefix_ + ".snap", snap_index_, snap_term_);
+    if (!have_snapshot) {
+        std::ifstream snapmeta(prefix_ + ".snapmeta");
+        have_snapshot = snapmeta && (snapmeta >> snap_index_ >> snap_term_);
+    }
+    if (have_snapshot) {
+        auto wlock = repl_.lockWrites(0);
+        if (!store_.loadFromFile(prefix_ + ".snap")) {
+            throw std::runtime_error("Raft: snapshot " + prefix_ + ".snap is unreadable");
+        }
+        commit_index_ = last_applied_ = snap_index_;
+    }
+
+    // Replay the log; anything not contiguous with the snapshot is dropped
+    bool dirty = false;
+    std::ifstream logf(prefix_ + ".log");
+    std::string line;
+    while (std::getline(logf, line)) {
+        std::istringstream iss(line);
+        uint64_t index = 0, term = 0;
+        if (!(iss >> index >> term)) { dirty = true; break; }
+        std::string command;
+        std::getline(iss >> std::ws, command);
+        if (index <= snap_index_) { dirty = true; continue; }
+        if (index != lastIndex() + 1) { dirty = true; break; }
+        log_.push_back({term, command});
+    }
+
+    log_file_ = std::fopen((prefix_ + ".log").c_str(), "ab");
+    if (!log_file_) throw std::runtime_error("Raft: cannot open " + prefix_ + ".log");
+    if (dirty) rewriteLogFile();
+    persisted_index_ = lastIndex();
+}
+
+void Raft::persistMeta() {
+    std::string data = std::to_string(current_term_) + " " +
+                       (voted_for_.empty() ? "-" : voted_for_) + "\n";
+    if (!writeFileDurably(prefix_ + ".meta", data)) {
+        Logger::instance().error("Raft: failed to persist term/vote");
+    }
+}
+
+void Raft::appendLocal(const Entry& e) {
+    log_.push_back(e);
+    std::fprintf(log_file_, "%llu %llu %s\n",
+                 static_cast<unsigned long long>(lastIndex()),
+                 static_cast<unsigned long long>(e.term), e.command.c_str());
+}
+
+void Raft::rewriteLogFile() {
+    std::string data;
+    for (uint64_t i = snap_index_ + 1; i <= lastIndex(); ++i) {
+        const Entry& e = entryAt(i);
+        data += std::to_string(i) + " " + std::to_string(e.term) + " " + e.command + "\n";
+    }
+    if (log_file_) std::fclose(log_file_);
+    if (!writeFileDurably(prefix_ + ".log", data)) {
+        Logger::instance().error("Raft: failed to rewrite log file");
+    }
+    log_file_ = std::fopen((prefix_ + ".log").c_str(), "ab");
+    persisted_index_ = lastIndex();
+    log_generation_++;
+}
+
+void Raft::truncateFrom(uint64_t index) {
+    log_.resize(index - snap_index_ - 1);
+    rewriteLogFile();
+    // Entries we proposed at or after index were overwritten
+    for (auto it = waiters_.lower_bound(index); it != waiters_.end();) {
+        it->second.reply.set_value("ERROR Raft entry overwritten by a new leader\n");
+        it = waiters_.erase(it);
+    }
+}
+
+uint64_t Raft::termAt(uint64_t index) const {
+    if (index == snap_index_) return snap_term_;
+    if (index < snap_index_ || index > lastIndex()) return 0;
+    return entryAt(index).term;
+}
+
+// ---------------------------------------------------------------------------
+// Roles
+// ---------------------------------------------------------------------------
+
+void Raft::resetElectionTimer() {
+    static thread_local std::mt19937 gen(std::random_device{}());
+    std::uniform_int_distribution<int> dist(kElectionMinMs, kElectionMaxMs);
+    election_deadline_ = Clock::now() + std::chrono::milliseconds(dist(gen));
+}
+
+void Raft::becomeFollower(uint64_t term, const std::string& leader) {
+    if (term > current_term_) {
+        current_term_ = term;
+        voted_for_.clear();
+        persistMeta();
+    }
+    if (role_ == Role::LEADER) {
+        Logger::instance().info("Raft: stepping down in term " + std::to_string(term));
+        for (auto& [index, w] : waiters_) {
+            w.reply.set_value("ERROR Raft leadership lost, outcome unknown\n");
+        }
+        waiters_.clear();
+    }
+    role_ = Role::FOLLOWER;
+    leader_ = leader;
+    cv_.notify_all();
+}
+
+void Raft::startElection() {
+    current_term_++;
+    role_ = Role::CANDIDATE;
+    voted_for_ = self_;
+    leader_.clear();
+    votes_ = 1;
+    persistMeta();
+    for (auto& p : peers_) p->vote_requested = false;
+    resetElectionTimer();
+    elections_++;
+    Logger::instance().info("Raft: starting election for term " + std::to_string(current_term_));
+
+    if (votes_ * 2 > cluster_size_) becomeLeader();
+    cv_.notify_all();
+}
+
+void Raft::becomeLeader() {
+    role_ = Role::LEADER;
+    leader_ = self_;
+    for (auto& p : peers_) {
+        p->next_index = lastIndex() + 1;
+        p->match_index = 0;
+        p->last_ack_sent = Clock::time_point{};
+        p->last_send = Clock::time_point{};
+    }
+    // A no-op commits everything from earlier terms and starts the lease
+    appendLocal({current_term_, "NOOP"});
+    noop_index_ = lastIndex();
+    Logger::instance().info("Raft: " + self_ + " is leader for term " + std::to_string(current_term_));
+    advanceCommit();
+    cv_.notify_all();
+}
+
+void Raft::advanceCommit() {
+    if (role_ != Role::LEADER) return;
+
+    std::vector<uint64_t> matches;
+    matches.push_back(persisted_index_);
+    for (auto& p : peers_) matches.push_back(p->match_index);
+    std::sort(matches.begin(), matches.end(), std::greater<uint64_t>());
+    uint64_t majority_index = matches[cluster_size_ / 2];
+
+    // Only entries from the current term are committed by counting
+    if (majority_index > commit_index_ && termAt(majority_index) == current_term_) {
+        commit_index_ = majority_index;
+        cv_.notify_all();
+    }
+}
+
+bool Raft::leaseValid() const {
+    if (role_ != Role::LEADER || last_applied_ < noop_index_) return false;
+    if (cluster_size_ == 1) return true;
+
+    auto now = Clock::now();
+    std::vector<Clock::time_point> acks;
+    acks.push_back(now);
+    for (auto& p : peers_) acks.push_back(p->last_ack_sent);
+    std::sort(acks.begin(), acks.end(), std::greater<Clock::time_point>());
+    auto majority_ack = acks[cluster_size_ / 2];
+    return now - majority_ack < std::chrono::milliseconds(kElectionMinMs - kLeaseMarginMs);
+}
+
+// ---------------------------------------------------------------------------
+// Client-facing API
+// ---------------------------------------------------------------------------
+
+std::string Raft::submit(const std::string& command) {
+    // Batching off: one write at a time through the whole pipeline
+    std::unique_lock<std::mutex> serial(submit_mtx_, std::defer_lock);
+    if (!batching_.load()) serial.lock();
+
+    std::future<std::string> reply;
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        if (role_ != Role::LEADER) {
+            return "ERROR NOTLEADER " + (leader_.empty() ? std::string("unknown") : leader_) + "\n";
+        }
+        appendLocal({current_term_, command});
+        auto& w = waiters_[lastIndex()];
+        w.term = current_term_;
+        reply = w.reply.get_future();
+        cv_.notify_all();
+    }
+
+    if (reply.wait_for(std::chrono::milliseconds(kSubmitTimeoutMs)) != std::future_status::ready) {
+        return "ERROR Raft commit timed out\n";
+    }
+    return reply.get();
+}
+
+bool Raft::canServeRead(std::string& redirect) {
+    std::lock_guard<std::mutex> lock(mtx_);
+    if (role_ != Role::LEADER) {
+        redirect = "ERROR NOTLEADER " + (leader_.empty() ? std::string("unknown") : leader_) + "\n";
+        return false;
+    }
+    if (!leaseValid()) {
+        redirect = "ERROR Raft leader lease not held, retry\n";
+        return false;
+    }
+    lease_reads_++;
+    return true;
+}
+
+void Raft::setBatching(bool on) {
+    batching_.store(on);
+}
+
+// ---------------------------------------------------------------------------
+// Background threads
+// ---------------------------------------------------------------------------
+
+void Raft::tickerLoop() {
+    while (!stopping_.load()) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        std::lock_guard<std::mutex> lock(mtx_);
+        if (role_ != Role::LEADER && Clock::now() >= election_deadline_) startElection();
+    }
+}
+
+void Raft::flushLoop() {
+    std::unique_lock<std::mutex> lock(mtx_);
+    while (!stopping_.load()) {
+        cv_.wait_for(lock, std::chrono::milliseconds(100), [&] {
+            return stopping_.load() || lastIndex() > persisted_index_;
+        });
+        if (stopping_.load()) break;
+        if (lastIndex() <= persisted_index_) continue;
+
+        // Group commit: everything appended so far shares one fsync
+        std::fflush(log_file_);
+        uint64_t target = lastIndex();
+        uint64_t generation = log_generation_;
+        int fd = dupForSync(log_file_);
+        lock.unlock();
+        if (fd >= 0) {
+            fdatasync(fd);
+            close(fd);
+        }
+        fsyncs_++;
+        lock.lock();
+
+        if (generation == log_generation_) persisted_index_ = std::max(persisted_index_, target);
+        advanceCommit();
+    }
+}
+
+void Raft::applyLoop() {
+    while (!stopping_.load()) {
+        {
+            std::unique_lock<std::mutex> lock(mtx_);
+            cv_.wait_for(lock, std::chrono::milliseconds(100), [&] {
+                return stopping_.load() || commit_index_ > last_applied_;
+            });
+            if (stopping_.load()) break;
+            if (commit_index_ <= last_applied_) continue;
+        }
+
+        std::lock_guard<std::mutex> apply_lock(apply_mtx_);
+        std::vector<std::pair<uint64_t, Entry>> batch;
+        {
+            std::lock_guard<std::mutex> lock(mtx_);
+            for (uint64_t i = last_applied_ + 1; i <= commit_index_; ++i) {
+                batch.emplace_back(i, entryAt(i));
+            }
+        }
+
+        std::vector<std::string> results;
+        results.reserve(batch.size());
+        for (const auto& [index, e] : batch) {
+            // Every replica applies the same entries: an error is the answer
+            try {
+                results.push_back(applyCommand(e.command));
+            } catch (const Store::WrongType& err) {
+                results.push_back(std::string("ERROR ") + err.what() + "\n");
+            } catch (const StorageError& err) {
+                Logger::instance().error("Raft: " + std::string(err.what()) + " applying: " + e.command);
+                results.push_back(std::string("ERROR ") + err.what() + "\n");
+            }
+        }
+
+        bool snapshot_due = false;
+        {
+            std::lock_guard<std::mutex> lock(mtx_);
+            if (!batch.empty()) last_applied_ = std::max(last_applied_, batch.back().first);
+            for (size_t i = 0; i < batch.size(); ++i) {
+                auto it = waiters_.find(batch[i].first);
+                if (it == waiters_.end()) continue;
+                it->second.reply.set_value(it->second.term == batch[i].second.term
+                    ? results[i] : "ERROR Raft entry overwritten by a new leader\n");
+                waiters_.erase(it);
+            }
+            snapshot_due = last_applied_ - snap_index_ >= kSnapshotEvery;
+        }
+        committed_entries_ += batch.size();
+
+        if (snapshot_due) takeSnapshot();
+    }
+}
+
+std::string Raft::applyCommand(const std::string& command) {
+    std::istringstream iss(command);
+    std::string cmd, key, value;
+    iss >> cmd >> key >> value;
+
+    auto wlock = repl_.lockWrites(0);
+    if (cmd == "PUT") {
+        store_.put(key, value);
+        return "OK " + std::to_string(repl_.propagate(command)) + "\n";
+    }
+    if (cmd == "UPDATE") {
+        bool updated = store_.update(key, value);
+        return updated ? "UPDATED " + std::to_string(repl_.propagate(command)) + "\n" : "NOT_FOUND\n";
+    }
+    if (cmd == "DELETE") {
+        bool removed = store_.remove(key);
+        return removed ? "DELETED " + std::to_string(repl_.propagate(command)) + "\n" : "NOT_FOUND\n";
+    }
+    if (cmd == "INCRBY" || cmd == "INCRBYFLOAT") {
+        return repl_.applyCounter(command);
+    }
+    if (cmd == "MSET") {
+        // Every pair under one store lock, and a transaction for replicas
+        Store::Batch batch(store_);
+        repl_.propagate("MULTI");
+        uint64_t off = 0;
+        do {
+            batch.put(key, value);
+            off = repl_.propagate("PUT " + key + " " + value);
+        } while (iss >> key >> value);
+        repl_.propagate("EXEC");
+        return "OK " + std::to_string(off) + "\n";
+    }
+    return "OK\n";  // NOOP
+}
+
+void Raft::takeSnapshot() {
+    // Called by the apply thread with apply_mtx_ held: the Store is exactly
+    // the state at last_applied_.
+    uint64_t index, term;
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        index = last_applied_;
+        term = termAt(index);
+    }
+
+    std::ostringstream data;
+    data << snapHeader(index, term);
+    store_.saveToStream(data);
+    std::string tmp = prefix_ + ".snap.tmp";
+    if (!writeFileDurably(tmp, data.str())) {
+        Logger::instance().error("Raft: failed to write snapshot");
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(mtx_);
+    std::rename(tmp.c_str(), (prefix_ + ".snap").c_str());
+    std::remove((prefix_ + ".snapmeta").c_str());
+    log_.erase(log_.begin(), log_.begin() + static_cast<long>(index - snap_index_));
+    snap_index_ = index;
+    snap_term_ = term;
+    rewriteLogFile();
+    snapshots_++;
+    Logger::instance().info("Raft: compacted log into snapshot at index " + std::to_string(index));
+}
+
+// ---------------------------------------------------------------------------
+// Outgoing peer traffic
+// ---------------------------------------------------------------------------
+
+bool Raft::connectPeer(Peer& peer) {
+    if (peer.reader.joinable()) peer.reader.join();
+
+    int fd = net::connectTo(peer.host, peer.port);
+    if (fd < 0) return false;
+
+    net::LineReader handshake(fd);
+    std::string line;
+    bool ok = true;
+    if (!token_.empty()) {
+        ok = net::sendAll(fd, "AUTH " + token_ + "\n") &&
+             handshake.readLine(line, 1000) == net::LineReader::Status::OK &&
+             line.rfind("OK", 0) == 0;
+    }
+    ok = ok && net::sendAll(fd, "RAFT_PEER\n") &&
+         handshake.readLine(line, 1000) == net::LineReader::Status::OK && line == "OK";
+    if (!ok) {
+        close(fd);
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(mtx_);
+    peer.fd = fd;
+    peer.inflight.clear();
+    // Whatever was in flight on the old connection is lost
+    peer.next_index = peer.match_index > 0 ? peer.match_index + 1 : lastIndex() + 1;
+    peer.reader = std::thread(&Raft::readerLoop, this, std::ref(peer), fd);
+    return true;
+}
+
+void Raft::senderLoop(Peer& peer) {
+    std::unique_lock<std::mutex> lock(mtx_);
+    while (!stopping_.load()) {
+        cv_.wait_for(lock, std::chrono::milliseconds(kHeartbeatMs / 2), [&] {
+            if (stopping_.load()) return true;
+            if (role_ == Role::CANDIDATE) return !peer.vote_requested;
+            if (role_ != Role::LEADER) return false;
+            return peer.inflight.size() < kPipelineDepth && peer.next_index <= lastIndex();
+        });
+        if (stopping_.load()) break;
+        if (role_ == Role::FOLLOWER) continue;
+
+        if (peer.fd < 0) {
+            lock.unlock();
+            bool connected = connectPeer(peer);
+            if (!connected) std::this_thread::sleep_for(std::chrono::milliseconds(100));
+            lock.lock();
+            continue;
+        }
+
+        auto now = Clock::now();
+        std::string msg;
+        int snap_fd = -1;
+        bool snapshot = false;
+
+        if (role_ == Role::CANDIDATE) {
+            if (peer.vote_requested) continue;
+            msg = "RAFT_VOTE " + std::to_string(current_term_) + " " + self_ + " " +
+                  std::to_string(lastIndex()) + " " + std::to_string(termAt(lastIndex())) + "\n";
+            peer.vote_requested = true;
+            peer.inflight.emplace_back('V', now);
+        }
+        else if (peer.inflight.size() >= kPipelineDepth) {
+            continue;
+        }
+        else if (peer.next_index <= snap_index_) {
+            // The entries it needs are compacted away: ship the snapshot
+            if (!peer.inflight.empty()) continue;
+            // Only opened here: it is read and sent without the lock, and
+            // the open file stays the one for snap_index_ even if a newer
+            // snapshot is renamed over it meanwhile
+            snap_fd = ::open((prefix_ + ".snap").c_str(), O_RDONLY | O_CLOEXEC);
+            snapshot = true;
+            msg = "RAFT_SNAPSHOT " + std::to_string(current_term_) + " " + self_ + " " +
+                  std::to_string(snap_index_) + " " + std::to_string(snap_term_) + " ";
+            peer.next_index = snap_index_ + 1;
+            peer.inflight.emplace_back('S', now);
+        }
+        else {
+            bool heartbeat_due = now - peer.last_send >= std::chrono::milliseconds(kHeartbeatMs);
+            if (peer.next_index > lastIndex() && !heartbeat_due) continue;
+
+            uint64_t prev = peer.next_index - 1;
+            uint64_t n = std::min<uint64_t>(lastIndex() - prev, batching_.load() ? kMaxBatch : 1);
+            std::ostringstream out;
+            out << "RAFT_APPEND " << current_term_ << " " << self_ << " " << prev << " "
+                << termAt(prev) << " " << commit_index_ << " " << n << "\n";
+            for (uint64_t i = prev + 1; i <= prev + n; ++i) {
+                const Entry& e = entryAt(i);
+                out << e.term << " " << e.command << "\n";
+            }
+            msg = out.str();
+            // Pipelining: assume success and keep streaming
+            peer.next_index += n;
+            peer.inflight.emplace_back('A', now);
+            append_rpcs_++;
+            appended_entries_ += n;
+        }
+        peer.last_send = now;
+
+        int fd = peer.fd;
+        lock.unlock();
+        bool ok = snapshot ? sendSnapshotFile(fd, msg, snap_fd) : net::sendAll(fd, msg);
+        if (snap_fd >= 0) ::close(snap_fd);
+        lock.lock();
+        if (!ok && peer.fd == fd) {
+            peer.fd = -1;
+            ::shutdown(fd, SHUT_RDWR);  // the reader closes it
+        }
+    }
+}
+
+void Raft::readerLoop(Peer& peer, int fd) {
+    net::LineReader reader(fd);
+    std::string line;
+    while (!stopping_.load()) {
+        auto st = reader.readLine(line, 100);
+        if (st == net::LineReader::Status::TIMEOUT) continue;
+        if (st == net::LineReader::Status::CLOSED) break;
+
+        std::istringstream iss(line);
+        std::string type;
+        uint64_t term = 0, a = 0, b = 0;
+        iss >> type >> term >> a >> b;
+
+        std::lock_guard<std::mutex> lock(mtx_);
+        Clock::time_point sent_at{};
+        if (!peer.inflight.empty()) {
+            sent_at = peer.inflight.front().second;
+            peer.inflight.pop_front();
+        }
+
+        if (term > current_term_) {
+            becomeFollower(term, "");
+            resetElectionTimer();
+            continue;
+        }
+        if (term < current_term_) continue;  // reply to an older term
+
+        if (type == "VOTE" && role_ == Role::CANDIDATE && a == 1) {
+            votes_++;
+            if (votes_ * 2 > cluster_size_) becomeLeader();
+        }
+        else if (type == "APPEND" && role_ == Role::LEADER) {
+            peer.last_ack_sent = std::max(peer.last_ack_sent, sent_at);
+            if (a == 1) {
+                peer.match_index = std::max(peer.match_index, b);
+                peer.next_index = std::max(peer.next_index, peer.match_index + 1);
+                advanceCommit();
+            } else {
+                // Rewind to the follower's hint; later pipelined requests
+                // will fail the same way and are resent from here
+                peer.next_index = std::max(peer.match_index + 1, std::min(b, lastIndex() + 1));
+            }
+        }
+        else if (type == "SNAP" && role_ == Role::LEADER) {
+            peer.last_ack_sent = std::max(peer.last_ack_sent, sent_at);
+            peer.match_index = std::max(peer.match_index, a);
+            peer.next_index = std::max(peer.next_index, peer.match_index + 1);
+            advanceCommit();
+        }
+        cv_.notify_all();
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        if (peer.fd == fd) peer.fd = -1;
+        peer.inflight.clear();
+        cv_.notify_all();
+    }
+    close(fd);
+}
+
+// ---------------------------------------------------------------------------
+// Incoming peer traffic
+// ---------------------------------------------------------------------------
+
+void Raft::servePeer(int fd) {
+    if (!net::sendAll(fd, "OK\n")) return;
+
+    net::LineReader reader(fd);
+    std::string line;
+    while (!stopping_.load()) {
+        auto st = reader.readLine(line, 100);
+        if (st == net::LineReader::Status::TIMEOUT) continue;
+        if (st == net::LineReader::Status::CLOSED) break;
+
+        std::istringstream iss(line);
+        std::string type;
+        iss >> type;
+        std::string reply;
+
+        if (type == "RAFT_VOTE") {
+            reply = handleVote(line);
+        }
+        else if (type == "RAFT_APPEND") {
+            uint64_t term, prev, prev_term, commit;
+            std::string leader;
+            size_t n = 0;
+            iss >> term >> leader >> prev >> prev_term >> commit >> n;
+            std::vector<Entry> entries;
+            entries.reserve(n);
+            for (size_t i = 0; i < n; ++i) {
+                if (reader.readLine(line, 5000) != net::LineReader::Status::OK) return;
+                std::istringstream es(line);
+                Entry e;
+                es >> e.term;
+                std::getline(es >> std::ws, e.command);
+                entries.push_back(std::move(e));
+            }
+            reply = handleAppend(iss.str(), entries);
+        }
+        else if (type == "RAFT_SNAPSHOT") {
+            uint64_t term, index, snap_term;
+            std::string leader;
+            size_t size = 0;
+            iss >> term >> leader >> index >> snap_term >> size;
+            std::string payload;
+            if (reader.readExact(size, payload, 30000) != net::LineReader::Status::OK) return;
+            reply = handleSnapshot(line, payload);
+        }
+        else {
+            reply = "ERROR Unknown Raft RPC\n";
+        }
+
+        if (!net::sendAll(fd, reply)) break;
+    }
+}
+
+std::string Raft::handleVote(const std::string& line) {
+    std::istringstream iss(line);
+    std::string type, candidate;
+    uint64_t term = 0, last_index = 0, last_term = 0;
+    iss >> type >> term >> candidate >> last_index >> last_term;
+
+    std::lock_guard<std::mutex> lock(mtx_);
+    // Leader stickiness: while the current leader is known to be alive,
+    // ignore a higher term altogether (without taking it). Its read lease
+    // counts on nobody else being elected within kElectionMinMs of the
+    // last AppendEntries a majority accepted.
+    if (term > current_term_) {
+        bool leader_alive = role_ == Role::LEADER
+                                ? leaseValid()
+                                : role_ == Role::FOLLOWER && !leader_.empty() &&
+                                      Clock::now() - last_leader_contact_ < std::chrono::milliseconds(kElectionMinMs);
+        if (leader_alive) return "VOTE " + std::to_string(current_term_) + " 0\n";
+        becomeFollower(term, "");
+    }
+
+    uint64_t my_last_term = termAt(lastIndex());
+    bool up_to_date = last_term > my_last_term ||
+                      (last_term == my_last_term && last_index >= lastIndex());
+    bool granted = term == current_term_ && up_to_date &&
+                   (voted_for_.empty() || voted_for_ == candidate);
+    if (granted) {
+        voted_for_ = candidate;
+        persistMeta();
+        resetElectionTimer();
+    }
+    return "VOTE " + std::to_string(current_term_) + " " + (granted ? "1" : "0") + "\n";
+}
+
+std::string Raft::handleAppend(const std::string& header, std::vector<Entry>& entries) {
+    std::istringstream iss(header);
+    std::string type, leader;
+    uint64_t term = 0, prev = 0, prev_term = 0, leader_commit = 0;
+    iss >> type >> term >> leader >> prev >> prev_term >> leader_commit;
+
+    std::unique_lock<std::mutex> lock(mtx_);
+    auto reply = [&](bool ok, uint64_t index) {
+        return "APPEND " + std::to_string(current_term_) + " " + (ok ? "1 " : "0 ") +
+               std::to_string(index) + "\n";
+    };
+
+    if (term < current_term_) return reply(false, lastIndex() + 1);
+    if (term > current_term_ || role_ != Role::FOLLOWER) becomeFollower(term, leader);
+    leader_ = leader;
+    last_leader_contact_ = Clock::now();
+    resetElectionTimer();
+
+    if (prev > lastIndex()) return reply(false, lastIndex() + 1);
+
+    uint64_t last_new = prev + entries.size();
+    if (prev < snap_index_) {
+        // Everything up to the snapshot is committed; skip that part
+        uint64_t skip = snap_index_ - prev;
+        if (skip >= entries.size()) return reply(true, last_new);
+        entries.erase(entries.begin(), entries.begin() + static_cast<long>(skip));
+        prev = snap_index_;
+    }
+    else if (termAt(prev) != prev_term) {
+        // Back up over the whole conflicting term in one round trip
+        uint64_t bad_term = termAt(prev);
+        uint64_t hint = prev;
+        while (hint > snap_index_ + 1 && termAt(hint - 1) == bad_term) hint--;
+        return reply(false, hint);
+    }
+
+    bool appended = false;
+    uint64_t index = prev;
+    for (const auto& e : entries) {
+        index++;
+        if (index <= lastIndex()) {
+            if (termAt(index) == e.term) continue;
+            truncateFrom(index);
+        }
+        appendLocal(e);
+        appended = true;
+    }
+
+    if (leader_commit > commit_index_) {
+        commit_index_ = std::min(leader_commit, last_new);
+        cv_.notify_all();
+    }
+
+    if (appended) {
+        // The entries must be durable before we acknowledge them
+        std::fflush(log_file_);
+        uint64_t generation = log_generation_;
+        uint64_t target = lastIndex();
+        int fd = dupForSync(log_file_);
+        lock.unlock();
+        if (fd >= 0) {
+            fdatasync(fd);
+            close(fd);
+        }
+        fsyncs_++;
+        lock.lock();
+        if (generation == log_generation_) persisted_index_ = std::max(persisted_index_, target);
+    }
+    return reply(true, last_new);
+}
+
+std::string Raft::handleSnapshot(const std::string& header, const std::string& payload) {
+    std::istringstream iss(header);
+    std::string type, leader;
+    uint64_t term = 0, index = 0, snap_term = 0;
+    iss >> type >> term >> leader >> index >> snap_term;
+
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        if (term < current_term_) return "SNAP " + std::to_string(current_term_) + " 0\n";
+        if (term > current_term_ || role_ != Role::FOLLOWER) becomeFollower(term, leader);
+        leader_ = leader;
+        last_leader_contact_ = Clock::now();
+        resetElectionTimer();
+        if (index <= snap_index_) return "SNAP " + std::to_string(current_term_) + " " + std::to_string(snap_index_) + "\n";
+    }
+
+    std::lock_guard<std::mutex> apply_lock(apply_mtx_);
+    std::string body = snapBody(payload);
+    if (!writeFileDurably(prefix_ + ".snap", snapHeader(index, snap_term) + body)) {
+        Logger::instance().error("Raft: failed to store received snapshot");
+    }
+    std::remove((prefix_ + ".snapmeta").c_str());
+    {
+        auto wlock = repl_.lockWrites(0);
+        std::istringstream data(body);
+        store_.loadFromStream(data);
+        repl_.newHistory();
+    }
+
+    std::lock_guard<std::mutex> lock(mtx_);
+    if (index < lastIndex() && termAt(index) == snap_term) {
+        log_.erase(log_.begin(), log_.begin() + static_cast<long>(index - snap_index_));
+    } else {
+        log_.clear();
+    }
+    snap_index_ = index;
+    snap_term_ = snap_term;
+    commit_index_ = std::max(commit_index_, index);
+    last_applied_ = index;
+    rewriteLogFile();
+    snapshots_++;
+    Logger::instance().info("Raft: installed snapshot at index " + std::to_string(index));
+    return "SNAP " + std::to_string(current_term_) + " " + std::to_string(index) + "\n";
+}
+
+// ---------------------------------------------------------------------------
+// Status / shutdown
+// ---------------------------------------------------------------------------
+
+std::string Raft::info() {
+    std::lock_guard<std::mutex> lock(mtx_);
+    std::ostringstream out;
+    const char* role = role_ == Role::LEADER ? "leader" : role_ == Role::CANDIDATE ? "candidate" : "follower";
+    out << "Raft role: " << role << "\n";
+    out << "Self: " << self_ << "\n";
+    out << "Term: " << current_term_ << "\n";
+    out << "Leader: " << (leader_.empty() ? "unknown" : leader_) << "\n";
+    out << "Last index: " << lastIndex() << "\n";
+    out << "Commit index: " << commit_index_ << "\n";
+    out << "Last applied: " << last_applied_ << "\n";
+    out << "Snapshot index: " << snap_index_ << "\n";
+    out << "Batching: " << (batching_.load() ? "on" : "off") << "\n";
+    out << "Committed entries: " << committed_entries_.load() << "\n";
+    uint64_t rpcs = append_rpcs_.load();
+    out << "AppendEntries sent: " << rpcs << " (avg "
+        << std::fixed << std::setprecision(1)
+        << (rpcs ? static_cast<double>(appended_entries_.load()) / rpcs : 0.0) << " entries)\n";
+    out << "Log fsyncs: " << fsyncs_.load() << "\n";
+    out << "Elections started: " << elections_.load() << "\n";
+    out << "Snapshots: " << snapshots_.load() << "\n";
+    out << "Lease reads: " << lease_reads_.load() << "\n";
+    if (role_ == Role::LEADER) {
+        out << "Lease: " << (leaseValid() ? "valid" : "expired") << "\n";
+        for (auto& p : peers_) {
+            out << "Peer " << p->addr << ": match=" << p->match_index << " next=" << p->next_index
+                << " inflight=" << p->inflight.size() << " link=" << (p->fd >= 0 ? "up" : "down") << "\n";
+        }
+    }
+    return out.str();
+}
+
+void Raft::shutdown() {
+    if (!enabled_.exchange(false)) return;
+    stopping_.store(true);
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        for (auto& p : peers_) {
+            if (p->fd >= 0) ::shutdown(p->fd, SHUT_RDWR);
+        }
+        cv_.notify_all();
+    }
+
+    if (ticker_.joinable()) ticker_.join();
+    if (applier_.joinable()) applier_.join();
+    if (flusher_.joinable()) flusher_.join();
+    for (auto& p : peers_) {
+        if (p->sender.joinable()) p->sender.join();
+        if (p->reader.joinable()) p->reader.join();
+    }
+
+    std::lock_guard<std::mutex> lock(mtx_);
+    for (auto& [index, w] : waiters_) w.reply.set_value("ERROR Server shutting down\n");
+    waiters_.clear();
+    if (log_file_) {
+        std::fflush(log_file_);
+        fsync(fileno(log_file_));
+        std::fclose(log_file_);
+        log_file_ = nullptr;
+    }
+}
+
+} // namespace keyforge
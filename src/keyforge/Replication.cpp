@@ -0,0 +1,797 @@
+#include "keyforge/Replication.hpp"
+#include "keyforge/Logger.hpp"
+#include "keyforge/Net.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <iomanip>
+#include <optional>
+#include <random>
+#include <sstream>
+#include <unistd.h>
+
+namespace keyforge {
+
+namespace {
+// A replica whose unsent stream grows past this is disconnected; it will
+// reconnect and full-resync instead of pinning unbounded leader memory.
+constexpr size_t kMaxPendingBytes = 64 * 1024 * 1024;
+constexpr size_t kMaxWriteSamples = 4096;
+constexpr size_t kSnapshotChunk = 256 * 1024;  // bytes per snapshot frame
+constexpr size_t kMaxLoadThreads = 8;
+
+double msBetween(std::chrono::steady_clock::time_point a,
+                 std::chrono::steady_clock::time_point b) {
+    return std::chrono::duration<double, std::milli>(b - a).count();
+}
+} // namespace
+
+Replication::Replication(Store& store) : store_(store), replid_(newReplId()) {
+    write_mtxs_.push_back(std::make_unique<std::mutex>());
+}
+
+Replication::~Replication() {
+    shutdown();
+}
+
+std::string Replication::newReplId() {
+    static const char hex[] = "0123456789abcdef";
+    std::random_device rd;
+    std::mt19937_64 gen(rd());
+    std::string id(40, '0');
+    for (auto& c : id) c = hex[gen() % 16];
+    return id;
+}
+
+void Replication::setDatabases(std::vector<Store*> dbs) {
+    dbs_ = std::move(dbs);
+    while (write_mtxs_.size() < dbs_.size()) write_mtxs_.push_back(std::make_unique<std::mutex>());
+}
+
+Replication::WriteLocks Replication::lockWrites(std::vector<size_t> dbs) {
+    std::sort(dbs.begin(), dbs.end());
+    dbs.erase(std::unique(dbs.begin(), dbs.end()), dbs.end());
+    WriteLocks locks;
+    for (size_t db : dbs) locks.push_back(lockWrites(db));
+    return locks;
+}
+
+Replication::WriteLocks Replication::lockAllWrites() {
+    std::vector<size_t> dbs(write_mtxs_.size());
+    for (size_t db = 0; db < dbs.size(); ++db) dbs[db] = db;
+    return lockWrites(std::move(dbs));
+}
+
+uint64_t Replication::propagate(const std::string& command) {
+    std::string line = command + "\n";
+    std::lock_guard<std::recursive_mutex> stream(stream_mtx_);
+    uint64_t off = repl_offset_.fetch_add(line.size()) + line.size();
+    propagated_cmds_++;
+    backlog_.append(line);
+    notifyOffsetWaiters();
+
+    std::lock_guard<std::mutex> lock(links_mtx_);
+    if (links_.empty()) return off;
+
+    for (auto& link : links_) {
+        if (link->drop) continue;
+        link->pending += line;
+        if (link->pending.size() > kMaxPendingBytes) {
+            Logger::instance().warn("Replica " + link->peer + " output buffer overflow, dropping");
+            link->drop = true;
+        }
+    }
+    write_times_.emplace_back(off, std::chrono::steady_clock::now());
+    if (write_times_.size() > kMaxWriteSamples) write_times_.pop_front();
+    links_cv_.notify_all();
+    return off;
+}
+
+void Replication::recordAck(ReplicaLink& link, uint64_t ack) {
+    auto now = std::chrono::steady_clock::now();
+    if (ack > link.ack_offset) {
+        // Lag = how long ago the newest write covered by this ACK was produced
+        auto it = std::upper_bound(write_times_.begin(), write_times_.end(), ack,
+            [](uint64_t v, const auto& sample) { return v < sample.first; });
+        if (it != write_times_.begin()) {
+            --it;
+            link.last_lag_ms = msBetween(it->second, now);
+        }
+        link.ack_offset = ack;
+    }
+    link.last_ack = now;
+
+    // Forget samples every replica has already acknowledged
+    uint64_t min_ack = ack;
+    for (auto& l : links_) min_ack = std::min(min_ack, l->ack_offset);
+    while (!write_times_.empty() && write_times_.front().first <= min_ack) {
+        write_times_.pop_front();
+    }
+}
+
+void Replication::serveReplica(int fd, const std::string& peer,
+                               const std::string& psync_replid, uint64_t psync_offset) {
+    auto& log = Logger::instance();
+    auto link = std::make_shared<ReplicaLink>();
+    link->fd = fd;
+    link->peer = peer;
+    link->last_ack = std::chrono::steady_clock::now();
+
+    auto unregister = [&]() {
+        std::lock_guard<std::mutex> lock(links_mtx_);
+        links_.erase(std::remove(links_.begin(), links_.end(), link), links_.end());
+    };
+
+    // Decide between partial and full resync under every database's write
+    // lock, so every mutation after the starting offset lands in
+    // link->pending.
+    // A full resync only takes a snapshot of each database here, which
+    // copies nothing (see Store::snapshot): its pairs are read and go onto
+    // the socket after the lock is released.
+    std::vector<Store::Snapshot> snapshot;  // per database
+    size_t snapshot_keys = 0;
+    uint64_t snapshot_offset = 0;
+    std::string replid;
+    bool partial = false;
+    size_t missed_bytes = 0;
+    {
+        auto wlocks = lockAllWrites();
+        std::lock_guard<std::recursive_mutex> stream(stream_mtx_);
+        replid = replid_;
+        bool same_history = !psync_replid.empty() &&
+            (psync_replid == replid_ ||
+             (psync_replid == replid2_ && psync_offset <= second_offset_));
+        std::string missed;
+        if (same_history && backlog_.copyFrom(psync_offset, missed)) {
+            partial = true;
+            missed_bytes = missed.size();
+            link->ack_offset = psync_offset;
+            link->pending = std::move(missed);
+        } else {
+            for (Store* db : dbs_) {
+                snapshot.push_back(db->snapshot());
+                snapshot_keys += snapshot.back().keys();
+            }
+            snapshot_offset = repl_offset_.load();
+            link->ack_offset = snapshot_offset;
+        }
+        std::lock_guard<std::mutex> lock(links_mtx_);
+        links_.push_back(link);
+    }
+
+    if (partial) {
+        partial_syncs_++;
+        partial_sync_bytes_ += missed_bytes;
+        log.info("Replica " + peer + " partial resync from offset " +
+                 std::to_string(psync_offset) + " (" + std::to_string(missed_bytes) +
+                 " bytes)");
+        if (!net::sendAll(fd, "CONTINUE " + replid + "\n")) {
+            unregister();
+            return;
+        }
+    } else {
+        full_syncs_++;
+        log.info("Replica " + peer + " full sync at offset " + std::to_string(snapshot_offset) +
+                 " (" + std::to_string(snapshot_keys) + " keys, diskless)");
+
+        // FULLRESYNC <replid> <offset> <keys>, then "<bytes> <db>\n<records>"
+        // frames of one database each, ended by "0\n". The database is in
+        // the frame header, never in the records, whose keys may start with
+        // anything. Blocking sends give us TCP flow control.
+        bool ok = net::sendAll(fd, "FULLRESYNC " + replid + " " + std::to_string(snapshot_offset) +
+                                   " " + std::to_string(snapshot_keys) + "\n");
+        std::string chunk;
+        size_t db = 0;
+        auto sendChunk = [&] {
+            ok = net::sendAll(fd, std::to_string(chunk.size()) + " " + std::to_string(db) + "\n") &&
+                 net::sendAll(fd, chunk);
+            snapshot_bytes_sent_ += chunk.size();
+            chunk.clear();
+            return ok;
+        };
+        try {
+            for (; ok && db < snapshot.size(); ++db) {
+                snapshot[db].consume([&](const std::string& key, const std::string& value) {
+                    Store::encodeRecord(chunk, key, value);
+                    return chunk.size() < kSnapshotChunk || sendChunk();
+                });
+                if (ok && !chunk.empty()) sendChunk();
+                snapshot[db] = {};
+            }
+        } catch (const StorageError& e) {
+            // The replica sees the connection drop and starts over
+            log.error("Replica " + peer + " full sync: " + e.what());
+            ok = false;
+        }
+        ok = ok && net::sendAll(fd, "0\n");
+        snapshot.clear();
+        snapshot.shrink_to_fit();
+        if (!ok) {
+            log.warn("Replica " + peer + " failed during snapshot transfer");
+            unregister();
+            return;
+        }
+    }
+
+    // Feed the stream and collect ACKs until the replica goes away
+    net::LineReader reader(fd);
+    while (!shutting_down_.load()) {
+        std::string out;
+        {
+            std::unique_lock<std::mutex> lock(links_mtx_);
+            links_cv_.wait_for(lock, std::chrono::milliseconds(100), [&] {
+                return !link->pending.empty() || link->drop || shutting_down_.load();
+            });
+            if (link->drop) break;
+            out.swap(link->pending);
+        }
+        if (!out.empty()) {
+            if (!net::sendAll(fd, out)) break;
+            std::lock_guard<std::mutex> lock(links_mtx_);
+            link->sent_bytes += out.size();
+        }
+
+        std::string line;
+        net::LineReader::Status st;
+        while ((st = reader.readLine(line, 0)) == net::LineReader::Status::OK) {
+            std::istringstream iss(line);
+            std::string cmd, sub;
+            uint64_t ack = 0;
+            iss >> cmd >> sub >> ack;
+            if (cmd == "REPLCONF" && sub == "ACK") {
+                std::lock_guard<std::mutex> lock(links_mtx_);
+                recordAck(*link, ack);
+            }
+        }
+        if (st == net::LineReader::Status::CLOSED) break;
+    }
+
+    log.info("Replica " + peer + " disconnected");
+    unregister();
+}
+
+void Replication::newHistory() {
+    std::lock_guard<std::recursive_mutex> stream(stream_mtx_);
+    replid_ = newReplId();
+    replid2_.clear();
+    second_offset_ = 0;
+    backlog_.reset(repl_offset_.load());
+    resetReplicas();
+}
+
+void Replication::setBacklogSize(size_t bytes) {
+    std::lock_guard<std::recursive_mutex> stream(stream_mtx_);
+    backlog_ = Backlog(std::max<size_t>(bytes, 1));
+    backlog_.reset(repl_offset_.load());
+}
+
+void Replication::resetReplicas() {
+    std::lock_guard<std::mutex> lock(links_mtx_);
+    for (auto& link : links_) link->drop = true;
+    links_cv_.notify_all();
+}
+
+std::string Replication::applyCounter(const std::string& command, size_t db, Store::Batch* batch) {
+    Store& store = *dbs_[db];
+    std::istringstream iss(command);
+    std::string cmd, key;
+    iss >> cmd >> key;
+
+    if (cmd == "INCRBYFLOAT") {
+        long double delta = 0;
+        iss >> delta;
+        auto result = batch ? batch->incrByFloat(key, delta) : store.incrByFloat(key, delta);
+        if (!result) return "ERROR value is not a valid float\n";
+        return *result + " " + std::to_string(propagate(db, "PUT " + key + " " + *result)) + "\n";
+    }
+
+    int64_t delta = 0;
+    iss >> delta;
+    auto result = batch ? batch->incrBy(key, delta) : store.incrBy(key, delta);
+    if (!result) return "ERROR value is not an integer or out of range\n";
+    return std::to_string(*result) + " " + std::to_string(propagate(db, command)) + "\n";
+}
+
+namespace {
+
+// Apply one stream command to a Store or a Store::Batch
+// Lists, hashes and sorted sets only have a Batch interface
+Store::Batch& batchFor(Store::Batch& batch, std::optional<Store::Batch>&) { return batch; }
+Store::Batch& batchFor(Store& store, std::optional<Store::Batch>& own) {
+    own.emplace(store);
+    return *own;
+}
+
+bool applyCollectionCommand(Store::Batch& batch, const std::string& cmd, const std::string& key,
+                            std::istringstream& iss) {
+    std::vector<std::string> args;
+    std::string arg;
+    while (iss >> arg) args.push_back(arg);
+
+    if (cmd == "LPUSH" || cmd == "RPUSH") {
+        batch.listPush(key, std::move(args), cmd == "LPUSH");
+    } else if (cmd == "LPOP" || cmd == "RPOP") {
+        batch.listPop(key, cmd == "LPOP");
+    } else if (cmd == "LSET" && args.size() == 2) {
+        batch.listSet(key, std::strtol(args[0].c_str(), nullptr, 10), args[1]);
+    } else if (cmd == "HSET") {
+        std::vector<std::pair<std::string, std::string>> fields;
+        for (size_t i = 0; i + 1 < args.size(); i += 2) fields.emplace_back(args[i], args[i + 1]);
+        batch.hashSet(key, std::move(fields));
+    } else if (cmd == "HDEL") {
+        batch.hashDelete(key, args);
+    } else if (cmd == "ZADD") {
+        std::vector<std::pair<double, std::string>> members;
+        double score = 0;
+        for (size_t i = 0; i + 1 < args.size() && SortedSet::parseScore(args[i], score); i += 2) {
+            members.emplace_back(score, args[i + 1]);
+        }
+        batch.zsetAdd(key, members);
+    } else if (cmd == "ZREM") {
+        batch.zsetRemove(key, args);
+    } else if (cmd == "RESTORE") {
+        std::string dump(1, Store::kDumpMark);
+        for (size_t i = 0; i < args.size(); ++i) dump += (i ? " " : "") + args[i];
+        batch.restore(key, dump);
+    } else {
+        return false;
+    }
+    return true;
+}
+
+template <typename Target>
+bool applyStreamCommand(Target& target, const std::string& line) {
+    std::istringstream iss(line);
+    std::string cmd, key, value;
+    iss >> cmd >> key;
+
+    if (cmd == "PUT") {
+        iss >> value;
+        target.put(key, value);
+    } else if (cmd == "UPDATE") {
+        iss >> value;
+        target.update(key, value);
+    } else if (cmd == "DELETE") {
+        target.remove(key);
+    } else if (cmd == "INCRBY") {
+        int64_t delta = 0;
+        iss >> delta;
+        target.incrBy(key, delta);
+    } else if (std::optional<Store::Batch> own;
+               !applyCollectionCommand(batchFor(target, own), cmd, key, iss)) {
+        Logger::instance().warn("Replication: ignoring unknown stream command: " + cmd);
+        return false;
+    }
+    return true;
+}
+
+} // namespace
+
+size_t Replication::streamDb(const std::string& line) {
+    return !line.empty() && line[0] == '@' ? std::strtoull(line.c_str() + 1, nullptr, 10) : 0;
+}
+
+Store* Replication::streamTarget(std::string& line) {
+    if (line.empty() || line[0] != '@') return dbs_[0];
+    size_t space = line.find(' ');
+    size_t db = streamDb(line);
+    line.erase(0, space == std::string::npos ? line.size() : space + 1);
+    if (db < dbs_.size()) return dbs_[db];
+    Logger::instance().warn("Replication: ignoring command for unknown database " + std::to_string(db));
+    return nullptr;
+}
+
+bool Replication::applyCommand(const std::string& line) {
+    std::string cmd = line;
+    Store* target = streamTarget(cmd);
+    try {
+        return target && applyStreamCommand(*target, cmd);
+    } catch (const Store::WrongType&) {
+        // Only streamed after it succeeded on the leader: we have diverged
+        Logger::instance().warn("Replication: wrong value type applying: " + line);
+        return false;
+    } catch (const StorageError& e) {
+        Logger::instance().error("Replication: " + std::string(e.what()) + " applying: " + line);
+        return false;
+    }
+}
+
+void Replication::applyTransaction(const std::vector<std::string>& lines) {
+    // A transaction stays within one database (SELECT can't be queued)
+    std::unique_ptr<Store::Batch> batch;
+    for (const auto& line : lines) {
+        if (line == "MULTI" || line == "EXEC") continue;
+        std::string cmd = line;
+        Store* target = streamTarget(cmd);
+        if (!target) continue;
+        if (!batch) batch = std::make_unique<Store::Batch>(*target);
+        try {
+            applyStreamCommand(*batch, cmd);
+        } catch (const Store::WrongType&) {
+            Logger::instance().warn("Replication: wrong value type applying: " + line);
+        } catch (const StorageError& e) {
+            Logger::instance().error("Replication: " + std::string(e.what()) + " applying: " + line);
+        }
+    }
+}
+
+bool Replication::bulkLoad(net::LineReader& reader, std::vector<std::unique_ptr<Store>>& staging,
+                           size_t& bytes) {
+    // The socket is read on this thread; parsing and inserting run on
+    // loader threads. The queue is bounded, so a slow loader stops us
+    // reading and TCP pushes back on the leader.
+    size_t threads = std::clamp<size_t>(std::thread::hardware_concurrency(), 1, kMaxLoadThreads);
+    std::mutex mtx;
+    std::condition_variable not_empty, not_full;
+    std::deque<std::pair<size_t, std::string>> queue;  // database, records
+    bool done = false;
+
+    std::vector<std::thread> loaders;
+    for (size_t t = 0; t < threads; ++t) {
+        loaders.emplace_back([&] {
+            std::vector<std::pair<std::string, std::string>> kvs;
+            std::string line, key, value;
+            while (true) {
+                size_t db;
+                std::string chunk;
+                {
+                    std::unique_lock<std::mutex> lock(mtx);
+                    not_empty.wait(lock, [&] { return !queue.empty() || done; });
+                    if (queue.empty()) return;
+                    db = queue.front().first;
+                    chunk = std::move(queue.front().second);
+                    queue.pop_front();
+                }
+                not_full.notify_one();
+                if (db >= staging.size()) continue;  // database we don't have
+
+                kvs.clear();
+                size_t start = 0, nl;
+                while ((nl = chunk.find('\n', start)) != std::string::npos) {
+                    line.assign(chunk, start, nl - start);
+                    start = nl + 1;
+                    if (Store::decodeRecord(line, key, value)) kvs.emplace_back(key, value);
+                }
+                staging[db]->putMany(kvs);
+            }
+        });
+    }
+
+    bool ok = true;
+    bytes = 0;
+    std::string header, chunk;
+    net::LineReader::Status st;
+    while (ok) {
+        do {
+            st = reader.readLine(header, 100);
+        } while (st == net::LineReader::Status::TIMEOUT && !follower_stop_.load());
+        if (st != net::LineReader::Status::OK) {
+            ok = false;
+            break;
+        }
+        char* end = nullptr;
+        size_t n = std::strtoull(header.c_str(), &end, 10);
+        if (n == 0) break;  // end of snapshot
+        size_t db = std::strtoull(end, nullptr, 10);
+
+        do {
+            st = reader.readExact(n, chunk, 100);
+        } while (st == net::LineReader::Status::TIMEOUT && !follower_stop_.load());
+        if (st != net::LineReader::Status::OK) {
+            ok = false;
+            break;
+        }
+        bytes += n;
+
+        std::unique_lock<std::mutex> lock(mtx);
+        not_full.wait(lock, [&] { return queue.size() < 2 * threads; });
+        queue.emplace_back(db, std::move(chunk));
+        not_empty.notify_one();
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        done = true;
+        if (!ok) queue.clear();
+    }
+    not_empty.notify_all();
+    for (auto& t : loaders) t.join();
+    return ok;
+}
+
+void Replication::followerSession(int fd, const std::string& token) {
+    auto& log = Logger::instance();
+    net::LineReader reader(fd);
+    std::string line;
+
+    // Blocking reads that still notice REPLICAOF NO ONE / shutdown
+    auto waitLine = [&]() {
+        net::LineReader::Status st;
+        do {
+            st = reader.readLine(line, 100);
+        } while (st == net::LineReader::Status::TIMEOUT && !follower_stop_.load());
+        return st == net::LineReader::Status::OK;
+    };
+
+    if (!token.empty()) {
+        if (!net::sendAll(fd, "AUTH " + token + "\n") || !waitLine()) return;
+        if (line.rfind("OK", 0) != 0) {
+            log.error("Replication: leader rejected AUTH: " + line);
+            return;
+        }
+    }
+
+    // Ask to continue our current history; the leader decides
+    std::string psync;
+    {
+        std::lock_guard<std::recursive_mutex> stream(stream_mtx_);
+        psync = "PSYNC " + replid_ + " " + std::to_string(repl_offset_.load()) + "\n";
+    }
+
+    auto sync_start = std::chrono::steady_clock::now();
+    if (!net::sendAll(fd, psync) || !waitLine()) return;
+
+    std::istringstream hdr(line);
+    std::string tag, replid;
+    uint64_t offset = 0;
+    size_t keys = 0;   // FULLRESYNC: across all databases
+    size_t bytes = 0;  // of the snapshot, once loaded
+    hdr >> tag >> replid >> offset >> keys;
+    net::LineReader::Status st;
+
+    if (tag == "CONTINUE") {
+        offset = repl_offset_.load();
+        {
+            std::lock_guard<std::recursive_mutex> stream(stream_mtx_);
+            if (replid != replid_) {
+                // Leader was promoted from a sibling; its new id now covers our history
+                replid2_ = replid_;
+                second_offset_ = offset;
+                replid_ = replid;
+            }
+        }
+        log.info("Replication: partial resync from offset " + std::to_string(offset));
+    } else if (tag == "FULLRESYNC") {
+        // Load into a staging Store, then swap it in: readers never see a
+        // half-loaded dataset, and the old one is freed outside the lock.
+        std::vector<std::unique_ptr<Store>> staging;
+        for (size_t db = 0; db < dbs_.size(); ++db) staging.push_back(dbs_[db]->emptyLike());
+        // The count covers every database: it only sizes database 0 when
+        // that is the only one
+        if (staging.size() == 1) staging[0]->reserve(keys);
+        if (!bulkLoad(reader, staging, bytes)) return;
+
+        {
+            auto wlocks = lockAllWrites();
+            std::lock_guard<std::recursive_mutex> stream(stream_mtx_);
+            for (size_t db = 0; db < dbs_.size(); ++db) dbs_[db]->swapContents(*staging[db]);
+            repl_offset_.store(offset);
+            notifyOffsetWaiters();
+            replid_ = replid;
+            replid2_.clear();
+            second_offset_ = 0;
+            backlog_.reset(offset);
+        }
+        // Our own replicas now hold a different history
+        resetReplicas();
+        log.info("Replication: full sync done (" + std::to_string(keys) + " keys, " +
+                 std::to_string(bytes) + " bytes, offset " + std::to_string(offset) + ")");
+    } else {
+        log.error("Replication: unexpected PSYNC reply: " + line);
+        return;
+    }
+
+    auto now = std::chrono::steady_clock::now();
+    {
+        std::lock_guard<std::mutex> lock(follower_mtx_);
+        link_up_ = true;
+        last_io_ = now;
+        last_sync_partial_ = tag == "CONTINUE";
+        if (!last_sync_partial_) {
+            last_sync_keys_ = 0;
+            for (Store* db : dbs_) last_sync_keys_ += db->size();
+            last_sync_bytes_ = bytes;
+        }
+        last_sync_ms_ = msBetween(sync_start, now);
+    }
+
+    // Tail the mutation stream
+    uint64_t acked = offset;
+    auto last_ack = now;
+    auto window_start = now;
+    uint64_t window_count = 0;
+    std::vector<std::string> txn;
+
+    while (!follower_stop_.load()) {
+        st = reader.readLine(line, 100);
+        if (st == net::LineReader::Status::CLOSED) break;
+
+        now = std::chrono::steady_clock::now();
+        if (st == net::LineReader::Status::OK) {
+            // A transaction is held back until its EXEC, so the offset (and
+            // any reader waiting on it) never stops halfway through one
+            if (line == "MULTI" || !txn.empty()) {
+                txn.push_back(line);
+                if (line != "EXEC") continue;
+            }
+            {
+                // A transaction stays within one database: its first command names it
+                size_t db = streamDb(txn.empty() ? line : txn[1]);
+                auto wlock = lockWrites(db < dbs_.size() ? db : 0);
+                if (txn.empty()) {
+                    applyCommand(line);
+                    propagate(line);
+                } else {
+                    auto frame = lockStream();
+                    applyTransaction(txn);
+                    for (const auto& l : txn) propagate(l);
+                }
+            }
+            txn.clear();
+            applied_cmds_++;
+            window_count++;
+            std::lock_guard<std::mutex> lock(follower_mtx_);
+            last_io_ = now;
+        }
+
+        // ACK as soon as the stream is drained, and at least once a second
+        bool drained = reader.buffered() == 0;
+        if ((drained && repl_offset_.load() != acked && msBetween(last_ack, now) >= 10.0) ||
+            msBetween(last_ack, now) >= 1000.0) {
+            acked = repl_offset_.load();
+            if (!net::sendAll(fd, "REPLCONF ACK " + std::to_string(acked) + "\n")) break;
+            last_ack = now;
+        }
+
+        double window_ms = msBetween(window_start, now);
+        if (window_ms >= 1000.0) {
+            std::lock_guard<std::mutex> lock(follower_mtx_);
+            apply_rate_ = window_count * 1000.0 / window_ms;
+            window_start = now;
+            window_count = 0;
+        }
+    }
+}
+
+void Replication::followerLoop(std::string host, int port, std::string token) {
+    auto& log = Logger::instance();
+    log.info("Replication: following " + host + ":" + std::to_string(port));
+
+    while (!follower_stop_.load()) {
+        int fd = net::connectTo(host, port);
+        if (fd >= 0) {
+            followerSession(fd, token);
+            close(fd);
+            {
+                std::lock_guard<std::mutex> lock(follower_mtx_);
+                link_up_ = false;
+            }
+            if (!follower_stop_.load()) log.warn("Replication: link to leader lost, retrying");
+        }
+        for (int i = 0; i < 10 && !follower_stop_.load(); ++i) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        }
+    }
+}
+
+void Replication::stopFollower() {
+    follower_stop_.store(true);
+    if (follower_thread_.joinable()) follower_thread_.join();
+    follower_stop_.store(false);
+}
+
+void Replication::replicaOf(const std::string& host, int port, const std::string& token) {
+    std::lock_guard<std::mutex> control(control_mtx_);
+    stopFollower();
+    {
+        std::lock_guard<std::mutex> lock(follower_mtx_);
+        leader_host_ = host;
+        leader_port_ = port;
+        link_up_ = false;
+        applied_cmds_ = 0;
+        apply_rate_ = 0.0;
+    }
+    is_replica_.store(true);
+    follower_thread_ = std::thread(&Replication::followerLoop, this, host, port, token);
+}
+
+void Replication::promote() {
+    std::lock_guard<std::mutex> control(control_mtx_);
+    stopFollower();
+    is_replica_.store(false);
+    // Keep the old id so siblings of the old leader can still PSYNC to us
+    std::lock_guard<std::recursive_mutex> stream(stream_mtx_);
+    replid2_ = replid_;
+    second_offset_ = repl_offset_.load();
+    replid_ = newReplId();
+    Logger::instance().info("Replication: promoted to leader");
+}
+
+void Replication::notifyOffsetWaiters() {
+    if (offset_waiters_.load() == 0) return;
+    std::lock_guard<std::mutex> lock(offset_mtx_);
+    offset_cv_.notify_all();
+}
+
+bool Replication::waitForOffset(uint64_t offset, std::chrono::milliseconds timeout) {
+    if (repl_offset_.load() >= offset) {
+        offset_waits_ok_++;
+        return true;
+    }
+    std::unique_lock<std::mutex> lock(offset_mtx_);
+    offset_waiters_++;
+    bool ok = offset_cv_.wait_for(lock, timeout, [&] {
+        return repl_offset_.load() >= offset || shutting_down_.load();
+    });
+    offset_waiters_--;
+    ok = ok && repl_offset_.load() >= offset;
+    (ok ? offset_waits_ok_ : offset_waits_timeout_)++;
+    return ok;
+}
+
+std::string Replication::leaderAddress() {
+    if (!is_replica_.load()) return "";
+    std::lock_guard<std::mutex> lock(follower_mtx_);
+    return leader_host_ + ":" + std::to_string(leader_port_);
+}
+
+void Replication::shutdown() {
+    std::lock_guard<std::mutex> control(control_mtx_);
+    shutting_down_.store(true);
+    stopFollower();
+    links_cv_.notify_all();
+    std::lock_guard<std::mutex> lock(offset_mtx_);
+    offset_cv_.notify_all();
+}
+
+std::string Replication::info() {
+    std::ostringstream out;
+    auto now = std::chrono::steady_clock::now();
+    uint64_t offset = repl_offset_.load();
+    {
+        std::lock_guard<std::recursive_mutex> stream(stream_mtx_);
+        out << "Role: " << (is_replica_.load() ? "replica" : "leader") << "\n";
+        out << "Replication ID: " << replid_ << "\n";
+        out << "Backlog: size=" << backlog_.buf_.size() << " first_offset=" << backlog_.firstOffset()
+            << " histlen=" << backlog_.histlen_ << "\n";
+    }
+    out << "Full resyncs served: " << full_syncs_.load() << " (diskless, "
+        << snapshot_bytes_sent_.load() << " snapshot bytes sent)\n";
+    out << "Partial resyncs served: " << partial_syncs_.load() << " ("
+        << partial_sync_bytes_.load() << " bytes)\n";
+    out << "Replication offset: " << offset << "\n";
+    out << "Propagated commands: " << propagated_cmds_.load() << "\n";
+    out << "WAIT_OFFSET reads: " << offset_waits_ok_.load() << " served, "
+        << offset_waits_timeout_.load() << " redirected\n";
+
+    if (is_replica_.load()) {
+        std::lock_guard<std::mutex> lock(follower_mtx_);
+        out << "Leader: " << leader_host_ << ":" << leader_port_ << "\n";
+        out << "Link: " << (link_up_ ? "up" : "down") << "\n";
+        if (link_up_) {
+            out << "Last IO: " << static_cast<long>(msBetween(last_io_, now)) << " ms ago\n";
+        }
+        out << "Applied commands: " << applied_cmds_.load() << "\n";
+        out << "Apply rate: " << std::fixed << std::setprecision(1) << apply_rate_ << " cmds/s\n";
+        out << "Last sync: " << (last_sync_partial_ ? "partial" : "full") << " in "
+            << std::setprecision(1) << last_sync_ms_ << " ms\n";
+        out << "Last full sync: " << last_sync_keys_ << " keys, " << last_sync_bytes_ << " bytes\n";
+    }
+
+    std::lock_guard<std::mutex> lock(links_mtx_);
+    out << "Connected replicas: " << links_.size() << "\n";
+    for (size_t i = 0; i < links_.size(); ++i) {
+        const auto& l = *links_[i];
+        uint64_t lag_bytes = offset > l.ack_offset ? offset - l.ack_offset : 0;
+        out << "Replica " << i << ": addr=" << l.peer
+            << " ack_offset=" << l.ack_offset
+            << " lag_bytes=" << lag_bytes
+            << " lag_ms=" << std::fixed << std::setprecision(1) << (lag_bytes ? l.last_lag_ms : 0.0)
+            << " last_ack_ms=" << static_cast<long>(msBetween(l.last_ack, now))
+            << " sent_bytes=" << l.sent_bytes << "\n";
+    }
+    return out.str();
+}
+
+} // namespace keyforge
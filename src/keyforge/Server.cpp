@@ -1,4 +1,8 @@
 #include "keyforge/Server.hpp"
+#include "keyforge/Lsm.hpp"
+#include "keyforge/MappedTable.hpp"
+#include "keyforge/Logger.hpp"
+#include "keyforge/Net.hpp"
 
 #include <unordered_map>
 #include <unordered_set>
@@ -6,15 +10,160 @@
 #include <sstream>
 #include <cstring>
 #include <unistd.h>
+#include <poll.h>
 #include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
 #include <chrono>
 #include <algorithm>
+#include <charconv>
+#include <cmath>
+#include <cstdlib>
 
 namespace keyforge {
 
+namespace {
+
+// INCR / DECR / INCRBY key n become "INCRBY key delta" and INCRBYFLOAT keeps
+// its form: what gets logged and replicated. Empty on a usage error.
+std::string counterCommand(const std::string& cmd, std::istringstream& iss, std::string& key) {
+    std::string arg;
+    iss >> key >> arg;
+    if (key.empty()) return "";
+    if (cmd == "INCR" || cmd == "DECR") {
+        return arg.empty() ? "INCRBY " + key + (cmd == "INCR" ? " 1" : " -1") : "";
+    }
+    if (cmd == "INCRBY") {
+        int64_t delta = 0;
+        auto [end, ec] = std::from_chars(arg.data(), arg.data() + arg.size(), delta);
+        if (arg.empty() || ec != std::errc() || end != arg.data() + arg.size()) return "";
+        return "INCRBY " + key + " " + std::to_string(delta);
+    }
+    char* end = nullptr;
+    long double delta = std::strtold(arg.c_str(), &end);
+    if (arg.empty() || *end != '\0' || !std::isfinite(delta)) return "";
+    return "INCRBYFLOAT " + key + " " + arg;
+}
+
+// Commands on list, hash and sorted-set values
+bool collectionRead(const std::string& cmd) {
+    return cmd == "LRANGE" || cmd == "LINDEX" || cmd == "LLEN" ||
+           cmd == "HGET" || cmd == "HGETALL" || cmd == "HLEN" ||
+           cmd == "ZSCORE" || cmd == "ZRANK" || cmd == "ZRANGE" || cmd == "ZCARD";
+}
+
+bool collectionWrite(const std::string& cmd) {
+    return cmd == "LPUSH" || cmd == "RPUSH" || cmd == "LPOP" || cmd == "RPOP" || cmd == "LSET" ||
+           cmd == "HSET" || cmd == "HDEL" || cmd == "ZADD" || cmd == "ZREM";
+}
+
+bool parseLong(const std::string& s, long& out) {
+    auto [end, ec] = std::from_chars(s.data(), s.data() + s.size(), out);
+    return !s.empty() && ec == std::errc() && end == s.data() + s.size();
+}
+
+// "<n> item item ...": elements never contain spaces
+std::string itemsReply(size_t n, const std::string& items) {
+    return std::to_string(n) + items + "\n";
+}
+
+// Commands MULTI can queue, and the keys each one touches
+bool transactional(const std::string& cmd) {
+    return cmd == "GET" || cmd == "GETV" || cmd == "PUT" || cmd == "UPDATE" || cmd == "DELETE" ||
+           cmd == "MGET" || cmd == "MSET" ||
+           cmd == "INCR" || cmd == "DECR" || cmd == "INCRBY" || cmd == "INCRBYFLOAT" ||
+           collectionRead(cmd) || collectionWrite(cmd);
+}
+
+std::vector<std::string> keysOf(const std::string& line) {
+    std::istringstream iss(line);
+    std::string cmd, word;
+    iss >> cmd;
+    std::vector<std::string> keys;
+    for (size_t i = 0; iss >> word; ++i) {
+        if (cmd == "MGET" || (cmd == "MSET" && i % 2 == 0) || i == 0) keys.push_back(word);
+        if (cmd != "MGET" && cmd != "MSET") break;
+    }
+    return keys;
+}
+
+} // namespace
+
 Server::Server(int port) : port_(port) {
     // Example tokens, you can add more
     auth_tokens_ = {"KeyForgeSecret", "AnotherSecretToken"};
+
+    setDatabases(kDefaultDatabases);
+}
+
+void Server::setDatabases(size_t count) {
+    dbs_ = {&store_};
+    extra_dbs_.clear();
+    for (size_t i = 1; i < std::max<size_t>(count, 1); ++i) {
+        extra_dbs_.push_back(std::make_unique<Store>());
+        dbs_.push_back(extra_dbs_.back().get());
+    }
+    // Every change, whether from a client, replication or Raft, reaches
+    // tracking clients and keyspace notification subscribers
+    for (size_t i = 0; i < dbs_.size(); ++i) {
+        dbs_[i]->setWriteObserver([this, i](const std::string& key, const char* event) {
+            tracking_.invalidate(key);
+            pubsub_.keyspaceEvent(i, key, event);
+            blocking_.touched(i, key, event);
+        });
+    }
+    repl_.setDatabases(dbs_);
+}
+
+void Server::setDbMaxMemory(size_t bytes) {
+    for (Store* db : dbs_) db->setMaxMemory(bytes);
+}
+
+void Server::enableKeyFilter() {
+    for (Store* db : dbs_) db->enableKeyFilter();
+}
+
+void Server::setCompression(size_t threshold) {
+    for (Store* db : dbs_) db->setCompression(threshold);
+}
+
+void Server::setStorageDir(const std::string& dir, size_t block_cache_bytes) {
+    LsmEngine::Options options;
+    options.block_cache_bytes = block_cache_bytes;
+    for (size_t i = 0; i < dbs_.size(); ++i) {
+        // A Store may need a second engine (a replica's full resync loads
+        // into a copy), so each one gets a directory of its own
+        std::string base = dir + "/db" + std::to_string(i) + "/";
+        auto next = std::make_shared<std::atomic<size_t>>(0);
+        dbs_[i]->setStorageEngine([base, next, options] {
+            return std::make_unique<LsmEngine>(base + std::to_string((*next)++), options);
+        });
+    }
+}
+
+void Server::setMappedDir(const std::string& dir) {
+    for (size_t i = 0; i < dbs_.size(); ++i) {
+        std::string home = dir + "/db" + std::to_string(i) + ".kfmap";
+        auto next = std::make_shared<std::atomic<size_t>>(0);
+        dbs_[i]->setStorageEngine([home, next] { return std::make_unique<MappedTable>(home, (*next)++); });
+    }
+}
+
+void Server::setValueLogDir(const std::string& dir, std::chrono::seconds cold_after) {
+    for (size_t i = 0; i < dbs_.size(); ++i) {
+        std::string base = dir + "/db" + std::to_string(i) + "/";
+        auto next = std::make_shared<std::atomic<size_t>>(0);
+        dbs_[i]->setValueLog([base, next] { return std::make_unique<ValueLog>(base + std::to_string((*next)++)); },
+                             cold_after);
+    }
+}
+
+void Server::setWriteOptions(const FileWriter::Options& options) {
+    for (Store* db : dbs_) db->setWriteOptions(options);
+}
+
+std::string Server::defaultFile(size_t db) {
+    return db == 0 ? "keyforge_store.db" : "keyforge_store_" + std::to_string(db) + ".db";
 }
 
 Server::~Server() {
@@ -31,147 +180,1098 @@ Server::~Server() {
 }
 
 void Server::requestShutdown() {
+    // Async-signal-safe: only wake up accept(); run() does the rest
     shutdown_requested_.store(true);
-    if (server_fd_ != -1) {
-        shutdown(server_fd_, SHUT_RDWR);
-        close(server_fd_);
-        server_fd_ = -1;
+    int fd = server_fd_;
+    if (fd != -1) shutdown(fd, SHUT_RDWR);
+}
+
+void Server::replicaOf(const std::string& host, int port, const std::string& token) {
+    repl_.replicaOf(host, port, token);
+}
+
+void Server::setReplBacklogSize(size_t bytes) {
+    repl_.setBacklogSize(bytes);
+}
+
+void Server::setReadWait(std::chrono::milliseconds timeout) {
+    read_wait_ = timeout;
+}
+
+void Server::enableCluster(const std::string& announce_host) {
+    cluster_.enable(announce_host + ":" + std::to_string(port_));
+}
+
+std::string Server::selfAddress(const std::vector<std::string>& members) const {
+    std::string suffix = ":" + std::to_string(port_);
+    for (const auto& m : members) {
+        if (m.size() > suffix.size() && m.compare(m.size() - suffix.size(), suffix.size(), suffix) == 0) {
+            return m;
+        }
+    }
+    return "";
+}
+
+void Server::enableRaft(const std::vector<std::string>& members, const std::string& token) {
+    raft_.start(selfAddress(members), members, "keyforge_raft_" + std::to_string(port_), token);
+}
+
+void Server::enableGossip(const std::vector<std::string>& seeds) {
+    std::string self = selfAddress(seeds);
+    if (self.empty()) self = "127.0.0.1:" + std::to_string(port_);
+    gossip_.start(self, seeds);
+}
+
+void Server::reply(int client_fd, Session& session, const std::string& msg) {
+    // With tracking on, writers push invalidations to this socket too
+    if (!session.tracking) {
+        send_all(client_fd, msg);
+        return;
     }
+    std::lock_guard<std::timed_mutex> lock(session.tracking->send_mtx);
+    send_all(client_fd, msg);
 }
 
 void Server::send_all(int fd, const std::string& msg) {
     size_t total_sent = 0;
     while (total_sent < msg.size()) {
-        ssize_t sent = send(fd, msg.data() + total_sent, msg.size() - total_sent, 0);
+        ssize_t sent = send(fd, msg.data() + total_sent, msg.size() - total_sent, MSG_NOSIGNAL);
         if (sent <= 0) break;
         total_sent += sent;
     }
 }
 
-void Server::handleClient(int client_fd) {
-    connected_clients_++;
+bool Server::processCommand(int client_fd, Session& session, const std::string& line, std::string& out) {
+    std::istringstream iss(line);
+    std::string cmd, key, value;
+    iss >> cmd;
 
-    std::chrono::steady_clock::time_point last_active = std::chrono::steady_clock::now();
-    char buffer[1024];
+    Store& store = *dbs_[session.db];
+    std::string response;
 
-    while (true) {
-        // Check inactivity timeout (2 minutes)
-        auto now = std::chrono::steady_clock::now();
-        auto inactive_seconds = std::chrono::duration_cast<std::chrono::seconds>(now - last_active).count();
-        if (inactive_seconds > 120) { // 2 minutes
-            send_all(client_fd, "INFO: Session expired due to inactivity\n");
-            break;
+    // Read-your-writes: WAIT_OFFSET <token> GET ... runs the read once this
+    // node has applied the stream up to the offset returned by a write.
+    if (cmd == "WAIT_OFFSET") {
+        uint64_t token = 0;
+        std::string inner;
+        iss >> token;
+        std::getline(iss >> std::ws, inner);
+        std::string inner_cmd = inner.substr(0, inner.find(' '));
+        if (inner_cmd != "GET" && inner_cmd != "GET_KEY") {
+            out += "ERROR WAIT_OFFSET only wraps GET and GET_KEY\n";
+            return true;
         }
-
-        memset(buffer, 0, sizeof(buffer));
-        ssize_t n = recv(client_fd, buffer, sizeof(buffer) - 1, MSG_DONTWAIT);
-        if (n < 0) {
-            // No data yet, just wait a bit
-            std::this_thread::sleep_for(std::chrono::milliseconds(100));
-            continue;
+        if (repl_.isReplica() && !repl_.waitForOffset(token, read_wait_)) {
+            out += "ERROR LAGGING " + repl_.leaderAddress() + " " +
+                   std::to_string(repl_.offset()) + "\n";
+            return true;
         }
-        if (n == 0) break; // client disconnected
+        return processCommand(client_fd, session, inner, out);
+    }
 
-        last_active = std::chrono::steady_clock::now();
-        std::istringstream iss(buffer);
-        std::string cmd, key, value;
-        iss >> cmd;
+    // ASKING only covers the command right after it
+    bool asking = session.asking;
+    session.asking = false;
 
-        std::string response;
+    // Sensitive command check
+    auto requires_auth = [&](const std::string& c) {
+        return c == "UPDATE" || c == "DELETE" || c == "SHUTDOWN" ||
+               c == "SYNC" || c == "PSYNC" || c == "REPLICAOF" ||
+               c == "MIGRATE" || c == "RAFT_PEER";
+    };
 
-        // Sensitive command check
-        auto requires_auth = [&](const std::string& c) {
-            return c == "UPDATE" || c == "DELETE" || c == "SHUTDOWN";
-        };
+    // Replicas only change through the replication stream
+    auto is_write = [&](const std::string& c) {
+        return c == "PUT" || c == "UPDATE" || c == "DELETE" || c == "LOAD" || c == "MSET" ||
+               c == "INCR" || c == "DECR" || c == "INCRBY" || c == "INCRBYFLOAT" || c == "CAS" ||
+               c == "RESTORE" || c == "BLPOP" || c == "BRPOP" || collectionWrite(c);
+    };
 
-        bool authenticated = false;
-        {
-            std::lock_guard<std::mutex> lock(auth_mutex_);
-            authenticated = client_authenticated_[client_fd];
+    // Still allowed over the memory limit
+    auto frees_memory = [&](const std::string& c) {
+        return c == "DELETE" || c == "LOAD" || c == "LPOP" || c == "RPOP" || c == "BLPOP" || c == "BRPOP" ||
+               c == "HDEL" || c == "ZREM";
+    };
+
+    bool authenticated = false;
+    {
+        std::lock_guard<std::mutex> lock(auth_mutex_);
+        authenticated = client_authenticated_[client_fd];
+    }
+
+    if (requires_auth(cmd) && !authenticated) {
+        session.multi_failed = session.in_multi;
+        out += "ERROR Unauthorized. Please AUTH first.\n";
+        return true;
+    }
+
+    if (is_write(cmd) && repl_.isReplica()) {
+        session.multi_failed = session.in_multi;
+        out += "ERROR READONLY You can't write against a replica.\n";
+        return true;
+    }
+
+    // A database over its memory limit only accepts writes that free memory
+    if (is_write(cmd) && !frees_memory(cmd) && store.overMemoryLimit()) {
+        session.multi_failed = session.in_multi;
+        out += "ERROR OOM command not allowed when used memory > 'maxmemory'\n";
+        return true;
+    }
+
+    // Inside MULTI everything but the transaction commands is queued for EXEC
+    if (session.in_multi && cmd != "EXEC" && cmd != "DISCARD" && cmd != "MULTI" && cmd != "WATCH") {
+        if (!transactional(cmd)) {
+            session.multi_failed = true;
+            out += "ERROR " + cmd + " can't be used inside MULTI\n";
+        } else {
+            session.queued.push_back(line);
+            out += "QUEUED\n";
         }
+        return true;
+    }
 
-        if (requires_auth(cmd) && !authenticated) {
-            response = "ERROR Unauthorized. Please AUTH first.\n";
-            send_all(client_fd, response);
-            continue;
+    if (cmd == "INCR" || cmd == "DECR" || cmd == "INCRBY" || cmd == "INCRBYFLOAT") {
+        std::string counter = counterCommand(cmd, iss, key);
+        if (counter.empty()) {
+            out += "ERROR Usage: INCR key | DECR key | INCRBY key integer | INCRBYFLOAT key number\n";
+            return true;
         }
+        if (raft_.enabled()) {
+            out += raft_.submit(counter);
+            return true;
+        }
+        auto wlock = repl_.lockWrites(session.db);
+        response = cluster_.route(key, asking);
+        out += response.empty() ? repl_.applyCounter(counter, session.db) : response;
+        return true;
+    }
 
-        if (cmd == "PUT") {
+    // Raft mode: mutations go through the replicated log, reads need the leader lease
+    if (raft_.enabled()) {
+        if (cmd == "PUT" || cmd == "UPDATE" || cmd == "DELETE") {
             iss >> key >> value;
-            store_.put(key, value);
-            response = "OK\n";
+            out += raft_.submit(cmd == "DELETE" ? cmd + " " + key : cmd + " " + key + " " + value);
+            return true;
         }
-        else if (cmd == "GET") {
-            iss >> key;
-            auto val = store_.get(key);
+        if (cmd == "MSET") {
+            // One log entry for all the pairs, applied in one step
+            std::string entry = "MSET";
+            while (iss >> key >> value) entry += " " + key + " " + value;
+            out += entry.size() > 4 ? raft_.submit(entry) : "ERROR Usage: MSET key value [key value ...]\n";
+            return true;
+        }
+        if (cmd == "LOAD" || cmd == "CAS" || cmd == "RESTORE" || cmd == "BLPOP" || cmd == "BRPOP" ||
+            collectionWrite(cmd)) {
+            // Versions come from each node's own clock, so replicas can't re-check them
+            out += "ERROR " + cmd + " is not available in Raft mode\n";
+            return true;
+        }
+        if ((cmd == "GET" || cmd == "GETV" || cmd == "GET_KEY" || cmd == "MGET" || cmd == "SCAN" ||
+             cmd == "TYPE" || collectionRead(cmd)) &&
+            !raft_.canServeRead(response)) {
+            out += response;
+            return true;
+        }
+    }
+
+    // Cluster routing: writes decide under the write lock, so a MIGRATE
+    // batch can't move the key between the check and the write.
+    if (cmd == "PUT") {
+        iss >> key >> value;
+        auto wlock = repl_.lockWrites(session.db);
+        response = cluster_.route(key, asking);
+        if (response.empty()) {
+            store.put(key, value);
+            uint64_t off = repl_.propagate(session.db, "PUT " + key + " " + value);
+            response = "OK " + std::to_string(off) + "\n";
+        }
+    }
+    else if (cmd == "GET") {
+        iss >> key;
+        response = cluster_.route(key, asking);
+        if (response.empty()) {
+            hotkeys_.record(key);
+            if (session.tracking) tracking_.remember(key, session.tracking);
+            auto val = store.get(key);
             response = val ? *val + "\n" : "NOT_FOUND\n";
         }
-        else if (cmd == "GET_KEY") {
-            iss >> value;
-            auto key_opt = store_.getKeyByValue(value);
-            response = key_opt ? ("OK. Key found :" + *key_opt + "\n") : "NOT_FOUND\n";
+    }
+    else if (cmd == "GETV") {
+        // "<value> <version>", the version to hand to CAS
+        iss >> key;
+        response = cluster_.route(key, asking);
+        if (response.empty()) {
+            hotkeys_.record(key);
+            if (session.tracking) tracking_.remember(key, session.tracking);
+            auto val = store.getVersioned(key);
+            response = val ? val->first + " " + std::to_string(val->second) + "\n" : "NOT_FOUND\n";
         }
-        else if (cmd == "DELETE") {
-            iss >> key;
-            bool removed = store_.remove(key);
-            response = removed ? "DELETED\n" : "NOT_FOUND\n";
+    }
+    else if (cmd == "CAS") {
+        // CAS key expected_version value -> "OK <offset> <new version>" or
+        // "CONFLICT <current version>"; version 0 means "create, must not exist"
+        uint64_t expected = 0;
+        iss >> key >> expected >> value;
+        if (key.empty() || value.empty() || iss.fail()) {
+            response = "ERROR Usage: CAS key expected_version value\n";
+        } else {
+            auto wlock = repl_.lockWrites(session.db);
+            response = cluster_.route(key, asking);
+            uint64_t version = 0;
+            if (response.empty() && store.compareAndSwap(key, expected, value, version)) {
+                uint64_t off = repl_.propagate(session.db, "PUT " + key + " " + value);
+                response = "OK " + std::to_string(off) + " " + std::to_string(version) + "\n";
+            } else if (response.empty()) {
+                response = "CONFLICT " + std::to_string(version) + "\n";
+            }
         }
-        else if (cmd == "UPDATE") {
-            iss >> key >> value;
-            bool updated = store_.update(key, value);
-            response = updated ? "UPDATED\n" : "NOT_FOUND\n";
+    }
+    else if (cmd == "MULTI") {
+        if (raft_.enabled()) {
+            response = "ERROR MULTI is not available in Raft mode\n";
+        } else if (session.in_multi) {
+            response = "ERROR MULTI calls can not be nested\n";
+        } else {
+            session.in_multi = true;
+            response = "OK\n";
         }
-        else if (cmd == "SHUTDOWN") {
-            response = "Server shutting down...\nType anything and enter to exit this NetCat session.\n";
-            send_all(client_fd, response);
-            close(client_fd);
-            requestShutdown();
-            break;
+    }
+    else if (cmd == "EXEC") {
+        response = session.in_multi ? execTransaction(session) : "ERROR EXEC without MULTI\n";
+    }
+    else if (cmd == "DISCARD") {
+        if (session.in_multi) {
+            session.resetMulti();
+            response = "OK\n";
+        } else {
+            response = "ERROR DISCARD without MULTI\n";
         }
-        else if (cmd == "SAVE") {
-            std::string filename;
-            iss >> filename;
-            if (filename.empty()) filename = "keyforge_store.db";
-            bool ok = store_.saveToFile(filename);
-            response = ok ? "OK Saved\n" : "ERROR Failed to save\n";
-        }
-        else if (cmd == "LOAD") {
-            std::string filename;
-            iss >> filename;
-            if (filename.empty()) filename = "keyforge_store.db";
-            bool ok = store_.loadFromFile(filename);
-            response = ok ? "OK Loaded\n" : "ERROR Failed to load\n";
-        }
-        else if (cmd == "STATS") {
-            size_t keys = store_.size();
-            response = "Keys: " + std::to_string(keys) + "\n";
-            response += "GET hits: " + std::to_string(store_.get_count) + "\n";
-            response += "GET misses: " + std::to_string(store_.get_miss_count) + "\n";
-            response += "PUTs: " + std::to_string(store_.put_count) + "\n";
-            response += "UPDATEs: " + std::to_string(store_.update_count) + "\n";
-            response += "DELETEs: " + std::to_string(store_.delete_count) + "\n";
-            response += "Connected clients: " + std::to_string(connected_clients_) + "\n";
-        }
-        else if (cmd == "AUTH") {
-            std::string token;
-            iss >> token;
-            bool valid = false;
-            {
-                std::lock_guard<std::mutex> lock(auth_mutex_);
-                if (auth_tokens_.count(token)) {
-                    client_authenticated_[client_fd] = true;
-                    valid = true;
-                } else {
-                    client_authenticated_[client_fd] = false;
+    }
+    else if (cmd == "WATCH") {
+        // EXEC aborts if any watched key was written (or deleted) in between
+        std::vector<std::string> keys;
+        while (iss >> key) keys.push_back(key);
+        if (session.in_multi) {
+            response = "ERROR WATCH inside MULTI is not allowed\n";
+        } else if (keys.empty()) {
+            response = "ERROR Usage: WATCH key [key ...]\n";
+        } else {
+            for (const auto& k : keys) {
+                response = cluster_.route(k, asking);
+                if (!response.empty()) break;
+            }
+            if (response.empty()) {
+                for (const auto& k : keys) session.watched.push_back({session.db, k, store.version(k)});
+                response = "OK\n";
+            }
+        }
+    }
+    else if (cmd == "UNWATCH") {
+        session.watched.clear();
+        response = "OK\n";
+    }
+    else if (cmd == "SELECT") {
+        // Logical databases share nothing but the connection; cluster and
+        // Raft mode only know database 0
+        size_t db = dbs_.size();
+        iss >> db;
+        if (iss.fail() || db >= dbs_.size()) {
+            response = "ERROR DB index is out of range (0-" + std::to_string(dbs_.size() - 1) + ")\n";
+        } else if (db != 0 && (cluster_.enabled() || raft_.enabled())) {
+            response = "ERROR SELECT is not allowed in cluster or Raft mode\n";
+        } else {
+            session.db = db;
+            response = "OK\n";
+        }
+    }
+    else if (collectionRead(cmd) || collectionWrite(cmd)) {
+        std::unique_lock<std::mutex> wlock;
+        if (collectionWrite(cmd)) wlock = repl_.lockWrites(session.db);
+        iss >> key;
+        response = cluster_.route(key, asking);
+        if (response.empty()) {
+            Store::Batch batch(store);
+            response = runCollection(session, batch, line);
+        }
+    }
+    else if (cmd == "BLPOP" || cmd == "BRPOP" || cmd == "WAITKEY") {
+        return runBlocking(client_fd, session, line, out);
+    }
+    else if (cmd == "TYPE") {
+        iss >> key;
+        response = cluster_.route(key, asking);
+        if (response.empty()) response = store.type(key) + "\n";
+    }
+    else if (cmd == "RESTORE") {
+        // RESTORE key <dump without its mark>: how MIGRATE moves a list,
+        // hash or sorted set
+        std::string dump;
+        iss >> key;
+        std::getline(iss >> std::ws, dump);
+        auto wlock = repl_.lockWrites(session.db);
+        response = cluster_.route(key, asking);
+        if (response.empty()) {
+            Store::Batch batch(store);
+            response = batch.restore(key, Store::kDumpMark + dump)
+                ? "OK " + std::to_string(repl_.propagate(session.db, "RESTORE " + key + " " + dump)) + "\n"
+                : "ERROR Usage: RESTORE key L|H|Z element ...\n";
+        }
+    }
+    else if (cmd == "GET_KEY") {
+        iss >> value;
+        auto key_opt = store.getKeyByValue(value);
+        response = key_opt ? ("OK. Key found :" + *key_opt + "\n") : "NOT_FOUND\n";
+    }
+    else if (cmd == "DELETE") {
+        iss >> key;
+        auto wlock = repl_.lockWrites(session.db);
+        response = cluster_.route(key, asking);
+        if (response.empty()) {
+            bool removed = store.remove(key);
+            response = removed ? "DELETED " + std::to_string(repl_.propagate(session.db, "DELETE " + key)) + "\n"
+                               : "NOT_FOUND\n";
+        }
+    }
+    else if (cmd == "UPDATE") {
+        iss >> key >> value;
+        auto wlock = repl_.lockWrites(session.db);
+        response = cluster_.route(key, asking);
+        if (response.empty()) {
+            bool updated = store.update(key, value);
+            response = updated ? "UPDATED " + std::to_string(repl_.propagate(session.db, "UPDATE " + key + " " + value)) + "\n"
+                               : "NOT_FOUND\n";
+        }
+    }
+    else if (cmd == "MGET") {
+        // Values on one line, in key order, NOT_FOUND for misses
+        std::vector<std::string> keys;
+        while (iss >> key) keys.push_back(key);
+        for (const auto& k : keys) {
+            response = cluster_.route(k, asking);
+            if (!response.empty()) break;
+        }
+        if (keys.empty()) {
+            response = "ERROR Usage: MGET key [key ...]\n";
+        } else if (response.empty()) {
+            for (size_t i = 0; i < keys.size(); ++i) {
+                hotkeys_.record(keys[i]);
+                if (session.tracking) tracking_.remember(keys[i], session.tracking);
+                auto val = store.get(keys[i]);
+                if (i > 0) response += ' ';
+                response += val ? *val : "NOT_FOUND";
+            }
+            response += '\n';
+        }
+    }
+    else if (cmd == "MSET") {
+        std::vector<std::pair<std::string, std::string>> kvs;
+        while (iss >> key >> value) kvs.emplace_back(key, value);
+        if (kvs.empty()) {
+            response = "ERROR Usage: MSET key value [key value ...]\n";
+        } else {
+            auto wlock = repl_.lockWrites(session.db);
+            for (const auto& kv : kvs) {
+                response = cluster_.route(kv.first, asking);
+                if (!response.empty()) break;
+            }
+            if (response.empty()) {
+                uint64_t off = 0;
+                for (const auto& [k, v] : kvs) {
+                    store.put(k, v);
+                    off = repl_.propagate(session.db, "PUT " + k + " " + v);
                 }
+                response = "OK " + std::to_string(off) + "\n";
+            }
+        }
+    }
+    else if (cmd == "SCAN") {
+        // SCAN cursor [COUNT n] -> "<next cursor> key key ...", 0 when done
+        std::string cursor, opt;
+        size_t count = 10;
+        iss >> cursor >> opt;
+        if (opt == "COUNT") iss >> count;
+        std::vector<std::string> keys;
+        cursor = store.scan(cursor, std::max<size_t>(count, 1), keys);
+        response = cursor;
+        for (const auto& k : keys) response += " " + k;
+        response += '\n';
+    }
+    else if (cmd == "SHUTDOWN") {
+        out += "Server shutting down...\nType anything and enter to exit this NetCat session.\n";
+        requestShutdown();
+        return false;
+    }
+    else if (cmd == "SAVE") {
+        std::string filename;
+        iss >> filename;
+        if (filename.empty()) filename = defaultFile(session.db);
+        bool ok = store.saveToFile(filename);
+        response = ok ? "OK Saved\n" : "ERROR Failed to save\n";
+    }
+    else if (cmd == "LOAD") {
+        std::string filename;
+        iss >> filename;
+        if (filename.empty()) filename = defaultFile(session.db);
+        bool ok = false;
+        {
+            // The dataset is replaced wholesale; replicas must full-resync
+            auto wlock = repl_.lockWrites(session.db);
+            ok = store.loadFromFile(filename);
+            if (ok) repl_.newHistory();
+        }
+        response = ok ? "OK Loaded\n" : "ERROR Failed to load\n";
+    }
+    else if (cmd == "STATS") {
+        size_t keys = store.size();
+        response = "Database: " + std::to_string(session.db) + "\n";
+        response += "Keys: " + std::to_string(keys) + "\n";
+        response += "Used memory: " + std::to_string(store.usedMemory()) + " bytes (limit " +
+                    std::to_string(store.maxMemory()) + ")\n";
+        response += "GET hits: " + std::to_string(store.get_count) + "\n";
+        response += "GET misses: " + std::to_string(store.get_miss_count) + "\n";
+        response += store.keyFilterInfo();
+        response += store.compressionInfo();
+        response += store.dedupInfo();
+        response += store.storageInfo();
+        response += store.valueLogInfo();
+        response += store.snapshotInfo();
+        response += "PUTs: " + std::to_string(store.put_count) + "\n";
+        response += "UPDATEs: " + std::to_string(store.update_count) + "\n";
+        response += "DELETEs: " + std::to_string(store.delete_count) + "\n";
+        response += "INCRs: " + std::to_string(store.incr_count) + "\n";
+        response += "CAS: " + std::to_string(store.cas_count) + " ok, " +
+                    std::to_string(store.cas_conflict_count) + " conflicts\n";
+        response += "Connected clients: " + std::to_string(connected_clients_) + "\n";
+        response += tracking_.info();
+        response += pubsub_.info();
+        response += blocking_.info();
+    }
+    else if (cmd == "COMPRESSION") {
+        // COMPRESSION TRAIN [max_bytes]: shared dictionary from the current values
+        std::string sub;
+        size_t max_bytes = compression::kMaxDictionary;
+        iss >> sub >> max_bytes;
+        if (sub != "TRAIN" || max_bytes == 0) {
+            response = "ERROR Usage: COMPRESSION TRAIN [max_bytes]\n";
+        } else {
+            size_t size = store.trainCompression(max_bytes);
+            response = size ? "OK " + std::to_string(size) + "\n" : "ERROR Not enough repeated content to train on\n";
+        }
+    }
+    else if (cmd == "HOTKEYS") {
+        // HOTKEYS [n] -> "HOTKEYS <m>" then m lines of "key estimated_reads"
+        size_t n = 10;
+        iss >> n;
+        auto hot = hotkeys_.top(std::min(n, HotKeys::kTopK));
+        response = "HOTKEYS " + std::to_string(hot.size()) + "\n";
+        for (const auto& [k, count] : hot) response += k + " " + std::to_string(count) + "\n";
+    }
+    else if (cmd == "CLIENT") {
+        std::string sub, arg;
+        iss >> sub >> arg;
+        if (sub == "TRACKING" && arg == "ON") {
+            if (!session.tracking) session.tracking = tracking_.subscribe(client_fd);
+            response = "OK\n";
+        } else if (sub == "TRACKING" && arg == "OFF") {
+            if (session.tracking) tracking_.unsubscribe(session.tracking);
+            session.tracking.reset();
+            response = "OK\n";
+        } else {
+            response = "ERROR Usage: CLIENT TRACKING ON|OFF\n";
+        }
+    }
+    else if (cmd == "SUBSCRIBE" || cmd == "UNSUBSCRIBE" || cmd == "PSUBSCRIBE" || cmd == "PUNSUBSCRIBE") {
+        // Replies "<CMD>D <subscriptions now>"; messages then arrive as
+        // >MESSAGE channel payload / >PMESSAGE pattern channel payload
+        std::vector<std::string> names;
+        std::string name;
+        while (iss >> name) names.push_back(name);
+        bool subscribing = cmd == "SUBSCRIBE" || cmd == "PSUBSCRIBE";
+        if (subscribing && names.empty()) {
+            response = "ERROR Usage: " + cmd + (cmd == "SUBSCRIBE" ? " channel" : " pattern") + " [...]\n";
+        } else {
+            if (!session.pubsub && subscribing) session.pubsub = std::make_shared<PubSub::Subscriber>(client_fd);
+            size_t count = 0;
+            if (session.pubsub) {
+                if (cmd == "SUBSCRIBE") count = pubsub_.subscribe(session.pubsub, names);
+                else if (cmd == "UNSUBSCRIBE") count = pubsub_.unsubscribe(session.pubsub, names);
+                else if (cmd == "PSUBSCRIBE") count = pubsub_.psubscribe(session.pubsub, names);
+                else count = pubsub_.punsubscribe(session.pubsub, names);
+            }
+            response = cmd + "D " + std::to_string(count) + "\n";
+        }
+    }
+    else if (cmd == "PUBLISH") {
+        // PUBLISH channel message... -> number of subscribers reached on this node
+        std::string channel, message;
+        iss >> channel;
+        std::getline(iss >> std::ws, message);
+        response = channel.empty() ? "ERROR Usage: PUBLISH channel message\n"
+                                   : std::to_string(pubsub_.publish(channel, message)) + "\n";
+    }
+    else if (cmd == "REPLICAOF") {
+        std::string host, port_str, token;
+        iss >> host >> port_str >> token;
+        if (host == "NO" && port_str == "ONE") {
+            repl_.promote();
+            response = "OK\n";
+        } else {
+            int leader_port = 0;
+            try {
+                leader_port = std::stoi(port_str);
+            } catch (const std::exception&) {
+                leader_port = 0;
+            }
+            if (host.empty() || leader_port <= 0) {
+                response = "ERROR Usage: REPLICAOF host port [token] | REPLICAOF NO ONE\n";
+            } else {
+                repl_.replicaOf(host, leader_port, token);
+                response = "OK\n";
+            }
+        }
+    }
+    else if (cmd == "SYNC" || cmd == "PSYNC") {
+        std::string psync_replid;
+        uint64_t psync_offset = 0;
+        if (cmd == "PSYNC") iss >> psync_replid >> psync_offset;
+
+        sockaddr_in peer{};
+        socklen_t peer_len = sizeof(peer);
+        std::string peer_name = "unknown";
+        if (getpeername(client_fd, (struct sockaddr*)&peer, &peer_len) == 0) {
+            char ip[INET_ADDRSTRLEN];
+            inet_ntop(AF_INET, &peer.sin_addr, ip, sizeof(ip));
+            peer_name = std::string(ip) + ":" + std::to_string(ntohs(peer.sin_port));
+        }
+        // This connection now belongs to the replication stream
+        send_all(client_fd, out);
+        out.clear();
+        repl_.serveReplica(client_fd, peer_name, psync_replid, psync_offset);
+        return false;
+    }
+    else if (cmd == "REPLINFO") {
+        response = repl_.info();
+    }
+    else if (cmd == "RAFT_PEER") {
+        if (!raft_.enabled()) {
+            response = "ERROR Raft mode is not enabled\n";
+        } else {
+            // This connection now carries Raft RPCs from a peer
+            send_all(client_fd, out);
+            out.clear();
+            raft_.servePeer(client_fd);
+            return false;
+        }
+    }
+    else if (cmd == "RAFT") {
+        std::string sub, arg;
+        iss >> sub >> arg;
+        if (!raft_.enabled()) {
+            response = "ERROR Raft mode is not enabled\n";
+        } else if (sub == "INFO") {
+            response = raft_.info();
+        } else if (sub == "BATCHING" && (arg == "ON" || arg == "OFF")) {
+            raft_.setBatching(arg == "ON");
+            response = "OK\n";
+        } else {
+            response = "ERROR Usage: RAFT INFO | RAFT BATCHING ON|OFF\n";
+        }
+    }
+    else if (cmd == "GOSSIP") {
+        std::string sub;
+        iss >> sub;
+        if (!gossip_.enabled()) {
+            response = "ERROR Gossip is not enabled\n";
+        } else if (sub == "MEMBERS") {
+            // One line, live members only: what clients and proxies shard over
+            for (const auto& m : gossip_.liveMembers()) response += (response.empty() ? "" : " ") + m;
+            response += "\n";
+        } else if (sub == "INFO") {
+            response = gossip_.info();
+        } else {
+            response = "ERROR Usage: GOSSIP MEMBERS|INFO\n";
+        }
+    }
+    else if (cmd == "ASKING") {
+        session.asking = true;
+        response = "OK\n";
+    }
+    else if (cmd == "CLUSTER") {
+        std::string sub;
+        iss >> sub;
+        if (!cluster_.enabled()) {
+            response = "ERROR This instance has cluster support disabled\n";
+        }
+        else if (sub == "KEYSLOT") {
+            iss >> key;
+            response = std::to_string(Cluster::keySlot(key)) + "\n";
+        }
+        else if (sub == "SLOTS") {
+            response = cluster_.slotsReply();
+        }
+        else if (sub == "INFO") {
+            response = cluster_.infoReply();
+        }
+        else if ((sub == "ADDSLOTS" || sub == "SETSLOT") && !authenticated) {
+            response = "ERROR Unauthorized. Please AUTH first.\n";
+        }
+        else if (sub == "ADDSLOTS" || sub == "SETSLOT") {
+            long first = -1, last = -1;
+            std::string state = "NODE", addr;
+            iss >> first >> last;
+            if (sub == "SETSLOT") iss >> state >> addr;
+            else addr = cluster_.self();
+            std::string err;
+            if (first < 0 || last < 0 || last >= Cluster::kSlots) {
+                response = "ERROR Usage: CLUSTER SETSLOT first last NODE|MIGRATING|IMPORTING|STABLE [host:port]\n";
+            } else if (cluster_.setSlots(static_cast<uint16_t>(first), static_cast<uint16_t>(last),
+                                         state, addr, err)) {
+                response = "OK\n";
+            } else {
+                response = err;
             }
-            response = valid ? "OK Authenticated\n" : "ERROR Invalid token\n";
         }
         else {
-            response = "ERROR: Unknown command\nValid Commands : [GET, PUT, UPDATE, DELETE, SHUTDOWN, AUTH, SAVE, LOAD, STATS, GET_KEY]\n";
+            response = "ERROR Usage: CLUSTER KEYSLOT|SLOTS|INFO|ADDSLOTS|SETSLOT\n";
+        }
+    }
+    else if (cmd == "MIGRATE") {
+        std::string host, token;
+        long target_port = 0, first = -1, last = -1;
+        iss >> host >> target_port >> first >> last >> token;
+        if (!cluster_.enabled()) {
+            response = "ERROR This instance has cluster support disabled\n";
+        } else if (host.empty() || target_port <= 0 || first < 0 || last < 0 || last >= Cluster::kSlots) {
+            response = "ERROR Usage: MIGRATE host port first_slot last_slot [token]\n";
+        } else {
+            std::string err;
+            long moved = cluster_.migrate(host, static_cast<int>(target_port),
+                                          static_cast<uint16_t>(first), static_cast<uint16_t>(last),
+                                          token, 100, err);
+            response = moved < 0 ? err : "OK Migrated " + std::to_string(moved) + " keys\n";
+        }
+    }
+    else if (cmd == "AUTH") {
+        std::string token;
+        iss >> token;
+        bool valid = false;
+        {
+            std::lock_guard<std::mutex> lock(auth_mutex_);
+            if (auth_tokens_.count(token)) {
+                client_authenticated_[client_fd] = true;
+                valid = true;
+            } else {
+                client_authenticated_[client_fd] = false;
+            }
+        }
+        response = valid ? "OK Authenticated\n" : "ERROR Invalid token\n";
+    }
+    else {
+        response = "ERROR: Unknown command\nValid Commands : [GET, PUT, UPDATE, DELETE, MGET, MSET, SCAN, INCR, DECR, INCRBY, INCRBYFLOAT, GETV, CAS, MULTI, EXEC, DISCARD, WATCH, UNWATCH, SELECT, SUBSCRIBE, UNSUBSCRIBE, PSUBSCRIBE, PUNSUBSCRIBE, PUBLISH, LPUSH, RPUSH, LPOP, RPOP, BLPOP, BRPOP, WAITKEY, LSET, LINDEX, LRANGE, LLEN, HSET, HGET, HDEL, HGETALL, HLEN, ZADD, ZREM, ZSCORE, ZRANK, ZRANGE, ZCARD, TYPE, COMPRESSION, SHUTDOWN, AUTH, SAVE, LOAD, STATS, GET_KEY, REPLICAOF, REPLINFO, WAIT_OFFSET, CLUSTER, MIGRATE, ASKING, RAFT, GOSSIP, HOTKEYS, CLIENT]\n";
+    }
+
+    out += response;
+    return true;
+}
+
+std::string Server::execTransaction(Session& session) {
+    std::vector<std::string> queued = std::move(session.queued);
+    std::vector<Session::Watch> watched = std::move(session.watched);
+    bool failed = session.multi_failed;
+    session.resetMulti();
+
+    if (failed) return "ERROR EXECABORT Transaction discarded because of previous errors\n";
+
+    bool writes = false;
+    for (const auto& line : queued) {
+        std::string cmd = line.substr(0, line.find(' '));
+        writes = writes || (cmd != "GET" && cmd != "GETV" && cmd != "MGET" && !collectionRead(cmd));
+    }
+
+    // Writers are serialized by their database's replication lock, readers
+    // by the store lock: holding both (in that order, like every writer)
+    // makes the whole transaction one step for everybody else. Databases
+    // with watched keys are locked too, so those can't change either.
+    std::vector<size_t> locked{session.db};
+    for (const auto& w : watched) locked.push_back(w.db);
+    auto wlocks = repl_.lockWrites(std::move(locked));
+    for (const auto& line : queued) {
+        for (const auto& k : keysOf(line)) {
+            std::string redirect = cluster_.route(k, false);
+            if (!redirect.empty()) return redirect;
+        }
+    }
+
+    std::string out;
+    {
+        Store::Batch batch(*dbs_[session.db]);
+        for (const auto& w : watched) {
+            uint64_t now = w.db == session.db ? batch.version(w.key) : dbs_[w.db]->version(w.key);
+            if (now != w.version) return "ABORTED\n";
+        }
+
+        // "EXEC <n>", then one reply line per queued command
+        out = "EXEC " + std::to_string(queued.size()) + "\n";
+        // The frame goes into the stream whole, not interleaved with
+        // another database's writes
+        std::unique_lock<std::recursive_mutex> frame;
+        if (writes) {
+            frame = repl_.lockStream();
+            repl_.propagate("MULTI");
+        }
+        for (const auto& line : queued) {
+            try {
+                out += runQueued(session, batch, line);
+            } catch (const Store::WrongType& e) {
+                out += std::string("ERROR ") + e.what() + "\n";  // the others still run
+            } catch (const StorageError& e) {
+                out += std::string("ERROR ") + e.what() + "\n";
+            }
+        }
+        if (writes) repl_.propagate("EXEC");
+    }
+    return out;
+}
+
+std::string Server::runQueued(Session& session, Store::Batch& batch, const std::string& line) {
+    std::istringstream iss(line);
+    std::string cmd, key, value;
+    iss >> cmd;
+
+    if (collectionRead(cmd) || collectionWrite(cmd)) return runCollection(session, batch, line);
+
+    auto read = [&](const std::string& k) {
+        hotkeys_.record(k);
+        if (session.tracking) tracking_.remember(k, session.tracking);
+        return batch.get(k);
+    };
+
+    if (cmd == "GET") {
+        iss >> key;
+        auto val = read(key);
+        return val ? *val + "\n" : "NOT_FOUND\n";
+    }
+    if (cmd == "GETV") {
+        iss >> key;
+        hotkeys_.record(key);
+        if (session.tracking) tracking_.remember(key, session.tracking);
+        auto val = batch.getVersioned(key);
+        return val ? val->first + " " + std::to_string(val->second) + "\n" : "NOT_FOUND\n";
+    }
+    if (cmd == "MGET") {
+        std::string reply;
+        while (iss >> key) {
+            auto val = read(key);
+            reply += (reply.empty() ? "" : " ") + (val ? *val : std::string("NOT_FOUND"));
+        }
+        return reply.empty() ? "ERROR Usage: MGET key [key ...]\n" : reply + "\n";
+    }
+    if (cmd == "PUT") {
+        iss >> key >> value;
+        batch.put(key, value);
+        return "OK " + std::to_string(repl_.propagate(session.db, "PUT " + key + " " + value)) + "\n";
+    }
+    if (cmd == "MSET") {
+        uint64_t off = 0;
+        while (iss >> key >> value) {
+            batch.put(key, value);
+            off = repl_.propagate(session.db, "PUT " + key + " " + value);
+        }
+        return off ? "OK " + std::to_string(off) + "\n" : "ERROR Usage: MSET key value [key value ...]\n";
+    }
+    if (cmd == "UPDATE") {
+        iss >> key >> value;
+        return batch.update(key, value)
+            ? "UPDATED " + std::to_string(repl_.propagate(session.db, "UPDATE " + key + " " + value)) + "\n"
+            : "NOT_FOUND\n";
+    }
+    if (cmd == "DELETE") {
+        iss >> key;
+        return batch.remove(key) ? "DELETED " + std::to_string(repl_.propagate(session.db, "DELETE " + key)) + "\n"
+                                 : "NOT_FOUND\n";
+    }
+    // INCR family
+    std::string counter = counterCommand(cmd, iss, key);
+    if (counter.empty()) return "ERROR Usage: INCR key | DECR key | INCRBY key integer | INCRBYFLOAT key number\n";
+    return repl_.applyCounter(counter, session.db, &batch);
+}
+
+std::string Server::runCollection(Session& session, Store::Batch& batch, const std::string& line) {
+    std::istringstream iss(line);
+    std::string cmd, key, arg;
+    iss >> cmd >> key;
+    std::vector<std::string> args;
+    while (iss >> arg) args.push_back(arg);
+
+    if (collectionRead(cmd)) {
+        hotkeys_.record(key);
+        if (session.tracking) tracking_.remember(key, session.tracking);
+    }
+
+    // Writes reply "<result> <offset>"; a write that changed nothing isn't streamed
+    auto written = [&](const std::string& result, bool changed = true) {
+        uint64_t off = changed ? repl_.propagate(session.db, line) : repl_.offset();
+        return result + " " + std::to_string(off) + "\n";
+    };
+    long start = 0, stop = 0;
+    std::string items;
+
+    // Lists
+    if (cmd == "LPUSH" || cmd == "RPUSH") {
+        if (key.empty() || args.empty()) return "ERROR Usage: " + cmd + " key value [value ...]\n";
+        return written(std::to_string(batch.listPush(key, std::move(args), cmd == "LPUSH")));
+    }
+    if (cmd == "LPOP" || cmd == "RPOP") {
+        auto value = batch.listPop(key, cmd == "LPOP");
+        return value ? written(*value) : "NOT_FOUND\n";
+    }
+    if (cmd == "LSET") {
+        if (args.size() != 2 || !parseLong(args[0], start)) return "ERROR Usage: LSET key index value\n";
+        return batch.listSet(key, start, args[1]) ? written("OK") : "ERROR no such key or index out of range\n";
+    }
+    if (cmd == "LINDEX") {
+        if (args.size() != 1 || !parseLong(args[0], start)) return "ERROR Usage: LINDEX key index\n";
+        auto value = batch.listIndex(key, start);
+        return value ? *value + "\n" : "NOT_FOUND\n";
+    }
+    if (cmd == "LRANGE") {
+        if (args.size() != 2 || !parseLong(args[0], start) || !parseLong(args[1], stop)) {
+            return "ERROR Usage: LRANGE key start stop\n";
+        }
+        auto values = batch.listRange(key, start, stop);
+        for (const auto& v : values) items += " " + v;
+        return itemsReply(values.size(), items);
+    }
+    if (cmd == "LLEN") return std::to_string(batch.listLength(key)) + "\n";
+
+    // Hashes
+    if (cmd == "HSET") {
+        if (key.empty() || args.empty() || args.size() % 2 != 0) {
+            return "ERROR Usage: HSET key field value [field value ...]\n";
+        }
+        std::vector<std::pair<std::string, std::string>> fields;
+        for (size_t i = 0; i < args.size(); i += 2) fields.emplace_back(args[i], std::move(args[i + 1]));
+        return written(std::to_string(batch.hashSet(key, std::move(fields))));
+    }
+    if (cmd == "HGET") {
+        if (args.size() != 1) return "ERROR Usage: HGET key field\n";
+        auto value = batch.hashGet(key, args[0]);
+        return value ? *value + "\n" : "NOT_FOUND\n";
+    }
+    if (cmd == "HDEL") {
+        if (args.empty()) return "ERROR Usage: HDEL key field [field ...]\n";
+        size_t removed = batch.hashDelete(key, args);
+        return written(std::to_string(removed), removed > 0);
+    }
+    if (cmd == "HGETALL") {
+        auto fields = batch.hashGetAll(key);
+        for (const auto& [f, v] : fields) items += " " + f + " " + v;
+        return itemsReply(fields.size(), items);
+    }
+    if (cmd == "HLEN") return std::to_string(batch.hashLength(key)) + "\n";
+
+    // Sorted sets
+    if (cmd == "ZADD") {
+        std::vector<std::pair<double, std::string>> members;
+        double score = 0;
+        for (size_t i = 0; i + 1 < args.size() && SortedSet::parseScore(args[i], score); i += 2) {
+            members.emplace_back(score, args[i + 1]);
+        }
+        if (key.empty() || members.empty() || members.size() * 2 != args.size()) {
+            return "ERROR Usage: ZADD key score member [score member ...]\n";
+        }
+        return written(std::to_string(batch.zsetAdd(key, members)));
+    }
+    if (cmd == "ZREM") {
+        if (args.empty()) return "ERROR Usage: ZREM key member [member ...]\n";
+        size_t removed = batch.zsetRemove(key, args);
+        return written(std::to_string(removed), removed > 0);
+    }
+    if (cmd == "ZSCORE") {
+        if (args.size() != 1) return "ERROR Usage: ZSCORE key member\n";
+        auto score = batch.zsetScore(key, args[0]);
+        return score ? SortedSet::formatScore(*score) + "\n" : "NOT_FOUND\n";
+    }
+    if (cmd == "ZRANK") {
+        if (args.size() != 1) return "ERROR Usage: ZRANK key member\n";
+        auto rank = batch.zsetRank(key, args[0]);
+        return rank ? std::to_string(*rank) + "\n" : "NOT_FOUND\n";
+    }
+    if (cmd == "ZRANGE") {
+        bool with_scores = args.size() == 3 && args[2] == "WITHSCORES";
+        if ((args.size() != 2 && !with_scores) || !parseLong(args[0], start) || !parseLong(args[1], stop)) {
+            return "ERROR Usage: ZRANGE key start stop [WITHSCORES]\n";
+        }
+        auto members = batch.zsetRange(key, start, stop);
+        for (const auto& [m, score] : members) {
+            items += " " + m;
+            if (with_scores) items += " " + SortedSet::formatScore(score);
+        }
+        return itemsReply(members.size(), items);
+    }
+    return std::to_string(batch.zsetLength(key)) + "\n";  // ZCARD
+}
+
+bool Server::runBlocking(int client_fd, Session& session, const std::string& line, std::string& out) {
+    std::istringstream iss(line);
+    std::string cmd, word;
+    iss >> cmd;
+    std::vector<std::string> keys;
+    while (iss >> word) keys.push_back(word);
+
+    // The last argument is the timeout in seconds (0: wait forever)
+    char* end = nullptr;
+    double timeout = keys.empty() ? -1 : std::strtod(keys.back().c_str(), &end);
+    if (keys.size() < 2 || *end != '\0' || !(timeout >= 0) || (cmd == "WAITKEY" && keys.size() != 2)) {
+        out += cmd == "WAITKEY" ? "ERROR Usage: WAITKEY key timeout\n" : "ERROR Usage: " + cmd + " key [key ...] timeout\n";
+        return true;
+    }
+    keys.pop_back();
+    for (const auto& k : keys) {
+        std::string redirect = cluster_.route(k, false);
+        if (!redirect.empty()) {
+            out += redirect;
+            return true;
+        }
+    }
+    auto deadline = std::chrono::steady_clock::now() +
+                    std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(std::min(timeout, 1e9)));
+
+    // Pops the first non-empty list, as "<key> <value> <offset>"
+    auto pop = [&]() -> std::string {
+        auto wlock = repl_.lockWrites(session.db);
+        Store::Batch batch(*dbs_[session.db]);
+        for (const auto& k : keys) {
+            if (!cluster_.route(k, false).empty()) continue;  // migrated away meanwhile
+            auto value = batch.listPop(k, cmd == "BLPOP");
+            if (!value) continue;
+            uint64_t off = repl_.propagate(session.db, (cmd == "BLPOP" ? "LPOP " : "RPOP ") + k);
+            return k + " " + *value + " " + std::to_string(off) + "\n";
+        }
+        return "";
+    };
+
+    // Registered before the first look, so a push right after it still wakes us
+    auto waiter = blocking_.watch(session.db, keys);
+    struct Cancel {
+        Blocking& blocking;
+        const std::shared_ptr<Blocking::Waiter>& waiter;
+        ~Cancel() { blocking.cancel(waiter); }
+    } cancel{blocking_, waiter};
+
+    std::string result = cmd == "WAITKEY" ? "" : pop();
+    if (!result.empty()) {
+        out += result;
+        return true;
+    }
+
+    // Replies to the commands before this one shouldn't wait with it
+    if (!out.empty()) {
+        reply(client_fd, session, out);
+        out.clear();
+    }
+
+    for (;;) {
+        switch (blocking_.block(*waiter, client_fd, timeout > 0 ? &deadline : nullptr)) {
+        case Blocking::Wake::Touched:
+            // WAITKEY replies the event (set, del, lpush...; * for LOAD or a resync)
+            result = cmd == "WAITKEY" ? std::string(waiter->event.load()) + "\n" : pop();
+            if (result.empty()) continue;  // another client took it first
+            out += result;
+            return true;
+        case Blocking::Wake::Timeout:
+            out += "TIMEOUT\n";
+            return true;
+        case Blocking::Wake::Shutdown:
+            out += "ERROR Server is shutting down\n";
+            return false;
+        case Blocking::Wake::Hangup:
+            return false;
+        }
+    }
+}
+
+void Server::handleClient(int client_fd) {
+    connected_clients_++;
+
+    std::chrono::steady_clock::time_point last_active = std::chrono::steady_clock::now();
+    char buffer[4096];
+    std::string inbuf;
+    Session session;
+    bool open = true;
+
+    while (open) {
+        // Check inactivity timeout (2 minutes)
+        auto now = std::chrono::steady_clock::now();
+        auto inactive_seconds = std::chrono::duration_cast<std::chrono::seconds>(now - last_active).count();
+        if (inactive_seconds > 120) { // 2 minutes
+            reply(client_fd, session, "INFO: Session expired due to inactivity\n");
+            break;
+        }
+
+        // Wait for data (or Pub/Sub messages), waking up periodically for
+        // the inactivity check
+        pollfd pfds[2] = {{client_fd, POLLIN, 0}, {session.pubsub ? session.pubsub->wakeFd() : -1, POLLIN, 0}};
+        if (poll(pfds, 2, 100) <= 0) continue;
+
+        if (pfds[1].revents & POLLIN) {
+            // The queued messages are shared with every other subscriber:
+            // write them straight from those buffers
+            auto messages = session.pubsub->take();
+            std::vector<const std::string*> parts;
+            for (const auto& m : messages) parts.push_back(m.get());
+            if (session.tracking) {
+                std::lock_guard<std::timed_mutex> lock(session.tracking->send_mtx);
+                net::sendAll(client_fd, parts);
+            } else {
+                net::sendAll(client_fd, parts);
+            }
         }
+        if (session.pubsub && session.pubsub->dropped()) break;
+        if (!(pfds[0].revents & (POLLIN | POLLHUP | POLLERR))) continue;
 
-        send_all(client_fd, response);
+        ssize_t n = recv(client_fd, buffer, sizeof(buffer), MSG_DONTWAIT);
+        if (n < 0) continue;
+        if (n == 0) break; // client disconnected
+
+        last_active = std::chrono::steady_clock::now();
+        inbuf.append(buffer, static_cast<size_t>(n));
+
+        // Run every complete line; replies to pipelined commands go out together
+        std::string out;
+        size_t start = 0;
+        size_t nl;
+        while (open && (nl = inbuf.find('\n', start)) != std::string::npos) {
+            std::string line = inbuf.substr(start, nl - start);
+            start = nl + 1;
+            if (!line.empty() && line.back() == '\r') line.pop_back();
+            try {
+                open = processCommand(client_fd, session, line, out);
+            } catch (const Store::WrongType& e) {
+                out += std::string("ERROR ") + e.what() + "\n";
+            } catch (const StorageError& e) {
+                out += std::string("ERROR ") + e.what() + "\n";
+            }
+        }
+        inbuf.erase(0, start);
+        if (open && inbuf.size() > net::kMaxLineBytes) {
+            out += "ERROR Line too long\n";
+            open = false;
+        }
+
+        if (!out.empty()) reply(client_fd, session, out);
+        last_active = std::chrono::steady_clock::now();  // a blocking command may have waited long
+        if (session.tracking && session.tracking->dropped) break;
+    }
+
+    if (session.pubsub) {
+        pubsub_.unsubscribe(session.pubsub, {});
+        pubsub_.punsubscribe(session.pubsub, {});
+    }
+    if (session.tracking) {
+        tracking_.unsubscribe(session.tracking);
+        std::lock_guard<std::timed_mutex> lock(session.tracking->send_mtx);
+        session.tracking->fd = -1;  // a push already in flight must not hit a reused fd
     }
 
     connected_clients_--;
@@ -198,7 +1298,7 @@ void Server::run() {
     addr.sin_addr.s_addr = INADDR_ANY;
     addr.sin_port = htons(port_);
 
-    if (bind(server_fd_, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+    if (::bind(server_fd_, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
         perror("bind");
         return;
     }
@@ -220,11 +1320,27 @@ void Server::run() {
             perror("accept");
             continue;
         }
+        if (shutdown_requested_.load()) {
+            close(client_fd);
+            break;
+        }
+
+        // Pipelined replies are flushed per read; don't let Nagle hold them back
+        int nodelay = 1;
+        setsockopt(client_fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
 
         std::lock_guard<std::mutex> lock(workers_mutex_);
         workers_.emplace_back(&Server::handleClient, this, client_fd);
     }
 
+    // Wake up and stop everything the clients may be waiting on
+    blocking_.shutdown();
+    repl_.shutdown();
+    raft_.shutdown();
+    gossip_.shutdown();
+    close(server_fd_);
+    server_fd_ = -1;
+
     {
         std::lock_guard<std::mutex> lock(workers_mutex_);
         for (auto& w : workers_) {
@@ -233,6 +1349,13 @@ void Server::run() {
         workers_.clear();
     }
 
+    // With --mmap-dir the next start maps the data instead of loading it
+    for (size_t i = 0; i < dbs_.size(); ++i) {
+        if (!dbs_[i]->persistStorage()) {
+            Logger::instance().error("Database " + std::to_string(i) + ": cannot persist its mapped table");
+        }
+    }
+
     std::cout << "Server stopped.\n";
 }
 
@@ -1,140 +1,1699 @@
 #include "keyforge/Store.hpp"
+#include "keyforge/Logger.hpp"
 #include <fstream>
 #include <sstream>
+#include <charconv>
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <chrono>
+#include <algorithm>
+#include <filesystem>
+#include <string_view>
 
 namespace keyforge {
 
-void Store::put(const std::string& key, const std::string& value) {
-    std::lock_guard<std::mutex> lock(mtx_);
+namespace {
 
-    // Increment PUT counter
-    put_count++;
+constexpr size_t kEntryOverhead = 64;  // hash node, Entry and bookkeeping, roughly
 
-    // If key exists, remove old reverse mapping
-    auto it = kv_store_.find(key);
-    if (it != kv_store_.end()) {
-        value_to_keys_[it->second].erase(key);
-        if (value_to_keys_[it->second].empty()) {
-            value_to_keys_.erase(it->second);
+// Canonical integers only ("7", "-12"; not "007", "+7" or " 7"), so a
+// counter renders back exactly as it was written
+bool parseInt(const std::string& s, int64_t& out) {
+    if (s.empty() || s.size() > 20) return false;
+    auto [end, ec] = std::from_chars(s.data(), s.data() + s.size(), out);
+    if (ec != std::errc() || end != s.data() + s.size()) return false;
+    return std::to_string(out) == s;
+}
+
+constexpr size_t kSpillSamples = 16;  // entries compared per spill
+constexpr std::chrono::seconds kSpillRetry{1};  // after the engine refused one
+
+// SCAN cursors past the in-memory keys: this, then the last key returned in
+// hex (a digit first, like every cursor, and no separators)
+constexpr std::string_view kSpilledCursor = "1:";
+
+std::string toHex(const std::string& s) {
+    static const char digits[] = "0123456789abcdef";
+    std::string out;
+    out.reserve(s.size() * 2);
+    for (unsigned char c : s) {
+        out += digits[c >> 4];
+        out += digits[c & 15];
+    }
+    return out;
+}
+
+bool fromHex(std::string_view hex, std::string& out) {
+    if (hex.size() % 2 != 0) return false;
+    out.clear();
+    for (size_t i = 0; i < hex.size(); i += 2) {
+        unsigned value = 0;
+        auto [end, ec] = std::from_chars(hex.data() + i, hex.data() + i + 2, value, 16);
+        if (ec != std::errc() || end != hex.data() + i + 2) return false;
+        out += static_cast<char>(value);
+    }
+    return true;
+}
+
+// A snapshot's walk takes the lock for this many buckets at a time, and
+// lets the table grow to this many times its load factor before a rehash
+// would cut it short
+constexpr size_t kCaptureBuckets = 1024;
+constexpr float kCaptureLoadFactor = 8.0f;
+
+constexpr size_t kColdMinBytes = 64;  // smaller values aren't worth a disk read
+constexpr size_t kCoolBatch = 4096;   // values looked at per lock hold
+
+// Past this many changed keys, and half of all keys, the next save writes
+// a base: a delta would save little, and the set costs memory
+constexpr size_t kMinDirtyKeys = 1024;
+
+std::string deltaPath(const std::string& filename, uint64_t seq) {
+    return filename + ".delta." + std::to_string(seq);
+}
+
+// Delete filename's deltas numbered up to `upto`
+void removeDeltas(const std::string& filename, uint64_t upto) {
+    namespace fs = std::filesystem;
+    fs::path path(filename);
+    fs::path dir = path.parent_path().empty() ? fs::path(".") : path.parent_path();
+    std::string prefix = path.filename().string() + ".delta.";
+    std::error_code ec;
+    for (const auto& file : fs::directory_iterator(dir, ec)) {
+        std::string name = file.path().filename().string();
+        if (name.compare(0, prefix.size(), prefix) != 0) continue;
+        uint64_t seq = 0;
+        const char* first = name.data() + prefix.size();
+        const char* last = name.data() + name.size();
+        auto [end, err] = std::from_chars(first, last, seq);
+        if (err == std::errc() && end == last && first != last && seq <= upto) fs::remove(file.path(), ec);
+    }
+}
+
+// "#KFBASE <chain> <upto>" or "#KFDELTA <chain> <seq>": no '=', so a plain
+// load skips it
+bool parseSnapshotHeader(const std::string& line, const char* tag, uint64_t& chain, uint64_t& n) {
+    std::istringstream iss(line);
+    std::string word;
+    return iss >> word >> chain >> n && word == tag;
+}
+
+// A spilled entry in the storage engine: its version (8 bytes, little
+// endian), then its value in render() form
+std::string spillRecord(uint64_t version, const std::string& text) {
+    std::string record(8, '\0');
+    for (int i = 0; i < 8; ++i) record[i] = static_cast<char>(version >> (8 * i));
+    return record + text;
+}
+
+bool parseSpillRecord(const std::string& record, uint64_t& version, std::string& text) {
+    if (record.size() < 8) return false;
+    version = 0;
+    for (int i = 0; i < 8; ++i) version |= static_cast<uint64_t>(static_cast<unsigned char>(record[i])) << (8 * i);
+    text.assign(record, 8, std::string::npos);
+    return true;
+}
+
+} // namespace
+
+std::string Store::render(const Value& v) {
+    if (auto* num = std::get_if<int64_t>(&v)) return std::to_string(*num);
+    if (auto* str = std::get_if<std::string>(&v)) return *str;
+    if (auto* blob = std::get_if<Blob*>(&v)) {
+        auto value = ValuePool::read(**blob);
+        if (!value) throw StorageError("value log read failed");
+        return std::move(*value);
+    }
+
+    std::string out(1, kDumpMark);
+    if (auto* list = std::get_if<std::unique_ptr<QuickList>>(&v)) {
+        out += 'L';
+        for (const auto& e : (*list)->range(0, (*list)->size() - 1)) out += " " + e;
+    } else if (auto* hash = std::get_if<std::unique_ptr<HashValue>>(&v)) {
+        out += 'H';
+        for (const auto& [f, val] : (*hash)->all()) out += " " + f + " " + val;
+    } else {
+        const auto& zset = std::get<std::unique_ptr<SortedSet>>(v);
+        out += 'Z';
+        for (const auto& [m, score] : zset->range(0, zset->size() - 1)) {
+            out += " " + SortedSet::formatScore(score) + " " + m;
         }
     }
+    return out;
+}
+
+Store::Value Store::parseValue(std::string text) {
+    if (text.size() < 2 || text[0] != kDumpMark) return Value(std::move(text));
 
-    kv_store_[key] = value;
-    value_to_keys_[value].insert(key);
+    std::istringstream iss(text.substr(2));
+    std::string a, b;
+    double score = 0;
+    if (text[1] == 'L') {
+        auto list = std::make_unique<QuickList>();
+        while (iss >> a) list->pushBack(std::move(a));
+        if (list->size() > 0) return Value(std::move(list));
+    } else if (text[1] == 'H') {
+        auto hash = std::make_unique<HashValue>();
+        while (iss >> a >> b) hash->set(a, std::move(b));
+        if (hash->size() > 0) return Value(std::move(hash));
+    } else if (text[1] == 'Z') {
+        auto zset = std::make_unique<SortedSet>();
+        while (iss >> a >> b && SortedSet::parseScore(a, score)) zset->add(b, score);
+        if (zset->size() > 0) return Value(std::move(zset));
+    }
+    return Value(std::move(text));  // not a dump after all
 }
 
-std::optional<std::string> Store::get(const std::string& key) {
-    std::lock_guard<std::mutex> lock(mtx_);
-    auto it = kv_store_.find(key);
-    if (it != kv_store_.end()) {
+size_t Store::valueBytes(const Value& v) {
+    if (auto* str = std::get_if<std::string>(&v)) return str->size();
+    if (auto* list = std::get_if<std::unique_ptr<QuickList>>(&v)) return (*list)->bytes();
+    if (auto* hash = std::get_if<std::unique_ptr<HashValue>>(&v)) return (*hash)->bytes();
+    if (auto* zset = std::get_if<std::unique_ptr<SortedSet>>(&v)) return (*zset)->bytes();
+    if (std::holds_alternative<Blob*>(v)) return 0;
+    return sizeof(int64_t);
+}
+
+void Store::indexValue(const std::string& key, const Value& v) {
+    used_bytes_.fetch_add(key.size() + valueBytes(v) + kEntryOverhead, std::memory_order_relaxed);
+    if (std::holds_alternative<int64_t>(v)) int_values_++;
+    // The pool already lists key; the value itself is counted for its first key
+    auto* blob = std::get_if<Blob*>(&v);
+    if (blob && (*blob)->keys.size() == 1) used_bytes_.fetch_add(ValuePool::cost(**blob), std::memory_order_relaxed);
+}
+
+void Store::unindexValue(const std::string& key, const Value& v) {
+    used_bytes_.fetch_sub(key.size() + valueBytes(v) + kEntryOverhead, std::memory_order_relaxed);
+    if (std::holds_alternative<int64_t>(v)) int_values_--;
+    auto* blob = std::get_if<Blob*>(&v);
+    if (!blob) return;
+    if ((*blob)->keys.size() == 1) used_bytes_.fetch_sub(ValuePool::cost(**blob), std::memory_order_relaxed);
+    pool_.release(key, *blob);  // frees it with its last key
+}
+
+Store::Store()
+    : clock_(static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(
+          std::chrono::system_clock::now().time_since_epoch()).count())) {}
+
+Store::~Store() {
+    joinMerge();
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        tier_stop_ = true;
+    }
+    tier_cv_.notify_all();
+    if (tier_thread_.joinable()) tier_thread_.join();
+}
+
+Store::Entry& Store::setValue(const std::string& key, Value v) {
+    preserve(key);
+    auto [it, inserted] = kv_store_.try_emplace(key);
+    if (!inserted) unindexValue(key, it->second.value);
+    else if (dropSpilled(key)) inserted = false;  // the filter has it already
+    if (auto* str = std::get_if<std::string>(&v)) {
+        v = pool_.acquire(key, std::move(*str), compress_threshold_,
+                          dictionaries_.empty() ? nullptr : dictionaries_.back().get());
+        std::get<Blob*>(v)->used = tier_now_;
+    }
+    it->second.value = std::move(v);
+    it->second.version = ++clock_;
+    it->second.touched = ++access_clock_;
+    markDirty(key);
+    indexValue(key, it->second.value);
+    if (inserted) filterAdd(key);
+    return it->second;
+}
+
+// The *Locked operations run with mtx_ held and leave change notification
+// to the caller: a single command notifies right away, a Batch at its end.
+
+std::optional<std::string> Store::getLocked(const std::string& key) {
+    if (Entry* entry = findLocked(key)) {
+        if (!scalar(entry->value)) throw WrongType();
         get_count++;
-        return it->second;
+        return render(entry->value);
     } else {
         get_miss_count++;
         return std::nullopt;
     }
 }
 
-bool Store::update(const std::string& key, const std::string& new_value) {
-    std::lock_guard<std::mutex> lock(mtx_);
-    auto it = kv_store_.find(key);
-    if (it == kv_store_.end()) return false;
+std::optional<std::pair<std::string, uint64_t>> Store::getVersionedLocked(const std::string& key) {
+    Entry* entry = findLocked(key);
+    if (!entry) {
+        get_miss_count++;
+        return std::nullopt;
+    }
+    if (!scalar(entry->value)) throw WrongType();
+    get_count++;
+    return std::make_pair(render(entry->value), entry->version);
+}
+
+void Store::putLocked(const std::string& key, const std::string& value) {
+    // Increment PUT counter
+    put_count++;
+    setValue(key, value);
+}
+
+bool Store::updateLocked(const std::string& key, const std::string& new_value) {
+    if (!findLocked(key)) return false;
 
     // Increment UPDATE counter
     update_count++;
+    setValue(key, new_value);
+    return true;
+}
+
+bool Store::removeLocked(const std::string& key) {
+    Entry* entry = findLocked(key);
+    if (!entry) return false;
+
+    // Increment DELETE counter
+    delete_count++;
+
+    // Remove from reverse map
+    preserve(key);
+    unindexValue(key, entry->value);
+    kv_store_.erase(key);
+    filterRemove(key);
+    markDirty(key);
+    return true;
+}
+
+std::optional<int64_t> Store::incrByLocked(const std::string& key, int64_t delta) {
+    Entry* entry = findLocked(key);
+    if (entry && !scalar(entry->value)) throw WrongType();
+    int64_t* num = entry ? std::get_if<int64_t>(&entry->value) : nullptr;
+    int64_t current = num ? *num : 0;
+    if (entry && !num && !parseInt(render(entry->value), current)) return std::nullopt;
 
-    // Update reverse map
-    value_to_keys_[it->second].erase(key);
-    if (value_to_keys_[it->second].empty()) {
-        value_to_keys_.erase(it->second);
+    // Nothing changes (not even the version) unless the sum fits
+    int64_t result = 0;
+    if (__builtin_add_overflow(current, delta, &result)) return std::nullopt;
+    if (num) {
+        preserve(key);
+        *num = result;
+        entry->version = ++clock_;
+        markDirty(key);
+    } else {
+        setValue(key, result);  // a new key, or a numeric string becoming a counter
     }
+    incr_count++;
+    return result;
+}
+
+std::optional<std::string> Store::incrByFloatLocked(const std::string& key, long double delta) {
+    long double current = 0;
+    if (Entry* entry = findLocked(key)) {
+        if (!scalar(entry->value)) throw WrongType();
+        if (auto* num = std::get_if<int64_t>(&entry->value)) {
+            current = static_cast<long double>(*num);
+        } else {
+            std::string str = render(entry->value);
+            char* end = nullptr;
+            errno = 0;
+            current = std::strtold(str.c_str(), &end);
+            if (str.empty() || *end != '\0' || errno == ERANGE) return std::nullopt;
+        }
+    }
+    long double sum = current + delta;
+    if (!std::isfinite(sum)) return std::nullopt;
+
+    // Fixed point, never an exponent, so an integral result stays a plain
+    // integer INCR can use; 17 decimals hide long double noise (0.1 + 0.2
+    // gives "0.3"). The largest long double takes about 4950 characters.
+    char buf[5120];
+    std::snprintf(buf, sizeof(buf), "%.17Lf", sum);
+    std::string result = buf;
+    if (result.find('.') != std::string::npos) {
+        result.erase(result.find_last_not_of('0') + 1);
+        if (result.back() == '.') result.pop_back();
+    }
+    if (result == "-0") result = "0";
+    setValue(key, result);
+    incr_count++;
+    return result;
+}
+
+void Store::put(const std::string& key, const std::string& value) {
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        putLocked(key, value);
+        spillLocked();
+    }
+    notifyWrite(key, "set");
+}
+
+std::optional<std::string> Store::get(const std::string& key) {
+    if (!mayContain(key)) {
+        get_miss_count++;
+        return std::nullopt;
+    }
+    Blob packed;
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        Entry* entry = findLocked(key);
+        auto* held = entry ? std::get_if<Blob*>(&entry->value) : nullptr;
+        if (!held || !(*held)->packed) {
+            auto value = getLocked(key);
+            if (!value && key_filter_.load(std::memory_order_relaxed)) filter_false_positives_++;
+            spillLocked();  // it may have been read back
+            return value;
+        }
+        get_count++;
+        // Compressed, so a small copy; its dictionary is never freed
+        packed.data = (*held)->data;
+        packed.size = (*held)->size;
+        packed.dict = (*held)->dict;
+        packed.packed = true;
+        spillLocked();
+    }
+    auto value = ValuePool::read(packed);
+    if (!value) throw StorageError("value log read failed");
+    return value;
+}
 
-    it->second = new_value;
-    value_to_keys_[new_value].insert(key);
+bool Store::update(const std::string& key, const std::string& new_value) {
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        if (!updateLocked(key, new_value)) return false;
+        spillLocked();
+    }
+    notifyWrite(key, "set");
     return true;
 }
 
 bool Store::remove(const std::string& key) {
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        if (!removeLocked(key)) return false;
+    }
+    notifyWrite(key, "del");
+    return true;
+}
+
+std::optional<std::pair<std::string, uint64_t>> Store::getVersioned(const std::string& key) {
+    if (!mayContain(key)) {
+        get_miss_count++;
+        return std::nullopt;
+    }
+    std::lock_guard<std::mutex> lock(mtx_);
+    auto value = getVersionedLocked(key);
+    if (!value && key_filter_.load(std::memory_order_relaxed)) filter_false_positives_++;
+    spillLocked();
+    return value;
+}
+
+uint64_t Store::version(const std::string& key) const {
     std::lock_guard<std::mutex> lock(mtx_);
     auto it = kv_store_.find(key);
-    if (it == kv_store_.end()) return false;
+    if (it != kv_store_.end()) return it->second.version;
+    uint64_t version = 0;
+    std::string text;
+    auto record = spilledRecord(key);
+    return record && parseSpillRecord(*record, version, text) ? version : 0;
+}
 
-    // Increment DELETE counter
-    delete_count++;
+bool Store::compareAndSwap(const std::string& key, uint64_t expected,
+                           const std::string& new_value, uint64_t& version) {
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        Entry* entry = findLocked(key);
+        uint64_t current = entry ? entry->version : 0;
+        if (current != expected) {
+            cas_conflict_count++;
+            version = current;
+            return false;
+        }
+        cas_count++;
+        version = setValue(key, new_value).version;
+        spillLocked();
+    }
+    notifyWrite(key, "set");
+    return true;
+}
 
-    // Remove from reverse map
-    value_to_keys_[it->second].erase(key);
-    if (value_to_keys_[it->second].empty()) {
-        value_to_keys_.erase(it->second);
+std::optional<int64_t> Store::incrBy(const std::string& key, int64_t delta) {
+    std::optional<int64_t> result;
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        result = incrByLocked(key, delta);
+        spillLocked();
+    }
+    if (result) notifyWrite(key, "incrby");
+    return result;
+}
+
+std::optional<std::string> Store::incrByFloat(const std::string& key, long double delta) {
+    std::optional<std::string> result;
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        result = incrByFloatLocked(key, delta);
+        spillLocked();
+    }
+    if (result) notifyWrite(key, "incrbyfloat");
+    return result;
+}
+
+// Batch
+
+Store::Batch::Batch(Store& store) : store_(store), lock_(store.mtx_) {}
+
+Store::Batch::~Batch() {
+    store_.spillLocked();
+    lock_.unlock();
+    for (const auto& [key, event] : changed_) store_.notifyWrite(key, event);
+}
+
+std::optional<std::string> Store::Batch::get(const std::string& key) {
+    return store_.getLocked(key);
+}
+
+std::optional<std::pair<std::string, uint64_t>> Store::Batch::getVersioned(const std::string& key) {
+    return store_.getVersionedLocked(key);
+}
+
+uint64_t Store::Batch::version(const std::string& key) const {
+    Entry* entry = store_.findLocked(key);
+    return entry ? entry->version : 0;
+}
+
+void Store::Batch::put(const std::string& key, const std::string& value) {
+    store_.putLocked(key, value);
+    changed_.emplace_back(key, "set");
+}
+
+bool Store::Batch::update(const std::string& key, const std::string& new_value) {
+    if (!store_.updateLocked(key, new_value)) return false;
+    changed_.emplace_back(key, "set");
+    return true;
+}
+
+bool Store::Batch::remove(const std::string& key) {
+    if (!store_.removeLocked(key)) return false;
+    changed_.emplace_back(key, "del");
+    return true;
+}
+
+std::optional<int64_t> Store::Batch::incrBy(const std::string& key, int64_t delta) {
+    auto result = store_.incrByLocked(key, delta);
+    if (result) changed_.emplace_back(key, "incrby");
+    return result;
+}
+
+std::optional<std::string> Store::Batch::incrByFloat(const std::string& key, long double delta) {
+    auto result = store_.incrByFloatLocked(key, delta);
+    if (result) changed_.emplace_back(key, "incrbyfloat");
+    return result;
+}
+
+// Lists, hashes and sorted sets
+
+namespace {
+
+// Negative indexes count from the end; false when out of range
+bool elementIndex(long index, size_t size, size_t& out) {
+    long n = static_cast<long>(size);
+    if (index < 0) index += n;
+    if (index < 0 || index >= n) return false;
+    out = static_cast<size_t>(index);
+    return true;
+}
+
+// Inclusive start..stop, negative from the end, clamped; false when empty
+bool elementRange(long start, long stop, size_t size, size_t& first, size_t& last) {
+    long n = static_cast<long>(size);
+    if (start < 0) start += n;
+    if (stop < 0) stop += n;
+    start = std::max(start, 0L);
+    stop = std::min(stop, n - 1);
+    if (start > stop) return false;
+    first = static_cast<size_t>(start);
+    last = static_cast<size_t>(stop);
+    return true;
+}
+
+} // namespace
+
+template <typename T>
+T* Store::Batch::collection(const std::string& key, bool create) {
+    Entry* entry = store_.findLocked(key);
+    if (!entry) {
+        if (!create) return nullptr;
+        return std::get<std::unique_ptr<T>>(store_.setValue(key, std::make_unique<T>()).value).get();
     }
+    auto* held = std::get_if<std::unique_ptr<T>>(&entry->value);
+    if (!held) throw WrongType();
+    return held->get();
+}
+
+void Store::Batch::changed(const std::string& key, const char* event, size_t bytes_before, size_t size) {
+    auto it = store_.kv_store_.find(key);
+    store_.used_bytes_.fetch_add(valueBytes(it->second.value), std::memory_order_relaxed);
+    store_.used_bytes_.fetch_sub(bytes_before, std::memory_order_relaxed);
+    if (size == 0) {
+        store_.unindexValue(key, it->second.value);
+        store_.kv_store_.erase(it);
+        store_.filterRemove(key);
+    } else {
+        it->second.version = ++store_.clock_;
+    }
+    store_.markDirty(key);
+    changed_.emplace_back(key, event);
+}
+
+size_t Store::Batch::listPush(const std::string& key, std::vector<std::string> values, bool front) {
+    store_.preserve(key);
+    auto* list = collection<QuickList>(key, true);
+    size_t before = list->bytes();
+    for (auto& v : values) {
+        if (front) list->pushFront(std::move(v));
+        else list->pushBack(std::move(v));
+    }
+    size_t length = list->size();
+    changed(key, front ? "lpush" : "rpush", before, length);
+    return length;
+}
+
+std::optional<std::string> Store::Batch::listPop(const std::string& key, bool front) {
+    store_.preserve(key);
+    auto* list = collection<QuickList>(key, false);
+    if (!list) return std::nullopt;
+    size_t before = list->bytes();
+    std::string value = front ? list->popFront() : list->popBack();
+    changed(key, front ? "lpop" : "rpop", before, list->size());
+    return value;
+}
+
+bool Store::Batch::listSet(const std::string& key, long index, std::string value) {
+    store_.preserve(key);
+    auto* list = collection<QuickList>(key, false);
+    size_t pos = 0;
+    if (!list || !elementIndex(index, list->size(), pos)) return false;
+    size_t before = list->bytes();
+    list->set(pos, std::move(value));
+    changed(key, "lset", before, list->size());
+    return true;
+}
+
+std::optional<std::string> Store::Batch::listIndex(const std::string& key, long index) {
+    auto* list = collection<QuickList>(key, false);
+    size_t pos = 0;
+    if (!list || !elementIndex(index, list->size(), pos)) return std::nullopt;
+    return list->at(pos);
+}
+
+std::vector<std::string> Store::Batch::listRange(const std::string& key, long start, long stop) {
+    auto* list = collection<QuickList>(key, false);
+    size_t first = 0, last = 0;
+    if (!list || !elementRange(start, stop, list->size(), first, last)) return {};
+    return list->range(first, last);
+}
+
+size_t Store::Batch::listLength(const std::string& key) {
+    auto* list = collection<QuickList>(key, false);
+    return list ? list->size() : 0;
+}
+
+size_t Store::Batch::hashSet(const std::string& key, std::vector<std::pair<std::string, std::string>> fields) {
+    store_.preserve(key);
+    auto* hash = collection<HashValue>(key, true);
+    size_t before = hash->bytes();
+    size_t added = 0;
+    for (auto& [f, v] : fields) added += hash->set(f, std::move(v));
+    changed(key, "hset", before, hash->size());
+    return added;
+}
+
+std::optional<std::string> Store::Batch::hashGet(const std::string& key, const std::string& field) {
+    auto* hash = collection<HashValue>(key, false);
+    const std::string* value = hash ? hash->get(field) : nullptr;
+    if (!value) return std::nullopt;
+    return *value;
+}
+
+size_t Store::Batch::hashDelete(const std::string& key, const std::vector<std::string>& fields) {
+    store_.preserve(key);
+    auto* hash = collection<HashValue>(key, false);
+    if (!hash) return 0;
+    size_t before = hash->bytes();
+    size_t removed = 0;
+    for (const auto& f : fields) removed += hash->erase(f);
+    if (removed > 0) changed(key, "hdel", before, hash->size());
+    return removed;
+}
+
+std::vector<std::pair<std::string, std::string>> Store::Batch::hashGetAll(const std::string& key) {
+    auto* hash = collection<HashValue>(key, false);
+    return hash ? hash->all() : std::vector<std::pair<std::string, std::string>>{};
+}
+
+size_t Store::Batch::hashLength(const std::string& key) {
+    auto* hash = collection<HashValue>(key, false);
+    return hash ? hash->size() : 0;
+}
+
+size_t Store::Batch::zsetAdd(const std::string& key, const std::vector<std::pair<double, std::string>>& members) {
+    store_.preserve(key);
+    auto* zset = collection<SortedSet>(key, true);
+    size_t before = zset->bytes();
+    size_t added = 0;
+    for (const auto& [score, m] : members) added += zset->add(m, score);
+    changed(key, "zadd", before, zset->size());
+    return added;
+}
 
-    kv_store_.erase(it);
+size_t Store::Batch::zsetRemove(const std::string& key, const std::vector<std::string>& members) {
+    store_.preserve(key);
+    auto* zset = collection<SortedSet>(key, false);
+    if (!zset) return 0;
+    size_t before = zset->bytes();
+    size_t removed = 0;
+    for (const auto& m : members) removed += zset->erase(m);
+    if (removed > 0) changed(key, "zrem", before, zset->size());
+    return removed;
+}
+
+std::optional<double> Store::Batch::zsetScore(const std::string& key, const std::string& member) {
+    auto* zset = collection<SortedSet>(key, false);
+    return zset ? zset->score(member) : std::nullopt;
+}
+
+std::optional<size_t> Store::Batch::zsetRank(const std::string& key, const std::string& member) {
+    auto* zset = collection<SortedSet>(key, false);
+    return zset ? zset->rank(member) : std::nullopt;
+}
+
+std::vector<std::pair<std::string, double>> Store::Batch::zsetRange(const std::string& key, long start, long stop) {
+    auto* zset = collection<SortedSet>(key, false);
+    size_t first = 0, last = 0;
+    if (!zset || !elementRange(start, stop, zset->size(), first, last)) return {};
+    return zset->range(first, last);
+}
+
+size_t Store::Batch::zsetLength(const std::string& key) {
+    auto* zset = collection<SortedSet>(key, false);
+    return zset ? zset->size() : 0;
+}
+
+bool Store::Batch::restore(const std::string& key, const std::string& dump) {
+    Value value = parseValue(dump);
+    if (scalar(value)) return false;
+    store_.setValue(key, std::move(value));
+    changed_.emplace_back(key, "restore");
     return true;
 }
 
 std::optional<std::string> Store::getKeyByValue(const std::string& value) {
     std::lock_guard<std::mutex> lock(mtx_);
-    auto it = value_to_keys_.find(value);
-    if (it != value_to_keys_.end() && !it->second.empty()) {
-        return *(it->second.begin()); // return one key
+    if (const Blob* blob = pool_.find(value)) {
+        return *(blob->keys.begin()); // return one key
+    }
+    // Counters aren't indexed: fall back to a scan, only if there are any
+    int64_t n = 0;
+    if (int_values_ > 0 && parseInt(value, n)) {
+        for (const auto& [key, entry] : kv_store_) {
+            auto* num = std::get_if<int64_t>(&entry.value);
+            if (num && *num == n) return key;
+        }
+    }
+    // Nor are spilled values: read them all
+    std::optional<std::string> found;
+    if (spilled_ > 0) {
+        uint64_t version = 0;
+        std::string text;
+        engine_->forEach([&](const std::string& key, const std::string& record) {
+            if (parseSpillRecord(record, version, text) && text == value) found = key;
+            return !found;
+        });
+    }
+    return found;
+}
+
+std::string Store::type(const std::string& key) const {
+    std::lock_guard<std::mutex> lock(mtx_);
+    auto it = kv_store_.find(key);
+    if (it != kv_store_.end()) {
+        static const char* const names[] = {"string", "string", "list", "hash", "zset", "string"};
+        return names[it->second.value.index()];
+    }
+    uint64_t version = 0;
+    std::string text;
+    auto record = spilledRecord(key);
+    if (!record || !parseSpillRecord(*record, version, text)) return "none";
+    if (text.size() < 2 || text[0] != kDumpMark) return "string";
+    return text[1] == 'L' ? "list" : text[1] == 'H' ? "hash" : "zset";
+}
+
+bool Store::contains(const std::string& key) const {
+    if (!mayContain(key)) return false;
+    std::lock_guard<std::mutex> lock(mtx_);
+    return kv_store_.count(key) > 0 || spilledRecord(key);
+}
+
+std::optional<std::string> Store::peek(const std::string& key) const {
+    std::lock_guard<std::mutex> lock(mtx_);
+    auto it = kv_store_.find(key);
+    if (it != kv_store_.end()) return render(it->second.value);
+    uint64_t version = 0;
+    std::string text;
+    auto record = spilledRecord(key);
+    if (!record || !parseSpillRecord(*record, version, text)) return std::nullopt;
+    return text;
+}
+
+std::string Store::scan(const std::string& cursor, size_t count, std::vector<std::string>& keys) const {
+    std::lock_guard<std::mutex> lock(mtx_);
+    size_t added = 0;
+    std::optional<std::string> after;
+    if (cursor.compare(0, kSpilledCursor.size(), kSpilledCursor) != 0) {
+        // Whole buckets at a time, so the cursor stays a plain bucket index
+        size_t bucket = std::strtoull(cursor.c_str(), nullptr, 10);
+        size_t buckets = kv_store_.bucket_count();
+        while (bucket < buckets && added < count) {
+            for (auto it = kv_store_.begin(bucket); it != kv_store_.end(bucket); ++it) {
+                keys.push_back(it->first);
+                added++;
+            }
+            bucket++;
+        }
+        if (bucket < buckets) return std::to_string(bucket);
+    } else if (!fromHex(std::string_view(cursor).substr(kSpilledCursor.size()), after.emplace())) {
+        after.reset();  // not one of ours: start over
     }
-    return std::nullopt;
+    if (spilled_ == 0) return "0";
+
+    // Then the spilled keys, in key order, from the engine's next page after
+    // the last one returned; at least one, so the cursor names a key
+    size_t want = std::max<size_t>(count - std::min(count, added), 1);
+    auto page = engine_->keysAfter(after, want);
+    if (page.size() < want) {
+        keys.insert(keys.end(), page.begin(), page.end());
+        return "0";
+    }
+    std::string next = std::string(kSpilledCursor) + toHex(page.back());
+    keys.insert(keys.end(), page.begin(), page.end());
+    return next;
 }
 
 // Persistence
 bool Store::saveToFile(const std::string& filename) {
-    std::lock_guard<std::mutex> lock(mtx_);
-    std::ofstream ofs(filename, std::ios::out | std::ios::trunc);
-    if (!ofs.is_open()) return false;
+    std::lock_guard<std::mutex> lock(snapshot_mtx_);
+    std::error_code ec;
+    if (filename == snapshot_file_ && std::filesystem::exists(filename, ec)) return saveDelta(filename);
+    return saveBase(filename);
+}
 
-    for (const auto& [key, value] : kv_store_) {
-        std::string escaped_value = value;
-        size_t pos = 0;
-        while ((pos = escaped_value.find('\n', pos)) != std::string::npos) {
-            escaped_value.replace(pos, 1, "\\n");
-            pos += 2;
+bool Store::saveBase(const std::string& filename) {
+    joinMerge();  // it would replace this base with one of the old chain
+    uint64_t chain = clock_ ^ static_cast<uint64_t>(std::chrono::steady_clock::now().time_since_epoch().count());
+    std::string tmp = filename + ".tmp";
+    FileWriter::Options options = write_options_;
+    options.preallocate = base_bytes_ + delta_bytes_;  // about the size of the last one
+    options.max_bytes_per_sec = 0;
+    size_t bytes = 0;
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        FileWriter file(tmp, options);
+        if (!file.isOpen()) return false;
+        std::ostream ofs(&file);
+        ofs << "#KFBASE " << chain << " 0\n";
+        bool ok = saveLocked(ofs) && ofs;
+        bytes = file.written();
+        wrote_direct_ = file.direct();
+        if (!file.close() || !ok || std::rename(tmp.c_str(), filename.c_str()) != 0) {
+            std::remove(tmp.c_str());
+            return false;
         }
-        pos = 0;
-        while ((pos = escaped_value.find('=', pos)) != std::string::npos) {
-            escaped_value.replace(pos, 1, "\\=");
-            pos += 2;
+        all_dirty_ = false;
+        dirty_keys_.clear();
+    }
+    removeDeltas(filename, UINT64_MAX);  // of an earlier chain
+    snapshot_file_ = filename;
+    chain_id_ = chain;
+    delta_seq_ = 0;
+    merged_upto_ = 0;
+    base_bytes_ = bytes;
+    delta_bytes_ = 0;
+    last_save_bytes_ = bytes;
+    base_saves_++;
+    return true;
+}
+
+bool Store::saveDelta(const std::string& filename) {
+    uint64_t seq = delta_seq_ + 1;
+    std::string path = deltaPath(filename, seq);
+    std::string tmp = path + ".tmp";
+    size_t bytes = 0;
+    {
+        std::unique_lock<std::mutex> lock(mtx_);
+        if (all_dirty_) {
+            lock.unlock();
+            return saveBase(filename);
+        }
+        FileWriter::Options options = write_options_;
+        options.max_bytes_per_sec = 0;
+        FileWriter file(tmp, options);
+        if (!file.isOpen()) return false;
+        std::ostream ofs(&file);
+        ofs << "#KFDELTA " << chain_id_ << " " << seq << "\n";
+        std::string record, text;
+        uint64_t version = 0;
+        bool ok = true;
+        try {
+            for (const auto& key : dirty_keys_) {
+                record.clear();
+                auto it = kv_store_.find(key);
+                if (it != kv_store_.end()) {
+                    encodeRecord(record, key, render(it->second.value));
+                } else if (auto spilled = spilledRecord(key); spilled && parseSpillRecord(*spilled, version, text)) {
+                    encodeRecord(record, key, text);
+                } else {
+                    record = key + "\n";  // deleted: a line without '='
+                }
+                ofs << record;
+            }
+        } catch (const StorageError& e) {
+            Logger::instance().error(std::string("Save: ") + e.what());
+            ok = false;
         }
-        ofs << key << "=" << escaped_value << "\n";
+        ok = ok && static_cast<bool>(ofs);
+        bytes = file.written();
+        wrote_direct_ = file.direct();
+        if (!file.close() || !ok || std::rename(tmp.c_str(), path.c_str()) != 0) {
+            std::remove(tmp.c_str());
+            return false;
+        }
+        dirty_keys_.clear();
+    }
+    delta_seq_ = seq;
+    delta_bytes_ += bytes;
+    last_save_bytes_ = bytes;
+    delta_saves_++;
+    if (!merging_ && (seq - merged_upto_ >= kMergeDeltas || delta_bytes_ > base_bytes_)) {
+        joinMerge();
+        merging_ = true;
+        FileWriter::Options options = write_options_;
+        options.preallocate = base_bytes_ + delta_bytes_;
+        merge_thread_ = std::thread(&Store::mergeDeltas, this, filename, chain_id_, seq, options);
     }
     return true;
 }
 
+void Store::mergeDeltas(std::string filename, uint64_t chain, uint64_t upto, FileWriter::Options options) {
+    // The last state of every key the deltas touch: its record, or nullopt
+    // if it was deleted. Only the deltas are held in memory; the base is
+    // streamed through.
+    std::unordered_map<std::string, std::optional<std::string>> changes;
+    uint64_t from = merged_upto_ + 1;
+    size_t merged_bytes = 0;
+    std::string line, tmp = filename + ".merge";
+    bool ok = true;
+    for (uint64_t seq = from; ok && seq <= upto; ++seq) {
+        std::error_code ec;
+        merged_bytes += std::filesystem::file_size(deltaPath(filename, seq), ec);
+        std::ifstream delta(deltaPath(filename, seq));
+        uint64_t c = 0, n = 0;
+        ok = std::getline(delta, line) && parseSnapshotHeader(line, "#KFDELTA", c, n) && c == chain && n == seq;
+        while (ok && std::getline(delta, line)) {
+            size_t eq = line.find('=');
+            if (eq == std::string::npos) changes[line].reset();
+            else changes[line.substr(0, eq)] = line;
+        }
+    }
+
+    std::ifstream base(filename);
+    uint64_t c = 0, n = 0;
+    ok = ok && std::getline(base, line) && parseSnapshotHeader(line, "#KFBASE", c, n) && c == chain && n == from - 1;
+    size_t bytes = 0;
+    if (ok) {
+        FileWriter file(tmp, options);
+        std::ostream out(&file);
+        if (!file.isOpen()) out.setstate(std::ios::badbit);
+        out << "#KFBASE " << chain << " " << upto << "\n";
+        while (std::getline(base, line)) {
+            size_t eq = line.find('=');
+            if (eq == std::string::npos) continue;
+            auto it = changes.find(line.substr(0, eq));
+            if (it == changes.end()) {
+                out << line << '\n';
+            } else {
+                if (it->second) out << *it->second << '\n';
+                changes.erase(it);
+            }
+        }
+        for (const auto& [key, record] : changes) {
+            if (record) out << *record << '\n';
+        }
+        bytes = file.written();
+        ok = static_cast<bool>(out) && file.close() && std::rename(tmp.c_str(), filename.c_str()) == 0;
+    }
+    if (ok) {
+        removeDeltas(filename, upto);
+        merged_upto_ = upto;
+        base_bytes_ = bytes;
+        delta_bytes_ -= std::min<size_t>(merged_bytes, delta_bytes_);
+        merges_++;
+    } else {
+        std::remove(tmp.c_str());
+        Logger::instance().error("Snapshot: cannot merge the deltas of " + filename);
+    }
+    merging_ = false;
+}
+
+void Store::joinMerge() {
+    if (merge_thread_.joinable()) merge_thread_.join();
+}
+
 bool Store::loadFromFile(const std::string& filename) {
+    std::lock_guard<std::mutex> snapshot_lock(snapshot_mtx_);
+    joinMerge();  // it rewrites the base and deletes deltas
+    auto readHeader = [&](uint64_t& chain, uint64_t& upto) {
+        std::ifstream ifs(filename, std::ios::in);
+        std::string header;
+        return std::getline(ifs, header) && parseSnapshotHeader(header, "#KFBASE", chain, upto);
+    };
+
+    bool based = false;
+    uint64_t chain = 0, upto = 0, seq = 0;
+    size_t delta_bytes = 0;
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        // Another store merging this file's deltas renames a new base in
+        // before deleting them: a delta gone missing shows up as a new
+        // header, and the load starts over
+        for (int attempt = 0; attempt < 3; ++attempt) {
+            std::ifstream ifs(filename, std::ios::in);
+            if (!ifs.is_open()) return false;
+            std::string header;
+            based = std::getline(ifs, header) && parseSnapshotHeader(header, "#KFBASE", chain, upto);
+            ifs.clear();
+            ifs.seekg(0);
+            loadLocked(ifs);
+            if (!based) break;
+
+            seq = upto;
+            delta_bytes = 0;
+            for (;;) {
+                std::ifstream delta(deltaPath(filename, seq + 1));
+                if (!delta || !applyDelta(delta, chain, seq + 1)) break;
+                std::error_code ec;
+                delta_bytes += std::filesystem::file_size(deltaPath(filename, ++seq), ec);
+            }
+            uint64_t now_chain = 0, now_upto = 0;
+            if (readHeader(now_chain, now_upto) && now_chain == chain && now_upto == upto) break;
+        }
+        // What is in memory is what is on disk
+        if (based) {
+            all_dirty_ = false;
+            dirty_keys_.clear();
+        }
+    }
+    std::error_code ec;
+    snapshot_file_ = based ? filename : "";
+    chain_id_ = chain;
+    delta_seq_ = seq;
+    merged_upto_ = upto;
+    base_bytes_ = based ? std::filesystem::file_size(filename, ec) : 0;
+    delta_bytes_ = delta_bytes;
+    notifyWrite("", nullptr);
+    return true;
+}
+
+bool Store::applyDelta(std::istream& is, uint64_t chain, uint64_t seq) {
+    std::string line, key, value;
+    uint64_t c = 0, n = 0;
+    if (!std::getline(is, line) || !parseSnapshotHeader(line, "#KFDELTA", c, n) || c != chain || n != seq) return false;
+    while (std::getline(is, line)) {
+        if (line.find('=') == std::string::npos) {
+            if (Entry* entry = findLocked(line)) {
+                unindexValue(line, entry->value);
+                kv_store_.erase(line);
+                filterRemove(line);
+            }
+            continue;
+        }
+        if (!decodeRecord(line, key, value)) continue;
+        setValue(key, parseValue(value));
+        spillLocked();
+    }
+    return true;
+}
+
+std::string Store::snapshotInfo() const {
+    std::lock_guard<std::mutex> snapshot_lock(snapshot_mtx_);
+    std::string dirty;
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        dirty = all_dirty_ ? "all" : std::to_string(dirty_keys_.size());
+    }
+    return "Snapshot: " + (snapshot_file_.empty() ? std::string("none") : snapshot_file_) + ", base " +
+           std::to_string(base_bytes_.load()) + " bytes, " + std::to_string(delta_seq_ - merged_upto_) +
+           " deltas (" + std::to_string(delta_bytes_.load()) + " bytes), keys changed since: " + dirty + "\n" +
+           "Saves: full: " + std::to_string(base_saves_.load()) + ", delta: " + std::to_string(delta_saves_.load()) +
+           ", last wrote " + std::to_string(last_save_bytes_.load()) + " bytes, merges: " +
+           std::to_string(merges_.load()) + "\n" +
+           "Snapshot I/O: " + (wrote_direct_ ? "direct" : "buffered") + ", merge rate limit: " +
+           (write_options_.max_bytes_per_sec > 0 ? std::to_string(write_options_.max_bytes_per_sec) + " bytes/s\n"
+                                                : std::string("none\n"));
+}
+
+void Store::setWriteOptions(FileWriter::Options options) {
+    std::lock_guard<std::mutex> snapshot_lock(snapshot_mtx_);
+    write_options_ = options;
+}
+
+void Store::markDirty(const std::string& key) {
+    if (all_dirty_) return;
+    dirty_keys_.insert(key);
+    if (dirty_keys_.size() > kMinDirtyKeys && dirty_keys_.size() * 2 > kv_store_.size() + spilled_) {
+        all_dirty_ = true;
+        dirty_keys_.clear();
+    }
+}
+
+void Store::encodeRecord(std::string& out, const std::string& key, const std::string& value) {
+    out += key;
+    out += '=';
+    for (char c : value) {
+        if (c == '\n') out += "\\n";
+        else if (c == '=') out += "\\=";
+        else out += c;
+    }
+    out += '\n';
+}
+
+bool Store::decodeRecord(const std::string& line, std::string& key, std::string& value) {
+    size_t eq_pos = line.find('=');
+    if (eq_pos == std::string::npos) return false;
+    key.assign(line, 0, eq_pos);
+
+    // unescape
+    value.clear();
+    value.reserve(line.size() - eq_pos - 1);
+    for (size_t i = eq_pos + 1; i < line.size(); ++i) {
+        if (line[i] == '\\' && i + 1 < line.size() && (line[i + 1] == 'n' || line[i + 1] == '=')) {
+            value += line[i + 1] == 'n' ? '\n' : '=';
+            ++i;
+        } else {
+            value += line[i];
+        }
+    }
+    return true;
+}
+
+bool Store::saveToStream(std::ostream& os) {
     std::lock_guard<std::mutex> lock(mtx_);
-    std::ifstream ifs(filename, std::ios::in);
-    if (!ifs.is_open()) return false;
+    return saveLocked(os);
+}
+
+bool Store::saveLocked(std::ostream& os) {
+    std::string record;
+    try {
+        for (const auto& [key, entry] : kv_store_) {
+            record.clear();
+            encodeRecord(record, key, render(entry.value));
+            os << record;
+        }
+        if (spilled_ > 0) {
+            uint64_t version = 0;
+            std::string text;
+            engine_->forEach([&](const std::string& key, const std::string& spilled) {
+                if (!parseSpillRecord(spilled, version, text)) return true;
+                record.clear();
+                encodeRecord(record, key, text);
+                os << record;
+                return static_cast<bool>(os);
+            });
+        }
+    } catch (const StorageError& e) {
+        Logger::instance().error(std::string("Save: ") + e.what());
+        return false;
+    }
+    return static_cast<bool>(os);
+}
 
+bool Store::loadFromStream(std::istream& is) {
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        loadLocked(is);
+    }
+    notifyWrite("", nullptr);
+    return true;
+}
+
+void Store::loadLocked(std::istream& is) {
+    breakCaptures();
     kv_store_.clear();
-    value_to_keys_.clear();
+    pool_.clear();
+    if (value_log_) value_log_->clear();
+    int_values_ = 0;
+    used_bytes_ = 0;
+    if (engine_) engine_->clear();
+    spilled_ = 0;
+    // Nothing on disk is known to match any more
+    all_dirty_ = true;
+    dirty_keys_.clear();
 
-    std::string line;
-    while (std::getline(ifs, line)) {
-        size_t eq_pos = line.find('=');
-        if (eq_pos == std::string::npos) continue;
-        std::string key = line.substr(0, eq_pos);
-        std::string value = line.substr(eq_pos + 1);
+    std::string line, key, value;
+    while (std::getline(is, line)) {
+        if (!decodeRecord(line, key, value)) continue;
+        setValue(key, parseValue(value));
+        spillLocked();
+    }
+    rebuildKeyFilter();  // the old keys are still counted
+}
+
+struct Store::Capture {
+    explicit Capture(Store& owner) : store(owner) {}
+    Store& store;
+    size_t buckets = 0;    // kv_store_'s when taken: a rehash ends the walk
+    size_t next = 0;       // the buckets before this one have been walked
+    bool broken = false;   // the contents were replaced under it
+    // What writers changed in the buckets ahead, as it was (nullopt: it
+    // wasn't in memory, the walk must skip it)
+    std::unordered_map<std::string, std::optional<std::string>> preserved;
+};
 
-        // unescape
-        size_t pos = 0;
-        while ((pos = value.find("\\n", pos)) != std::string::npos) {
-            value.replace(pos, 2, "\n");
-            pos += 1;
+Store::Snapshot Store::snapshot() {
+    std::lock_guard<std::mutex> lock(mtx_);
+    Snapshot out;
+    if (!kv_store_.empty()) {
+        if (captures_.empty()) {
+            load_factor_ = kv_store_.max_load_factor();
+            kv_store_.max_load_factor(load_factor_ * kCaptureLoadFactor);
         }
-        pos = 0;
-        while ((pos = value.find("\\=", pos)) != std::string::npos) {
-            value.replace(pos, 2, "=");
-            pos += 1;
+        auto* capture = new Capture(*this);
+        capture->buckets = kv_store_.bucket_count();
+        captures_.push_back(capture);
+        out.memory.reset(capture, [](Capture* c) {
+            {
+                std::lock_guard<std::mutex> lock(c->store.mtx_);
+                c->store.endCapture(c);
+            }
+            delete c;
+        });
+        out.memory_keys = kv_store_.size();
+    }
+    if (spilled_ > 0) {
+        out.spilled = engine_->view();
+        out.spilled_keys = spilled_;
+    }
+    return out;
+}
+
+void Store::preserve(const std::string& key) {
+    for (Capture* capture : captures_) {
+        if (capture->broken) continue;
+        if (kv_store_.bucket_count() != capture->buckets) {
+            capture->broken = true;
+            continue;
+        }
+        if (kv_store_.bucket(key) < capture->next) continue;  // walked already
+        auto [kept, inserted] = capture->preserved.try_emplace(key);
+        if (!inserted) continue;
+        auto it = kv_store_.find(key);
+        if (it == kv_store_.end()) continue;
+        try {
+            kept->second = render(it->second.value);
+        } catch (const StorageError&) {
+            capture->broken = true;  // a cold value can't be read: let the write go on
         }
+    }
+}
 
-        kv_store_[key] = value;
-        value_to_keys_[value].insert(key);
+bool Store::captureNext(Capture& capture, std::vector<std::pair<std::string, std::string>>& out) {
+    std::lock_guard<std::mutex> lock(mtx_);
+    if (capture.broken || kv_store_.bucket_count() != capture.buckets) {
+        throw StorageError("the contents changed wholesale while a snapshot was being read");
+    }
+    size_t end = std::min(capture.buckets, capture.next + kCaptureBuckets);
+    for (; capture.next < end; ++capture.next) {
+        for (auto it = kv_store_.begin(capture.next); it != kv_store_.end(capture.next); ++it) {
+            if (!capture.preserved.count(it->first)) out.emplace_back(it->first, render(it->second.value));
+        }
     }
+    if (capture.next < capture.buckets) return true;
+    endCapture(&capture);
+    return false;
+}
+
+void Store::endCapture(Capture* capture) {
+    auto it = std::find(captures_.begin(), captures_.end(), capture);
+    if (it == captures_.end()) return;
+    captures_.erase(it);
+    if (captures_.empty()) kv_store_.max_load_factor(load_factor_);
+}
+
+void Store::breakCaptures() {
+    for (Capture* capture : captures_) capture->broken = true;
+}
+
+void Store::Snapshot::consume(const std::function<bool(const std::string&, const std::string&)>& fn) {
+    bool more = true;
+    if (memory) {
+        std::vector<std::pair<std::string, std::string>> pairs;
+        for (bool walking = true; more && walking;) {
+            walking = memory->store.captureNext(*memory, pairs);
+            for (const auto& [key, value] : pairs) {
+                more = fn(key, value);
+                if (!more) break;
+            }
+            pairs.clear();
+        }
+        // The walk is over, so nothing adds to these any more
+        for (const auto& [key, value] : memory->preserved) {
+            if (!more) break;
+            if (value) more = fn(key, *value);
+        }
+        memory.reset();
+    }
+    if (!more || !spilled) return;
+    uint64_t version = 0;
+    std::string text;
+    spilled->forEach([&](const std::string& key, const std::string& record) {
+        return !parseSpillRecord(record, version, text) || fn(key, text);
+    });
+    spilled.reset();
+}
+
+void Store::reserve(size_t n) {
+    std::lock_guard<std::mutex> lock(mtx_);
+    kv_store_.reserve(n);
+}
+
+void Store::putMany(std::vector<std::pair<std::string, std::string>>& kvs) {
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        for (auto& [key, value] : kvs) {
+            setValue(key, parseValue(std::move(value)));
+            spillLocked();
+        }
+    }
+    notifyWrite("", nullptr);
+}
+
+void Store::swapContents(Store& other) {
+    {
+        std::scoped_lock lock(mtx_, other.mtx_);
+        breakCaptures();
+        other.breakCaptures();
+        kv_store_.swap(other.kv_store_);
+        pool_.swap(other.pool_);
+        std::swap(int_values_, other.int_values_);
+        used_bytes_ = other.used_bytes_.exchange(used_bytes_.load());
+        // Spilled entries go with the rest
+        engine_.swap(other.engine_);
+        engine_factory_.swap(other.engine_factory_);
+        std::swap(spilled_, other.spilled_);
+        spill_full_ = other.spill_full_.exchange(spill_full_.load());
+        // So do cold values, and the log they are in
+        value_log_.swap(other.value_log_);
+        value_log_factory_.swap(other.value_log_factory_);
+        // Each side keeps the dictionaries its new values refer to (its
+        // own current one stays last)
+        auto adopt = [](auto& to, const auto& from) {
+            for (const auto& dict : from) {
+                if (std::find(to.begin(), to.end(), dict) == to.end()) to.insert(to.begin(), dict);
+            }
+        };
+        auto mine = dictionaries_;
+        adopt(dictionaries_, other.dictionaries_);
+        adopt(other.dictionaries_, mine);
+        // Both sides' versions must stay below their clocks
+        clock_ = other.clock_ = std::max(clock_, other.clock_);
+        all_dirty_ = other.all_dirty_ = true;
+        dirty_keys_.clear();
+        other.dirty_keys_.clear();
+        rebuildKeyFilter();
+        other.rebuildKeyFilter();
+    }
+    notifyWrite("", nullptr);
+    other.notifyWrite("", nullptr);
+}
+
+void Store::notifyWrite(const std::string& key, const char* event) {
+    if (write_observer_) write_observer_(key, event);
+}
+
+// Key filter
+
+void Store::enableKeyFilter() {
+    std::lock_guard<std::mutex> lock(mtx_);
+    if (key_filter_.load()) return;
+    key_filters_.push_back(std::make_unique<KeyFilter>(std::max<size_t>((kv_store_.size() + spilled_) * 2, 1024)));
+    for (const auto& [key, entry] : kv_store_) key_filters_.back()->add(KeyFilter::hash(key));
+    if (spilled_ > 0) {
+        try {
+            engine_->forEach([&](const std::string& key, const std::string&) {
+                key_filters_.back()->add(KeyFilter::hash(key));
+                return true;
+            });
+        } catch (const StorageError& e) {
+            // Missing keys would be reported absent: no filter at all
+            Logger::instance().error(std::string("Key filter: ") + e.what());
+            key_filters_.pop_back();
+            return;
+        }
+    }
+    key_filter_.store(key_filters_.back().get(), std::memory_order_release);
+}
+
+bool Store::mayContain(const std::string& key) const {
+    // Seqlock read: a rebuild in between (odd or changed sequence) sends
+    // the lookup to the map instead
+    uint64_t seq = key_filter_seq_.load(std::memory_order_acquire);
+    KeyFilter* filter = key_filter_.load(std::memory_order_acquire);
+    if (!filter || (seq & 1)) return true;
+    bool maybe = filter->mayContain(KeyFilter::hash(key));
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (maybe || key_filter_seq_.load(std::memory_order_relaxed) != seq) return true;
+    filter_skips_++;
+    return false;
+}
+
+void Store::filterAdd(const std::string& key) {
+    KeyFilter* filter = key_filter_.load(std::memory_order_relaxed);
+    if (!filter) return;
+    if (kv_store_.size() + spilled_ > filter->capacity()) {
+        rebuildKeyFilter();  // counts the new key too
+        return;
+    }
+    filter->add(KeyFilter::hash(key));
+}
+
+void Store::filterRemove(const std::string& key) {
+    KeyFilter* filter = key_filter_.load(std::memory_order_relaxed);
+    if (filter) filter->remove(KeyFilter::hash(key));
+}
+
+void Store::rebuildKeyFilter() {
+    KeyFilter* filter = key_filter_.load(std::memory_order_relaxed);
+    if (!filter) return;
+    key_filter_seq_.fetch_add(1, std::memory_order_acq_rel);
+    if (kv_store_.size() + spilled_ > filter->capacity()) {
+        // Twice the keys, so the next growth is as far away as this one
+        key_filters_.push_back(std::make_unique<KeyFilter>((kv_store_.size() + spilled_) * 2));
+        filter = key_filters_.back().get();
+        key_filter_.store(filter, std::memory_order_release);
+    } else {
+        filter->clear();
+    }
+    for (const auto& [key, entry] : kv_store_) filter->add(KeyFilter::hash(key));
+    if (spilled_ > 0) {
+        try {
+            engine_->forEach([&](const std::string& key, const std::string&) {
+                filter->add(KeyFilter::hash(key));
+                return true;
+            });
+        } catch (const StorageError& e) {
+            // Half built: turn it off rather than answer from it
+            Logger::instance().error(std::string("Key filter: ") + e.what());
+            key_filter_.store(nullptr, std::memory_order_release);
+        }
+    }
+    key_filter_seq_.fetch_add(1, std::memory_order_release);
+}
+
+// Storage engine
+
+void Store::setStorageEngine(std::function<std::unique_ptr<StorageEngine>()> factory) {
+    auto engine = factory();
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        engine_factory_ = std::move(factory);
+        engine_ = std::move(engine);
+        // A persistent engine may come back with a dataset: it is served
+        // from there, read into memory key by key as it is used
+        spilled_ = engine_->restoredKeys();
+        if (spilled_ > 0) rebuildKeyFilter();
+        spillLocked();
+    }
+}
+
+bool Store::persistStorage() {
+    std::lock_guard<std::mutex> lock(mtx_);
+    if (!engine_ || !engine_->persistent()) return true;
+    try {
+        for (auto it = kv_store_.begin(); it != kv_store_.end();) {
+            if (!engine_->put(it->first, spillRecord(it->second.version, render(it->second.value)))) return false;
+            preserve(it->first);
+            unindexValue(it->first, it->second.value);
+            it = kv_store_.erase(it);
+            spilled_++;
+        }
+    } catch (const StorageError& e) {
+        Logger::instance().error(std::string("Storage engine: cannot persist: ") + e.what());
+        return false;
+    }
+    return engine_->persist();
+}
+
+std::unique_ptr<Store> Store::emptyLike() const {
+    auto copy = std::make_unique<Store>();
+    std::function<std::unique_ptr<StorageEngine>()> factory;
+    std::function<std::unique_ptr<ValueLog>()> log_factory;
+    std::chrono::seconds cold_after{0};
+    {
+        std::lock_guard<std::mutex> snapshot_lock(snapshot_mtx_);
+        copy->write_options_ = write_options_;
+    }
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        copy->max_memory_ = max_memory_;
+        copy->compress_threshold_ = compress_threshold_;
+        copy->dictionaries_ = dictionaries_;
+        factory = engine_factory_;
+        log_factory = value_log_factory_;
+        cold_after = cold_after_;
+    }
+    if (factory) copy->setStorageEngine(std::move(factory));
+    if (log_factory) copy->setValueLog(std::move(log_factory), cold_after);
+    return copy;
+}
+
+Store::Entry* Store::findLocked(const std::string& key) {
+    auto it = kv_store_.find(key);
+    if (it != kv_store_.end()) {
+        it->second.touched = ++access_clock_;
+        if (auto* blob = std::get_if<Blob*>(&it->second.value)) {
+            (*blob)->used = tier_now_;
+            if ((*blob)->log) used_bytes_.fetch_add(pool_.warm(*blob), std::memory_order_relaxed);
+        }
+        return &it->second;
+    }
+    uint64_t version = 0;
+    std::string text;
+    auto record = spilledRecord(key);
+    if (!record || !parseSpillRecord(*record, version, text)) return nullptr;
+    // setValue() takes it out of the engine; the version stays, and it
+    // hasn't changed since the last save any more than before
+    bool dirty = all_dirty_ || dirty_keys_.count(key) > 0;
+    Entry& entry = setValue(key, parseValue(std::move(text)));
+    entry.version = version;
+    if (!dirty) dirty_keys_.erase(key);
+    faults_++;
+    return &entry;
+}
+
+std::optional<std::string> Store::spilledRecord(const std::string& key) const {
+    if (spilled_ == 0) return std::nullopt;
+    return engine_->get(key);
+}
+
+bool Store::dropSpilled(const std::string& key) {
+    try {
+        if (!spilledRecord(key)) return false;
+    } catch (const StorageError&) {
+        // Whatever is there goes anyway. Not knowing whether it was, keep
+        // counting it (and add the key to the filter again, harmlessly)
+        engine_->remove(key);
+        return false;
+    }
+    engine_->remove(key);
+    spilled_--;
     return true;
 }
 
+void Store::spillLocked() {
+    if (!engine_ || max_memory_ == 0) return;
+    // After the engine ran out of room, try again now and then, not on every write
+    if (spill_full_.load(std::memory_order_relaxed) && std::chrono::steady_clock::now() < spill_retry_) return;
+    while (used_bytes_.load(std::memory_order_relaxed) > max_memory_ && !kv_store_.empty()) {
+        // Approximate LRU: the least recently used of a few entries from a
+        // random spot in the table
+        spill_seed_ = spill_seed_ * 6364136223846793005ULL + 1442695040888963407ULL;
+        size_t buckets = kv_store_.bucket_count();
+        size_t bucket = (spill_seed_ >> 33) % buckets;
+        const std::string* victim = nullptr;
+        uint32_t oldest = 0;
+        size_t seen = 0;
+        for (size_t n = 0; n < buckets && seen < kSpillSamples; ++n, bucket = (bucket + 1) % buckets) {
+            for (auto it = kv_store_.begin(bucket); it != kv_store_.end(bucket) && seen < kSpillSamples; ++it, ++seen) {
+                uint32_t age = access_clock_ - it->second.touched;
+                if (!victim || age > oldest) {
+                    victim = &it->first;
+                    oldest = age;
+                }
+            }
+        }
+        std::string key = *victim;
+        auto it = kv_store_.find(key);
+        std::string text;
+        try {
+            text = render(it->second.value);
+        } catch (const StorageError& e) {
+            // A cold value takes next to no memory where it is: leave it
+            Logger::instance().error(std::string("Storage engine: cannot spill ") + key + ": " + e.what());
+            break;
+        }
+        if (!engine_->put(key, spillRecord(it->second.version, text))) {
+            // No room on disk either: writes get OOM until there is
+            spill_full_.store(true, std::memory_order_relaxed);
+            spill_retry_ = std::chrono::steady_clock::now() + kSpillRetry;
+            return;
+        }
+        spill_full_.store(false, std::memory_order_relaxed);
+        preserve(key);
+        unindexValue(key, it->second.value);
+        kv_store_.erase(it);
+        spilled_++;
+        spills_++;
+    }
+}
+
+std::string Store::storageInfo() const {
+    std::lock_guard<std::mutex> lock(mtx_);
+    if (!engine_) return "Storage engine: off\n";
+    return "Spilled keys: " + std::to_string(spilled_) + " (spills: " + std::to_string(spills_.load()) +
+           ", read back: " + std::to_string(faults_.load()) + ")\n" + engine_->info();
+}
+
+// Value tiering
+
+void Store::setValueLog(std::function<std::unique_ptr<ValueLog>()> factory, std::chrono::seconds cold_after) {
+    auto log = factory();
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        if (value_log_) return;  // set once
+        value_log_factory_ = std::move(factory);
+        value_log_ = std::move(log);
+        cold_after_ = cold_after;
+    }
+    tier_thread_ = std::thread(&Store::tieringLoop, this);
+}
+
+void Store::tieringLoop() {
+    auto start = std::chrono::steady_clock::now();
+    std::unique_lock<std::mutex> lock(mtx_);
+    auto interval = std::clamp<std::chrono::seconds>(cold_after_ / 4, std::chrono::seconds(1), std::chrono::minutes(1));
+    while (!tier_stop_) {
+        tier_now_ = static_cast<uint32_t>(
+            std::chrono::duration_cast<std::chrono::seconds>(std::chrono::steady_clock::now() - start).count());
+
+        // A pass over every value, letting commands in between batches.
+        // swapContents() may bring another pool and log meanwhile; the pass
+        // just goes on over those.
+        if (value_log_ && tier_now_ >= static_cast<uint64_t>(cold_after_.count())) {
+            uint32_t before = tier_now_ - static_cast<uint32_t>(cold_after_.count());
+            size_t cursor = 0;
+            do {
+                used_bytes_.fetch_sub(pool_.cool(*value_log_, before, kColdMinBytes, cursor, kCoolBatch),
+                                      std::memory_order_relaxed);
+                lock.unlock();
+                std::this_thread::yield();
+                lock.lock();
+            } while (cursor != 0 && value_log_ && !tier_stop_);
+        }
+        // Then the log's mostly dead segments, one per lock hold
+        while (value_log_ && !tier_stop_ && pool_.collect(*value_log_)) {
+            lock.unlock();
+            std::this_thread::yield();
+            lock.lock();
+        }
+        tier_cv_.wait_for(lock, interval, [&] { return tier_stop_; });
+    }
+}
+
+std::string Store::valueLogInfo() const {
+    std::lock_guard<std::mutex> lock(mtx_);
+    if (!value_log_) return "Value log: off\n";
+    return "Value log: " + std::to_string(pool_.coldValues()) + " cold values (" + std::to_string(pool_.coldBytes()) +
+           " bytes), untouched for " + std::to_string(cold_after_.count()) + " s, on disk " +
+           std::to_string(value_log_->diskBytes()) + " bytes in " + std::to_string(value_log_->segments()) +
+           " segments (" + std::to_string(value_log_->deadBytes()) + " dead)\n" +
+           "Value log traffic: cooled: " + std::to_string(pool_.cooled()) + ", read back: " +
+           std::to_string(pool_.warmed()) + ", segments collected: " + std::to_string(pool_.collected()) + " (" +
+           std::to_string(pool_.rewrittenBytes()) + " bytes rewritten)\n";
+}
+
+// Compression
+
+void Store::setCompression(size_t threshold) {
+    std::lock_guard<std::mutex> lock(mtx_);
+    compress_threshold_ = threshold;
+}
+
+size_t Store::trainCompression(size_t max_bytes) {
+    constexpr size_t kSampleBytes = 1 << 20;
+    constexpr size_t kMaxSamples = 4096;
+
+    // Sample under the lock, train without it
+    std::vector<std::string> samples;
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        size_t bytes = 0;
+        for (const auto& [key, entry] : kv_store_) {
+            if (samples.size() >= kMaxSamples || bytes >= kSampleBytes) break;
+            if (!scalar(entry.value) || std::holds_alternative<int64_t>(entry.value)) continue;
+            if (auto* blob = std::get_if<Blob*>(&entry.value); blob && (*blob)->log) continue;  // cold
+            samples.push_back(render(entry.value));
+            bytes += samples.back().size();
+        }
+    }
+    std::string dict = compression::train(samples, max_bytes);
+    if (dict.empty()) return 0;
+
+    std::lock_guard<std::mutex> lock(mtx_);
+    dictionaries_.push_back(std::make_shared<const compression::Dictionary>(std::move(dict)));
+    return dictionaries_.back()->bytes().size();
+}
+
+std::string Store::compressionInfo() const {
+    size_t threshold = 0, dict = 0, values = 0, raw = 0, packed = 0;
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        threshold = compress_threshold_;
+        if (!dictionaries_.empty()) dict = dictionaries_.back()->bytes().size();
+        values = pool_.packedValues();
+        raw = pool_.packedRawBytes();
+        packed = pool_.packedBytes();
+    }
+    if (threshold == 0 && values == 0) return "Compression: off\n";
+    char ratio[32];
+    std::snprintf(ratio, sizeof(ratio), "%.2f", packed ? static_cast<double>(raw) / packed : 1.0);
+    return std::string("Compression: ") + compression::codecName() + ", values >= " + std::to_string(threshold) +
+           " bytes, " + std::to_string(values) + " compressed, " + std::to_string(raw) + " -> " +
+           std::to_string(packed) + " bytes (ratio " + ratio + "), dictionary " + std::to_string(dict) + " bytes\n";
+}
+
+std::string Store::dedupInfo() const {
+    std::lock_guard<std::mutex> lock(mtx_);
+    return "Distinct values: " + std::to_string(pool_.values()) + " for " + std::to_string(pool_.references()) +
+           " keys, " + std::to_string(pool_.storedBytes()) + " bytes stored, " +
+           std::to_string(pool_.sharedBytes()) + " bytes saved by sharing\n";
+}
+
+std::string Store::keyFilterInfo() const {
+    KeyFilter* filter = key_filter_.load(std::memory_order_acquire);
+    if (!filter) return "Key filter: off\n";
+    size_t skips = filter_skips_.load(), false_positives = filter_false_positives_.load();
+    char rate[32];
+    std::snprintf(rate, sizeof(rate), "%.2f%%",
+                  skips + false_positives ? 100.0 * false_positives / (skips + false_positives) : 0.0);
+    return "Key filter: " + std::to_string(filter->bytes()) + " bytes, misses skipped: " + std::to_string(skips) +
+           ", false positives: " + std::to_string(false_positives) + " (" + rate + ")\n";
+}
+
 } // namespace keyforge
@@ -0,0 +1,121 @@
+#include "keyforge/Tracking.hpp"
+#include "keyforge/Logger.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <sys/socket.h>
+
+namespace keyforge {
+
+std::shared_ptr<Tracking::Subscriber> Tracking::subscribe(int fd) {
+    auto sub = std::make_shared<Subscriber>(fd);
+    std::lock_guard<std::mutex> lock(mtx_);
+    subscribers_.insert(sub);
+    return sub;
+}
+
+void Tracking::unsubscribe(const std::shared_ptr<Subscriber>& sub) {
+    std::lock_guard<std::mutex> lock(mtx_);
+    for (const auto& key : sub->keys) {
+        auto it = table_.find(key);
+        if (it == table_.end()) continue;
+        auto& subs = it->second;
+        subs.erase(std::remove(subs.begin(), subs.end(), sub), subs.end());
+        if (subs.empty()) table_.erase(it);
+    }
+    sub->keys.clear();
+    subscribers_.erase(sub);
+    tracked_keys_.store(table_.size());
+}
+
+void Tracking::remember(const std::string& key, const std::shared_ptr<Subscriber>& sub) {
+    std::string evicted;
+    std::vector<std::shared_ptr<Subscriber>> notify;
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        if (!sub->keys.insert(key).second) return;
+        table_[key].push_back(sub);
+
+        // Table full: stop tracking some key, telling its readers to drop it
+        if (table_.size() > kMaxTrackedKeys) {
+            auto victim = table_.begin();
+            if (victim->first == key) ++victim;
+            evicted = victim->first;
+            notify = std::move(victim->second);
+            for (auto& s : notify) s->keys.erase(evicted);
+            table_.erase(victim);
+            evictions_++;
+        }
+        tracked_keys_.store(table_.size());
+    }
+    for (auto& s : notify) push(*s, ">INVALIDATE " + evicted + "\n");
+}
+
+void Tracking::invalidate(const std::string& key) {
+    if (tracked_keys_.load() == 0) return;
+
+    std::vector<std::shared_ptr<Subscriber>> notify;
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        if (key.empty()) {
+            for (const auto& sub : subscribers_) {
+                if (!sub->keys.empty()) notify.push_back(sub);
+                sub->keys.clear();
+            }
+            table_.clear();
+        } else {
+            auto it = table_.find(key);
+            if (it == table_.end()) return;
+            notify = std::move(it->second);
+            for (auto& s : notify) s->keys.erase(key);
+            table_.erase(it);
+        }
+        tracked_keys_.store(table_.size());
+    }
+
+    std::string msg = ">INVALIDATE " + (key.empty() ? std::string("*") : key) + "\n";
+    for (auto& s : notify) push(*s, msg);
+}
+
+void Tracking::push(Subscriber& sub, const std::string& msg) {
+    if (sub.dropped) return;
+    std::unique_lock<std::timed_mutex> lock(sub.send_mtx, kPushWait);
+    bool ok = lock.owns_lock();
+    if (ok && sub.fd < 0) return;
+
+    size_t sent = 0;
+    while (ok && sent < msg.size()) {
+        ssize_t n = send(sub.fd, msg.data() + sent, msg.size() - sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n < 0 && errno == EINTR) continue;
+        ok = n > 0;
+        if (ok) sent += static_cast<size_t>(n);
+    }
+    if (ok) {
+        invalidations_++;
+        return;
+    }
+
+    // Not reading its socket (or gone): cut it off rather than block the
+    // writer. Without the lock the fd may be closing concurrently, so leave
+    // that case to the connection's own thread (it checks dropped).
+    sub.dropped = true;
+    dropped_clients_++;
+    Logger::instance().warn("Tracking: dropping a client that can't take invalidations");
+    if (lock.owns_lock()) shutdown(sub.fd, SHUT_RDWR);
+}
+
+std::string Tracking::info() {
+    size_t clients = 0;
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        clients = subscribers_.size();
+    }
+    std::string out = "Tracking clients: " + std::to_string(clients) + "\n";
+    out += "Tracked keys: " + std::to_string(tracked_keys_.load()) + "\n";
+    out += "Invalidations sent: " + std::to_string(invalidations_.load()) + "\n";
+    out += "Tracking evictions: " + std::to_string(evictions_.load()) + "\n";
+    out += "Dropped slow clients: " + std::to_string(dropped_clients_.load()) + "\n";
+    return out;
+}
+
+} // namespace keyforge
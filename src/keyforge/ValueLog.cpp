@@ -0,0 +1,117 @@
+#include "keyforge/ValueLog.hpp"
+
+#include <cerrno>
+#include <cstdio>
+#include <filesystem>
+#include <stdexcept>
+#include <system_error>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace keyforge {
+
+ValueLog::ValueLog(std::string dir, Options options) : dir_(std::move(dir)), options_(options) {
+    std::error_code ec;
+    std::filesystem::remove_all(dir_, ec);
+    std::filesystem::create_directories(dir_, ec);
+    if (ec) throw std::runtime_error("Value log directory " + dir_ + ": " + ec.message());
+}
+
+ValueLog::~ValueLog() {
+    clear();
+    std::error_code ec;
+    std::filesystem::remove_all(dir_, ec);
+}
+
+std::string ValueLog::segmentPath(uint32_t number) const {
+    char name[32];
+    std::snprintf(name, sizeof(name), "/%06u.vlog", number);
+    return dir_ + name;
+}
+
+bool ValueLog::append(const std::string& bytes, Ref& ref) {
+    if (bytes.size() > UINT32_MAX) return false;
+    auto head = segments_.find(head_);
+    if (head == segments_.end() || (head->second.size > 0 && head->second.size + bytes.size() > options_.segment_bytes)) {
+        // Seal the head (an all-dead one goes now) and start a new segment
+        if (head != segments_.end() && head->second.dead == head->second.size) drop(head);
+        Segment segment;
+        segment.fd = ::open(segmentPath(head_ + 1).c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (segment.fd < 0) return false;
+        // Best effort: one extent for the whole segment
+        ::fallocate(segment.fd, FALLOC_FL_KEEP_SIZE, 0, static_cast<off_t>(options_.segment_bytes));
+        head = segments_.emplace(++head_, segment).first;
+    }
+
+    Segment& segment = head->second;
+    size_t done = 0;
+    while (done < bytes.size()) {
+        ssize_t n = ::pwrite(segment.fd, bytes.data() + done, bytes.size() - done,
+                             static_cast<off_t>(segment.size + done));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;  // the space is reused by the next append
+        done += static_cast<size_t>(n);
+    }
+    ref.segment = head_;
+    ref.size = static_cast<uint32_t>(bytes.size());
+    ref.offset = segment.size;
+    segment.size += bytes.size();
+    disk_bytes_ += bytes.size();
+    if (options_.sync_bytes > 0 && segment.size - segment.synced >= options_.sync_bytes) {
+        ::sync_file_range(segment.fd, static_cast<off_t>(segment.synced), static_cast<off_t>(segment.size - segment.synced),
+                          SYNC_FILE_RANGE_WRITE);
+        segment.synced = segment.size;
+    }
+    return true;
+}
+
+bool ValueLog::read(const Ref& ref, std::string& out) const {
+    auto it = segments_.find(ref.segment);
+    if (it == segments_.end()) return false;
+    out.resize(ref.size);
+    size_t done = 0;
+    while (done < ref.size) {
+        ssize_t n = ::pread(it->second.fd, &out[done], ref.size - done, static_cast<off_t>(ref.offset + done));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        done += static_cast<size_t>(n);
+    }
+    return true;
+}
+
+void ValueLog::release(const Ref& ref) {
+    auto it = segments_.find(ref.segment);
+    if (it == segments_.end()) return;
+    it->second.dead += ref.size;
+    dead_bytes_ += ref.size;
+    if (ref.segment != head_ && it->second.dead == it->second.size) drop(it);
+}
+
+uint32_t ValueLog::gcVictim() const {
+    uint32_t victim = 0;
+    double worst = options_.gc_dead_ratio;
+    for (const auto& [number, segment] : segments_) {
+        if (number == head_ || segment.size == 0) continue;
+        double ratio = static_cast<double>(segment.dead) / segment.size;
+        if (ratio >= worst) {
+            victim = number;
+            worst = ratio;
+        }
+    }
+    return victim;
+}
+
+void ValueLog::drop(std::map<uint32_t, Segment>::iterator it) {
+    ::close(it->second.fd);
+    ::unlink(segmentPath(it->first).c_str());
+    disk_bytes_ -= it->second.size;
+    dead_bytes_ -= it->second.dead;
+    segments_.erase(it);
+}
+
+void ValueLog::clear() {
+    while (!segments_.empty()) drop(segments_.begin());
+}
+
+} // namespace keyforge
@@ -0,0 +1,181 @@
+#include "keyforge/ValuePool.hpp"
+
+#include <functional>
+#include <utility>
+
+namespace keyforge {
+
+std::optional<std::string> ValuePool::read(const Blob& blob) {
+    std::string cold;
+    if (blob.log && !blob.log->read(blob.ref, cold)) return std::nullopt;
+    const std::string& data = blob.log ? cold : blob.data;
+    if (!blob.packed) return data;
+    std::string out;
+    if (!compression::decompress(data, blob.size, blob.dict, out)) return std::nullopt;
+    return out;
+}
+
+ValuePool::Blob* ValuePool::lookup(size_t hash, const std::string& value) const {
+    auto [first, last] = blobs_.equal_range(hash);
+    for (auto it = first; it != last; ++it) {
+        Blob* blob = it->second.get();
+        if (blob->size != value.size()) continue;
+        if (blob->packed || blob->log ? read(*blob) == value : blob->data == value) return blob;
+    }
+    return nullptr;
+}
+
+ValuePool::Blob* ValuePool::acquire(const std::string& key, std::string value, size_t compress_from,
+                                    const compression::Dictionary* dict) {
+    size_t hash = std::hash<std::string>{}(value);
+    Blob* blob = lookup(hash, value);
+    if (!blob) {
+        auto fresh = std::make_unique<Blob>();
+        fresh->size = static_cast<uint32_t>(value.size());
+        fresh->hash = hash;
+        if (compress_from > 0 && value.size() >= compress_from && value.size() <= UINT32_MAX &&
+            compression::compress(value, dict, fresh->data)) {
+            fresh->data.shrink_to_fit();
+            fresh->dict = dict;
+            fresh->packed = true;
+            packed_values_++;
+            packed_raw_bytes_ += fresh->size;
+            packed_bytes_ += fresh->data.size();
+        } else {
+            fresh->data = std::move(value);
+        }
+        stored_bytes_ += fresh->data.size();
+        blob = blobs_.emplace(hash, std::move(fresh))->second.get();
+    } else if (blob->keys.count(key) == 0) {
+        shared_bytes_ += stored(*blob);
+    }
+    if (blob->keys.insert(key).second) references_++;
+    return blob;
+}
+
+void ValuePool::release(const std::string& key, Blob* blob) {
+    if (blob->keys.erase(key) == 0) return;
+    references_--;
+    if (!blob->keys.empty()) {
+        shared_bytes_ -= stored(*blob);
+        return;
+    }
+
+    stored_bytes_ -= stored(*blob);
+    if (blob->packed) {
+        packed_values_--;
+        packed_raw_bytes_ -= blob->size;
+        packed_bytes_ -= stored(*blob);
+    }
+    forgetCold(blob);
+    auto [first, last] = blobs_.equal_range(blob->hash);
+    for (auto it = first; it != last; ++it) {
+        if (it->second.get() == blob) {
+            blobs_.erase(it);
+            return;
+        }
+    }
+}
+
+const ValuePool::Blob* ValuePool::find(const std::string& value) const {
+    return lookup(std::hash<std::string>{}(value), value);
+}
+
+// Tiering
+
+size_t ValuePool::cool(ValueLog& log, uint32_t before, size_t min_bytes, size_t& cursor, size_t budget) {
+    size_t freed = 0, seen = 0;
+    size_t buckets = blobs_.bucket_count();
+    // Whole buckets at a time, like Store::scan()
+    while (cursor < buckets && seen < budget) {
+        for (auto it = blobs_.begin(cursor); it != blobs_.end(cursor); ++it, ++seen) {
+            Blob* blob = it->second.get();
+            if (blob->log || blob->used >= before || blob->data.size() < min_bytes) continue;
+            if (!log.append(blob->data, blob->ref)) {
+                cursor = 0;  // the log can't take it: give up this pass
+                return freed;
+            }
+            freed += blob->data.size();
+            std::string().swap(blob->data);
+            blob->log = &log;
+            cold_[blob->ref.segment].insert(blob);
+            cold_values_++;
+            cold_bytes_ += blob->ref.size;
+            cooled_++;
+        }
+        cursor++;
+    }
+    if (cursor >= buckets) cursor = 0;
+    return freed;
+}
+
+size_t ValuePool::warm(Blob* blob) {
+    if (!blob->log) return 0;
+    std::string data;
+    if (!blob->log->read(blob->ref, data)) return 0;  // it stays cold
+    forgetCold(blob);
+    blob->data = std::move(data);
+    warmed_++;
+    return blob->data.size();
+}
+
+bool ValuePool::collect(ValueLog& log) {
+    uint32_t victim = log.gcVictim();
+    if (victim == 0) return false;
+    std::unordered_set<Blob*> blobs;
+    if (auto it = cold_.find(victim); it != cold_.end()) {
+        blobs = std::move(it->second);
+        cold_.erase(it);
+    }
+    // Copying the last live value out releases the segment
+    std::string data;
+    for (auto it = blobs.begin(); it != blobs.end(); ++it) {
+        Blob* blob = *it;
+        ValueLog::Ref old = blob->ref;
+        if (!log.read(old, data) || !log.append(data, blob->ref)) {
+            cold_[victim].insert(it, blobs.end());
+            return false;
+        }
+        cold_[blob->ref.segment].insert(blob);
+        rewritten_bytes_ += data.size();
+        log.release(old);
+    }
+    collected_++;
+    return true;
+}
+
+void ValuePool::forgetCold(Blob* blob) {
+    if (!blob->log) return;
+    blob->log->release(blob->ref);
+    auto it = cold_.find(blob->ref.segment);
+    if (it != cold_.end()) {
+        it->second.erase(blob);
+        if (it->second.empty()) cold_.erase(it);
+    }
+    cold_values_--;
+    cold_bytes_ -= blob->ref.size;
+    blob->log = nullptr;
+}
+
+void ValuePool::clear() {
+    blobs_.clear();
+    references_ = stored_bytes_ = shared_bytes_ = 0;
+    packed_values_ = packed_raw_bytes_ = packed_bytes_ = 0;
+    cold_.clear();
+    cold_values_ = cold_bytes_ = 0;
+}
+
+void ValuePool::swap(ValuePool& other) {
+    blobs_.swap(other.blobs_);
+    std::swap(references_, other.references_);
+    std::swap(stored_bytes_, other.stored_bytes_);
+    std::swap(shared_bytes_, other.shared_bytes_);
+    std::swap(packed_values_, other.packed_values_);
+    std::swap(packed_raw_bytes_, other.packed_raw_bytes_);
+    std::swap(packed_bytes_, other.packed_bytes_);
+    cold_.swap(other.cold_);
+    std::swap(cold_values_, other.cold_values_);
+    std::swap(cold_bytes_, other.cold_bytes_);
+}
+
+} // namespace keyforge
@@ -1,26 +1,129 @@
 #include "../includes_this/keyforge/Server.hpp"
+#include "../includes_this/keyforge/Lsm.hpp"
 #include <iostream>
+#include <chrono>
 #include <csignal>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
 
 using namespace keyforge;
 
 static Server* g_server = nullptr;
 
-// Signal handler for Ctrl+C
+// Signal handler for Ctrl+C: async-signal-safe calls only, so no output
+// here; run() returns once the server has stopped
 void handle_sigint(int) {
     if (g_server) {
-        std::cout << "\n[Main] Caught SIGINT, shutting down server..." << std::endl;
         g_server->requestShutdown();  // <-- call the public method, not shutdown_requested_
     }
 }
 
-int main() {
+// Usage: keyforge [port] [--replicaof host port [token]] [--repl-backlog bytes]
+//                 [--read-wait ms] [--cluster [announce_host]] [--raft host:port,host:port,... [token]]
+//                 [--gossip host:port,host:port,...] [--databases n] [--db-maxmemory bytes]
+//                 [--key-filter] [--compress bytes] [--storage-dir path [--block-cache bytes]]
+//                 [--mmap-dir path] [--value-log path [--cold-after seconds]]
+//                 [--direct-io] [--save-sync bytes] [--merge-rate bytes_per_sec]
+int main(int argc, char** argv) {
     int port = 4545;
+    std::string leader_host, leader_token;
+    int leader_port = 0;
+    size_t repl_backlog = 0;
+    long read_wait_ms = -1;
+    std::string cluster_host;
+    std::vector<std::string> raft_members;
+    std::string raft_token;
+    std::vector<std::string> gossip_seeds;
+    size_t databases = 0;
+    size_t db_maxmemory = 0;
+    bool key_filter = false;
+    size_t compress_threshold = 0;
+    std::string storage_dir;
+    size_t block_cache = LsmEngine::Options().block_cache_bytes;
+    std::string mmap_dir;
+    std::string value_log_dir;
+    long cold_after = 300;
+    FileWriter::Options write_options;
 
     try {
+        for (int i = 1; i < argc; ++i) {
+            std::string arg = argv[i];
+            if (arg == "--replicaof" && i + 2 < argc) {
+                leader_host = argv[++i];
+                leader_port = std::stoi(argv[++i]);
+                if (i + 1 < argc && argv[i + 1][0] != '-') leader_token = argv[++i];
+            } else if (arg == "--cluster") {
+                cluster_host = "127.0.0.1";
+                if (i + 1 < argc && argv[i + 1][0] != '-') cluster_host = argv[++i];
+            } else if (arg == "--raft" && i + 1 < argc) {
+                std::istringstream members(argv[++i]);
+                std::string member;
+                while (std::getline(members, member, ',')) raft_members.push_back(member);
+                if (i + 1 < argc && argv[i + 1][0] != '-') raft_token = argv[++i];
+            } else if (arg == "--gossip" && i + 1 < argc) {
+                std::istringstream seeds(argv[++i]);
+                std::string seed;
+                while (std::getline(seeds, seed, ',')) gossip_seeds.push_back(seed);
+            } else if (arg == "--repl-backlog" && i + 1 < argc) {
+                repl_backlog = std::stoul(argv[++i]);
+            } else if (arg == "--read-wait" && i + 1 < argc) {
+                read_wait_ms = std::stol(argv[++i]);
+            } else if (arg == "--databases" && i + 1 < argc) {
+                databases = std::stoul(argv[++i]);
+            } else if (arg == "--db-maxmemory" && i + 1 < argc) {
+                db_maxmemory = std::stoul(argv[++i]);
+            } else if (arg == "--key-filter") {
+                key_filter = true;
+            } else if (arg == "--compress" && i + 1 < argc) {
+                compress_threshold = std::stoul(argv[++i]);
+            } else if (arg == "--storage-dir" && i + 1 < argc) {
+                storage_dir = argv[++i];
+            } else if (arg == "--block-cache" && i + 1 < argc) {
+                block_cache = std::stoul(argv[++i]);
+            } else if (arg == "--mmap-dir" && i + 1 < argc) {
+                mmap_dir = argv[++i];
+            } else if (arg == "--value-log" && i + 1 < argc) {
+                value_log_dir = argv[++i];
+            } else if (arg == "--cold-after" && i + 1 < argc) {
+                cold_after = std::stol(argv[++i]);
+            } else if (arg == "--direct-io") {
+                write_options.direct = true;
+            } else if (arg == "--save-sync" && i + 1 < argc) {
+                write_options.sync_bytes = std::stoul(argv[++i]);
+            } else if (arg == "--merge-rate" && i + 1 < argc) {
+                write_options.max_bytes_per_sec = std::stoul(argv[++i]);
+            } else {
+                port = std::stoi(arg);
+            }
+        }
+
+        if (!storage_dir.empty() && !mmap_dir.empty()) {
+            throw std::invalid_argument("--storage-dir and --mmap-dir can't be used together");
+        }
+
         Server server(port);
         g_server = &server;
 
+        if (databases > 0) server.setDatabases(databases);
+        if (db_maxmemory > 0) server.setDbMaxMemory(db_maxmemory);
+        if (key_filter) server.enableKeyFilter();
+        if (compress_threshold > 0) server.setCompression(compress_threshold);
+        if (!storage_dir.empty()) server.setStorageDir(storage_dir, block_cache);
+        if (!mmap_dir.empty()) server.setMappedDir(mmap_dir);
+        if (!value_log_dir.empty()) server.setValueLogDir(value_log_dir, std::chrono::seconds(cold_after));
+        server.setWriteOptions(write_options);
+        if (repl_backlog > 0) server.setReplBacklogSize(repl_backlog);
+        if (read_wait_ms >= 0) server.setReadWait(std::chrono::milliseconds(read_wait_ms));
+        if (!cluster_host.empty()) server.enableCluster(cluster_host);
+        if (!raft_members.empty()) server.enableRaft(raft_members, raft_token);
+        if (!gossip_seeds.empty()) server.enableGossip(gossip_seeds);
+
+        if (!leader_host.empty()) {
+            server.replicaOf(leader_host, leader_port, leader_token);
+        }
+
         // Register Ctrl+C handler
         std::signal(SIGINT, handle_sigint);
 
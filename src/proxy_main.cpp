@@ -0,0 +1,55 @@
+#include "../includes_this/keyforge/Proxy.hpp"
+#include <chrono>
+#include <csignal>
+#include <iostream>
+#include <string>
+#include <vector>
+
+using namespace keyforge;
+
+static Proxy* g_proxy = nullptr;
+
+void handle_sigint(int) {
+    if (g_proxy) {
+        std::cout << "\n[Proxy] Caught SIGINT, shutting down..." << std::endl;
+        g_proxy->requestShutdown();
+    }
+}
+
+// Usage: keyforge-proxy [-p port] [--pool clients] [-a token] [--watch ms] host:port [host:port ...]
+int main(int argc, char** argv) {
+    int port = 4600;
+    size_t pool_size = 8;
+    std::string token;
+    long watch_ms = 0;
+    std::vector<Client::Node> backends;
+
+    try {
+        for (int i = 1; i < argc; ++i) {
+            std::string arg = argv[i];
+            if (arg == "-p" && i + 1 < argc) port = std::stoi(argv[++i]);
+            else if (arg == "--pool" && i + 1 < argc) pool_size = std::stoul(argv[++i]);
+            else if (arg == "-a" && i + 1 < argc) token = argv[++i];
+            else if (arg == "--watch" && i + 1 < argc) watch_ms = std::stol(argv[++i]);
+            else {
+                auto colon = arg.rfind(':');
+                if (colon == std::string::npos) throw std::invalid_argument("bad node " + arg);
+                backends.push_back({arg.substr(0, colon), std::stoi(arg.substr(colon + 1))});
+            }
+        }
+        if (backends.empty()) backends.push_back({"127.0.0.1", 4545});
+
+        Proxy proxy(port, backends, pool_size, token);
+        g_proxy = &proxy;
+        std::signal(SIGINT, handle_sigint);
+        if (watch_ms > 0) proxy.watchMembership(std::chrono::milliseconds(watch_ms));
+
+        proxy.run();
+        std::cout << "[Proxy] Stopped cleanly.\n";
+    }
+    catch (const std::exception& e) {
+        std::cerr << "[Proxy] Fatal error: " << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
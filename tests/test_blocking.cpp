@@ -0,0 +1,94 @@
+// Blocking: a change wakes only the waiters of that key in that database,
+// and a waiter also returns at its deadline, when its client hangs up, or
+// at shutdown.
+
+#include "keyforge/Blocking.hpp"
+
+#include <gtest/gtest.h>
+
+#include <chrono>
+#include <future>
+#include <string>
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+using namespace keyforge;
+
+namespace {
+
+// A client connection: the server's end and the client's
+struct Connection {
+    Connection() {
+        int fds[2];
+        if (::socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0) {
+            server = fds[0];
+            client = fds[1];
+        }
+    }
+    ~Connection() {
+        ::close(server);
+        if (client >= 0) ::close(client);
+    }
+
+    int server = -1;
+    int client = -1;
+};
+
+std::chrono::steady_clock::time_point in(std::chrono::milliseconds ms) {
+    return std::chrono::steady_clock::now() + ms;
+}
+
+} // namespace
+
+TEST(Blocking, OnlyTheKeysWaitersWake) {
+    Blocking blocking;
+    Connection conn;
+    auto waiter = blocking.watch(1, {"a", "b"});
+    auto deadline = in(std::chrono::milliseconds(50));
+
+    blocking.touched(1, "c", "lpush");
+    blocking.touched(0, "a", "lpush");  // another database
+    EXPECT_EQ(blocking.block(*waiter, conn.server, &deadline), Blocking::Wake::Timeout);
+
+    auto woken = std::async(std::launch::async, [&] { return blocking.block(*waiter, conn.server, nullptr); });
+    EXPECT_EQ(woken.wait_for(std::chrono::milliseconds(20)), std::future_status::timeout);
+    blocking.touched(1, "b", "rpush");
+    ASSERT_EQ(woken.wait_for(std::chrono::seconds(5)), std::future_status::ready);
+    EXPECT_EQ(woken.get(), Blocking::Wake::Touched);
+    EXPECT_STREQ(waiter->event.load(), "rpush");
+
+    // A change while it wasn't sleeping isn't missed, and a whole-database one is "*"
+    blocking.touched(1, "", nullptr);
+    EXPECT_EQ(blocking.block(*waiter, conn.server, nullptr), Blocking::Wake::Touched);
+    EXPECT_STREQ(waiter->event.load(), "*");
+
+    blocking.cancel(waiter);
+    blocking.touched(1, "a", "lpush");
+    deadline = in(std::chrono::milliseconds(20));
+    EXPECT_EQ(blocking.block(*waiter, conn.server, &deadline), Blocking::Wake::Timeout);
+    EXPECT_EQ(blocking.info(), "Blocked clients: 0, wakeups: 1, timeouts: 2\n");
+}
+
+TEST(Blocking, HangupAndShutdownEndTheWait) {
+    Blocking blocking;
+    Connection conn;
+    auto waiter = blocking.watch(0, {"k"});
+    auto hung_up = std::async(std::launch::async, [&] { return blocking.block(*waiter, conn.server, nullptr); });
+    ::close(conn.client);
+    conn.client = -1;
+    ASSERT_EQ(hung_up.wait_for(std::chrono::seconds(5)), std::future_status::ready);
+    EXPECT_EQ(hung_up.get(), Blocking::Wake::Hangup);
+    blocking.cancel(waiter);
+
+    Connection other;
+    waiter = blocking.watch(0, {"k"});
+    auto stopped = std::async(std::launch::async, [&] { return blocking.block(*waiter, other.server, nullptr); });
+    blocking.shutdown();
+    ASSERT_EQ(stopped.wait_for(std::chrono::seconds(5)), std::future_status::ready);
+    EXPECT_EQ(stopped.get(), Blocking::Wake::Shutdown);
+
+    // Nor does anyone start waiting afterwards
+    auto late = blocking.watch(0, {"k"});
+    EXPECT_EQ(blocking.block(*late, other.server, nullptr), Blocking::Wake::Shutdown);
+}
@@ -0,0 +1,172 @@
+// Cluster: the slot function and hash tags, routing replies for every slot
+// state, and MIGRATE against a fake target while the source keeps taking
+// writes to the keys in flight.
+
+#include "keyforge/Cluster.hpp"
+
+#include <gtest/gtest.h>
+
+#include <functional>
+#include <map>
+#include <sstream>
+#include <string>
+#include <thread>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+using namespace keyforge;
+
+namespace {
+
+const std::string kSelf = "127.0.0.1:7001";
+
+// Takes one MIGRATE connection and keeps what it is sent. before_reply runs
+// on every PUT or RESTORE, before the target answers it.
+class Target {
+public:
+    Target() {
+        listen_fd_ = ::socket(AF_INET, SOCK_STREAM, 0);
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        socklen_t len = sizeof(addr);
+        if (::bind(listen_fd_, reinterpret_cast<sockaddr*>(&addr), len) != 0 || ::listen(listen_fd_, 1) != 0 ||
+            ::getsockname(listen_fd_, reinterpret_cast<sockaddr*>(&addr), &len) != 0) {
+            return;
+        }
+        port_ = ntohs(addr.sin_port);
+        thread_ = std::thread([this] {
+            int fd = ::accept(listen_fd_, nullptr, nullptr);
+            if (fd < 0) return;
+            net::LineReader reader(fd);
+            std::string line;
+            while (reader.readLine(line, 10000) == net::LineReader::Status::OK) {
+                std::istringstream iss(line);
+                std::string cmd, key, value;
+                iss >> cmd >> key >> value;
+                std::string reply = "OK\n";
+                if (cmd == "PUT" || cmd == "RESTORE") {
+                    if (before_reply) before_reply(key);
+                    keys[key] = cmd == "PUT" ? value : "\t" + line.substr(line.find(' ', 8) + 1);
+                } else if (cmd == "DELETE") {
+                    reply = keys.erase(key) ? "DELETED 1\n" : "NOT_FOUND\n";
+                } else if (cmd == "CLUSTER") {
+                    took_slots = true;
+                }
+                if (!net::sendAll(fd, reply)) break;
+            }
+            ::close(fd);
+        });
+    }
+    ~Target() {
+        ::shutdown(listen_fd_, SHUT_RDWR);
+        if (thread_.joinable()) thread_.join();
+        ::close(listen_fd_);
+    }
+
+    int port() const { return port_; }
+    void join() {
+        if (thread_.joinable()) thread_.join();
+    }
+
+    std::function<void(const std::string&)> before_reply;
+    std::map<std::string, std::string> keys;
+    bool took_slots = false;
+
+private:
+    int listen_fd_ = -1;
+    int port_ = 0;
+    std::thread thread_;
+};
+
+} // namespace
+
+TEST(Cluster, SlotsFollowHashTags) {
+    EXPECT_EQ(Cluster::keySlot("123456789"), 12739);  // CRC16 0x31C3, as in Redis
+    EXPECT_EQ(Cluster::keySlot("{user1000}.following"), Cluster::keySlot("{user1000}.followers"));
+    EXPECT_EQ(Cluster::keySlot("{user1000}.following"), Cluster::keySlot("user1000"));
+    // An empty or unclosed tag hashes the whole key
+    EXPECT_NE(Cluster::keySlot("{}.a"), Cluster::keySlot("{}.b"));
+    EXPECT_NE(Cluster::keySlot("{a"), Cluster::keySlot("a"));
+}
+
+TEST(Cluster, RoutesEverySlotState) {
+    Store store;
+    Replication repl(store);
+    Cluster cluster(store, repl);
+    EXPECT_EQ(cluster.route("k", false), "");  // cluster mode off
+    cluster.enable(kSelf);
+    std::string err;
+    uint16_t slot = Cluster::keySlot("k");
+    std::string range = std::to_string(slot);
+    EXPECT_EQ(cluster.route("k", false), "CLUSTERDOWN Hash slot " + range + " not served\n");
+
+    ASSERT_TRUE(cluster.setSlots(0, Cluster::kSlots - 1, "NODE", "10.0.0.2:7000", err));
+    EXPECT_EQ(cluster.route("k", false), "MOVED " + range + " 10.0.0.2:7000\n");
+    EXPECT_FALSE(cluster.setSlots(slot, slot, "MIGRATING", "10.0.0.3:7000", err));
+    ASSERT_TRUE(cluster.setSlots(slot, slot, "IMPORTING", "10.0.0.2:7000", err));
+    EXPECT_EQ(cluster.route("k", false), "MOVED " + range + " 10.0.0.2:7000\n");
+    EXPECT_EQ(cluster.route("k", true), "");
+
+    // Migrating away: keys still here are served, the others are asked for there
+    ASSERT_TRUE(cluster.setSlots(slot, slot, "NODE", kSelf, err));
+    EXPECT_EQ(cluster.route("k", false), "");
+    ASSERT_TRUE(cluster.setSlots(slot, slot, "MIGRATING", "10.0.0.3:7000", err));
+    EXPECT_EQ(cluster.route("k", false), "ASK " + range + " 10.0.0.3:7000\n");
+    store.put("k", "v");
+    EXPECT_EQ(cluster.route("k", false), "");
+    EXPECT_FALSE(cluster.setSlots(1, 0, "STABLE", "", err));
+    EXPECT_FALSE(cluster.setSlots(0, 0, "SIDEWAYS", kSelf, err));
+}
+
+TEST(Cluster, MigrateResendsKeysWrittenInFlight) {
+    Store store;
+    Replication repl(store);
+    Cluster cluster(store, repl);
+    cluster.enable(kSelf);
+    std::string err;
+    ASSERT_TRUE(cluster.setSlots(0, Cluster::kSlots - 1, "NODE", kSelf, err));
+    for (int i = 0; i < 1000; ++i) store.put("k" + std::to_string(i), "v" + std::to_string(i));
+    {
+        Store::Batch batch(store);
+        batch.listPush("list", {"a", "b"}, false);
+    }
+    Target target;
+    ASSERT_NE(target.port(), 0);
+    std::string to = "127.0.0.1:" + std::to_string(target.port());
+    ASSERT_TRUE(cluster.setSlots(0, Cluster::kSlots - 1, "MIGRATING", to, err));
+
+    // The first batch's round trip: a writer changes one of its keys and
+    // deletes another, which is still served here rather than asked for
+    bool wrote = false;
+    std::string changed, deleted, routed;
+    target.before_reply = [&](const std::string& key) {
+        if (wrote || key == "list") return;
+        if (changed.empty()) {
+            changed = key;
+            return;
+        }
+        wrote = true;
+        deleted = key;
+        auto wlock = repl.lockWrites(0);
+        store.put(changed, "changed");
+        store.remove(deleted);
+        routed = cluster.route(deleted, false);
+    };
+
+    long moved = cluster.migrate("127.0.0.1", target.port(), 0, Cluster::kSlots - 1, "", 100, err);
+    target.join();
+    ASSERT_EQ(moved, 1000) << err;  // all but the deleted one, the list included
+    ASSERT_TRUE(wrote);
+    EXPECT_EQ(routed, "");
+    EXPECT_EQ(store.size(), 0u);
+    EXPECT_TRUE(target.took_slots);
+    EXPECT_EQ(target.keys.size(), 1000u);
+    EXPECT_EQ(target.keys[changed], "changed");
+    EXPECT_FALSE(target.keys.count(deleted));
+    EXPECT_EQ(target.keys["list"], "\tL a b");
+    EXPECT_EQ(cluster.route("k1", false), "MOVED " + std::to_string(Cluster::keySlot("k1")) + " " + to + "\n");
+}
@@ -0,0 +1,170 @@
+// Collections, each checked against a standard container doing the same
+// operations: sorted set ranks and rank ranges as members come and go,
+// quicklist pushes and pops across chunk boundaries, and hashes before and
+// after they outgrow the compact encoding.
+
+#include "keyforge/Collections.hpp"
+
+#include <gtest/gtest.h>
+
+#include <deque>
+#include <map>
+#include <random>
+#include <set>
+#include <string>
+#include <vector>
+
+using namespace keyforge;
+
+namespace {
+
+using Members = std::vector<std::pair<std::string, double>>;
+using Fields = std::map<std::string, std::string>;
+
+std::string member(int i) {
+    return "m" + std::to_string(i);
+}
+
+Fields fields(const HashValue& hash) {
+    auto all = hash.all();
+    return Fields(all.begin(), all.end());
+}
+
+} // namespace
+
+TEST(SortedSet, RanksAndRangesFollowDeletes) {
+    SortedSet zset;
+    std::set<std::pair<double, std::string>> model;
+    std::map<std::string, double> scores;
+    std::mt19937 rng(7);
+    for (int step = 0; step < 20000; ++step) {
+        std::string m = member(static_cast<int>(rng() % 2000));
+        double score = static_cast<double>(rng() % 100);  // plenty of ties
+        if (rng() % 3 == 0) {
+            EXPECT_EQ(zset.erase(m), scores.count(m) == 1);
+            if (scores.count(m)) model.erase({scores[m], m});
+            scores.erase(m);
+        } else {
+            EXPECT_EQ(zset.add(m, score), scores.count(m) == 0);
+            if (scores.count(m)) model.erase({scores[m], m});
+            model.insert({score, m});
+            scores[m] = score;
+        }
+    }
+    ASSERT_EQ(zset.size(), model.size());
+
+    size_t rank = 0;
+    Members ordered;
+    for (const auto& [score, m] : model) {
+        ASSERT_EQ(zset.rank(m), rank) << m;
+        EXPECT_EQ(zset.score(m), score);
+        ordered.emplace_back(m, score);
+        rank++;
+    }
+    for (size_t first = 0; first < ordered.size(); first += 97) {
+        size_t last = std::min(ordered.size() - 1, first + 150);
+        EXPECT_EQ(zset.range(first, last), Members(ordered.begin() + first, ordered.begin() + last + 1));
+    }
+    EXPECT_FALSE(zset.rank("absent"));
+
+    // Emptied, it starts over
+    for (const auto& [score, m] : model) zset.erase(m);
+    EXPECT_EQ(zset.size(), 0u);
+    EXPECT_EQ(zset.bytes(), 0u);
+    zset.add("a", 1);
+    EXPECT_EQ(zset.range(0, 0), (Members{{"a", 1}}));
+}
+
+TEST(SortedSet, ScoresReadBackExactly) {
+    double score = 0;
+    for (double d : {0.1, -2.5, 1e300, 1.0 / 3, 5e-324}) {
+        ASSERT_TRUE(SortedSet::parseScore(SortedSet::formatScore(d), score));
+        EXPECT_EQ(score, d);
+    }
+    EXPECT_EQ(SortedSet::formatScore(0.1), "0.1");
+    EXPECT_EQ(SortedSet::formatScore(3), "3");
+    for (const char* bad : {"", "1x", "nan", "inf", "-inf", "1e400"}) {
+        EXPECT_FALSE(SortedSet::parseScore(bad, score)) << bad;
+    }
+}
+
+TEST(QuickList, BothEndsAcrossChunks) {
+    QuickList list;
+    std::deque<std::string> model;
+    std::mt19937 rng(11);
+    for (int step = 0; step < 5000; ++step) {
+        std::string value = "v" + std::to_string(step);
+        switch (rng() % 5) {
+            case 0:
+                list.pushFront(value);
+                model.push_front(value);
+                break;
+            case 1:
+            case 2:
+                list.pushBack(value);
+                model.push_back(value);
+                break;
+            case 3:
+                if (!model.empty()) {
+                    EXPECT_EQ(list.popFront(), model.front());
+                    model.pop_front();
+                }
+                break;
+            default:
+                if (!model.empty()) {
+                    EXPECT_EQ(list.popBack(), model.back());
+                    model.pop_back();
+                }
+        }
+    }
+    ASSERT_EQ(list.size(), model.size());
+    ASSERT_GT(model.size(), 3 * QuickList::kChunkSize);
+
+    for (size_t i = 0; i < model.size(); i += 37) {
+        EXPECT_EQ(list.at(i), model[i]);
+        list.set(i, "set" + std::to_string(i));
+        model[i] = "set" + std::to_string(i);
+    }
+    EXPECT_EQ(list.range(0, model.size() - 1), std::vector<std::string>(model.begin(), model.end()));
+    EXPECT_EQ(list.range(100, 300), std::vector<std::string>(model.begin() + 100, model.begin() + 301));
+
+    while (list.size() > 0) list.popBack();
+    EXPECT_EQ(list.bytes(), 0u);
+}
+
+TEST(HashValue, OutgrowsTheCompactEncoding) {
+    HashValue hash;
+    Fields model;
+    for (size_t i = 0; i < HashValue::kMaxCompactFields; ++i) {
+        EXPECT_TRUE(hash.set("f" + std::to_string(i), "v"));
+        model["f" + std::to_string(i)] = "v";
+    }
+    EXPECT_FALSE(hash.set("f0", "changed"));
+    model["f0"] = "changed";
+    EXPECT_TRUE(hash.erase("f1"));
+    EXPECT_FALSE(hash.erase("f1"));
+    model.erase("f1");
+    EXPECT_TRUE(hash.compact());
+    EXPECT_EQ(fields(hash), model);
+
+    // One field too many
+    hash.set("f1", "back");
+    model["f1"] = "back";
+    EXPECT_TRUE(hash.compact());
+    hash.set("extra", "v");
+    model["extra"] = "v";
+    EXPECT_FALSE(hash.compact());
+    EXPECT_EQ(fields(hash), model);
+    EXPECT_EQ(*hash.get("f0"), "changed");
+    EXPECT_EQ(hash.get("missing"), nullptr);
+
+    // Or one value too long
+    HashValue small;
+    small.set("a", "1");
+    small.set("b", std::string(HashValue::kMaxCompactLength + 1, 'x'));
+    EXPECT_FALSE(small.compact());
+    EXPECT_EQ(small.size(), 2u);
+    EXPECT_TRUE(small.erase("a"));
+    EXPECT_TRUE(small.erase("b"));
+    EXPECT_EQ(small.bytes(), 0u);
+}
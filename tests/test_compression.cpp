@@ -0,0 +1,86 @@
+// Compression: values round-trip through the codec, corrupt input is
+// refused, incompressible values are left alone (also by the Store), and a
+// trained dictionary lets small values with common structure compress.
+
+#include "keyforge/Compression.hpp"
+#include "keyforge/Store.hpp"
+
+#include <gtest/gtest.h>
+
+#include <random>
+#include <string>
+#include <vector>
+
+using namespace keyforge;
+
+namespace {
+
+std::string randomBytes(size_t n, unsigned seed) {
+    std::mt19937 rng(seed);
+    std::string out(n, '\0');
+    for (auto& c : out) c = static_cast<char>(rng());
+    return out;
+}
+
+std::string record(int i) {
+    return "{\"user_id\":" + std::to_string(1000 + i) + ",\"name\":\"user" + std::to_string(i) +
+           "\",\"status\":\"active\",\"plan\":\"premium\"}";
+}
+
+} // namespace
+
+TEST(Compression, RoundTrips) {
+    std::string text;
+    for (int i = 0; i < 200; ++i) text += "the quick brown fox " + std::to_string(i % 7) + " ";
+    std::vector<std::string> inputs = {
+        text,
+        std::string(100000, 'a'),                     // matches overlapping themselves
+        randomBytes(64, 1) + std::string(1000, 'z') + randomBytes(64, 2),
+        text.substr(0, 50) + randomBytes(10, 3) + text,
+    };
+    for (const auto& src : inputs) {
+        std::string packed, unpacked;
+        ASSERT_TRUE(compression::compress(src, nullptr, packed)) << src.size();
+        EXPECT_LE(packed.size(), src.size() - src.size() / 8);
+        ASSERT_TRUE(compression::decompress(packed, src.size(), nullptr, unpacked));
+        EXPECT_EQ(unpacked, src);
+
+        // Cut short, or expected to be longer than it is: refused
+        EXPECT_FALSE(compression::decompress(packed.substr(0, packed.size() / 2), src.size(), nullptr, unpacked));
+        EXPECT_FALSE(compression::decompress(packed, src.size() + 1, nullptr, unpacked));
+    }
+}
+
+TEST(Compression, IncompressibleValuesStayRaw) {
+    std::string packed;
+    EXPECT_FALSE(compression::compress(randomBytes(4096, 4), nullptr, packed));
+    EXPECT_FALSE(compression::compress("", nullptr, packed));
+
+    Store store;
+    store.setCompression(64);
+    std::string noise = randomBytes(4096, 5);
+    std::string text(4096, 'x');
+    store.put("noise", noise);
+    store.put("text", text);
+    store.put("short", std::string(63, 'y'));
+    EXPECT_EQ(*store.get("noise"), noise);
+    EXPECT_EQ(*store.get("text"), text);
+    EXPECT_EQ(*store.get("short"), std::string(63, 'y'));
+    EXPECT_NE(store.compressionInfo().find(", 1 compressed, 4096 -> "), std::string::npos) << store.compressionInfo();
+}
+
+TEST(Compression, DictionaryHelpsSmallValues) {
+    std::vector<std::string> samples;
+    for (int i = 0; i < 200; ++i) samples.push_back(record(i));
+    std::string packed, unpacked;
+    std::string value = record(5000);
+    EXPECT_FALSE(compression::compress(value, nullptr, packed));
+
+    compression::Dictionary dict(compression::train(samples, 1024));
+    ASSERT_FALSE(dict.bytes().empty());
+    EXPECT_LE(dict.bytes().size(), 1024u);
+    ASSERT_TRUE(compression::compress(value, &dict, packed));
+    EXPECT_LT(packed.size(), value.size() / 2);
+    ASSERT_TRUE(compression::decompress(packed, value.size(), &dict, unpacked));
+    EXPECT_EQ(unpacked, value);
+}
@@ -0,0 +1,115 @@
+// FileWriter: O_DIRECT writes pad the last block and close() truncates the
+// file back to what was written, preallocated space included; buffered
+// writes come out the same.
+
+#include "keyforge/FileWriter.hpp"
+
+#include <gtest/gtest.h>
+
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <ostream>
+#include <string>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace keyforge;
+
+namespace {
+
+std::string scratchPath(const std::string& name) {
+    return (std::filesystem::temp_directory_path() / ("keyforge_test_" + std::to_string(::getpid()) + "_" + name))
+        .string();
+}
+
+std::string readFile(const std::string& path) {
+    std::ifstream in(path, std::ios::binary);
+    return std::string(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+}
+
+// Bytes the file system has allocated to it
+uint64_t allocated(const std::string& path) {
+    struct stat st{};
+    return ::stat(path.c_str(), &st) == 0 ? static_cast<uint64_t>(st.st_blocks) * 512 : 0;
+}
+
+uint64_t wholeBlocks(uint64_t bytes) {
+    return (bytes + FileWriter::kBlock - 1) / FileWriter::kBlock * FileWriter::kBlock;
+}
+
+// Single characters, short lines and pieces longer than the buffer, so no
+// drain lands on a block boundary
+std::string write(FileWriter& file) {
+    std::ostream out(&file);
+    std::string expected;
+    for (int i = 0; i < 2000; ++i) {
+        std::string line = "line " + std::to_string(i) + "\n";
+        out << line << static_cast<char>('a' + i % 26);
+        expected += line + static_cast<char>('a' + i % 26);
+        if (i % 500 == 7) {
+            std::string piece(20000 + i, static_cast<char>('A' + i % 26));
+            out << piece;
+            expected += piece;
+        }
+    }
+    out << "end";
+    expected += "end";
+    EXPECT_TRUE(out);
+    return expected;
+}
+
+} // namespace
+
+TEST(FileWriter, DirectWritesPadTheTailAndTruncate) {
+    std::string path = scratchPath("file_writer_direct");
+    FileWriter::Options options;
+    options.direct = true;
+    options.buffer_bytes = 8192;
+    options.preallocate = 1 << 20;
+    FileWriter file(path, options);
+    ASSERT_TRUE(file.isOpen());
+    if (!file.direct()) GTEST_SKIP() << "No O_DIRECT on " << path;
+
+    std::string expected = write(file);
+    EXPECT_EQ(file.written(), expected.size());
+    ASSERT_NE(expected.size() % FileWriter::kBlock, 0u);
+    ASSERT_TRUE(file.close());
+    EXPECT_TRUE(file.direct());
+    EXPECT_EQ(std::filesystem::file_size(path), expected.size());
+    EXPECT_EQ(readFile(path), expected);
+    // Neither the padding nor the rest of the preallocation is kept
+    EXPECT_LE(allocated(path), wholeBlocks(expected.size()));
+    std::filesystem::remove(path);
+}
+
+TEST(FileWriter, ShortDirectFileIsJustItsBytes) {
+    std::string path = scratchPath("file_writer_short");
+    FileWriter::Options options;
+    options.direct = true;
+    FileWriter file(path, options);
+    ASSERT_TRUE(file.isOpen());
+    std::ostream out(&file);
+    out << "abc";
+    ASSERT_TRUE(file.close());
+    EXPECT_EQ(readFile(path), "abc");
+    std::filesystem::remove(path);
+}
+
+TEST(FileWriter, BufferedWritesGiveBackThePreallocation) {
+    std::string path = scratchPath("file_writer_buffered");
+    FileWriter::Options options;
+    options.buffer_bytes = 8192;
+    options.preallocate = 4 << 20;
+    options.sync_bytes = 16384;
+    FileWriter file(path, options);
+    ASSERT_TRUE(file.isOpen());
+    EXPECT_FALSE(file.direct());
+    std::string expected = write(file);
+    ASSERT_TRUE(file.close());
+    EXPECT_EQ(std::filesystem::file_size(path), expected.size());
+    EXPECT_EQ(readFile(path), expected);
+    EXPECT_LE(allocated(path), wholeBlocks(expected.size()));
+    std::filesystem::remove(path);
+}
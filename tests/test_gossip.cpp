@@ -0,0 +1,148 @@
+// Gossip: members on loopback UDP find each other through a seed and notice
+// one that stops, a member refutes being suspected, and PINGREQ probes a
+// target on another member's behalf.
+
+#include "keyforge/Gossip.hpp"
+
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+using namespace keyforge;
+
+namespace {
+
+bool waitFor(const std::function<bool()>& done) {
+    for (int i = 0; i < 1000 && !done(); ++i) std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    return done();
+}
+
+// A bound loopback UDP socket standing in for a member
+class Peer {
+public:
+    Peer() {
+        fd_ = ::socket(AF_INET, SOCK_DGRAM, 0);
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        socklen_t len = sizeof(addr);
+        if (::bind(fd_, reinterpret_cast<sockaddr*>(&addr), len) == 0 &&
+            ::getsockname(fd_, reinterpret_cast<sockaddr*>(&addr), &len) == 0) {
+            addr_ = "127.0.0.1:" + std::to_string(ntohs(addr.sin_port));
+        }
+    }
+    ~Peer() {
+        if (fd_ >= 0) ::close(fd_);
+    }
+
+    const std::string& addr() const { return addr_; }
+
+    void send(const std::string& to, const std::string& msg) {
+        sockaddr_in dest{};
+        dest.sin_family = AF_INET;
+        dest.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        dest.sin_port = htons(static_cast<uint16_t>(std::stoi(to.substr(to.rfind(':') + 1))));
+        ::sendto(fd_, msg.data(), msg.size(), 0, reinterpret_cast<sockaddr*>(&dest), sizeof(dest));
+    }
+
+    // The next datagram whose first line starts with `type`, skipping others
+    std::string receive(const std::string& type) {
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+        char buf[65536];
+        while (std::chrono::steady_clock::now() < deadline) {
+            pollfd pfd{fd_, POLLIN, 0};
+            if (::poll(&pfd, 1, 100) <= 0) continue;
+            ssize_t n = ::recv(fd_, buf, sizeof(buf), 0);
+            if (n > 0 && std::string(buf, static_cast<size_t>(n)).rfind(type + " ", 0) == 0) {
+                return std::string(buf, static_cast<size_t>(n));
+            }
+        }
+        return "";
+    }
+
+    // Its port, given up for a Gossip to bind
+    std::string release() {
+        ::close(fd_);
+        fd_ = -1;
+        return addr_;
+    }
+
+private:
+    int fd_ = -1;
+    std::string addr_;
+};
+
+} // namespace
+
+TEST(Gossip, JoinsThroughASeedAndNoticesAFailure) {
+    std::vector<std::string> addrs;
+    for (int i = 0; i < 3; ++i) addrs.push_back(Peer().release());
+    Gossip a, b, c;
+    a.start(addrs[0], {addrs[0]});
+    b.start(addrs[1], {addrs[0]});
+    c.start(addrs[2], {addrs[0]});
+    ASSERT_TRUE(a.enabled() && b.enabled() && c.enabled());
+
+    // c only ever talked to a: it hears of b, and b of it, by gossip
+    auto sorted = addrs;
+    std::sort(sorted.begin(), sorted.end());
+    ASSERT_TRUE(waitFor([&] {
+        return a.liveMembers() == sorted && b.liveMembers() == sorted && c.liveMembers() == sorted;
+    })) << b.info();
+
+    c.shutdown();
+    sorted.erase(std::find(sorted.begin(), sorted.end(), addrs[2]));
+    ASSERT_TRUE(waitFor([&] { return a.liveMembers() == sorted && b.liveMembers() == sorted; })) << a.info();
+    EXPECT_NE(a.info().find(addrs[2] + " DEAD"), std::string::npos) << a.info();
+    EXPECT_NE(b.info().find(addrs[2] + " DEAD"), std::string::npos) << b.info();
+}
+
+TEST(Gossip, RefutesBeingSuspected) {
+    std::string self = Peer().release();
+    Gossip node;
+    node.start(self, {self});
+    Peer peer;
+
+    // A PING carrying a suspicion of it at a later incarnation than its own
+    const uint64_t suspected = 1ull << 40;
+    peer.send(self, "PING 5 " + peer.addr() + "\n" + self + " SUSPECT " + std::to_string(suspected) + "\n");
+    std::string ack = peer.receive("ACK");
+    ASSERT_EQ(ack.rfind("ACK 5 " + self + "\n", 0), 0u) << ack;
+    EXPECT_NE(ack.find(self + " ALIVE " + std::to_string(suspected + 1) + "\n"), std::string::npos) << ack;
+    EXPECT_NE(node.info().find("refutations: 1"), std::string::npos) << node.info();
+
+    // An older suspicion is old news
+    peer.send(self, "PING 6 " + peer.addr() + "\n" + self + " SUSPECT 1\n");
+    ASSERT_EQ(peer.receive("ACK").rfind("ACK 6 ", 0), 0u);
+    EXPECT_NE(node.info().find("incarnation " + std::to_string(suspected + 1) + ")"), std::string::npos);
+    EXPECT_NE(node.info().find("refutations: 1"), std::string::npos);
+    EXPECT_EQ(node.liveMembers().size(), 2u);
+}
+
+TEST(Gossip, ProbesOnAnotherMembersBehalf) {
+    std::string self = Peer().release();
+    Gossip node;
+    node.start(self, {self});
+    Peer requester, target;
+
+    // The target's ack reaches the requester under the requester's own seq
+    requester.send(self, "PINGREQ 7 " + requester.addr() + " " + target.addr() + "\n");
+    std::string ping = target.receive("PING");
+    ASSERT_FALSE(ping.empty());
+    std::string seq = ping.substr(5, ping.find(' ', 5) - 5);
+    ASSERT_NE(seq, "0");
+    target.send(self, "ACK " + seq + " " + target.addr() + "\n");
+    std::string ack = requester.receive("ACK 7");
+    EXPECT_EQ(ack.rfind("ACK 7 " + target.addr() + "\n", 0), 0u) << ack;
+}
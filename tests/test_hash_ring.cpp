@@ -0,0 +1,62 @@
+// HashRing: placement is the same for every ring built from the same
+// nodes, spread evenly, and a node joining only takes keys over.
+
+#include "keyforge/HashRing.hpp"
+
+#include <gtest/gtest.h>
+
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+using namespace keyforge;
+
+namespace {
+
+std::string key(int i) {
+    return "key" + std::to_string(i);
+}
+
+HashRing ring(int nodes) {
+    HashRing out;
+    for (int n = 0; n < nodes; ++n) out.addNode("10.0.0." + std::to_string(n) + ":7000");
+    return out;
+}
+
+} // namespace
+
+TEST(HashRing, PlacementIsStable) {
+    // Fixed values, not std::hash: every client process must agree
+    EXPECT_EQ(hash64(""), 0x552d3fb62b3c344fULL);
+    EXPECT_EQ(hash64("key"), 0xe427ce386d557ceaULL);
+    HashRing a = ring(4), b = ring(4);
+    for (int i = 0; i < 1000; ++i) EXPECT_EQ(a.nodeFor(key(i)), b.nodeFor(key(i)));
+    EXPECT_EQ(a.nodeName(a.nodeFor("x")), b.nodeName(b.nodeFor("x")));
+    EXPECT_THROW(HashRing().nodeFor("x"), std::runtime_error);
+}
+
+TEST(HashRing, KeysSpreadEvenly) {
+    HashRing r = ring(4);
+    std::vector<int> owned(4);
+    constexpr int kKeys = 40000;
+    for (int i = 0; i < kKeys; ++i) owned[r.nodeFor(key(i))]++;
+    for (int n = 0; n < 4; ++n) {
+        EXPECT_GT(owned[n], kKeys / 4 * 7 / 10) << "node " << n;
+        EXPECT_LT(owned[n], kKeys / 4 * 13 / 10) << "node " << n;
+    }
+}
+
+TEST(HashRing, JoiningNodeOnlyTakesKeysOver) {
+    HashRing before = ring(4), after = ring(5);
+    constexpr int kKeys = 40000;
+    int moved = 0;
+    for (int i = 0; i < kKeys; ++i) {
+        size_t was = before.nodeFor(key(i)), is = after.nodeFor(key(i));
+        if (was == is) continue;
+        // Nothing moves between the old nodes, only onto the new one
+        EXPECT_EQ(is, 4u) << key(i);
+        moved++;
+    }
+    EXPECT_GT(moved, kKeys / 5 * 7 / 10);
+    EXPECT_LT(moved, kKeys / 5 * 13 / 10);
+}
@@ -0,0 +1,40 @@
+// HotKeys: the hottest keys rank first with counts that never undercount,
+// and every count halves once kDecayEvery reads have gone by.
+
+#include "keyforge/HotKeys.hpp"
+
+#include <gtest/gtest.h>
+
+#include <string>
+
+using namespace keyforge;
+
+TEST(HotKeys, HottestKeysRankFirst) {
+    HotKeys hot;
+    for (int round = 0; round < 3; ++round) {
+        for (int i = 0; i < 2000; ++i) hot.record("cold" + std::to_string(i));
+    }
+    for (int i = 0; i < 800; ++i) hot.record("hot");
+    for (int i = 0; i < 400; ++i) hot.record("warm");
+    EXPECT_EQ(hot.recorded(), 7200u);
+
+    auto top = hot.top(2);
+    ASSERT_EQ(top.size(), 2u);
+    EXPECT_EQ(top[0].first, "hot");
+    EXPECT_EQ(top[1].first, "warm");
+    // Counts are sampled every kSampleEvery hits and only ever overestimate
+    EXPECT_GE(top[0].second, 800u - HotKeys::kSampleEvery);
+    EXPECT_LT(top[0].second, 800u + 100);
+    EXPECT_GE(top[1].second, 400u - HotKeys::kSampleEvery);
+    EXPECT_LT(top[1].second, 400u + 100);
+    EXPECT_LE(hot.top(1000).size(), HotKeys::kTopK);
+}
+
+TEST(HotKeys, CountsDecay) {
+    HotKeys hot;
+    for (uint64_t i = 0; i < HotKeys::kDecayEvery; ++i) hot.record("k");
+    for (uint32_t i = 0; i < HotKeys::kSampleEvery; ++i) hot.record("k");
+    auto top = hot.top(1);
+    ASSERT_EQ(top.size(), 1u);
+    EXPECT_EQ(top[0].second, HotKeys::kDecayEvery / 2 + HotKeys::kSampleEvery);
+}
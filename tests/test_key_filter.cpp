@@ -0,0 +1,64 @@
+// KeyFilter: no false negatives, few false positives at capacity, removed
+// keys going absent again unless a counter saturated, and a Store that
+// keeps its filter in step through removes and rebuilds.
+
+#include "keyforge/KeyFilter.hpp"
+#include "keyforge/Store.hpp"
+
+#include <gtest/gtest.h>
+
+#include <string>
+
+using namespace keyforge;
+
+namespace {
+
+uint64_t hashOf(const std::string& prefix, int i) {
+    return KeyFilter::hash(prefix + std::to_string(i));
+}
+
+} // namespace
+
+TEST(KeyFilter, FewFalsePositivesAtCapacity) {
+    constexpr int kKeys = 100000;
+    KeyFilter filter(kKeys);
+    for (int i = 0; i < kKeys; ++i) filter.add(hashOf("in", i));
+    for (int i = 0; i < kKeys; ++i) ASSERT_TRUE(filter.mayContain(hashOf("in", i))) << i;
+
+    int false_positives = 0;
+    for (int i = 0; i < kKeys; ++i) false_positives += filter.mayContain(hashOf("out", i));
+    EXPECT_LT(false_positives, kKeys * 3 / 200);  // about 1%
+    EXPECT_EQ(filter.bytes(), kKeys * KeyFilter::kCountersPerKey);
+}
+
+TEST(KeyFilter, RemovedKeysGoAbsent) {
+    KeyFilter filter(10000);
+    for (int i = 0; i < 10000; ++i) filter.add(hashOf("k", i));
+    for (int i = 0; i < 10000; i += 2) filter.remove(hashOf("k", i));
+    for (int i = 1; i < 10000; i += 2) ASSERT_TRUE(filter.mayContain(hashOf("k", i))) << i;
+    for (int i = 1; i < 10000; i += 2) filter.remove(hashOf("k", i));
+    for (int i = 0; i < 10000; ++i) EXPECT_FALSE(filter.mayContain(hashOf("k", i))) << i;
+
+    // A saturated counter stays put: it may stand for more adds than it counted
+    uint64_t h = hashOf("hot", 0);
+    for (int i = 0; i < 300; ++i) filter.add(h);
+    for (int i = 0; i < 300; ++i) filter.remove(h);
+    EXPECT_TRUE(filter.mayContain(h));
+    filter.clear();
+    EXPECT_FALSE(filter.mayContain(h));
+}
+
+TEST(KeyFilter, StoreKeepsItInStep) {
+    Store store;
+    store.enableKeyFilter();
+    for (int i = 0; i < 50000; ++i) store.put("k" + std::to_string(i), "v");
+    for (int i = 0; i < 50000; i += 2) store.remove("k" + std::to_string(i));
+    store.incrBy("counter", 1);
+    for (int i = 0; i < 50000; ++i) {
+        ASSERT_EQ(store.get("k" + std::to_string(i)).has_value(), i % 2 == 1) << i;
+    }
+    EXPECT_EQ(*store.get("counter"), "1");
+    EXPECT_FALSE(store.get("never"));
+    store.put("k0", "back");
+    EXPECT_EQ(*store.get("k0"), "back");
+}
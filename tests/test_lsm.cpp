@@ -0,0 +1,217 @@
+// LsmEngine: reads across the memtable, flushes and compactions, read
+// errors, seeks and pinned views. Tiny memtables and tables make a few
+// thousand keys go through every level.
+
+#include "keyforge/Lsm.hpp"
+
+#include <gtest/gtest.h>
+
+#include <chrono>
+#include <csignal>
+#include <filesystem>
+#include <map>
+#include <string>
+#include <thread>
+
+#include <sys/resource.h>
+#include <unistd.h>
+
+using namespace keyforge;
+
+namespace {
+
+std::string scratchDir(const std::string& name) {
+    return (std::filesystem::temp_directory_path() / ("keyforge_test_" + std::to_string(::getpid()) + "_" + name))
+        .string();
+}
+
+LsmEngine::Options smallOptions() {
+    LsmEngine::Options options;
+    options.memtable_bytes = 4 << 10;
+    options.block_bytes = 512;
+    options.table_bytes = 8 << 10;
+    options.level0_tables = 2;
+    options.level1_bytes = 16 << 10;
+    options.block_cache_bytes = 64 << 10;
+    return options;
+}
+
+// A counter from info(), e.g. "compactions"
+size_t counter(const LsmEngine& engine, const std::string& name) {
+    std::string info = engine.info();
+    size_t at = info.find(name + ": ");
+    return at == std::string::npos ? 0 : std::stoul(info.substr(at + name.size() + 2));
+}
+
+bool waitFor(const std::function<bool()>& done) {
+    for (int i = 0; i < 500 && !done(); ++i) std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    return done();
+}
+
+std::string key(int i) {
+    return "key" + std::to_string(i);
+}
+
+std::string value(int i, int round) {
+    return "value" + std::to_string(round) + "_" + std::to_string(i) + std::string(40, 'x');
+}
+
+std::map<std::string, std::string> contents(LsmEngine& engine) {
+    std::map<std::string, std::string> out;
+    engine.forEach([&](const std::string& k, const std::string& v) {
+        out.emplace(k, v);
+        return true;
+    });
+    return out;
+}
+
+} // namespace
+
+TEST(LsmEngine, OverwritesAndDeletesSurviveFlushAndCompaction) {
+    LsmEngine engine(scratchDir("lsm_rw"), smallOptions());
+    std::map<std::string, std::string> expected;
+    constexpr int kKeys = 3000;
+    for (int i = 0; i < kKeys; ++i) {
+        engine.put(key(i), value(i, 1));
+        expected[key(i)] = value(i, 1);
+    }
+    for (int i = 0; i < kKeys; i += 2) {
+        engine.put(key(i), value(i, 2));
+        expected[key(i)] = value(i, 2);
+    }
+    for (int i = 0; i < kKeys; i += 3) {
+        engine.remove(key(i));
+        expected.erase(key(i));
+    }
+    ASSERT_TRUE(waitFor([&] { return counter(engine, "compactions") >= 2; })) << engine.info();
+
+    for (int i = 0; i < kKeys; ++i) {
+        auto it = expected.find(key(i));
+        auto got = engine.get(key(i));
+        if (it == expected.end()) {
+            EXPECT_FALSE(got) << key(i);
+        } else {
+            ASSERT_TRUE(got) << key(i);
+            EXPECT_EQ(*got, it->second);
+        }
+    }
+    EXPECT_FALSE(engine.get("missing"));
+    EXPECT_EQ(contents(engine), expected);
+}
+
+TEST(LsmEngine, KeysAfterPagesInKeyOrder) {
+    LsmEngine engine(scratchDir("lsm_pages"), smallOptions());
+    std::map<std::string, std::string> expected;
+    for (int i = 0; i < 2000; ++i) {
+        engine.put(key(i), value(i, 1));
+        expected[key(i)] = value(i, 1);
+    }
+    for (int i = 0; i < 2000; i += 5) {
+        engine.remove(key(i));
+        expected.erase(key(i));
+    }
+
+    std::vector<std::string> seen;
+    std::optional<std::string> after;
+    for (;;) {
+        auto page = engine.keysAfter(after, 7);
+        seen.insert(seen.end(), page.begin(), page.end());
+        if (page.size() < 7) break;
+        after = page.back();
+    }
+    std::vector<std::string> keys;
+    for (const auto& [k, v] : expected) keys.push_back(k);
+    EXPECT_EQ(seen, keys);
+}
+
+TEST(LsmEngine, ViewKeepsWhatItPinned) {
+    LsmEngine engine(scratchDir("lsm_view"), smallOptions());
+    std::map<std::string, std::string> before;
+    for (int i = 0; i < 1000; ++i) {
+        engine.put(key(i), value(i, 1));
+        before[key(i)] = value(i, 1);
+    }
+    auto view = engine.view();
+
+    // Rewrite everything, compacting the pinned tables away
+    size_t compactions = counter(engine, "compactions");
+    for (int i = 0; i < 1000; ++i) engine.put(key(i), value(i, 2));
+    engine.remove(key(0));
+    ASSERT_TRUE(waitFor([&] { return counter(engine, "compactions") > compactions; }));
+
+    std::map<std::string, std::string> pinned;
+    view->forEach([&](const std::string& k, const std::string& v) {
+        pinned.emplace(k, v);
+        return true;
+    });
+    EXPECT_EQ(pinned, before);
+    EXPECT_EQ(*engine.get(key(1)), value(1, 2));
+    EXPECT_FALSE(engine.get(key(0)));
+}
+
+TEST(LsmEngine, UnreadableTableIsAnErrorNotAMiss) {
+    std::string dir = scratchDir("lsm_error");
+    auto options = smallOptions();
+    options.level0_tables = 1000;  // nothing compacts the tables away
+    options.block_cache_bytes = 0;
+    LsmEngine engine(dir, options);
+    for (int i = 0; i < 1000; ++i) engine.put(key(i), value(i, 1));
+    ASSERT_TRUE(waitFor([&] { return counter(engine, "flushes") >= 3; }));
+
+    for (const auto& file : std::filesystem::directory_iterator(dir)) {
+        ASSERT_EQ(::truncate(file.path().c_str(), 0), 0);
+    }
+    EXPECT_THROW(engine.get(key(0)), StorageError);
+    EXPECT_THROW(contents(engine), StorageError);
+    EXPECT_THROW(engine.keysAfter(std::nullopt, 10), StorageError);
+}
+
+TEST(LsmEngine, CompactionKeepsInputsItCannotRead) {
+    std::string dir = scratchDir("lsm_keep");
+    auto options = smallOptions();
+    options.block_cache_bytes = 0;
+    LsmEngine engine(dir, options);
+    // One table in level 0, one short of a compaction
+    for (int i = 0; i < 80; ++i) engine.put(key(i), value(i, 1));
+    ASSERT_TRUE(waitFor([&] { return counter(engine, "flushes") >= 1; }));
+    ASSERT_EQ(counter(engine, "compactions"), 0u);
+    std::string first = dir + "/000001.sst";
+    ASSERT_TRUE(std::filesystem::exists(first));
+    ASSERT_EQ(::truncate(first.c_str(), 100), 0);
+
+    for (int i = 80; i < 160; ++i) engine.put(key(i), value(i, 1));
+    ASSERT_TRUE(waitFor([&] { return counter(engine, "flushes") >= 2; }));
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    EXPECT_EQ(counter(engine, "compactions"), 0u);
+    EXPECT_TRUE(std::filesystem::exists(first));
+    EXPECT_THROW(contents(engine), StorageError);
+    EXPECT_EQ(*engine.get(key(150)), value(150, 1));
+}
+
+TEST(LsmEngine, PutRefusedWhileTablesCannotBeWritten) {
+    std::string dir = scratchDir("lsm_full");
+    LsmEngine engine(dir, smallOptions());
+    std::signal(SIGXFSZ, SIG_IGN);
+    rlimit saved{};
+    ASSERT_EQ(::getrlimit(RLIMIT_FSIZE, &saved), 0);
+    rlimit limited = saved;
+    limited.rlim_cur = 256;  // less than any table
+    ASSERT_EQ(::setrlimit(RLIMIT_FSIZE, &limited), 0);
+
+    // One memtable is frozen and fails to flush, the next one fills up
+    int stored = 0;
+    while (stored < 1000 && engine.put(key(stored), value(stored, 1))) ++stored;
+    bool refused = stored < 1000;
+    engine.remove(key(0));  // deletes still go in
+    ::setrlimit(RLIMIT_FSIZE, &saved);
+    std::signal(SIGXFSZ, SIG_DFL);
+    ASSERT_TRUE(refused);
+    EXPECT_EQ(counter(engine, "flushes"), 0u);
+
+    // Nothing accepted is lost, and puts go through again once the retry succeeds
+    EXPECT_FALSE(engine.get(key(0)));
+    for (int i = 1; i < stored; ++i) EXPECT_EQ(*engine.get(key(i)), value(i, 1)) << key(i);
+    EXPECT_FALSE(engine.get(key(stored)));
+    ASSERT_TRUE(waitFor([&] { return counter(engine, "flushes") >= 1; }));
+    EXPECT_TRUE(engine.put(key(stored), value(stored, 1)));
+}
@@ -0,0 +1,167 @@
+// MappedTable: what persist() leaves is mapped again by the next instance
+// 0 on the same home, anything else starts over, and a full disk refuses
+// writes instead of faulting on the mapping.
+
+#include "keyforge/MappedTable.hpp"
+#include "keyforge/Store.hpp"
+
+#include <gtest/gtest.h>
+
+#include <csignal>
+#include <filesystem>
+#include <map>
+#include <string>
+
+#include <sys/resource.h>
+#include <unistd.h>
+
+using namespace keyforge;
+
+namespace {
+
+std::string scratchHome(const std::string& name) {
+    auto dir = std::filesystem::temp_directory_path() / ("keyforge_test_" + std::to_string(::getpid()) + "_" + name);
+    std::filesystem::remove_all(dir);
+    return (dir / "table.kfm").string();
+}
+
+std::string key(int i) {
+    return "key" + std::to_string(i);
+}
+
+std::string value(int i, int round) {
+    return "value" + std::to_string(round) + "_" + std::to_string(i) + std::string(40, 'x');
+}
+
+std::map<std::string, std::string> contents(MappedTable& table) {
+    std::map<std::string, std::string> out;
+    table.forEach([&](const std::string& k, const std::string& v) {
+        out.emplace(k, v);
+        return true;
+    });
+    return out;
+}
+
+} // namespace
+
+TEST(MappedTable, ReopensWhatWasPersisted) {
+    std::string home = scratchHome("mapped_reopen");
+    std::map<std::string, std::string> expected;
+    {
+        MappedTable table(home);
+        EXPECT_EQ(table.restoredKeys(), 0u);
+        // Enough to outgrow the first slots and arena a few times
+        for (int i = 0; i < 20000; ++i) {
+            ASSERT_TRUE(table.put(key(i), value(i, 1)));
+            expected[key(i)] = value(i, 1);
+        }
+        for (int i = 0; i < 20000; i += 3) {
+            ASSERT_TRUE(table.put(key(i), value(i, 2)));
+            expected[key(i)] = value(i, 2);
+        }
+        for (int i = 0; i < 20000; i += 7) {
+            table.remove(key(i));
+            expected.erase(key(i));
+        }
+        ASSERT_TRUE(table.persist());
+    }
+    ASSERT_TRUE(std::filesystem::exists(home));
+
+    MappedTable table(home);
+    EXPECT_EQ(table.restoredKeys(), expected.size());
+    EXPECT_EQ(contents(table), expected);
+    EXPECT_FALSE(table.get(key(0)));
+    EXPECT_EQ(*table.get(key(3)), value(3, 2));
+    EXPECT_EQ(*table.get(key(1)), value(1, 1));
+
+    // Still writable, and persisting again keeps the change
+    ASSERT_TRUE(table.put(key(1), value(1, 3)));
+    ASSERT_TRUE(table.persist());
+}
+
+TEST(MappedTable, UnpersistedTableStartsOver) {
+    std::string home = scratchHome("mapped_unpersisted");
+    {
+        MappedTable table(home);
+        ASSERT_TRUE(table.put("a", "1"));
+    }
+    EXPECT_FALSE(std::filesystem::exists(home));
+
+    {
+        MappedTable table(home);
+        ASSERT_TRUE(table.put("a", "1"));
+        ASSERT_TRUE(table.persist());
+    }
+    {
+        // Mapped again, then changed without a persist()
+        MappedTable table(home);
+        ASSERT_EQ(table.restoredKeys(), 1u);
+        ASSERT_TRUE(table.put("b", "2"));
+    }
+    MappedTable table(home);
+    EXPECT_EQ(table.restoredKeys(), 0u);
+    EXPECT_FALSE(table.get("a"));
+}
+
+TEST(MappedTable, OtherInstancePersistsOverHome) {
+    std::string home = scratchHome("mapped_instance");
+    {
+        MappedTable table(home);
+        ASSERT_TRUE(table.put("old", "1"));
+        ASSERT_TRUE(table.persist());
+    }
+    {
+        MappedTable copy(home, 1);
+        EXPECT_EQ(copy.restoredKeys(), 0u);
+        EXPECT_FALSE(copy.get("old"));
+        ASSERT_TRUE(copy.put("new", "2"));
+        ASSERT_TRUE(copy.persist());
+    }
+    MappedTable table(home);
+    EXPECT_EQ(table.restoredKeys(), 1u);
+    EXPECT_FALSE(table.get("old"));
+    EXPECT_EQ(*table.get("new"), "2");
+}
+
+TEST(MappedTable, StoreMapsItsSpilledKeysBack) {
+    std::string home = scratchHome("mapped_store");
+    auto factory = [home] { return std::make_unique<MappedTable>(home); };
+    {
+        Store store;
+        store.setStorageEngine(factory);
+        for (int i = 0; i < 2000; ++i) store.put(key(i), value(i, 1));
+        store.remove(key(0));
+        ASSERT_TRUE(store.persistStorage());
+    }
+    Store store;
+    store.setStorageEngine(factory);
+    EXPECT_EQ(store.size(), 1999u);
+    EXPECT_FALSE(store.get(key(0)));
+    for (int i = 1; i < 2000; i += 97) EXPECT_EQ(*store.get(key(i)), value(i, 1));
+}
+
+TEST(MappedTable, FullDiskRefusesPut) {
+    std::string home = scratchHome("mapped_full");
+    std::signal(SIGXFSZ, SIG_IGN);
+    rlimit saved{};
+    ASSERT_EQ(::getrlimit(RLIMIT_FSIZE, &saved), 0);
+
+    int stored = 0;
+    {
+        // The first table fits, the file it outgrows into doesn't
+        MappedTable table(home);
+        rlimit limited = saved;
+        limited.rlim_cur = 24 << 20;
+        ASSERT_EQ(::setrlimit(RLIMIT_FSIZE, &limited), 0);
+        while (stored < 100000 && table.put(key(stored), std::string(1000, 'v'))) ++stored;
+        ::setrlimit(RLIMIT_FSIZE, &saved);
+        ASSERT_LT(stored, 100000);
+        ASSERT_GT(stored, 0);
+
+        // What went in before is untouched, and room comes back with the disk
+        for (int i = 0; i < stored; i += 101) EXPECT_EQ(*table.get(key(i)), std::string(1000, 'v'));
+        EXPECT_FALSE(table.get(key(stored)));
+        EXPECT_TRUE(table.put(key(stored), std::string(1000, 'v')));
+    }
+    std::signal(SIGXFSZ, SIG_DFL);
+}
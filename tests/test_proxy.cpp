@@ -0,0 +1,180 @@
+// Proxy: two servers behind a proxy, all in this process. Multi-key
+// commands are split across the nodes and merged back in order, SCAN walks
+// every node under one cursor, and pipelined commands answer in order.
+
+#include "keyforge/Proxy.hpp"
+#include "keyforge/Server.hpp"
+
+#include <gtest/gtest.h>
+
+#include <chrono>
+#include <memory>
+#include <set>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+using namespace keyforge;
+
+namespace {
+
+const std::string kToken = "KeyForgeSecret";
+
+int freePort() {
+    int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(addr);
+    int port = 0;
+    if (::bind(fd, reinterpret_cast<sockaddr*>(&addr), len) == 0 &&
+        ::getsockname(fd, reinterpret_cast<sockaddr*>(&addr), &len) == 0) {
+        port = ntohs(addr.sin_port);
+    }
+    ::close(fd);
+    return port;
+}
+
+// A line-protocol connection
+class Connection {
+public:
+    explicit Connection(int port) {
+        for (int attempt = 0; attempt < 100 && fd_ < 0; ++attempt) {
+            fd_ = net::connectTo("127.0.0.1", port);
+            if (fd_ < 0) std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        }
+        if (fd_ >= 0) reader_ = std::make_unique<net::LineReader>(fd_);
+    }
+    ~Connection() {
+        if (fd_ >= 0) ::close(fd_);
+    }
+    bool connected() const { return fd_ >= 0; }
+
+    // Send every line in one write, then read a reply line for each
+    std::vector<std::string> send(const std::vector<std::string>& lines) {
+        std::string wire;
+        for (const auto& l : lines) wire += l + "\n";
+        std::vector<std::string> replies;
+        if (!net::sendAll(fd_, wire)) return replies;
+        std::string reply;
+        while (replies.size() < lines.size() && reader_->readLine(reply, 5000) == net::LineReader::Status::OK) {
+            replies.push_back(reply);
+        }
+        return replies;
+    }
+    std::string send(const std::string& line) {
+        auto replies = send(std::vector<std::string>{line});
+        return replies.empty() ? "" : replies.front();
+    }
+
+private:
+    int fd_ = -1;
+    std::unique_ptr<net::LineReader> reader_;
+};
+
+// Runs something with run() / requestShutdown() on its own thread
+template <typename T>
+class Running {
+public:
+    template <typename... Args>
+    explicit Running(Args&&... args) : it(std::forward<Args>(args)...), thread_([this] { it.run(); }) {}
+    ~Running() {
+        it.requestShutdown();
+        thread_.join();
+    }
+    T it;
+
+private:
+    std::thread thread_;
+};
+
+} // namespace
+
+TEST(Proxy, SplitsAndMergesAcrossNodes) {
+    std::vector<Client::Node> nodes = {{"127.0.0.1", freePort()}, {"127.0.0.1", freePort()}};
+    Running<Server> first(nodes[0].port);
+    Running<Server> second(nodes[1].port);
+    ASSERT_TRUE(Connection(nodes[0].port).connected() && Connection(nodes[1].port).connected());
+    int port = freePort();
+    Running<Proxy> proxy(port, nodes, 2, kToken);
+    Connection conn(port);
+    ASSERT_TRUE(conn.connected());
+    ASSERT_EQ(conn.send("AUTH " + kToken).rfind("OK", 0), 0u);
+
+    std::string mset = "MSET", mget = "MGET";
+    std::vector<std::string> keys;
+    for (int i = 0; i < 200; ++i) {
+        keys.push_back("key" + std::to_string(i));
+        mset += " " + keys.back() + " v" + std::to_string(i);
+        mget += " " + keys.back();
+    }
+    ASSERT_EQ(conn.send(mset), "OK");
+    mget += " missing";
+    std::istringstream values(conn.send(mget));
+    std::string value;
+    for (int i = 0; i < 200; ++i) {
+        ASSERT_TRUE(values >> value);
+        EXPECT_EQ(value, "v" + std::to_string(i));
+    }
+    ASSERT_TRUE(values >> value);
+    EXPECT_EQ(value, "NOT_FOUND");
+
+    // Each key went to the node the ring gives it, and both got some
+    Client ring(nodes);
+    std::vector<size_t> owned(2);
+    for (const auto& k : keys) owned[ring.nodeFor(k)]++;
+    EXPECT_GT(owned[0], 0u);
+    EXPECT_GT(owned[1], 0u);
+    Connection direct(nodes[ring.nodeFor("key7")].port);
+    direct.send("AUTH " + kToken);
+    EXPECT_EQ(direct.send("GET key7"), "v7");
+
+    // One cursor for both nodes, small pages
+    std::set<std::string> scanned;
+    std::string cursor = "0";
+    int pages = 0;
+    do {
+        std::istringstream reply(conn.send("SCAN " + cursor + " COUNT 16"));
+        reply >> cursor;
+        std::string k;
+        while (reply >> k) scanned.insert(k);
+    } while (cursor != "0" && ++pages < 1000);
+    EXPECT_EQ(scanned, std::set<std::string>(keys.begin(), keys.end()));
+    EXPECT_EQ(conn.send("SCAN 0,0,0"), "ERROR Invalid SCAN cursor");
+
+    EXPECT_EQ(conn.send("GET_KEY v150"), "OK. Key found :key150");
+    EXPECT_EQ(conn.send("GET_KEY nowhere"), "NOT_FOUND");
+}
+
+TEST(Proxy, PipelinedCommandsAnswerInOrder) {
+    std::vector<Client::Node> nodes = {{"127.0.0.1", freePort()}, {"127.0.0.1", freePort()}};
+    Running<Server> first(nodes[0].port);
+    Running<Server> second(nodes[1].port);
+    ASSERT_TRUE(Connection(nodes[0].port).connected() && Connection(nodes[1].port).connected());
+    int port = freePort();
+    Running<Proxy> proxy(port, nodes, 1, kToken);
+    Connection conn(port);
+    ASSERT_TRUE(conn.connected());
+
+    // Not authenticated yet: writes are refused, in their place in the batch
+    auto replies = conn.send({"GET a", "DELETE a", "AUTH " + kToken});
+    ASSERT_EQ(replies.size(), 3u);
+    EXPECT_EQ(replies[0], "NOT_FOUND");
+    EXPECT_EQ(replies[1].rfind("ERROR", 0), 0u);
+
+    std::vector<std::string> lines;
+    for (int i = 0; i < 50; ++i) lines.push_back("PUT p" + std::to_string(i) + " " + std::to_string(i));
+    for (int i = 0; i < 50; ++i) lines.push_back("GET p" + std::to_string(i));
+    replies = conn.send(lines);
+    ASSERT_EQ(replies.size(), 100u);
+    for (int i = 0; i < 50; ++i) {
+        EXPECT_EQ(replies[i].rfind("OK", 0), 0u) << replies[i];
+        EXPECT_EQ(replies[50 + i], std::to_string(i));
+    }
+}
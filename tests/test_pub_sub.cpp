@@ -0,0 +1,138 @@
+// PubSub: glob patterns, channel and pattern subscribers sharing one
+// formatted message, keyspace notifications, and a subscriber cut off once
+// it falls too far behind.
+
+#include "keyforge/PubSub.hpp"
+
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+using namespace keyforge;
+
+namespace {
+
+// A subscriber on one end of a socket pair
+struct Connection {
+    Connection() {
+        int fds[2];
+        if (::socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0) {
+            server = fds[0];
+            client = fds[1];
+        }
+        sub = std::make_shared<PubSub::Subscriber>(server);
+    }
+    ~Connection() {
+        ::close(server);
+        ::close(client);
+    }
+
+    bool woken() const {
+        pollfd pfd{sub->wakeFd(), POLLIN, 0};
+        return ::poll(&pfd, 1, 0) == 1;
+    }
+
+    std::vector<std::string> take() {
+        std::vector<std::string> out;
+        for (const auto& msg : sub->take()) out.push_back(*msg);
+        return out;
+    }
+
+    int server = -1;
+    int client = -1;
+    std::shared_ptr<PubSub::Subscriber> sub;
+};
+
+} // namespace
+
+TEST(PubSub, GlobPatterns) {
+    EXPECT_TRUE(PubSub::matches("news.*", "news.sport"));
+    EXPECT_TRUE(PubSub::matches("news.*", "news."));
+    EXPECT_FALSE(PubSub::matches("news.*", "news"));
+    EXPECT_TRUE(PubSub::matches("*", ""));
+    EXPECT_TRUE(PubSub::matches("h?llo", "hello"));
+    EXPECT_FALSE(PubSub::matches("h?llo", "hllo"));
+    EXPECT_TRUE(PubSub::matches("a*b*c", "axxbyybzc"));
+    EXPECT_FALSE(PubSub::matches("a*b*c", "axxcyyb"));
+    EXPECT_TRUE(PubSub::matches("a\\*", "a*"));
+    EXPECT_FALSE(PubSub::matches("a\\*", "ab"));
+    EXPECT_TRUE(PubSub::matches("a\\?", "a?"));
+    EXPECT_FALSE(PubSub::matches("a\\?", "ab"));
+}
+
+TEST(PubSub, ChannelAndPatternSubscribers) {
+    PubSub pubsub;
+    Connection a, b, c;
+    EXPECT_EQ(pubsub.subscribe(a.sub, {"news", "weather"}), 2u);
+    EXPECT_EQ(pubsub.subscribe(a.sub, {"news"}), 2u);
+    EXPECT_EQ(pubsub.subscribe(b.sub, {"news"}), 1u);
+    EXPECT_EQ(pubsub.psubscribe(c.sub, {"n*", "*s"}), 2u);
+
+    EXPECT_FALSE(a.woken());
+    EXPECT_EQ(pubsub.publish("news", "hello"), 4u);  // c through both patterns
+    EXPECT_TRUE(a.woken());
+    // Everybody on the channel shares one buffer
+    auto got_a = a.sub->take();
+    auto got_b = b.sub->take();
+    ASSERT_EQ(got_a.size(), 1u);
+    ASSERT_EQ(got_b.size(), 1u);
+    EXPECT_EQ(got_a[0], got_b[0]);
+    EXPECT_EQ(*got_a[0], ">MESSAGE news hello\n");
+    EXPECT_FALSE(a.woken());
+    auto got_c = c.take();
+    std::sort(got_c.begin(), got_c.end());
+    EXPECT_EQ(got_c, (std::vector<std::string>{">PMESSAGE *s news hello\n", ">PMESSAGE n* news hello\n"}));
+
+    EXPECT_EQ(pubsub.publish("weather", "rain"), 1u);
+    EXPECT_EQ(pubsub.publish("nobody", "x"), 1u);
+    EXPECT_EQ(pubsub.unsubscribe(a.sub, {}), 0u);
+    EXPECT_EQ(pubsub.punsubscribe(c.sub, {"*s"}), 1u);
+    EXPECT_EQ(pubsub.publish("news", "again"), 2u);
+    EXPECT_EQ(a.take(), (std::vector<std::string>{">MESSAGE weather rain\n"}));
+    EXPECT_NE(pubsub.info().find("Messages published: 4, delivered: 8"), std::string::npos) << pubsub.info();
+}
+
+TEST(PubSub, KeyspaceNotifications) {
+    PubSub pubsub;
+    Connection conn;
+    pubsub.keyspaceEvent(0, "k", "set");  // nobody listening
+    pubsub.subscribe(conn.sub, {"__keyspace@0__:k"});
+    pubsub.psubscribe(conn.sub, {"__keyevent@2__:*"});
+    pubsub.keyspaceEvent(0, "k", "set");
+    pubsub.keyspaceEvent(2, "list", "lpush");
+    pubsub.keyspaceEvent(2, "bulk", nullptr);
+    EXPECT_EQ(conn.take(), (std::vector<std::string>{">MESSAGE __keyspace@0__:k set\n",
+                                                     ">PMESSAGE __keyevent@2__:* __keyevent@2__:lpush list\n"}));
+}
+
+TEST(PubSub, DropsASubscriberThatFallsBehind) {
+    PubSub pubsub;
+    Connection slow, fast;
+    pubsub.subscribe(slow.sub, {"c"});
+    pubsub.subscribe(fast.sub, {"c"});
+    std::string payload(1 << 20, 'x');
+    size_t published = 0;
+    size_t receivers = 2;
+    while (receivers == 2 && published < 20) {
+        receivers = pubsub.publish("c", payload);
+        fast.sub->take();
+        published++;
+    }
+    ASSERT_TRUE(slow.sub->dropped());
+    EXPECT_EQ(receivers, 1u);
+    // Headers included, the payload that would fill kMaxPendingBytes is one too many
+    EXPECT_EQ(published, PubSub::kMaxPendingBytes / payload.size());
+    EXPECT_TRUE(slow.take().empty());
+    // Its socket is shut down, so its connection notices
+    char byte;
+    EXPECT_EQ(::recv(slow.client, &byte, 1, MSG_DONTWAIT), 0);
+    EXPECT_EQ(pubsub.publish("c", "more"), 1u);
+    EXPECT_NE(pubsub.info().find("Dropped slow subscribers: 1"), std::string::npos);
+}
@@ -0,0 +1,127 @@
+// Raft: a follower driven over a peer connection by a test playing the
+// leaders, whose other members never answer. Conflicting entries are cut
+// off, and votes go only to candidates whose log is up to date.
+
+#include "keyforge/Raft.hpp"
+
+#include <gtest/gtest.h>
+
+#include <chrono>
+#include <filesystem>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+using namespace keyforge;
+
+namespace {
+
+std::string scratchPrefix(const std::string& name) {
+    auto prefix = std::filesystem::temp_directory_path() / ("keyforge_test_" + std::to_string(::getpid()) + "_" + name);
+    for (const char* ext : {".log", ".meta", ".snap"}) std::filesystem::remove(prefix.string() + ext);
+    return prefix.string();
+}
+
+bool waitFor(const std::function<bool()>& done) {
+    for (int i = 0; i < 500 && !done(); ++i) std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    return done();
+}
+
+// One node of a three-member group, the other two being unreachable, with
+// a peer connection into it
+class Follower {
+public:
+    explicit Follower(const std::string& name) : repl_(store), raft_(store, repl_) {
+        raft_.start("127.0.0.1:1", {"127.0.0.1:1", "127.0.0.1:2", "127.0.0.1:3"}, scratchPrefix(name), "");
+        int fds[2];
+        if (::socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) return;
+        fd_ = fds[0];
+        reader_ = std::make_unique<net::LineReader>(fd_);
+        server_ = std::thread([this, peer = fds[1]] {
+            raft_.servePeer(peer);
+            ::close(peer);
+        });
+        std::string ok;
+        reader_->readLine(ok, 1000);
+    }
+    ~Follower() {
+        raft_.shutdown();
+        ::shutdown(fd_, SHUT_RDWR);
+        if (server_.joinable()) server_.join();
+        ::close(fd_);
+    }
+
+    // One RPC, entries as "<term> <command>" lines; the reply line
+    std::string rpc(const std::string& header, const std::vector<std::string>& entries = {}) {
+        std::string msg = header + "\n";
+        for (const auto& e : entries) msg += e + "\n";
+        std::string reply;
+        if (!net::sendAll(fd_, msg) || reader_->readLine(reply, 5000) != net::LineReader::Status::OK) return "";
+        return reply;
+    }
+
+    // Its current term, asked with a vote it can't grant
+    uint64_t term() { return std::stoull(rpc("RAFT_VOTE 0 nobody 0 0").substr(5)); }
+
+    std::string info() { return raft_.info(); }
+
+    Store store;
+
+private:
+    Replication repl_;
+    Raft raft_;
+    int fd_ = -1;
+    std::unique_ptr<net::LineReader> reader_;
+    std::thread server_;
+};
+
+} // namespace
+
+TEST(Raft, AppendCutsOffConflictingEntries) {
+    Follower node("raft_append");
+    // A leader of term 1 gets three entries in, and only the first committed
+    EXPECT_EQ(node.rpc("RAFT_APPEND 1 L1 0 0 1 3", {"1 PUT a 1", "1 PUT b 1", "1 PUT c 1"}), "APPEND 1 1 3");
+    ASSERT_TRUE(waitFor([&] { return node.store.peek("a").has_value(); }));
+
+    // Its successor doesn't have 2 and 3: asked to back up over the whole term
+    EXPECT_EQ(node.rpc("RAFT_APPEND 2 L2 3 2 1 0"), "APPEND 2 0 1");
+    EXPECT_EQ(node.rpc("RAFT_APPEND 2 L2 9 2 1 0"), "APPEND 2 0 4");
+    EXPECT_EQ(node.rpc("RAFT_APPEND 2 L2 1 1 2 1", {"2 PUT b 2"}), "APPEND 2 1 2");
+    ASSERT_TRUE(waitFor([&] { return node.store.peek("b") == std::optional<std::string>("2"); }));
+    EXPECT_FALSE(node.store.peek("c"));
+    EXPECT_NE(node.info().find("Last index: 2\n"), std::string::npos) << node.info();
+
+    // The old leader is behind the times; resending what is there changes nothing
+    EXPECT_EQ(node.rpc("RAFT_APPEND 1 L1 3 1 3 0"), "APPEND 2 0 3");
+    EXPECT_EQ(node.rpc("RAFT_APPEND 2 L2 0 0 2 2", {"1 PUT a 1", "2 PUT b 2"}), "APPEND 2 1 2");
+    EXPECT_NE(node.info().find("Last index: 2\n"), std::string::npos);
+}
+
+TEST(Raft, VotesOnlyForUpToDateLogs) {
+    Follower node("raft_vote");
+    ASSERT_EQ(node.rpc("RAFT_APPEND 1 L1 0 0 0 1", {"1 PUT a 1"}), "APPEND 1 1 1");
+    ASSERT_EQ(node.rpc("RAFT_APPEND 2 L2 1 1 0 1", {"2 PUT b 1"}), "APPEND 2 1 2");
+
+    // While L2 is heard from, a higher term isn't even taken
+    EXPECT_EQ(node.rpc("RAFT_VOTE 9 C 5 5"), "VOTE 2 0");
+    // Once it times out it runs itself, and then listens
+    ASSERT_TRUE(waitFor([&] { return node.term() > 2; }));
+    uint64_t t = node.term() + 1;
+    auto vote = [&](uint64_t term, const std::string& who, int last_index, int last_term) {
+        return node.rpc("RAFT_VOTE " + std::to_string(term) + " " + who + " " + std::to_string(last_index) + " " +
+                        std::to_string(last_term));
+    };
+    std::string term = std::to_string(t);
+    EXPECT_EQ(vote(t, "A", 5, 1), "VOTE " + term + " 0");  // longer, but an older last term
+    term = std::to_string(t + 1);
+    EXPECT_EQ(vote(t + 1, "B", 1, 2), "VOTE " + term + " 0");  // same last term, shorter
+    term = std::to_string(t + 2);
+    EXPECT_EQ(vote(t + 2, "C", 2, 2), "VOTE " + term + " 1");
+    EXPECT_EQ(vote(t + 2, "D", 9, 9), "VOTE " + term + " 0");  // one vote a term
+    EXPECT_EQ(vote(t + 2, "C", 2, 2), "VOTE " + term + " 1");  // asking again is fine
+    EXPECT_EQ(vote(t + 1, "E", 9, 9), "VOTE " + term + " 0");  // stale term
+}
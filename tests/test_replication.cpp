@@ -0,0 +1,362 @@
+// Replication: a follower of a leader on a loopback socket applies its
+// stream, a partial resync resends what the backlog still has, and a full
+// resync loads every frame into its database, or nothing if cut short, and
+// carries every database whatever the keys look like; writers of
+// one database don't wait for another's, and reads wait for their token.
+
+#include "keyforge/Replication.hpp"
+
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <future>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+using namespace keyforge;
+
+namespace {
+
+bool waitFor(const std::function<bool()>& done) {
+    for (int i = 0; i < 1000 && !done(); ++i) std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    return done();
+}
+
+std::map<std::string, std::string> contents(const Store& store) {
+    std::map<std::string, std::string> out;
+    std::string cursor = "0";
+    do {
+        std::vector<std::string> keys;
+        cursor = store.scan(cursor, 100, keys);
+        for (const auto& k : keys) out.emplace(k, *store.peek(k));
+    } while (cursor != "0");
+    return out;
+}
+
+// Accepts replica connections on a loopback port, one at a time, and hands
+// them to the leader the way the server does for SYNC / PSYNC
+class Leader {
+public:
+    explicit Leader(Replication& repl) : repl_(repl) {
+        listen_fd_ = ::socket(AF_INET, SOCK_STREAM, 0);
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        socklen_t len = sizeof(addr);
+        if (::bind(listen_fd_, reinterpret_cast<sockaddr*>(&addr), len) != 0 || ::listen(listen_fd_, 1) != 0 ||
+            ::getsockname(listen_fd_, reinterpret_cast<sockaddr*>(&addr), &len) != 0) {
+            return;
+        }
+        port_ = ntohs(addr.sin_port);
+        thread_ = std::thread([this] {
+            for (;;) {
+                int fd = ::accept(listen_fd_, nullptr, nullptr);
+                if (fd < 0) return;
+                net::LineReader reader(fd);
+                std::string line, cmd, replid;
+                uint64_t offset = 0;
+                if (reader.readLine(line, 5000) == net::LineReader::Status::OK) {
+                    std::istringstream iss(line);
+                    iss >> cmd >> replid >> offset;
+                    repl_.serveReplica(fd, "test", replid, offset);
+                }
+                ::close(fd);
+            }
+        });
+    }
+    ~Leader() {
+        repl_.shutdown();
+        ::shutdown(listen_fd_, SHUT_RDWR);
+        if (thread_.joinable()) thread_.join();
+        ::close(listen_fd_);
+    }
+
+    int port() const { return port_; }
+
+private:
+    Replication& repl_;
+    int listen_fd_ = -1;
+    int port_ = 0;
+    std::thread thread_;
+};
+
+// A raw replica connection: sends `request`, returns the reply line and
+// then up to `lines` stream lines
+std::vector<std::string> replicaRequest(int port, const std::string& request, size_t lines) {
+    std::vector<std::string> out;
+    int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(static_cast<uint16_t>(port));
+    if (::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0 && net::sendAll(fd, request)) {
+        net::LineReader reader(fd);
+        std::string line;
+        while (out.size() <= lines && reader.readLine(line, 2000) == net::LineReader::Status::OK) out.push_back(line);
+    }
+    ::close(fd);
+    return out;
+}
+
+std::string replId(Replication& repl) {
+    std::string info = repl.info();
+    const std::string label = "Replication ID: ";
+    size_t at = info.find(label) + label.size();
+    return info.substr(at, info.find('\n', at) - at);
+}
+
+// Answers the first replica connection's PSYNC with `script`, then hangs
+// up once the test is done with it, or right away if told to
+class ScriptedLeader {
+public:
+    ScriptedLeader(std::string script, bool hang_up) {
+        listen_fd_ = ::socket(AF_INET, SOCK_STREAM, 0);
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        socklen_t len = sizeof(addr);
+        if (::bind(listen_fd_, reinterpret_cast<sockaddr*>(&addr), len) != 0 || ::listen(listen_fd_, 1) != 0 ||
+            ::getsockname(listen_fd_, reinterpret_cast<sockaddr*>(&addr), &len) != 0) {
+            return;
+        }
+        port_ = ntohs(addr.sin_port);
+        thread_ = std::thread([this, script = std::move(script), hang_up] {
+            int fd = ::accept(listen_fd_, nullptr, nullptr);
+            if (fd < 0) return;
+            net::LineReader reader(fd);
+            std::string line;
+            if (reader.readLine(line, 5000) == net::LineReader::Status::OK && net::sendAll(fd, script)) {
+                served_ = true;
+                // Acks until the follower goes
+                while (!hang_up && reader.readLine(line, 10000) != net::LineReader::Status::CLOSED) {
+                }
+            }
+            ::close(fd);
+        });
+    }
+    ~ScriptedLeader() {
+        ::shutdown(listen_fd_, SHUT_RDWR);
+        if (thread_.joinable()) thread_.join();
+        ::close(listen_fd_);
+    }
+
+    int port() const { return port_; }
+    bool served() const { return served_.load(); }
+
+private:
+    int listen_fd_ = -1;
+    int port_ = 0;
+    std::atomic<bool> served_{false};
+    std::thread thread_;
+};
+
+// One snapshot frame of database db
+std::string frame(size_t db, const std::vector<std::pair<std::string, std::string>>& kvs) {
+    std::string records;
+    for (const auto& [k, v] : kvs) Store::encodeRecord(records, k, v);
+    return std::to_string(records.size()) + " " + std::to_string(db) + "\n" + records;
+}
+
+} // namespace
+
+TEST(Replication, FollowerAppliesTheStream) {
+    Store leader_store;
+    leader_store.put("before", "the sync");
+    Replication leader(leader_store);
+    Leader server(leader);
+    ASSERT_NE(server.port(), 0);
+
+    Store follower_store;
+    Replication follower(follower_store);
+    follower.replicaOf("127.0.0.1", server.port());
+    ASSERT_TRUE(waitFor([&] { return follower_store.peek("before").has_value(); }));
+
+    // What a writer does: change the Store, then stream the change
+    auto write = [&](const std::string& command, const std::function<void()>& change) {
+        auto wlock = leader.lockWrites(0);
+        change();
+        return leader.propagate(command);
+    };
+    write("PUT a 1", [&] { leader_store.put("a", "1"); });
+    write("PUT b 2", [&] { leader_store.put("b", "2"); });
+    write("DELETE before", [&] { leader_store.remove("before"); });
+    write("INCRBY n 5", [&] { leader_store.incrBy("n", 5); });
+    {
+        auto wlock = leader.lockWrites(0);
+        auto frame = leader.lockStream();
+        Store::Batch batch(leader_store);
+        batch.put("c", "3");
+        batch.remove("b");
+        leader.propagate("MULTI");
+        leader.propagate("PUT c 3");
+        leader.propagate("DELETE b");
+        leader.propagate("EXEC");
+    }
+    uint64_t last = write("UPDATE a 4", [&] { leader_store.update("a", "4"); });
+
+    // Followers re-propagate what they apply, at the leader's offsets
+    ASSERT_TRUE(follower.waitForOffset(last, std::chrono::seconds(10)));
+    follower.shutdown();
+    EXPECT_EQ(contents(follower_store), contents(leader_store));
+    EXPECT_EQ(*follower_store.peek("n"), "5");
+    EXPECT_FALSE(follower_store.peek("b"));
+}
+
+TEST(Replication, PartialResyncReadsAcrossTheBacklogWrap) {
+    Store store;
+    Replication leader(store);
+    leader.setBacklogSize(64);
+    // Ten bytes a command: the second five wrap around the ring
+    for (int i = 0; i < 5; ++i) leader.propagate("PUT k" + std::to_string(i) + " v" + std::to_string(i));
+    uint64_t from = leader.offset();
+    std::vector<std::string> missed;
+    for (int i = 5; i < 10; ++i) {
+        missed.push_back("PUT k" + std::to_string(i) + " v" + std::to_string(i));
+        leader.propagate(missed.back());
+    }
+    ASSERT_EQ(leader.offset(), 100u);
+    Leader server(leader);
+    ASSERT_NE(server.port(), 0);
+    std::string replid = replId(leader);
+
+    auto reply = replicaRequest(server.port(), "PSYNC " + replid + " " + std::to_string(from) + "\n", missed.size());
+    ASSERT_EQ(reply.size(), missed.size() + 1);
+    EXPECT_EQ(reply[0], "CONTINUE " + replid);
+    EXPECT_EQ(std::vector<std::string>(reply.begin() + 1, reply.end()), missed);
+
+    // Already overwritten, or another history: a full resync
+    reply = replicaRequest(server.port(), "PSYNC " + replid + " 30\n", 0);
+    ASSERT_EQ(reply.size(), 1u);
+    EXPECT_EQ(reply[0].rfind("FULLRESYNC ", 0), 0u) << reply[0];
+    reply = replicaRequest(server.port(), "PSYNC 0123456789abcdef 90\n", 0);
+    ASSERT_EQ(reply.size(), 1u);
+    EXPECT_EQ(reply[0].rfind("FULLRESYNC ", 0), 0u) << reply[0];
+
+    // Up to date: nothing to send
+    reply = replicaRequest(server.port(), "PSYNC " + replid + " 100\n", 0);
+    ASSERT_EQ(reply.size(), 1u);
+    EXPECT_EQ(reply[0], "CONTINUE " + replid);
+}
+
+TEST(Replication, FullResyncLoadsFramesIntoTheirDatabases) {
+    // Database 0 across two frames, a frame for a database we don't have,
+    // then the stream from the snapshot's offset
+    std::string script = "FULLRESYNC 0123456789abcdef 500 5\n" + frame(0, {{"a", "1"}, {"b", "two words"}}) +
+                         frame(1, {{"x", "db1"}}) + frame(7, {{"z", "nowhere"}}) + frame(0, {{"c", "3"}}) + "0\n" +
+                         "PUT d 4\n";
+    ScriptedLeader leader(script, false);
+    ASSERT_NE(leader.port(), 0);
+    Store db0, db1;
+    db0.put("stale", "dropped by the resync");
+    Replication follower(db0);
+    follower.setDatabases({&db0, &db1});
+    follower.replicaOf("127.0.0.1", leader.port());
+    ASSERT_TRUE(follower.waitForOffset(508, std::chrono::seconds(10)));
+    follower.shutdown();
+
+    using Contents = std::map<std::string, std::string>;
+    EXPECT_EQ(contents(db0), (Contents{{"a", "1"}, {"b", "two words"}, {"c", "3"}, {"d", "4"}}));
+    EXPECT_EQ(contents(db1), (Contents{{"x", "db1"}}));
+    EXPECT_EQ(replId(follower), "0123456789abcdef");
+}
+
+TEST(Replication, CutShortFullResyncKeepsTheOldData) {
+    std::string full = frame(0, {{"a", "1"}, {"b", "2"}});
+    ScriptedLeader leader("FULLRESYNC 0123456789abcdef 500 2\n" + full.substr(0, full.size() - 2), true);
+    ASSERT_NE(leader.port(), 0);
+    Store store;
+    store.put("old", "kept");
+    Replication follower(store);
+    follower.replicaOf("127.0.0.1", leader.port());
+    ASSERT_TRUE(waitFor([&] { return leader.served(); }));
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    follower.shutdown();
+
+    EXPECT_EQ(contents(store), (std::map<std::string, std::string>{{"old", "kept"}}));
+    EXPECT_EQ(follower.offset(), 0u);
+}
+
+TEST(Replication, FullResyncKeepsKeysThatLookLikeFrameHeaders) {
+    Store leader0, leader1;
+    // Enough for several frames, every one of them starting with an '@' key
+    for (int i = 0; i < 5000; ++i) leader0.put("@" + std::to_string(i % 4) + "k" + std::to_string(i), std::string(100, 'v'));
+    leader0.put("@x", "1");
+    leader0.put("plain", "2");
+    for (int i = 0; i < 100; ++i) leader1.put("@0k" + std::to_string(i), "db1");
+    Replication leader(leader0);
+    leader.setDatabases({&leader0, &leader1});
+    Leader server(leader);
+    ASSERT_NE(server.port(), 0);
+
+    Store follower0, follower1;
+    follower0.put("stale", "dropped by the resync");
+    Replication follower(follower0);
+    follower.setDatabases({&follower0, &follower1});
+    follower.replicaOf("127.0.0.1", server.port());
+    bool synced = waitFor([&] { return follower0.size() == leader0.size() && follower1.size() == leader1.size(); });
+    follower.shutdown();
+
+    ASSERT_TRUE(synced) << follower0.size() << " / " << follower1.size();
+    EXPECT_EQ(contents(follower0), contents(leader0));
+    EXPECT_EQ(contents(follower1), contents(leader1));
+}
+
+TEST(Replication, WritersOfOtherDatabasesDontWait) {
+    Store db0, db1;
+    Replication repl(db0);
+    repl.setDatabases({&db0, &db1});
+    auto busy = repl.lockWrites(0);
+
+    auto other = std::async(std::launch::async, [&] {
+        auto wlock = repl.lockWrites(1);
+        db1.put("k", "v");
+        return repl.propagate(1, "PUT k v");
+    });
+    ASSERT_EQ(other.wait_for(std::chrono::seconds(5)), std::future_status::ready);
+    EXPECT_EQ(other.get(), std::string("@1 PUT k v\n").size());
+
+    // Several at once are taken in index order, whatever order they're asked in
+    auto all = std::async(std::launch::async, [&] { return repl.lockWrites({1, 0}).size(); });
+    EXPECT_EQ(all.wait_for(std::chrono::milliseconds(100)), std::future_status::timeout);
+    busy.unlock();
+    EXPECT_EQ(all.get(), 2u);
+}
+
+TEST(Replication, ReadsWaitForTheirWriteToken) {
+    Store store;
+    Replication repl(store);
+    uint64_t token = repl.propagate("PUT a 1");
+    EXPECT_TRUE(repl.waitForOffset(token, std::chrono::milliseconds(0)));
+    EXPECT_FALSE(repl.waitForOffset(token + 1, std::chrono::milliseconds(20)));
+
+    // A waiter wakes as soon as the stream gets there, not at its timeout
+    auto start = std::chrono::steady_clock::now();
+    auto caught_up = std::async(std::launch::async, [&] {
+        return repl.waitForOffset(token + 16, std::chrono::seconds(10));
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    repl.propagate("PUT b 2");  // 8 bytes
+    EXPECT_EQ(caught_up.wait_for(std::chrono::milliseconds(50)), std::future_status::timeout);
+    repl.propagate("PUT c 3");
+    EXPECT_TRUE(caught_up.get());
+    EXPECT_LT(std::chrono::steady_clock::now() - start, std::chrono::seconds(5));
+    EXPECT_NE(repl.info().find("WAIT_OFFSET reads: 2 served, 1 redirected"), std::string::npos) << repl.info();
+
+    // Nor does shutting down leave it waiting
+    auto pending = std::async(std::launch::async, [&] {
+        return repl.waitForOffset(token + 1000, std::chrono::seconds(10));
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    repl.shutdown();
+    EXPECT_EQ(pending.wait_for(std::chrono::seconds(5)), std::future_status::ready);
+    EXPECT_FALSE(pending.get());
+}
@@ -0,0 +1,241 @@
+// Server: MULTI/EXEC over real connections. Queued commands run as one
+// step, a write to a WATCHed key in between aborts the transaction, and a
+// command refused while queueing discards it. SELECTed databases keep
+// their keys and their memory limits apart. BLPOP and WAITKEY wait for a
+// push or a change from another connection.
+
+#include "keyforge/Server.hpp"
+
+#include <gtest/gtest.h>
+
+#include <chrono>
+#include <functional>
+#include <future>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+using namespace keyforge;
+
+namespace {
+
+int freePort() {
+    int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(addr);
+    int port = 0;
+    if (::bind(fd, reinterpret_cast<sockaddr*>(&addr), len) == 0 &&
+        ::getsockname(fd, reinterpret_cast<sockaddr*>(&addr), &len) == 0) {
+        port = ntohs(addr.sin_port);
+    }
+    ::close(fd);
+    return port;
+}
+
+// A server on its own thread, set up by configure before it runs
+class Running {
+public:
+    explicit Running(const std::function<void(Server&)>& configure = {}) : port(freePort()), server(port) {
+        if (configure) configure(server);
+        thread_ = std::thread([this] { server.run(); });
+    }
+    ~Running() {
+        server.requestShutdown();
+        thread_.join();
+    }
+    int port;
+    Server server;
+
+private:
+    std::thread thread_;
+};
+
+// An authenticated line-protocol connection
+class Connection {
+public:
+    explicit Connection(int port) {
+        for (int attempt = 0; attempt < 100 && fd_ < 0; ++attempt) {
+            fd_ = net::connectTo("127.0.0.1", port);
+            if (fd_ < 0) std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        }
+        if (fd_ < 0) return;
+        reader_ = std::make_unique<net::LineReader>(fd_);
+        send("AUTH KeyForgeSecret");
+    }
+    ~Connection() {
+        if (fd_ >= 0) ::close(fd_);
+    }
+    bool connected() const { return fd_ >= 0; }
+
+    // The reply line, or "" on a timeout
+    std::string send(const std::string& line) {
+        std::string reply;
+        if (!net::sendAll(fd_, line + "\n") || reader_->readLine(reply, 5000) != net::LineReader::Status::OK) return "";
+        return reply;
+    }
+
+    // The next n lines
+    std::vector<std::string> read(size_t n) {
+        std::vector<std::string> lines;
+        std::string line;
+        while (lines.size() < n && reader_->readLine(line, 5000) == net::LineReader::Status::OK) lines.push_back(line);
+        return lines;
+    }
+
+private:
+    int fd_ = -1;
+    std::unique_ptr<net::LineReader> reader_;
+};
+
+bool ok(const std::string& reply) {
+    return reply.rfind("OK", 0) == 0;
+}
+
+} // namespace
+
+TEST(Transactions, ExecRunsTheQueue) {
+    Running server;
+    Connection conn(server.port);
+    ASSERT_TRUE(conn.connected());
+    ASSERT_TRUE(ok(conn.send("PUT n 1")));
+
+    EXPECT_EQ(conn.send("WATCH n"), "OK");
+    EXPECT_EQ(conn.send("MULTI"), "OK");
+    EXPECT_EQ(conn.send("INCR n"), "QUEUED");
+    EXPECT_EQ(conn.send("PUT k v"), "QUEUED");
+    EXPECT_EQ(conn.send("GET k"), "QUEUED");
+    EXPECT_EQ(conn.send("EXEC"), "EXEC 3");
+    auto replies = conn.read(3);
+    ASSERT_EQ(replies.size(), 3u);
+    EXPECT_EQ(replies[0].rfind("2", 0), 0u) << replies[0];
+    EXPECT_TRUE(ok(replies[1])) << replies[1];
+    EXPECT_EQ(replies[2], "v");
+
+    EXPECT_EQ(conn.send("MULTI"), "OK");
+    EXPECT_EQ(conn.send("PUT k w"), "QUEUED");
+    EXPECT_EQ(conn.send("DISCARD"), "OK");
+    EXPECT_EQ(conn.send("GET k"), "v");
+    EXPECT_EQ(conn.send("EXEC"), "ERROR EXEC without MULTI");
+}
+
+TEST(Transactions, WriteToAWatchedKeyAborts) {
+    Running server;
+    Connection conn(server.port), other(server.port);
+    ASSERT_TRUE(conn.connected() && other.connected());
+    ASSERT_TRUE(ok(conn.send("PUT k 1")));
+
+    EXPECT_EQ(conn.send("WATCH k missing"), "OK");
+    EXPECT_EQ(conn.send("MULTI"), "OK");
+    EXPECT_EQ(conn.send("PUT k mine"), "QUEUED");
+    ASSERT_TRUE(ok(other.send("PUT k theirs")));
+    EXPECT_EQ(conn.send("EXEC"), "ABORTED");
+    EXPECT_EQ(conn.send("GET k"), "theirs");
+
+    // Creating a watched key counts, and the watch ends with the EXEC
+    EXPECT_EQ(conn.send("WATCH missing"), "OK");
+    ASSERT_TRUE(ok(other.send("PUT missing now")));
+    EXPECT_EQ(conn.send("MULTI"), "OK");
+    EXPECT_EQ(conn.send("PUT k mine"), "QUEUED");
+    EXPECT_EQ(conn.send("EXEC"), "ABORTED");
+    EXPECT_EQ(conn.send("MULTI"), "OK");
+    EXPECT_EQ(conn.send("PUT k mine"), "QUEUED");
+    EXPECT_EQ(conn.send("EXEC"), "EXEC 1");
+    conn.read(1);
+    EXPECT_EQ(conn.send("GET k"), "mine");
+
+    // A key is watched in the database it was watched in
+    EXPECT_EQ(conn.send("SELECT 1"), "OK");
+    EXPECT_EQ(conn.send("WATCH k"), "OK");
+    EXPECT_EQ(conn.send("SELECT 0"), "OK");
+    ASSERT_TRUE(ok(other.send("PUT k db0")));
+    EXPECT_EQ(conn.send("MULTI"), "OK");
+    EXPECT_EQ(conn.send("PUT x 1"), "QUEUED");
+    EXPECT_EQ(conn.send("EXEC"), "EXEC 1");
+    conn.read(1);
+}
+
+TEST(Transactions, RefusedCommandDiscardsTheQueue) {
+    Running server;
+    Connection conn(server.port);
+    ASSERT_TRUE(conn.connected());
+    EXPECT_EQ(conn.send("MULTI"), "OK");
+    EXPECT_EQ(conn.send("PUT k v"), "QUEUED");
+    EXPECT_EQ(conn.send("MULTI"), "ERROR MULTI calls can not be nested");
+    EXPECT_EQ(conn.send("WATCH k"), "ERROR WATCH inside MULTI is not allowed");
+    EXPECT_EQ(conn.send("BLPOP k 0").rfind("ERROR BLPOP can't be used inside MULTI", 0), 0u);
+    EXPECT_EQ(conn.send("EXEC"), "ERROR EXECABORT Transaction discarded because of previous errors");
+    EXPECT_EQ(conn.send("GET k"), "NOT_FOUND");
+}
+
+TEST(Databases, SelectKeepsKeysApart) {
+    Running server;
+    Connection conn(server.port), other(server.port);
+    ASSERT_TRUE(conn.connected() && other.connected());
+    ASSERT_TRUE(ok(conn.send("PUT k db0")));
+    EXPECT_EQ(conn.send("SELECT 3"), "OK");
+    EXPECT_EQ(conn.send("GET k"), "NOT_FOUND");
+    ASSERT_TRUE(ok(conn.send("PUT k db3")));
+    EXPECT_EQ(conn.send("GET k"), "db3");
+    // Each connection has its own
+    EXPECT_EQ(other.send("GET k"), "db0");
+    EXPECT_EQ(conn.send("SELECT 16"), "ERROR DB index is out of range (0-15)");
+    EXPECT_EQ(conn.send("SELECT x"), "ERROR DB index is out of range (0-15)");
+    EXPECT_EQ(conn.send("GET k"), "db3");
+}
+
+TEST(Databases, MemoryLimitIsPerDatabase) {
+    Running server([](Server& s) {
+        s.setDatabases(2);
+        s.setDbMaxMemory(64 << 10);
+    });
+    Connection full(server.port), other(server.port);
+    ASSERT_TRUE(full.connected() && other.connected());
+    EXPECT_EQ(full.send("SELECT 1"), "OK");
+    std::string value(200, 'v');
+    std::string reply;
+    int stored = 0;
+    for (; stored < 10000; ++stored) {
+        reply = full.send("PUT k" + std::to_string(stored) + " " + value);
+        if (!ok(reply)) break;
+    }
+    EXPECT_EQ(reply, "ERROR OOM command not allowed when used memory > 'maxmemory'");
+    EXPECT_GT(stored, 0);
+    EXPECT_EQ(full.send("SELECT 2"), "ERROR DB index is out of range (0-1)");
+
+    // The other database has room, and deletes still go through
+    EXPECT_TRUE(ok(other.send("PUT k " + value)));
+    EXPECT_EQ(other.send("GET k"), value);
+    EXPECT_EQ(full.send("DELETE k0").rfind("DELETED", 0), 0u);
+}
+
+TEST(BlockingCommands, BlpopTakesAPushFromAnotherConnection) {
+    Running server;
+    Connection first(server.port), second(server.port), pusher(server.port);
+    ASSERT_TRUE(first.connected() && second.connected() && pusher.connected());
+    ASSERT_EQ(pusher.send("RPUSH ready x").rfind("1 ", 0), 0u);
+    EXPECT_EQ(first.send("BLPOP empty ready 1").rfind("ready x ", 0), 0u);  // no need to wait
+
+    // Two waiters, one element: one gets it, the other times out
+    auto a = std::async(std::launch::async, [&] { return first.send("BLPOP q 1"); });
+    auto b = std::async(std::launch::async, [&] { return second.send("BLPOP q 1"); });
+    EXPECT_EQ(a.wait_for(std::chrono::milliseconds(100)), std::future_status::timeout);
+    ASSERT_EQ(pusher.send("RPUSH q only").rfind("1 ", 0), 0u);
+    std::string got_a = a.get(), got_b = b.get();
+    std::string taken = got_a == "TIMEOUT" ? got_b : got_a;
+    EXPECT_EQ(taken.rfind("q only ", 0), 0u) << taken;
+    EXPECT_EQ(got_a == "TIMEOUT" ? got_a : got_b, "TIMEOUT");
+    EXPECT_EQ(pusher.send("LLEN q"), "0");
+
+    auto event = std::async(std::launch::async, [&] { return first.send("WAITKEY k 5"); });
+    EXPECT_EQ(event.wait_for(std::chrono::milliseconds(100)), std::future_status::timeout);
+    ASSERT_TRUE(ok(pusher.send("PUT k v")));
+    EXPECT_EQ(event.get(), "set");
+}
@@ -0,0 +1,391 @@
+// Store with a second tier: spilled keys read back, SCAN over both tiers,
+// snapshot deltas that carry changes to spilled keys and fold into a new
+// base that loads with the deltas after it, and full-resync
+// snapshots that stay as they were taken while writers go on. Counters
+// refuse to overflow and print float results plainly; compare-and-swap
+// goes by versions that are never reused.
+
+#include "keyforge/Lsm.hpp"
+#include "keyforge/Store.hpp"
+
+#include <gtest/gtest.h>
+
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <set>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
+using namespace keyforge;
+
+namespace {
+
+std::string scratchPath(const std::string& name) {
+    return (std::filesystem::temp_directory_path() / ("keyforge_test_" + std::to_string(::getpid()) + "_" + name))
+        .string();
+}
+
+// A Store that spills to an LSM engine past 64 KiB
+void spillToLsm(Store& store, const std::string& name) {
+    LsmEngine::Options options;
+    options.memtable_bytes = 16 << 10;
+    options.block_bytes = 1024;
+    options.table_bytes = 32 << 10;
+    options.level1_bytes = 64 << 10;
+    std::string dir = scratchPath(name);
+    store.setMaxMemory(64 << 10);
+    store.setStorageEngine([dir, options] { return std::make_unique<LsmEngine>(dir, options); });
+}
+
+size_t spilledKeys(const Store& store) {
+    std::string info = store.storageInfo();
+    const std::string label = "Spilled keys: ";
+    size_t at = info.find(label);
+    return at == std::string::npos ? 0 : std::stoul(info.substr(at + label.size()));
+}
+
+bool waitFor(const std::function<bool()>& done) {
+    for (int i = 0; i < 500 && !done(); ++i) std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    return done();
+}
+
+std::string key(int i) {
+    return "key" + std::to_string(i);
+}
+
+std::string value(int i, int round) {
+    return "value" + std::to_string(round) + "_" + std::to_string(i) + std::string(40, 'x');
+}
+
+std::set<std::string> scanAll(const Store& store, size_t count) {
+    std::set<std::string> seen;
+    std::string cursor = "0";
+    do {
+        std::vector<std::string> keys;
+        cursor = store.scan(cursor, count, keys);
+        seen.insert(keys.begin(), keys.end());
+    } while (cursor != "0");
+    return seen;
+}
+
+std::map<std::string, std::string> contents(const Store& store) {
+    std::map<std::string, std::string> out;
+    for (const auto& k : scanAll(store, 100)) {
+        auto v = store.peek(k);
+        if (v) out.emplace(k, *v);
+    }
+    return out;
+}
+
+void removeSnapshot(const std::string& file) {
+    std::error_code ec;
+    std::filesystem::remove(file, ec);
+    for (int n = 1; n <= static_cast<int>(Store::kMergeDeltas); ++n) {
+        std::filesystem::remove(file + ".delta." + std::to_string(n), ec);
+    }
+}
+
+} // namespace
+
+TEST(StoreSpill, SpilledKeysReadBack) {
+    Store store;
+    spillToLsm(store, "store_spill");
+    for (int i = 0; i < 3000; ++i) store.put(key(i), value(i, 1));
+    ASSERT_GT(spilledKeys(store), 1000u);
+
+    for (int i = 0; i < 3000; i += 3) store.put(key(i), value(i, 2));
+    for (int i = 0; i < 3000; i += 7) store.remove(key(i));
+    EXPECT_EQ(store.size(), 3000u - 429u);
+    for (int i = 0; i < 3000; ++i) {
+        auto got = store.get(key(i));
+        if (i % 7 == 0) {
+            EXPECT_FALSE(got) << key(i);
+        } else {
+            ASSERT_TRUE(got) << key(i);
+            EXPECT_EQ(*got, value(i, i % 3 == 0 ? 2 : 1));
+        }
+    }
+}
+
+TEST(StoreSpill, ScanVisitsBothTiers) {
+    Store store;
+    spillToLsm(store, "store_scan");
+    std::set<std::string> expected;
+    for (int i = 0; i < 3000; ++i) {
+        store.put(key(i), value(i, 1));
+        expected.insert(key(i));
+    }
+    store.put("", "empty key");
+    expected.insert("");
+    for (int i = 0; i < 3000; i += 11) {
+        store.remove(key(i));
+        expected.erase(key(i));
+    }
+    ASSERT_GT(spilledKeys(store), 0u);
+
+    for (size_t count : {1, 10, 333}) EXPECT_EQ(scanAll(store, count), expected) << "count " << count;
+}
+
+TEST(StoreSnapshot, DeltaChainLoadsBack) {
+    std::string file = scratchPath("store_deltas.kf");
+    removeSnapshot(file);
+    Store store;
+    for (int i = 0; i < 1000; ++i) store.put(key(i), value(i, 1));
+    ASSERT_TRUE(store.saveToFile(file));
+
+    for (int i = 0; i < 20; ++i) store.put(key(i), value(i, 2));
+    store.remove(key(500));
+    ASSERT_TRUE(store.saveToFile(file));
+    EXPECT_TRUE(std::filesystem::exists(file + ".delta.1"));
+
+    store.put(key(500), value(500, 3));
+    store.remove(key(0));
+    store.put("new", "in the second delta");
+    ASSERT_TRUE(store.saveToFile(file));
+    EXPECT_TRUE(std::filesystem::exists(file + ".delta.2"));
+
+    Store loaded;
+    ASSERT_TRUE(loaded.loadFromFile(file));
+    EXPECT_EQ(contents(loaded), contents(store));
+    EXPECT_FALSE(loaded.peek(key(0)));
+    EXPECT_EQ(*loaded.peek(key(1)), value(1, 2));
+    EXPECT_EQ(*loaded.peek(key(500)), value(500, 3));
+    removeSnapshot(file);
+}
+
+TEST(StoreSnapshot, DeltasCarrySpilledKeys) {
+    std::string file = scratchPath("store_spilled_deltas.kf");
+    removeSnapshot(file);
+    Store store;
+    spillToLsm(store, "store_spilled_deltas");
+    for (int i = 0; i < 3000; ++i) store.put(key(i), value(i, 1));
+    ASSERT_GT(spilledKeys(store), 1000u);
+    ASSERT_TRUE(store.saveToFile(file));
+
+    // The earliest keys are the coldest, so these are spilled ones
+    for (int i = 0; i < 50; ++i) store.put(key(i), value(i, 2));
+    for (int i = 50; i < 100; ++i) store.remove(key(i));
+    ASSERT_TRUE(store.saveToFile(file));
+
+    Store loaded;
+    ASSERT_TRUE(loaded.loadFromFile(file));
+    EXPECT_EQ(loaded.size(), 2950u);
+    EXPECT_EQ(contents(loaded), contents(store));
+    removeSnapshot(file);
+}
+
+TEST(StoreSnapshot, MergedDeltasLoadWithTheRest) {
+    std::string file = scratchPath("store_merge.kf");
+    removeSnapshot(file);
+    Store store;
+    for (int i = 0; i < 1000; ++i) store.put(key(i), value(i, 0));
+    ASSERT_TRUE(store.saveToFile(file));
+
+    // Small deltas, so it is their count that calls for a merge. Each
+    // changes some keys and deletes others: ones from the base, and ones
+    // that only an earlier delta had
+    for (int round = 1; round <= static_cast<int>(Store::kMergeDeltas); ++round) {
+        for (int i = round + 10; i < 1000; i += 97) store.put(key(i), value(i, round));
+        store.remove(key(round));
+        store.put("added" + std::to_string(round), value(round, round));
+        store.remove("added" + std::to_string(round - 1));
+        ASSERT_TRUE(store.saveToFile(file));
+    }
+    ASSERT_TRUE(waitFor([&] { return store.snapshotInfo().find("merges: 1") != std::string::npos; }))
+        << store.snapshotInfo();
+    EXPECT_FALSE(std::filesystem::exists(file + ".delta.1"));
+    EXPECT_FALSE(std::filesystem::exists(file + ".delta." + std::to_string(Store::kMergeDeltas)));
+    std::ifstream base(file);
+    std::string header;
+    ASSERT_TRUE(std::getline(base, header));
+    EXPECT_EQ(header.substr(header.rfind(' ')), " " + std::to_string(Store::kMergeDeltas));
+
+    // A delta after the merge goes on the new base
+    store.remove(key(999));
+    store.put(key(2), "after the merge");
+    ASSERT_TRUE(store.saveToFile(file));
+    EXPECT_TRUE(std::filesystem::exists(file + ".delta." + std::to_string(Store::kMergeDeltas + 1)));
+
+    Store loaded;
+    ASSERT_TRUE(loaded.loadFromFile(file));
+    EXPECT_EQ(contents(loaded), contents(store));
+    EXPECT_FALSE(loaded.peek(key(1)));
+    EXPECT_FALSE(loaded.peek(key(999)));
+    EXPECT_FALSE(loaded.peek("added1"));
+    EXPECT_EQ(*loaded.peek("added" + std::to_string(Store::kMergeDeltas)), value(8, 8));
+    EXPECT_EQ(*loaded.peek(key(2)), "after the merge");
+    EXPECT_EQ(*loaded.peek(key(15)), value(15, 5));
+    removeSnapshot(file);
+}
+
+TEST(StoreSnapshot, WritesDuringConsumeAreNotSeen) {
+    Store store;
+    spillToLsm(store, "store_snapshot_writes");
+    store.setMaxMemory(1 << 20);  // enough in memory for a walk of several lock holds
+    for (int i = 0; i < 20000; ++i) store.put(key(i), value(i, 1));
+    {
+        Store::Batch batch(store);
+        batch.listPush("list", {"a", "b"}, false);
+    }
+    ASSERT_GT(spilledKeys(store), 0u);
+    auto expected = contents(store);
+
+    auto snapshot = store.snapshot();
+    EXPECT_EQ(snapshot.keys(), expected.size());
+    std::map<std::string, std::string> seen;
+    bool wrote = false;
+    snapshot.consume([&](const std::string& k, const std::string& v) {
+        EXPECT_TRUE(seen.emplace(k, v).second) << k;
+        if (!wrote) {
+            // Every kind of change, to keys on both sides of the walk and in both tiers
+            wrote = true;
+            for (int i = 0; i < 20000; i += 3) store.put(key(i), value(i, 2));
+            for (int i = 1; i < 20000; i += 7) store.remove(key(i));
+            for (int i = 0; i < 1000; ++i) store.put("new" + std::to_string(i), "x");
+            for (int i = 0; i < 20000; i += 11) store.get(key(i));
+            Store::Batch batch(store);
+            batch.listPush("list", {"c"}, true);
+            batch.incrBy("counter", 1);
+        }
+        return true;
+    });
+    EXPECT_EQ(seen, expected);
+    EXPECT_EQ(*store.peek(key(3)), value(3, 2));
+}
+
+TEST(StoreSnapshot, ReloadCutsConsumeShort) {
+    Store store;
+    for (int i = 0; i < 5000; ++i) store.put(key(i), value(i, 1));
+    auto snapshot = store.snapshot();
+    std::istringstream replacement("a=1\n");
+    bool loaded = false;
+    EXPECT_THROW(snapshot.consume([&](const std::string&, const std::string&) {
+                     if (!loaded) loaded = store.loadFromStream(replacement);
+                     return true;
+                 }),
+                 StorageError);
+    EXPECT_EQ(store.size(), 1u);
+
+    // Once it is gone, the table rehashes as before
+    snapshot = {};
+    for (int i = 0; i < 50000; ++i) store.put(key(i), value(i, 2));
+    auto again = store.snapshot();
+    size_t pairs = 0;
+    again.consume([&](const std::string&, const std::string&) { return ++pairs > 0; });
+    EXPECT_EQ(pairs, 50001u);
+}
+
+TEST(StoreCounters, OverflowLeavesTheValueAlone) {
+    Store store;
+    EXPECT_EQ(store.incrBy("n", 5), 5);
+    EXPECT_EQ(store.incrBy("n", -7), -2);
+    store.put("s", "41");
+    EXPECT_EQ(store.incrBy("s", 1), 42);
+    EXPECT_EQ(*store.get("s"), "42");
+
+    store.put("max", std::to_string(INT64_MAX - 1));
+    EXPECT_EQ(store.incrBy("max", 1), INT64_MAX);
+    uint64_t version = store.version("max");
+    EXPECT_FALSE(store.incrBy("max", 1));
+    EXPECT_EQ(*store.get("max"), std::to_string(INT64_MAX));
+    EXPECT_EQ(store.version("max"), version);
+    EXPECT_EQ(store.incrBy("min", INT64_MIN), INT64_MIN);
+    EXPECT_FALSE(store.incrBy("min", -1));
+
+    store.put("word", "abc");
+    EXPECT_FALSE(store.incrBy("word", 1));
+    store.put("big", "9223372036854775808");
+    EXPECT_FALSE(store.incrBy("big", 0));
+    {
+        Store::Batch batch(store);
+        batch.listPush("list", {"a"}, false);
+    }
+    EXPECT_THROW(store.incrBy("list", 1), Store::WrongType);
+}
+
+TEST(StoreCounters, FloatResultsPrintPlainly) {
+    Store store;
+    EXPECT_EQ(store.incrByFloat("f", 0.1L), "0.1");
+    EXPECT_EQ(store.incrByFloat("f", 0.2L), "0.3");
+    EXPECT_EQ(store.incrByFloat("f", -0.3L), "0");
+    store.put("i", "10");
+    EXPECT_EQ(store.incrByFloat("i", 1.5L), "11.5");
+    // An integral result stays an integer for INCR, never an exponent
+    EXPECT_EQ(store.incrByFloat("i", 0.5L), "12");
+    EXPECT_EQ(store.incrBy("i", 1), 13);
+    EXPECT_EQ(store.incrByFloat("e", 1e20L), "100000000000000000000");
+    EXPECT_EQ(store.incrByFloat("neg", -2.25L), "-2.25");
+
+    store.put("word", "1.5x");
+    EXPECT_FALSE(store.incrByFloat("word", 1));
+    store.put("inf", "inf");
+    EXPECT_FALSE(store.incrByFloat("inf", 1));
+    EXPECT_EQ(*store.get("inf"), "inf");
+}
+
+TEST(StoreVersions, CompareAndSwapChecksTheVersion) {
+    Store store;
+    uint64_t version = 0;
+    EXPECT_TRUE(store.compareAndSwap("k", 0, "a", version));  // 0: only if missing
+    uint64_t first = version;
+    EXPECT_EQ(store.version("k"), first);
+    EXPECT_FALSE(store.compareAndSwap("k", 0, "b", version));
+    EXPECT_EQ(version, first);
+    EXPECT_FALSE(store.compareAndSwap("k", first - 1, "b", version));
+    EXPECT_EQ(*store.getVersioned("k"), std::make_pair(std::string("a"), first));
+
+    EXPECT_TRUE(store.compareAndSwap("k", first, "b", version));
+    EXPECT_GT(version, first);
+    // A deleted and recreated key never gets an old version back
+    store.remove("k");
+    EXPECT_FALSE(store.compareAndSwap("k", version, "c", version));
+    EXPECT_EQ(version, 0u);
+    store.put("k", "d");
+    EXPECT_GT(store.version("k"), first);
+    EXPECT_FALSE(store.getVersioned("missing"));
+}
+
+TEST(StoreVersions, ConcurrentSwapsLoseNoUpdates) {
+    Store store;
+    store.put("n", "0");
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; ++t) {
+        threads.emplace_back([&] {
+            for (int done = 0; done < 500;) {
+                auto [value, version] = *store.getVersioned("n");
+                uint64_t now = 0;
+                done += store.compareAndSwap("n", version, std::to_string(std::stoi(value) + 1), now);
+            }
+        });
+    }
+    for (auto& t : threads) t.join();
+    EXPECT_EQ(*store.get("n"), "2000");
+}
+
+TEST(StoreVersions, SpilledKeysKeepTheirVersion) {
+    Store store;
+    spillToLsm(store, "store_versions");
+    std::vector<uint64_t> versions;
+    for (int i = 0; i < 2000; ++i) {
+        store.put(key(i), value(i, 1));
+        versions.push_back(store.version(key(i)));
+    }
+    ASSERT_GT(spilledKeys(store), 1000u);
+
+    for (int i = 0; i < 2000; ++i) ASSERT_EQ(store.version(key(i)), versions[i]) << key(i);
+    for (int i = 0; i < 2000; i += 100) {
+        uint64_t now = 0;
+        EXPECT_FALSE(store.compareAndSwap(key(i), versions[i] + 1, "x", now));
+        EXPECT_EQ(now, versions[i]);
+        EXPECT_TRUE(store.compareAndSwap(key(i), versions[i], "x", now));
+        EXPECT_EQ(*store.get(key(i)), "x");
+    }
+}
@@ -0,0 +1,100 @@
+// Tracking: a read key is invalidated once on its next change, a replaced
+// dataset invalidates everything, and a client that can't take a push is
+// dropped rather than waited for.
+
+#include "keyforge/Tracking.hpp"
+
+#include <gtest/gtest.h>
+
+#include <string>
+
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+using namespace keyforge;
+
+namespace {
+
+// One end of a socket pair for the subscriber, the other for the test
+struct Connection {
+    Connection() {
+        int fds[2];
+        if (::socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0) {
+            server = fds[0];
+            client = fds[1];
+        }
+    }
+    ~Connection() {
+        ::close(server);
+        ::close(client);
+    }
+
+    // Whatever has been pushed so far
+    std::string pushed() {
+        std::string out;
+        char buf[4096];
+        ssize_t n;
+        while ((n = ::recv(client, buf, sizeof(buf), MSG_DONTWAIT)) > 0) out.append(buf, static_cast<size_t>(n));
+        return out;
+    }
+
+    int server = -1;
+    int client = -1;
+};
+
+} // namespace
+
+TEST(Tracking, InvalidatesReadKeysOnce) {
+    Tracking tracking;
+    Connection a, b;
+    auto sub_a = tracking.subscribe(a.server);
+    auto sub_b = tracking.subscribe(b.server);
+    tracking.remember("k", sub_a);
+    tracking.remember("k", sub_b);
+    tracking.remember("k", sub_a);
+    tracking.remember("other", sub_b);
+
+    tracking.invalidate("k");
+    EXPECT_EQ(a.pushed(), ">INVALIDATE k\n");
+    EXPECT_EQ(b.pushed(), ">INVALIDATE k\n");
+    // Until read again, further changes aren't news
+    tracking.invalidate("k");
+    tracking.invalidate("unread");
+    EXPECT_EQ(a.pushed(), "");
+
+    // A flush only reaches those still caching something
+    tracking.invalidate("");
+    EXPECT_EQ(a.pushed(), "");
+    EXPECT_EQ(b.pushed(), ">INVALIDATE *\n");
+    tracking.invalidate("other");
+    EXPECT_EQ(b.pushed(), "");
+
+    tracking.remember("k", sub_a);
+    tracking.unsubscribe(sub_a);
+    tracking.invalidate("k");
+    EXPECT_EQ(a.pushed(), "");
+    EXPECT_NE(tracking.info().find("Tracking clients: 1\nTracked keys: 0\nInvalidations sent: 3\n"),
+              std::string::npos) << tracking.info();
+}
+
+TEST(Tracking, DropsAClientThatStopsReading) {
+    Tracking tracking;
+    Connection conn;
+    auto sub = tracking.subscribe(conn.server);
+    tracking.remember("k", sub);
+
+    // Its socket buffer is full
+    ::fcntl(conn.server, F_SETFL, ::fcntl(conn.server, F_GETFL) | O_NONBLOCK);
+    std::string fill(4096, 'x');
+    while (::send(conn.server, fill.data(), fill.size(), MSG_NOSIGNAL) > 0) {
+    }
+
+    tracking.invalidate("k");
+    EXPECT_TRUE(sub->dropped);
+    EXPECT_NE(tracking.info().find("Dropped slow clients: 1"), std::string::npos);
+    // It was shut down; nothing more goes to it
+    tracking.remember("k", sub);
+    tracking.invalidate("k");
+    EXPECT_NE(tracking.info().find("Invalidations sent: 0"), std::string::npos) << tracking.info();
+}
@@ -0,0 +1,122 @@
+// ValueLog: records read back from sealed segments, a segment goes once
+// all of it is dead, and garbage collection through the ValuePool copies
+// the live values out of the most dead segments and keeps them readable.
+
+#include "keyforge/ValueLog.hpp"
+#include "keyforge/ValuePool.hpp"
+
+#include <gtest/gtest.h>
+
+#include <filesystem>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+using namespace keyforge;
+
+namespace {
+
+std::string scratchDir(const std::string& name) {
+    return (std::filesystem::temp_directory_path() / ("keyforge_test_" + std::to_string(::getpid()) + "_" + name))
+        .string();
+}
+
+ValueLog::Options smallSegments() {
+    ValueLog::Options options;
+    options.segment_bytes = 4096;
+    options.sync_bytes = 1024;
+    return options;
+}
+
+size_t files(const std::string& dir) {
+    size_t n = 0;
+    for (const auto& entry : std::filesystem::directory_iterator(dir)) n += entry.is_regular_file();
+    return n;
+}
+
+std::string value(int i) {
+    return std::string(500, static_cast<char>('a' + i % 26)) + std::to_string(i);
+}
+
+} // namespace
+
+TEST(ValueLog, DeadSegmentsGo) {
+    std::string dir = scratchDir("value_log");
+    ValueLog log(dir, smallSegments());
+    std::vector<ValueLog::Ref> refs(20);
+    for (int i = 0; i < 20; ++i) ASSERT_TRUE(log.append(value(i), refs[i]));
+    ASSERT_GT(log.segments(), 2u);
+    EXPECT_EQ(files(dir), log.segments());
+    for (int i = 0; i < 20; ++i) {
+        std::string out;
+        ASSERT_TRUE(log.read(refs[i], out));
+        EXPECT_EQ(out, value(i));
+    }
+
+    // The first segment, all dead, is deleted; most of the second makes it a victim
+    uint32_t first = refs[0].segment, second = first + 1;
+    size_t segments = log.segments();
+    for (const auto& ref : refs) {
+        if (ref.segment == first) log.release(ref);
+    }
+    EXPECT_EQ(log.segments(), segments - 1);
+    EXPECT_EQ(files(dir), segments - 1);
+    EXPECT_EQ(log.gcVictim(), 0u);
+    int released = 0, in_second = 0;
+    for (const auto& ref : refs) in_second += ref.segment == second;
+    for (const auto& ref : refs) {
+        if (ref.segment == second && released + 2 < in_second) {
+            log.release(ref);
+            released++;
+        }
+    }
+    EXPECT_EQ(log.gcVictim(), second);
+    std::string out;
+    EXPECT_FALSE(log.read(refs[0], out));
+
+    // The head is never offered, however dead
+    for (const auto& ref : refs) {
+        if (ref.segment == refs.back().segment) log.release(ref);
+    }
+    EXPECT_EQ(log.gcVictim(), second);
+}
+
+TEST(ValueLog, CollectionKeepsLiveValues) {
+    std::string dir = scratchDir("value_log_gc");
+    ValueLog log(dir, smallSegments());
+    ValuePool pool;
+    std::map<std::string, ValuePool::Blob*> blobs;
+    for (int i = 0; i < 200; ++i) {
+        std::string key = "k" + std::to_string(i);
+        blobs[key] = pool.acquire(key, value(i), 0, nullptr);
+    }
+    size_t cursor = 0;
+    while (pool.coldValues() < 200) ASSERT_GT(pool.cool(log, 1, 0, cursor, 1000), 0u);
+    size_t segments = log.segments();
+
+    // Two of every three die: every sealed segment is worth collecting
+    for (int i = 0; i < 200; ++i) {
+        if (i % 3 == 0) continue;
+        std::string key = "k" + std::to_string(i);
+        pool.release(key, blobs[key]);
+        blobs.erase(key);
+    }
+    size_t collections = 0;
+    while (pool.collect(log)) collections++;
+    EXPECT_GT(collections, 0u);
+    EXPECT_EQ(pool.collected(), collections);
+    EXPECT_EQ(log.gcVictim(), 0u);
+    EXPECT_LT(log.segments(), segments / 2);
+    EXPECT_EQ(files(dir), log.segments());
+    EXPECT_LT(log.deadBytes(), log.diskBytes() / 2 + smallSegments().segment_bytes);
+
+    ASSERT_EQ(pool.coldValues(), blobs.size());
+    for (const auto& [key, blob] : blobs) {
+        ASSERT_NE(blob->log, nullptr);
+        auto read = ValuePool::read(*blob);
+        ASSERT_TRUE(read) << key;
+        EXPECT_EQ(*read, value(std::stoi(key.substr(1))));
+    }
+}
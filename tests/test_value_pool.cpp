@@ -0,0 +1,95 @@
+// ValuePool: a value held by several keys is stored once and freed with
+// the last of them, whether it is kept plain, compressed or cold in a
+// value log.
+
+#include "keyforge/ValuePool.hpp"
+
+#include <gtest/gtest.h>
+
+#include <filesystem>
+#include <string>
+
+#include <unistd.h>
+
+using namespace keyforge;
+
+namespace {
+
+std::string scratchDir(const std::string& name) {
+    return (std::filesystem::temp_directory_path() / ("keyforge_test_" + std::to_string(::getpid()) + "_" + name))
+        .string();
+}
+
+} // namespace
+
+TEST(ValuePool, LastKeyReleasesTheValue) {
+    ValuePool pool;
+    std::string value(100, 'v');
+    auto* a = pool.acquire("a", value, 0, nullptr);
+    auto* b = pool.acquire("b", value, 0, nullptr);
+    EXPECT_EQ(a, b);
+    EXPECT_EQ(pool.acquire("a", value, 0, nullptr), a);  // no second reference
+    auto* other = pool.acquire("c", "other", 0, nullptr);
+    EXPECT_NE(other, a);
+    EXPECT_EQ(pool.values(), 2u);
+    EXPECT_EQ(pool.references(), 3u);
+    EXPECT_EQ(pool.storedBytes(), 105u);
+    EXPECT_EQ(pool.sharedBytes(), 100u);
+    EXPECT_EQ(a->keys, (std::unordered_set<std::string>{"a", "b"}));
+
+    pool.release("a", a);
+    pool.release("a", a);  // not held any more: nothing happens
+    EXPECT_EQ(pool.find(value), a);
+    EXPECT_EQ(pool.references(), 2u);
+    EXPECT_EQ(pool.sharedBytes(), 0u);
+    pool.release("b", a);
+    EXPECT_EQ(pool.find(value), nullptr);
+    pool.release("c", other);
+    EXPECT_EQ(pool.values(), 0u);
+    EXPECT_EQ(pool.references(), 0u);
+    EXPECT_EQ(pool.storedBytes(), 0u);
+}
+
+TEST(ValuePool, CompressedValuesAreFoundByContent) {
+    ValuePool pool;
+    std::string value(4096, 'x');
+    auto* blob = pool.acquire("a", value, 64, nullptr);
+    ASSERT_TRUE(blob->packed);
+    EXPECT_LT(blob->data.size(), value.size());
+    EXPECT_EQ(pool.packedValues(), 1u);
+    EXPECT_EQ(pool.packedRawBytes(), 4096u);
+    EXPECT_EQ(pool.acquire("b", value, 64, nullptr), blob);
+    EXPECT_EQ(*ValuePool::read(*blob), value);
+    EXPECT_EQ(pool.find(std::string(4096, 'y')), nullptr);
+
+    pool.release("a", blob);
+    pool.release("b", blob);
+    EXPECT_EQ(pool.packedValues(), 0u);
+    EXPECT_EQ(pool.packedRawBytes(), 0u);
+    EXPECT_EQ(pool.packedBytes(), 0u);
+    EXPECT_EQ(pool.storedBytes(), 0u);
+}
+
+TEST(ValuePool, ColdValuesReleaseTheirLogSpace) {
+    ValueLog log(scratchDir("value_pool_cold"));
+    ValuePool pool;
+    std::string value(1000, 'c');
+    auto* blob = pool.acquire("a", value, 0, nullptr);
+    pool.acquire("b", value, 0, nullptr);
+    pool.acquire("small", "s", 0, nullptr);
+    size_t cursor = 0;
+    EXPECT_EQ(pool.cool(log, 1, 100, cursor, 1000), 1000u);  // "s" is under min_bytes
+    ASSERT_NE(blob->log, nullptr);
+    EXPECT_TRUE(blob->data.empty());
+    EXPECT_EQ(pool.coldValues(), 1u);
+    EXPECT_EQ(pool.find(value), blob);  // still found, by reading it back
+    EXPECT_EQ(*ValuePool::read(*blob), value);
+
+    pool.release("a", blob);
+    EXPECT_EQ(log.deadBytes(), 0u);
+    pool.release("b", blob);
+    EXPECT_EQ(pool.coldValues(), 0u);
+    EXPECT_EQ(pool.coldBytes(), 0u);
+    EXPECT_EQ(log.deadBytes(), 1000u);  // the head segment stays until it is sealed
+    EXPECT_EQ(pool.storedBytes(), 1u);
+}